@@ -0,0 +1,90 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                     MAME BRIDGE NET-TO-WIN : BUSY-POLL RECEIVE
+// ==================================================================================
+// Optional (--busy-poll <microseconds>), for cabinets with a core to spare.
+//
+// Sleeping until MAME sends something costs a wake-up every time: the OS has to
+// notice the packet, schedule the network thread and switch to it. That is usually
+// tens of microseconds, and a lot more when the core has dropped into a deep power
+// state. For a light gun's recoil, that wake-up can be most of the delay. So after
+// each packet the network thread keeps asking the socket for more (without blocking)
+// for a while, and only goes to sleep if nothing came.
+//
+// Spinning keeps a core busy, so the window adapts to what MAME is doing:
+//   - data arrived while spinning: the window goes back to the full time
+//   - the spin ran out: the window halves (below BUSY_POLL_MIN_US, no spinning)
+//   - data woke the thread from sleep: the window doubles again
+// While a game sends something every frame the thread never sleeps; in a menu, or
+// with nothing changing, it is back to sleeping after a handful of packets.
+//
+// Nothing in here is Windows specific: the receive is a callback, so BridgeDaemon
+// uses the same policy on Linux.
+// ==================================================================================
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define BUSY_POLL_PAUSE() _mm_pause()
+#else
+#define BUSY_POLL_PAUSE() ((void)0)
+#endif
+
+// --- CONFIGURATION ---
+#define BUSY_POLL_MIN_US 10        // Shortest window worth spinning for
+#define BUSY_POLL_CLOCK_EVERY 16   // Receive attempts between looks at the clock
+
+struct BusyPoller {
+    uint32_t maxUs = 0;        // Full window, 0 = off (always sleep)
+    uint32_t windowUs = 0;     // Current window
+    uint64_t spins = 0;        // Statistics for the log and the tools
+    uint64_t caught = 0;       // Spins that ended with data
+    uint64_t wakes = 0;        // Times data woke the thread from sleep
+
+    void Configure(uint32_t us) { maxUs = windowUs = us; }
+    bool Enabled() const { return maxUs > 0; }
+
+    // Calls tryRecv() until it returns non-zero or the window runs out, and returns
+    // what it returned (0 = nothing came, go to sleep).
+    //   tryRecv() must not block: > 0 for data, 0 for nothing yet, < 0 to stop.
+    //   idle() is called every so often while spinning (e.g. to serve the mailbox).
+    template <typename F, typename G>
+    long Spin(F tryRecv, G idle) {
+        if (windowUs == 0) return 0;
+        spins++;
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point until = Clock::now() + std::chrono::microseconds(windowUs);
+        for (uint32_t i = 1;; i++) {
+            long r = tryRecv();
+            if (r != 0) {
+                if (r > 0) {
+                    caught++;
+                    windowUs = maxUs;
+                }
+                return r;
+            }
+            if (i % BUSY_POLL_CLOCK_EVERY == 0) {
+                if (Clock::now() >= until) break;
+                idle();
+            }
+            BUSY_POLL_PAUSE();
+        }
+        windowUs /= 2;
+        if (windowUs < BUSY_POLL_MIN_US) windowUs = 0;
+        return 0;
+    }
+
+    // Data arrived while the thread was asleep: MAME is busy again
+    void OnWake() {
+        if (!Enabled()) return;
+        wakes++;
+        windowUs = (windowUs < BUSY_POLL_MIN_US) ? BUSY_POLL_MIN_US : windowUs * 2;
+        if (windowUs > maxUs) windowUs = maxUs;
+    }
+};
@@ -0,0 +1,331 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                    MAME BRIDGE NET-TO-WIN : SESSION CAPTURE & REPLAY
+// ==================================================================================
+// Records the raw byte stream received from MAME, with monotonic timestamps, into
+// an append-only capture file, and plays it back through the core (BridgeCore.h).
+//
+// Capturing the bytes exactly as recv() returned them (rather than parsed lines)
+// means a replay exercises the framer, parser and dispatch exactly as the live
+// session did, including how lines were split across reads.
+//
+// FILE FORMAT (all numbers little-endian):
+//   Header:  "MBNWCAP1" (8 bytes), capture start as Unix time in seconds (u64)
+//   Records: type (u8), microseconds since capture start (u64), length (u32), payload
+//
+// Records are only ever appended. A file cut short by a crash simply ends at the
+// last complete record.
+// ==================================================================================
+
+#pragma once
+
+#include "BridgeCore.h"
+
+#include <string>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define CAPTURE_MAGIC "MBNWCAP1"
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_RECORD_HEADER_SIZE 13
+
+// Record types
+enum CaptureRecordType {
+    CAP_CONNECT = 1,    // TCP connection to MAME established (no payload)
+    CAP_DATA = 2,       // Bytes returned by one recv() call
+    CAP_DISCONNECT = 3  // TCP connection to MAME dropped (no payload)
+};
+
+struct CaptureRecord {
+    uint8_t type;
+    uint64_t timeUs;     // Microseconds since the capture started
+    const char* data;    // Payload (points into the mapped file)
+    uint32_t length;
+};
+
+// ==================================================================================
+//                                 CAPTURE WRITER
+// ==================================================================================
+class CaptureWriter {
+public:
+    ~CaptureWriter() { Close(); }
+
+    bool Open(const std::string& path) {
+        Close();
+        m_file = fopen(path.c_str(), "wb");
+        if (!m_file) return false;
+        setvbuf(m_file, NULL, _IOFBF, 1 << 16);
+
+        uint8_t header[CAPTURE_HEADER_SIZE];
+        memcpy(header, CAPTURE_MAGIC, 8);
+        PutU64(header + 8, (uint64_t)time(NULL));
+        fwrite(header, 1, sizeof(header), m_file);
+        m_start = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    bool IsOpen() const { return m_file != NULL; }
+
+    void Close() {
+        if (m_file) fclose(m_file);
+        m_file = NULL;
+    }
+
+    void WriteEvent(CaptureRecordType type) { Write(type, NULL, 0); }
+    void WriteData(const char* data, size_t len) { Write(CAP_DATA, data, len); }
+
+    // Pushes buffered records to disk (e.g. on disconnect, so a crash loses little)
+    void Flush() { if (m_file) fflush(m_file); }
+
+private:
+    FILE* m_file = NULL;
+    std::chrono::steady_clock::time_point m_start;
+
+    static void PutU32(uint8_t* p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i)); }
+    static void PutU64(uint8_t* p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i)); }
+
+    void Write(CaptureRecordType type, const char* data, size_t len) {
+        if (!m_file) return;
+        uint64_t t = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - m_start).count();
+
+        uint8_t rec[CAPTURE_RECORD_HEADER_SIZE];
+        rec[0] = (uint8_t)type;
+        PutU64(rec + 1, t);
+        PutU32(rec + 9, (uint32_t)len);
+        fwrite(rec, 1, sizeof(rec), m_file);
+        if (len) fwrite(data, 1, len, m_file);
+    }
+};
+
+// ==================================================================================
+//                                  MAPPED FILE
+// ==================================================================================
+// Read-only memory mapping, so even very large captures cost no read() copies.
+class MappedFile {
+public:
+    ~MappedFile() { Close(); }
+
+    bool Open(const std::string& path) {
+        Close();
+#ifdef _WIN32
+        m_hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE) { m_hFile = NULL; return false; }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0) { Close(); return false; }
+        m_hMap = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!m_hMap) { Close(); return false; }
+        m_data = (const char*)MapViewOfFile(m_hMap, FILE_MAP_READ, 0, 0, 0);
+        m_size = (size_t)size.QuadPart;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return false; }
+        void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) return false;
+        m_data = (const char*)p;
+        m_size = (size_t)st.st_size;
+#endif
+        if (!m_data) { Close(); return false; }
+        return true;
+    }
+
+    void Close() {
+#ifdef _WIN32
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_hMap) CloseHandle(m_hMap);
+        if (m_hFile) CloseHandle(m_hFile);
+        m_hMap = m_hFile = NULL;
+#else
+        if (m_data) munmap((void*)m_data, m_size);
+#endif
+        m_data = NULL;
+        m_size = 0;
+    }
+
+    const char* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+
+private:
+    const char* m_data = NULL;
+    size_t m_size = 0;
+#ifdef _WIN32
+    HANDLE m_hFile = NULL;
+    HANDLE m_hMap = NULL;
+#endif
+};
+
+// ==================================================================================
+//                                 CAPTURE READER
+// ==================================================================================
+class CaptureReader {
+public:
+    bool Open(const std::string& path) {
+        if (!m_file.Open(path)) return false;
+        if (m_file.Size() < CAPTURE_HEADER_SIZE || memcmp(m_file.Data(), CAPTURE_MAGIC, 8) != 0) {
+            m_file.Close();
+            return false;
+        }
+        m_startUnix = GetU64((const uint8_t*)m_file.Data() + 8);
+        Rewind();
+        return true;
+    }
+
+    void Rewind() { m_pos = CAPTURE_HEADER_SIZE; }
+
+    // Reads the next record. Returns false at the end (or at a truncated tail).
+    bool Next(CaptureRecord& rec) {
+        size_t size = m_file.Size();
+        if (m_pos + CAPTURE_RECORD_HEADER_SIZE > size) return false;
+        const uint8_t* p = (const uint8_t*)m_file.Data() + m_pos;
+        rec.type = p[0];
+        rec.timeUs = GetU64(p + 1);
+        rec.length = GetU32(p + 9);
+        if (m_pos + CAPTURE_RECORD_HEADER_SIZE + rec.length > size) return false;
+        rec.data = (const char*)p + CAPTURE_RECORD_HEADER_SIZE;
+        m_pos += CAPTURE_RECORD_HEADER_SIZE + rec.length;
+        return true;
+    }
+
+    uint64_t StartUnixTime() const { return m_startUnix; }
+    size_t FileSize() const { return m_file.Size(); }
+
+private:
+    MappedFile m_file;
+    size_t m_pos = 0;
+    uint64_t m_startUnix = 0;
+
+    static uint32_t GetU32(const uint8_t* p) { uint32_t v = 0; for (int i = 3; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+    static uint64_t GetU64(const uint8_t* p) { uint64_t v = 0; for (int i = 7; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+};
+
+// ==================================================================================
+//                                  REPLAY CLOCK
+// ==================================================================================
+// The core's clock during a replay. It shows the time of the record last fed
+// until the next one is due: a replay at 1x that is waiting for the next record
+// must not show its time yet, or a timer due in between (a stretched pulse
+// ending, a brightness tick) fires early, at the moment the wait begins. Moving
+// on to a record runs those timers first, each with the clock at its own
+// deadline, waiting for each at speed > 0. Restores the core's own clock when done.
+class ReplayClock {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    ReplayClock(BridgeCore& core, double speed,
+                const std::function<void(Clock::time_point)>& waitUntil)
+        : m_core(core), m_speed(speed), m_waitUntil(waitUntil), m_oldClock(core.clock) {
+        core.clock = [this] { return m_nowUs / 1000; };
+    }
+    ~ReplayClock() { m_core.clock = m_oldClock; }
+
+    // The capture time replayed so far (the clock starts at the first record)
+    uint64_t NowUs() const { return m_nowUs; }
+
+    // Moves the clock on to the capture time "us", through the timers due before it
+    void AdvanceTo(uint64_t us) {
+        if (!m_started) {
+            m_started = true;
+            m_firstUs = m_nowUs = us;
+            m_wallStart = Clock::now();
+        }
+        for (;;) {
+            uint64_t nextMs = m_core.timers.NextWakeMs();
+            if (nextMs == 0 || nextMs * 1000 >= us) break;
+            Wait(nextMs * 1000);
+            if (nextMs * 1000 > m_nowUs) m_nowUs = nextMs * 1000;
+            m_core.RunTimers();
+        }
+        Wait(us);
+        if (us > m_nowUs) m_nowUs = us;
+    }
+
+private:
+    BridgeCore& m_core;
+    double m_speed;
+    std::function<void(Clock::time_point)> m_waitUntil;
+    std::function<uint64_t()> m_oldClock;
+    bool m_started = false;
+    uint64_t m_firstUs = 0, m_nowUs = 0;
+    Clock::time_point m_wallStart;
+
+    // Keeps the original spacing (scaled by speed)
+    void Wait(uint64_t us) {
+        if (m_speed <= 0 || us <= m_firstUs) return;
+        double offsetSecs = (double)(us - m_firstUs) / 1e6 / m_speed;
+        Clock::time_point due = m_wallStart + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(offsetSecs));
+        if (m_waitUntil) m_waitUntil(due);
+        else std::this_thread::sleep_until(due);
+    }
+};
+
+// ==================================================================================
+//                                  REPLAY ENGINE
+// ==================================================================================
+// Feeds a capture back through the core, exactly as the network thread would.
+//   speed = 1.0  real time
+//   speed = N    N times faster
+//   speed = 0    as fast as possible
+// The bytes, their split into reads and their order are always the same, so the
+// messages the sink receives are identical at any speed; only the gaps change.
+// The core's clock (its timers and reconnect grace window) runs on capture time
+// for the same reason, see ReplayClock.
+// Stops early if "running" is given and goes false. "onRecord", if given, is called
+// with the capture time before each record. "waitUntil", if given, does the waiting
+// between records instead of sleeping (the bridge serves its clients meanwhile).
+// Returns the records replayed.
+inline uint64_t ReplayCapture(CaptureReader& reader, BridgeCore& core, double speed,
+                              const std::atomic<bool>* running = NULL,
+                              const std::function<void(uint64_t)>& onRecord = nullptr,
+                              const std::function<void(std::chrono::steady_clock::time_point)>& waitUntil = nullptr) {
+    uint64_t records = 0;
+    bool connected = false;
+    CaptureRecord rec;
+    ReplayClock clock(core, speed, waitUntil);
+
+    reader.Rewind();
+    while (reader.Next(rec)) {
+        if (running && !*running) break;
+        clock.AdvanceTo(rec.timeUs);
+        core.CheckReconnectGrace();
+        if (onRecord) onRecord(rec.timeUs);
+
+        if (rec.type == CAP_CONNECT) {
+            core.OnConnect();
+            connected = true;
+        }
+        else if (rec.type == CAP_DATA) {
+            core.Feed(rec.data, rec.length);
+        }
+        else if (rec.type == CAP_DISCONNECT) {
+            core.OnDisconnect();
+            connected = false;
+        }
+        records++;
+    }
+
+    // A capture cut short mid-session still ends with the lights off
+    if (connected) core.OnDisconnect();
+    core.CheckReconnectGrace(true);
+    return records;
+}
@@ -0,0 +1,438 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                     MAME BRIDGE NET-TO-WIN : CAPTURE INDEX
+// ==================================================================================
+// Lets us jump straight to "lamp17 between minute 40 and 41" in a multi-hour compact
+// capture (BridgeCompactCapture.h) instead of decoding it from the start.
+//
+// The index lives next to the capture ("session.ccap.idx") and is built on first use.
+// It splits the capture into blocks of at most 4096 events or 1 second, and stores:
+//   - A checkpoint per block: file offset, decoder time, connection state, ROM name
+//     and every output's value at that point, so decoding can start right there.
+//   - The dictionary (output names), sorted so a name is found by binary search.
+//   - A posting list per output: the blocks in which that output changes.
+// Seeking by time or by name is a binary search; only the blocks that matter are
+// decoded. The replay engine uses the same reader, so replay can start anywhere.
+//
+// INDEX FORMAT (all numbers little-endian u64 unless noted):
+//   Header:    "MBNWIDX1", capture size, block count, name count,
+//              offsets of the blocks, names, sorted names and postings sections
+//   Blocks:    start time, file offset, decoder time, first event number,
+//              dictionary size, snapshot offset, connected, event count
+//   Snapshot:  i32 value per output defined so far, u32 ROM name length, ROM name
+//   Names:     offset per name, then (u32 length, bytes) per name
+//   Sorted:    u32 output IDs ordered by name
+//   Postings:  start per output (+1 end marker), then u32 block numbers
+// ==================================================================================
+
+#pragma once
+
+#include "BridgeCore.h"
+#include "BridgeCapture.h"
+#include "BridgeCompactCapture.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#define INDEX_MAGIC "MBNWIDX1"
+#define INDEX_HEADER_SIZE 64
+#define INDEX_BLOCK_SIZE 64
+#define INDEX_BLOCK_EVENTS 4096       // A new checkpoint at least every 4096 events...
+#define INDEX_BLOCK_MICROS 1000000    // ...and at least every second of capture time
+
+// Connection state at a point in the capture
+struct CaptureState {
+    bool connected = false;
+    std::string romName;
+};
+
+inline void IndexPutU32(std::string& out, uint32_t v) { for (int i = 0; i < 4; i++) out += (char)(v >> (8 * i)); }
+inline void IndexPutU64(std::string& out, uint64_t v) { for (int i = 0; i < 8; i++) out += (char)(v >> (8 * i)); }
+inline uint32_t IndexGetU32(const char* p) { uint32_t v = 0; for (int i = 3; i >= 0; i--) v = (v << 8) | (uint8_t)p[i]; return v; }
+inline uint64_t IndexGetU64(const char* p) { uint64_t v = 0; for (int i = 7; i >= 0; i--) v = (v << 8) | (uint8_t)p[i]; return v; }
+
+// Follows the connection state through an event
+inline void TrackCaptureState(const CompactEvent& ev, CaptureState& state) {
+    if (ev.type == CEV_CONNECT) { state.connected = true; state.romName = "___empty"; }
+    else if (ev.type == CEV_DISCONNECT) state.connected = false;
+    else if (ev.type == CEV_START) state.romName.assign(ev.text, ev.textLen);
+}
+
+// ==================================================================================
+//                                  INDEX BUILDER
+// ==================================================================================
+// Scans a compact capture once and writes "<capture>.idx"
+inline bool BuildCaptureIndex(const std::string& capturePath) {
+    CompactReader reader;
+    if (!reader.Open(capturePath)) return false;
+
+    struct Block {
+        uint64_t startTime, fileOffset, decoderTime, firstEvent, dictSize, snapshotOffset, connected, events;
+    };
+    std::vector<Block> blocks;
+    std::string snapshots;
+    std::vector<std::vector<uint32_t>> postings(1);
+    CaptureState state;
+    CompactEvent ev;
+    uint64_t events = 0;
+    bool newBlock = true;
+
+    while (true) {
+        // Checkpoint: everything needed to start decoding from here
+        if (newBlock) {
+            Block b;
+            b.startTime = reader.Time();
+            b.fileOffset = reader.Offset();
+            b.decoderTime = reader.Time();
+            b.firstEvent = events;
+            b.dictSize = reader.Values().size();
+            b.snapshotOffset = snapshots.size();
+            b.connected = state.connected ? 1 : 0;
+            b.events = 0;
+            for (int v : reader.Values()) IndexPutU32(snapshots, (uint32_t)v);
+            IndexPutU32(snapshots, (uint32_t)state.romName.size());
+            snapshots += state.romName;
+            blocks.push_back(b);
+            newBlock = false;
+        }
+
+        if (!reader.Next(ev)) break;
+        Block& b = blocks.back();
+        if (b.events == 0) b.startTime = ev.timeUs;
+        b.events++;
+        events++;
+
+        if (ev.type == CEV_UPDATE) {
+            if (postings.size() <= ev.id) postings.resize(ev.id + 1);
+            uint32_t blockNo = (uint32_t)(blocks.size() - 1);
+            if (postings[ev.id].empty() || postings[ev.id].back() != blockNo) postings[ev.id].push_back(blockNo);
+        }
+        TrackCaptureState(ev, state);
+
+        if (b.events >= INDEX_BLOCK_EVENTS || ev.timeUs - b.startTime >= INDEX_BLOCK_MICROS) newBlock = true;
+    }
+    if (!blocks.empty() && blocks.back().events == 0) blocks.pop_back();
+
+    // Dictionary, plus the IDs sorted by name for binary search
+    uint64_t nameCount = reader.OutputCount() + 1;
+    postings.resize(nameCount);
+    std::vector<uint32_t> sorted;
+    for (uint32_t id = 1; id < nameCount; id++) sorted.push_back(id);
+    std::sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b) { return reader.Name(a) < reader.Name(b); });
+
+    // Lay out the sections
+    uint64_t blocksOffset = INDEX_HEADER_SIZE;
+    uint64_t snapshotsOffset = blocksOffset + blocks.size() * INDEX_BLOCK_SIZE;
+    uint64_t namesOffset = snapshotsOffset + snapshots.size();
+
+    std::string names;
+    uint64_t nameData = namesOffset + nameCount * 8;
+    std::string nameTable;
+    for (uint64_t id = 0; id < nameCount; id++) {
+        IndexPutU64(nameTable, nameData + names.size());
+        const std::string& n = reader.Name((uint32_t)id);
+        IndexPutU32(names, (uint32_t)n.size());
+        names += n;
+    }
+    uint64_t sortedOffset = nameData + names.size();
+    uint64_t postingsOffset = sortedOffset + sorted.size() * 4;
+
+    std::string out;
+    out.append(INDEX_MAGIC, 8);
+    IndexPutU64(out, reader.FileSize());
+    IndexPutU64(out, blocks.size());
+    IndexPutU64(out, nameCount);
+    IndexPutU64(out, blocksOffset);
+    IndexPutU64(out, namesOffset);
+    IndexPutU64(out, sortedOffset);
+    IndexPutU64(out, postingsOffset);
+
+    for (const Block& b : blocks) {
+        IndexPutU64(out, b.startTime);
+        IndexPutU64(out, b.fileOffset);
+        IndexPutU64(out, b.decoderTime);
+        IndexPutU64(out, b.firstEvent);
+        IndexPutU64(out, b.dictSize);
+        IndexPutU64(out, snapshotsOffset + b.snapshotOffset);
+        IndexPutU64(out, b.connected);
+        IndexPutU64(out, b.events);
+    }
+    out += snapshots;
+    out += nameTable;
+    out += names;
+    for (uint32_t id : sorted) IndexPutU32(out, id);
+
+    uint64_t entry = 0;
+    for (uint64_t id = 0; id < nameCount; id++) {
+        IndexPutU64(out, entry);
+        entry += postings[id].size();
+    }
+    IndexPutU64(out, entry);
+    for (uint64_t id = 0; id < nameCount; id++) {
+        for (uint32_t blockNo : postings[id]) IndexPutU32(out, blockNo);
+    }
+
+    FILE* f = fopen((capturePath + ".idx").c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    fclose(f);
+    return ok;
+}
+
+// ==================================================================================
+//                                 INDEXED CAPTURE
+// ==================================================================================
+class IndexedCapture {
+public:
+    // Opens a compact capture and its index, (re)building the index if it is
+    // missing or was made for a different version of the file
+    bool Open(const std::string& capturePath) {
+        if (!m_reader.Open(capturePath)) return false;
+        std::string indexPath = capturePath + ".idx";
+        if (LoadIndex(indexPath)) return true;
+        m_index.Close();
+        return BuildCaptureIndex(capturePath) && LoadIndex(indexPath);
+    }
+
+    size_t BlockCount() const { return (size_t)m_blockCount; }
+    size_t OutputCount() const { return m_names.size() - 1; }
+    const std::string& Name(uint32_t id) const { return m_names[id]; }
+    CompactReader& Reader() { return m_reader; }
+
+    uint64_t BlockStartTime(size_t b) const { return IndexGetU64(Block(b)); }
+
+    // O(log n): the output ID for a name, or 0 if it never appears
+    uint32_t FindOutput(const std::string& name) const {
+        const char* sorted = m_index.Data() + m_sortedOffset;
+        size_t lo = 0, hi = m_names.size() - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            uint32_t id = IndexGetU32(sorted + mid * 4);
+            if (m_names[id] < name) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < m_names.size() - 1) {
+            uint32_t id = IndexGetU32(sorted + lo * 4);
+            if (m_names[id] == name) return id;
+        }
+        return 0;
+    }
+
+    // O(log n): the block that contains time t (the last one starting at or before t)
+    size_t FindBlock(uint64_t t) const {
+        size_t lo = 0, hi = (size_t)m_blockCount;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (BlockStartTime(mid) <= t) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo ? lo - 1 : 0;
+    }
+
+    // Positions the reader on the first event at or after time t and returns it.
+    // "state" and Reader().Values() describe the capture just before that event.
+    bool SeekTime(uint64_t t, CompactEvent& ev, CaptureState& state) {
+        if (m_blockCount == 0) return false;
+        RestoreBlock(FindBlock(t), state);
+        while (m_reader.Next(ev)) {
+            if (ev.timeUs >= t) return true;
+            TrackCaptureState(ev, state);
+        }
+        return false;
+    }
+
+    // Calls fn(event) for every update of output "id" in [t0, t1), decoding only
+    // the blocks the output's posting list points to. Returns the blocks decoded.
+    template <typename F>
+    size_t ForEachUpdate(uint32_t id, uint64_t t0, uint64_t t1, F fn) {
+        if (id == 0 || id >= m_names.size() || m_blockCount == 0) return 0;
+        const char* postings = m_index.Data() + m_postingsOffset;
+        uint64_t begin = IndexGetU64(postings + id * 8);
+        uint64_t end = IndexGetU64(postings + (id + 1) * 8);
+        const char* entries = postings + (m_names.size() + 1) * 8;
+
+        // Binary search the posting list for the first block that can hold t0
+        uint32_t firstBlock = (uint32_t)FindBlock(t0);
+        uint64_t lo = begin, hi = end;
+        while (lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            if (IndexGetU32(entries + mid * 4) < firstBlock) lo = mid + 1;
+            else hi = mid;
+        }
+
+        size_t decoded = 0;
+        CaptureState state;
+        CompactEvent ev;
+        for (uint64_t i = lo; i < end; i++) {
+            uint32_t b = IndexGetU32(entries + i * 4);
+            if (BlockStartTime(b) >= t1) break;
+
+            RestoreBlock(b, state);
+            size_t blockEnd = (b + 1 < m_blockCount) ? (size_t)IndexGetU64(Block(b + 1) + 8) : m_reader.FileSize();
+            decoded++;
+            while (m_reader.Offset() < blockEnd && m_reader.Next(ev)) {
+                if (ev.timeUs >= t1) break;
+                if (ev.type == CEV_UPDATE && ev.id == id && ev.timeUs >= t0) fn(ev);
+            }
+        }
+        return decoded;
+    }
+
+private:
+    CompactReader m_reader;
+    MappedFile m_index;
+    uint64_t m_blockCount = 0;
+    uint64_t m_blocksOffset = 0, m_sortedOffset = 0, m_postingsOffset = 0;
+    std::vector<std::string> m_names;
+
+    const char* Block(size_t b) const { return m_index.Data() + m_blocksOffset + b * INDEX_BLOCK_SIZE; }
+
+    bool LoadIndex(const std::string& indexPath) {
+        if (!m_index.Open(indexPath)) return false;
+        const char* p = m_index.Data();
+        if (m_index.Size() < INDEX_HEADER_SIZE || memcmp(p, INDEX_MAGIC, 8) != 0) return false;
+        if (IndexGetU64(p + 8) != m_reader.FileSize()) return false;  // Stale: the capture changed
+
+        m_blockCount = IndexGetU64(p + 16);
+        uint64_t nameCount = IndexGetU64(p + 24);
+        m_blocksOffset = IndexGetU64(p + 32);
+        uint64_t namesOffset = IndexGetU64(p + 40);
+        m_sortedOffset = IndexGetU64(p + 48);
+        m_postingsOffset = IndexGetU64(p + 56);
+        if (nameCount == 0 || m_postingsOffset + (nameCount + 1) * 8 > m_index.Size()) return false;
+
+        m_names.clear();
+        for (uint64_t id = 0; id < nameCount; id++) {
+            const char* entry = p + IndexGetU64(p + namesOffset + id * 8);
+            m_names.push_back(std::string(entry + 4, IndexGetU32(entry)));
+        }
+        return true;
+    }
+
+    void RestoreBlock(size_t b, CaptureState& state) {
+        const char* block = Block(b);
+        uint64_t dictSize = IndexGetU64(block + 32);
+        const char* snapshot = m_index.Data() + IndexGetU64(block + 40);
+
+        std::vector<int> values(dictSize);
+        for (uint64_t i = 0; i < dictSize; i++) values[i] = (int)(int32_t)IndexGetU32(snapshot + i * 4);
+        m_reader.Restore((size_t)IndexGetU64(block + 8), IndexGetU64(block + 16), m_names, dictSize, values);
+
+        const char* rom = snapshot + dictSize * 4;
+        state.connected = IndexGetU64(block + 48) != 0;
+        state.romName.assign(rom + 4, IndexGetU32(rom));
+    }
+};
+
+// ==================================================================================
+//                              COMPACT REPLAY ENGINE
+// ==================================================================================
+
+// Formats one line exactly as MAME does ("name = value\r")
+inline void AppendOutputLine(std::string& packet, const std::string& name, const std::string& value) {
+    packet += name + " = " + value + "\r";
+}
+
+// Sends one line to the core on its own
+inline void FeedOutputLine(BridgeCore& core, const std::string& name, const std::string& value) {
+    std::string line;
+    AppendOutputLine(line, name, value);
+    core.Feed(line.data(), line.size());
+}
+
+// Turns compact events back into the packets MAME sent. Lines with the same
+// timestamp arrived in one recv(): they are fed together, so the core sees the
+// same packets as from the raw capture (see PRIORITY LANE), and replaying a
+// compact capture gives the same result as the raw one it was encoded from.
+// For each event: Flush() if Ends() says the packet waiting is complete (with the
+// core's clock still at PacketUs()), then Add(). Flush() once more at the end.
+// "names" is anything with Name(id): the CompactReader, or an IndexedCapture.
+class CompactPacketFeeder {
+public:
+    explicit CompactPacketFeeder(BridgeCore& core) : m_core(core) {}
+
+    bool connected = false;  // Between a connect and a disconnect
+
+    bool Ends(const CompactEvent& ev) const {
+        return !m_packet.empty() && (ev.timeUs != m_packetUs || ev.type == CEV_CONNECT || ev.type == CEV_DISCONNECT);
+    }
+    uint64_t PacketUs() const { return m_packetUs; }
+
+    void Flush() {
+        if (m_packet.empty()) return;
+        m_core.Feed(m_packet.data(), m_packet.size());
+        m_packet.clear();
+    }
+
+    // A connect or disconnect goes to the core straight away, a line joins the packet
+    template <typename Names>
+    void Add(const CompactEvent& ev, const Names& names) {
+        if (Ends(ev)) Flush();
+        if (ev.type == CEV_CONNECT) { m_core.OnConnect(); connected = true; return; }
+        if (ev.type == CEV_DISCONNECT) { m_core.OnDisconnect(); connected = false; return; }
+        if (ev.type == CEV_START) AppendOutputLine(m_packet, "mame_start", std::string(ev.text, ev.textLen));
+        else if (ev.type == CEV_STOP) AppendOutputLine(m_packet, "mame_stop", "1");
+        else AppendOutputLine(m_packet, names.Name(ev.id), std::to_string(ev.value));
+        m_packetUs = ev.timeUs;
+    }
+
+private:
+    BridgeCore& m_core;
+    std::string m_packet;
+    uint64_t m_packetUs = 0;
+};
+
+// Plays a compact capture through the core from "fromUs" onwards (see ReplayCapture
+// in BridgeCapture.h for the meaning of speed, running, onRecord and waitUntil).
+// Starting mid-capture first brings the clients up to the state at that point, the
+// same way MAME sends its current state to a new connection. Returns the events replayed.
+inline uint64_t ReplayCompact(IndexedCapture& capture, BridgeCore& core, double speed, uint64_t fromUs = 0,
+                              const std::atomic<bool>* running = NULL,
+                              const std::function<void(uint64_t)>& onRecord = nullptr,
+                              const std::function<void(std::chrono::steady_clock::time_point)>& waitUntil = nullptr) {
+    CompactEvent ev;
+    CaptureState state;
+    if (!capture.SeekTime(fromUs, ev, state)) return 0;
+    // The clock shows the packet being put together until it is fed (see ReplayClock)
+    ReplayClock clock(core, speed, waitUntil);
+    clock.AdvanceTo(ev.timeUs);
+
+    CompactPacketFeeder feeder(core);
+    feeder.connected = state.connected;
+    if (feeder.connected) {
+        core.OnConnect();
+        if (state.romName != "___empty") FeedOutputLine(core, "mame_start", state.romName);
+        const std::vector<int>& values = capture.Reader().Values();
+        for (uint32_t id = 1; id < values.size(); id++) {
+            if (values[id] == 0) continue;
+            if (ev.type == CEV_UPDATE && ev.id == id) continue;  // About to be sent anyway
+            FeedOutputLine(core, capture.Name(id), std::to_string(values[id]));
+        }
+    }
+
+    uint64_t events = 0;
+    do {
+        if (feeder.Ends(ev)) feeder.Flush();
+        if (running && !*running) break;
+        clock.AdvanceTo(ev.timeUs);
+        core.CheckReconnectGrace();
+        if (onRecord) onRecord(ev.timeUs);
+        feeder.Add(ev, capture);
+        events++;
+    } while (capture.Reader().Next(ev));
+    feeder.Flush();
+
+    // A capture cut short mid-session still ends with the lights off
+    if (feeder.connected) core.OnDisconnect();
+    core.CheckReconnectGrace(true);
+    return events;
+}
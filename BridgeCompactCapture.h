@@ -0,0 +1,316 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                   MAME BRIDGE NET-TO-WIN : COMPACT CAPTURE FORMAT
+// ==================================================================================
+// A binary encoding of a session for long recordings (e.g. hours of attract mode).
+// Where a raw capture (BridgeCapture.h) keeps every byte MAME sent, a compact
+// capture keeps the parsed events:
+//   - Each output name is written once, the first time it appears (the dictionary).
+//   - After that an update is: varint time delta, varint ID, zigzag value delta.
+// A lamp toggling every frame costs about 3 bytes per update instead of ~12.
+//
+// The encoder and decoder both stream, so neither needs the whole file in memory.
+// A compact capture does not keep how MAME's bytes were split across recv() calls;
+// keep the raw capture when that matters.
+//
+// FILE FORMAT:
+//   Header:  "MBNWCCP1" (8 bytes), capture start as Unix time in seconds (u64, LE)
+//   Records: varint time delta (microseconds since the previous record)
+//            varint (code << 2 | kind), followed by the kind's payload:
+//     KIND_UPDATE   code = output ID        zigzag varint (value - previous value)
+//     KIND_DEFINE   code = new output ID    varint length + name bytes
+//     KIND_CONTROL  code = CTRL_*           CTRL_START: varint length + ROM name bytes
+// Output IDs start at 1 and are given out in order of first appearance.
+// ==================================================================================
+
+#pragma once
+
+#include "BridgeCore.h"
+#include "BridgeCapture.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#define COMPACT_MAGIC "MBNWCCP1"
+#define COMPACT_HEADER_SIZE 16
+
+enum CompactKind { KIND_UPDATE = 0, KIND_DEFINE = 1, KIND_CONTROL = 2 };
+enum CompactControl { CTRL_CONNECT = 0, CTRL_DISCONNECT = 1, CTRL_START = 2, CTRL_STOP = 3 };
+
+// ==================================================================================
+//                                    VARINTS
+// ==================================================================================
+
+// LEB128: 7 bits per byte, high bit set on every byte except the last
+inline void PutVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += (char)(v | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+inline bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// Maps small negative and positive numbers to small unsigned ones (0,-1,1,-2 -> 0,1,2,3)
+inline uint64_t ZigZag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+inline int64_t UnZigZag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+// ==================================================================================
+//                                    ENCODER
+// ==================================================================================
+class CompactWriter {
+public:
+    ~CompactWriter() { Close(); }
+
+    bool Open(const std::string& path, uint64_t startUnix) {
+        Close();
+        m_file = fopen(path.c_str(), "wb");
+        if (!m_file) return false;
+
+        uint8_t header[COMPACT_HEADER_SIZE];
+        memcpy(header, COMPACT_MAGIC, 8);
+        for (int i = 0; i < 8; i++) header[8 + i] = (uint8_t)(startUnix >> (8 * i));
+        fwrite(header, 1, sizeof(header), m_file);
+        m_bytes = sizeof(header);
+        return true;
+    }
+
+    void Close() {
+        if (!m_file) return;
+        FlushBuffer();
+        fclose(m_file);
+        m_file = NULL;
+    }
+
+    // Times are microseconds since the capture started and must not go backwards
+    void Connect(uint64_t t)    { Head(t, CTRL_CONNECT, KIND_CONTROL); }
+    void Disconnect(uint64_t t) { Head(t, CTRL_DISCONNECT, KIND_CONTROL); }
+    void Stop(uint64_t t)       { Head(t, CTRL_STOP, KIND_CONTROL); }
+
+    void Start(uint64_t t, const std::string& romName) {
+        Head(t, CTRL_START, KIND_CONTROL);
+        PutString(romName);
+    }
+
+    void Update(uint64_t t, const std::string& name, int value) {
+        uint32_t id;
+        auto it = m_dict.find(name);
+        if (it == m_dict.end()) {
+            // First sighting: add it to the dictionary
+            id = (uint32_t)m_values.size();
+            m_dict[name] = id;
+            m_values.push_back(0);
+            Head(t, id, KIND_DEFINE);
+            PutString(name);
+        }
+        else {
+            id = it->second;
+        }
+
+        Head(t, id, KIND_UPDATE);
+        PutVarint(m_buf, ZigZag((int64_t)value - (int64_t)m_values[id]));
+        m_values[id] = value;
+        if (m_buf.size() >= (1 << 16)) FlushBuffer();
+    }
+
+    uint64_t BytesWritten() const { return m_bytes + m_buf.size(); }
+
+private:
+    FILE* m_file = NULL;
+    std::string m_buf;
+    uint64_t m_bytes = 0;
+    uint64_t m_lastTime = 0;
+    std::unordered_map<std::string, uint32_t> m_dict;
+    std::vector<int> m_values = std::vector<int>(1, 0);  // Slot 0 unused, IDs start at 1
+
+    void Head(uint64_t t, uint64_t code, CompactKind kind) {
+        if (t < m_lastTime) t = m_lastTime;
+        PutVarint(m_buf, t - m_lastTime);
+        PutVarint(m_buf, (code << 2) | kind);
+        m_lastTime = t;
+    }
+
+    void PutString(const std::string& s) {
+        PutVarint(m_buf, s.size());
+        m_buf += s;
+    }
+
+    void FlushBuffer() {
+        if (m_file && !m_buf.empty()) fwrite(m_buf.data(), 1, m_buf.size(), m_file);
+        m_bytes += m_buf.size();
+        m_buf.clear();
+    }
+};
+
+// ==================================================================================
+//                                    DECODER
+// ==================================================================================
+
+enum CompactEventType { CEV_CONNECT, CEV_DISCONNECT, CEV_START, CEV_STOP, CEV_UPDATE };
+
+struct CompactEvent {
+    CompactEventType type;
+    uint64_t timeUs;     // Microseconds since the capture started
+    uint32_t id;         // CEV_UPDATE: output ID (see CompactReader::Name)
+    int value;           // CEV_UPDATE: new value
+    const char* text;    // CEV_START: ROM name (points into the mapped file)
+    uint32_t textLen;
+};
+
+class CompactReader {
+public:
+    bool Open(const std::string& path) {
+        if (!m_file.Open(path)) return false;
+        if (m_file.Size() < COMPACT_HEADER_SIZE || memcmp(m_file.Data(), COMPACT_MAGIC, 8) != 0) {
+            m_file.Close();
+            return false;
+        }
+        Rewind();
+        return true;
+    }
+
+    void Rewind() {
+        m_pos = (const uint8_t*)m_file.Data() + COMPACT_HEADER_SIZE;
+        m_end = (const uint8_t*)m_file.Data() + m_file.Size();
+        m_time = 0;
+        m_names.assign(1, std::string());
+        m_values.assign(1, 0);
+    }
+
+    // Decodes the next event. Returns false at the end (or at a damaged/truncated tail).
+    bool Next(CompactEvent& ev) {
+        while (m_pos < m_end) {
+            uint64_t dt, head;
+            if (!GetVarint(m_pos, m_end, dt) || !GetVarint(m_pos, m_end, head)) return Stop();
+            m_time += dt;
+            uint64_t code = head >> 2;
+            ev.timeUs = m_time;
+
+            switch (head & 3) {
+            case KIND_UPDATE: {
+                uint64_t zz;
+                if (code >= m_values.size() || !GetVarint(m_pos, m_end, zz)) return Stop();
+                m_values[code] = (int)((int64_t)m_values[code] + UnZigZag(zz));
+                ev.type = CEV_UPDATE;
+                ev.id = (uint32_t)code;
+                ev.value = m_values[code];
+                return true;
+            }
+            case KIND_DEFINE: {
+                const char* text;
+                uint32_t len;
+                if (code != m_names.size() || !GetString(text, len)) return Stop();
+                m_names.push_back(std::string(text, len));
+                m_values.push_back(0);
+                continue;  // Definitions are not events by themselves
+            }
+            case KIND_CONTROL:
+                if (code == CTRL_CONNECT) ev.type = CEV_CONNECT;
+                else if (code == CTRL_DISCONNECT) ev.type = CEV_DISCONNECT;
+                else if (code == CTRL_STOP) ev.type = CEV_STOP;
+                else if (code == CTRL_START) {
+                    ev.type = CEV_START;
+                    if (!GetString(ev.text, ev.textLen)) return Stop();
+                }
+                else return Stop();
+                return true;
+            default:
+                return Stop();
+            }
+        }
+        return false;
+    }
+
+    const std::string& Name(uint32_t id) const { return m_names[id]; }
+    size_t OutputCount() const { return m_names.size() - 1; }
+    size_t FileSize() const { return m_file.Size(); }
+
+    // --- SEEKING (used by BridgeCaptureIndex.h) ---
+    size_t Offset() const { return m_pos - (const uint8_t*)m_file.Data(); }
+    uint64_t Time() const { return m_time; }
+    const std::vector<int>& Values() const { return m_values; }
+
+    // Continues decoding from a checkpoint: the file offset and decoder time there,
+    // the first "count" dictionary names and every output's value at that point
+    void Restore(size_t offset, uint64_t time, const std::vector<std::string>& names, size_t count,
+                 const std::vector<int>& values) {
+        m_pos = (const uint8_t*)m_file.Data() + offset;
+        m_end = (const uint8_t*)m_file.Data() + m_file.Size();
+        m_time = time;
+        m_names.assign(names.begin(), names.begin() + count);
+        m_values = values;
+    }
+
+private:
+    MappedFile m_file;
+    const uint8_t* m_pos = NULL;
+    const uint8_t* m_end = NULL;
+    uint64_t m_time = 0;
+    std::vector<std::string> m_names;  // Dictionary, index = output ID
+    std::vector<int> m_values;         // Last value per output ID (for the deltas)
+
+    bool GetString(const char*& text, uint32_t& len) {
+        uint64_t n;
+        if (!GetVarint(m_pos, m_end, n) || n > (uint64_t)(m_end - m_pos)) return false;
+        text = (const char*)m_pos;
+        len = (uint32_t)n;
+        m_pos += n;
+        return true;
+    }
+
+    bool Stop() {
+        m_pos = m_end;
+        return false;
+    }
+};
+
+// ==================================================================================
+//                                   CONVERTER
+// ==================================================================================
+// Re-encodes a raw capture as a compact one, using the bridge's own framer and line
+// parser, so the events are exactly the ones the bridge would have acted on.
+// Returns the number of updates written.
+inline uint64_t ConvertCaptureToCompact(CaptureReader& in, CompactWriter& out) {
+    LineFramer framer;
+    CaptureRecord rec;
+    uint64_t updates = 0;
+    std::string name, valStr;
+
+    in.Rewind();
+    while (in.Next(rec)) {
+        if (rec.type == CAP_CONNECT) {
+            framer.Clear();
+            out.Connect(rec.timeUs);
+        }
+        else if (rec.type == CAP_DISCONNECT) {
+            out.Disconnect(rec.timeUs);
+        }
+        else if (rec.type == CAP_DATA) {
+            framer.Feed(rec.data, rec.length, [&](const std::string& line) {
+                if (!ParseLine(line, name, valStr)) return;
+                if (name == "mame_start") out.Start(rec.timeUs, valStr);
+                else if (name == "mame_stop") out.Stop(rec.timeUs);
+                else {
+                    out.Update(rec.timeUs, name, std::atoi(valStr.c_str()));
+                    updates++;
+                }
+            });
+        }
+    }
+    return updates;
+}
@@ -0,0 +1,1866 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                      MAME BRIDGE NET-TO-WIN : PORTABLE CORE
+// ==================================================================================
+// The part of the bridge that understands MAME's network protocol.
+// 1. It splits the TCP byte stream into lines (the "framer").
+// 2. It parses each line and maps output names to IDs.
+// 3. It fans updates out to every registered client through a "sink", recoil and
+//    solenoid outputs first (see PRIORITY LANE below).
+// 4. It rides out short network hiccups (see RECONNECT GRACE below).
+// 5. It keeps short solenoid and flasher pulses visible (see PULSE STRETCHING below),
+//    and can turn strobing lamps into brightness levels (see PWM DIMMING below).
+// 6. It calms chattering outputs, caps runaway ones, and gives each client only the
+//    outputs it wants, in the values it wants (see OUTPUT FILTERS, RATE CAPS, ROUTING
+//    and TRANSFORMS below).
+// 7. It can make up outputs of its own from MAME's (see VIRTUAL OUTPUTS below).
+//
+// Nothing in here includes Windows headers. The Windows bridge supplies a sink that
+// turns events into PostMessage calls; the developer tools in "tools" supply sinks
+// that count or record messages, so they exercise exactly the same code on Linux.
+// ==================================================================================
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include "BridgeFlightRecorder.h"
+#include "BridgeIDStrings.h"
+#include "BridgeTimerWheel.h"
+#include "BridgeTransforms.h"
+#include "BridgeExpressions.h"
+
+#define BRIDGE_VERSION "3.6.0"
+
+// --- CONFIGURATION ---
+#define RECONNECT_GRACE_MS 5000  // How long the lights are held after MAME drops without "mame_stop"
+#define CATCHUP_BATCH 64         // Most catch-up updates sent to a new client per PumpCatchUp()
+#define CONNECT_RETRY_MIN_MS 250     // First retry after MAME goes away (often just a game change)
+#define CONNECT_RETRY_MAX_MS 10000   // Retries slow down to this while MAME stays away
+#define PRIORITY_OUTPUTS "*recoil*,*solenoid*,*rumble*,sol?*"  // Outputs sent ahead of the lamps (see PRIORITY LANE)
+#define DEBOUNCE_MS 20           // Settle time for a debounce rule without one (see OUTPUT FILTERS)
+#define HYSTERESIS_DELTA 2       // Smallest change passed on for a hysteresis rule without one
+#define PULSE_STRETCH_MS 40      // Minimum on-time for a stretch pattern without one (see PULSE STRETCHING)
+#define PWM_WINDOW_MS 200        // Sliding window the duty cycle is measured over (see PWM DIMMING)
+#define PWM_SLICES 10            // ...kept as this many slices
+#define PWM_MIN_EDGES 6          // Switches in the window that mean "strobing" (30 a second; a blinker does 2-8)
+#define PWM_STEADY_EDGES 2       // Fewer than this and the lamp is steady again
+#define PWM_INTERVAL_MS 50       // Brightness updates per output at most this often
+#define PWM_LEVELS 16            // Brightness steps
+#define PWM_MAX_VALUE 255        // Brightness of a lamp that is on all the time
+#define RATE_CAP_HZ 200          // Updates per second for a rate cap rule without one (see RATE CAPS)
+#define RATE_CAP_BURST 4         // Updates a capped output may send back to back
+
+typedef intptr_t OutputID;      // Same width as LPARAM, which carries the ID on Windows
+typedef uintptr_t ClientHandle; // HWND on Windows, any unique number elsewhere
+
+// Same value as HWND_BROADCAST, so the Windows sink can pass it straight through
+#define CLIENT_BROADCAST ((ClientHandle)0xffff)
+
+// How START and STOP reach the clients (see START/STOP DELIVERY)
+enum NotifyMode {
+    NOTIFY_BROADCAST,  // Always to every top-level window, like MAME itself
+    NOTIFY_TARGETED    // To the registered clients, broadcast only for discovery
+};
+
+// How urgently an output's updates go out (see PRIORITY LANE)
+enum OutputClass {
+    OUTPUT_BULK,      // Lamps, LEDs, gauges: sent once per chunk from MAME, latest value
+    OUTPUT_PRIORITY   // Recoil, solenoids: sent the moment their line is read
+};
+
+// What a core timer is for (see TIMERS)
+enum CoreTimer {
+    TIMER_PULSE_END,  // Send a stretched output's held-back 0
+    TIMER_PWM_TICK,   // Send a strobing output's brightness
+    TIMER_DEBOUNCE,   // Send a debounced output's value once it has settled
+    TIMER_RATE_HOLD,  // Send a rate-capped output's latest value to the capped clients
+    CORE_TIMER_KINDS
+};
+
+// The messages the bridge sends to clients (these mirror MAME's window messages)
+enum BridgeMessage {
+    MSG_MAME_START,   // "MAMEOutputStart"       - a game started / name changed
+    MSG_MAME_STOP,    // "MAMEOutputStop"        - MAME went away, turn everything off
+    MSG_UPDATE_STATE  // "MAMEOutputUpdateState" - output ID changed to value
+};
+
+// A snapshot of what the bridge is doing (see BridgeCore::Status). This is all a
+// headless bridge reports: no log text is produced at all.
+struct BridgeStatus {
+    bool connected = false;       // TCP connection to MAME is up
+    bool holding = false;         // Inside the reconnect grace window
+    std::string rom;              // Current ROM ("___empty" before "mame_start")
+    size_t outputs = 0;           // Outputs with an ID
+    size_t clients = 0;           // Registered clients
+    size_t catchingUp = 0;        // Clients still being sent the current state
+    uint64_t lines = 0;           // Lines received from MAME
+    uint64_t updates = 0;         // Update messages posted to clients
+    uint64_t reconnectsResumed = 0;
+    uint64_t idsReclaimed = 0;
+
+    std::string ToString() const {
+        return std::string(connected ? "connected" : (holding ? "holding" : "waiting")) +
+               " rom=" + rom + " outputs=" + std::to_string(outputs) +
+               " clients=" + std::to_string(clients) + " catching_up=" + std::to_string(catchingUp) +
+               " lines=" + std::to_string(lines) + " updates=" + std::to_string(updates) +
+               " resumed=" + std::to_string(reconnectsResumed) + " reclaimed=" + std::to_string(idsReclaimed);
+    }
+};
+
+// ==================================================================================
+//                                      SINK
+// ==================================================================================
+// Whatever owns the core decides how messages are delivered.
+struct BridgeSink {
+    virtual ~BridgeSink() {}
+
+    // Deliver a message to one client, or to everyone with CLIENT_BROADCAST.
+    // Called from the network thread, so it must not block.
+    virtual void Post(ClientHandle target, BridgeMessage msg, OutputID id, int value) = 0;
+
+    // Receive a log line (optional)
+    virtual void Log(const std::string& /*msg*/) {}
+
+    // MAME went away without sending "mame_stop" (optional). Called before the ID
+    // maps are cleared, so this is the place to save the flight recorder.
+    virtual void OnUnexpectedDisconnect() {}
+
+    // Tell one client the name of an ID before it asks (optional). Used when a
+    // client catches up, so it doesn't have to ask about every output at once.
+    virtual void SendIDString(ClientHandle /*client*/, OutputID /*id*/) {}
+};
+
+// ==================================================================================
+//                                  HELPER FUNCTIONS
+// ==================================================================================
+
+// Helper: Remove invisible chars, quotes, and whitespace artifacts
+inline std::string CleanString(const std::string& input) {
+    std::string output = "";
+    for (char c : input) {
+        if (isalnum((unsigned char)c) || c == '_' || c == '.') {
+            output += c;
+        }
+    }
+    return output;
+}
+
+// Splits a line from MAME (e.g., "lamp0 = 1") into its cleaned name and value text.
+// Returns false for blank lines and lines without '='.
+inline bool ParseLine(std::string line, std::string& name, std::string& valStr) {
+    // Basic Trim
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty()) return false;
+
+    size_t eqPos = line.find("=");
+    if (eqPos == std::string::npos) return false;
+
+    // CLEANING: Strip quotes and garbage characters
+    name = CleanString(line.substr(0, eqPos));
+    valStr = CleanString(line.substr(eqPos + 1));
+    return true;
+}
+
+// Matches an output name against a pattern ('*' = anything, '?' = one character),
+// ignoring case: "*recoil*" matches "P1_Gun_Recoil"
+inline bool MatchPattern(const char* pattern, const char* name) {
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        }
+        else if (*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*name)) {
+            pattern++;
+            name++;
+        }
+        else if (star) {
+            // Let the last '*' swallow one more character and try again
+            pattern = star + 1;
+            name = ++resume;
+        }
+        else return false;
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == 0;
+}
+
+// Splits a list like "lamp*,led*;*flash*" (',' or ';' between the items) into its
+// items, leaving out empty ones
+inline std::vector<std::string> SplitList(const std::string& list) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find_first_of(",;", start);
+        if (end == std::string::npos) end = list.size();
+        if (end > start) items.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+    return items;
+}
+
+// ==================================================================================
+//                                     FRAMER
+// ==================================================================================
+// Turns the TCP byte stream into lines, however recv() happened to split it.
+struct LineFramer {
+    std::string buffer;  // Persistent buffer for fragmented packets
+
+    // Calls onLine(line) for every complete line in the data received so far
+    template <typename F>
+    void Feed(const char* data, size_t len, F onLine) {
+        buffer.append(data, len);
+        size_t pos = 0;
+
+        // CRITICAL: MAME uses '\r' (Carriage Return) as a line terminator, NOT '\n'.
+        // We must split on '\r' to correctly process messages.
+        while ((pos = buffer.find('\r')) != std::string::npos) {
+            std::string line = buffer.substr(0, pos);
+            onLine(line);
+            buffer.erase(0, pos + 1);
+        }
+    }
+
+    void Clear() { buffer.clear(); }
+};
+
+// ==================================================================================
+//                                   BRIDGE CORE
+// ==================================================================================
+struct BridgeCore {
+    BridgeSink* sink;
+
+    // --- ID MAPPING ---
+    // MAME uses integer IDs for outputs (e.g., ID 10 = "lamp0").
+    // Since we don't know MAME's internal IDs, we generate our own on the fly.
+    std::map<std::string, OutputID> nameToID; // Maps "lamp0" -> 1
+    std::map<OutputID, std::string> idToName; // Maps 1 -> "lamp0"
+    OutputID nextID = 1;
+    std::string currentRomName = "___empty";  // Stores current game name (e.g., "pacman")
+
+    // --- ROM EPOCHS ---
+    // A frontend can switch games many times without MAME closing the connection.
+    // Every "mame_start" begins a new epoch, and every ID is tagged with the last
+    // epoch that used it. Clients drop their ID caches on START, but one may still
+    // ask about an ID from the game just before (a request already in flight), so
+    // an ID is only reclaimed once a whole epoch has passed without it. Its number
+    // goes back on a free list and is handed out again, lowest first, keeping the
+    // tables (and the IDs) as small as the last two games.
+    uint32_t romEpoch = 0;
+    std::vector<uint32_t> idEpoch;            // Last epoch that used each ID
+    std::vector<OutputID> freeIDs;            // Reclaimed IDs (min-heap)
+    uint64_t idsReclaimed = 0;
+
+    // --- ID STRINGS ---
+    // Ready-made "MAMEOutputGetIDString" replies, built as IDs are handed out
+    // (see BridgeIDStrings.h). Rebuilt for ID 0 whenever the ROM name changes.
+    IDStringArena idStrings;
+    std::vector<uint8_t> idStringScratch;     // Reply for an ID with no cached blob
+
+    // --- CLIENTS ---
+    std::vector<ClientHandle> clients;        // List of connected clients (e.g. LEDBlinky)
+
+    // --- ROUTING ---
+    // Every client used to get every output. A lamp controller only cares about
+    // "lamp*", a recoil tool only about "*recoil*": a client can be given a route, a
+    // list of patterns (SetClientRoute(), on Windows --route by the client's program
+    // name), and then only gets the outputs that match. The patterns are matched once
+    // per output, when it gets its ID, and the answer kept as a bit per ID; sending
+    // an update tests that bit. clientRoute runs parallel to clients, so the test
+    // needs no search. Clients without a route get everything, as before.
+    struct ClientRoute {
+        ClientHandle client;
+        std::vector<std::string> patterns;
+        std::vector<uint64_t> wants;          // Bit per ID: the output matches a pattern
+    };
+    std::vector<ClientRoute> routes;
+    std::vector<int32_t> clientRoute;         // Per entry of clients: index in routes, -1 = everything
+    uint64_t updatesUnrouted = 0;             // Statistics: updates clients did not want
+
+    // --- TRANSFORMS ---
+    // Clients can want different values for the same output: swapped 0 and 1, 0-100
+    // instead of 0-255 (see BridgeTransforms.h). When a client is named (on Windows,
+    // after its program) the transform rules for that name are looked up for every
+    // output, and for each new ID as it is handed out, and kept as a program number
+    // per ID. Posting an update then reads that number and the program's table.
+    // clientTransform runs parallel to clients. Clients that no rule names get the
+    // values as MAME sends them.
+    struct ClientTransforms {
+        ClientHandle client;
+        std::string name;
+        std::vector<uint16_t> programOf;      // Per ID: program + 1, 0 = unchanged
+    };
+    TransformSet transforms;
+    std::vector<ClientTransforms> transformClients;
+    std::vector<int32_t> clientTransform;     // Per entry of clients: index in transformClients, -1 = none
+
+    // --- VIRTUAL OUTPUTS ---
+    // Outputs worked out from others with an expression (see BridgeExpressions.h).
+    // One gets its ID from GetIDForName the first time it has a value in a game, and
+    // from then on goes through everything a real output goes through. The names an
+    // expression reads are its inputs: virtualInputs holds the ID of each (0 until
+    // it is handed out), and readers lists, per ID, the virtual outputs that read it,
+    // so an update only re-evaluates those, and only if the value changed.
+    // inputValue keeps the latest value of every ID that is read, as MAME sent it
+    // (ahead of the filters and the priority lane).
+    struct VirtualState {
+        uint32_t firstInput;                  // Its inputs in virtualInputs
+        OutputID id;                          // 0 = no value in this game yet
+        int value;
+        bool stale = false;                   // An input changed while no client was registered
+    };
+    ExpressionSet virtuals;
+    std::vector<VirtualState> virtualState;   // Per virtual output
+    std::vector<OutputID> virtualInputs;      // Per input of each virtual output: its ID
+    std::vector<uint32_t> virtualInputOwner;  // ...and the virtual output it belongs to
+    std::map<std::string, std::vector<uint32_t>> inputSlots;  // Input name -> entries of virtualInputs
+    std::vector<std::vector<uint32_t>> readers;  // Per ID: the virtual outputs that read it
+    std::vector<int32_t> inputValue;          // Per ID that is read: latest value
+    uint64_t virtualEvaluations = 0;          // Statistics: expressions evaluated
+    uint64_t virtualUpdates = 0;              // Statistics: virtual output values passed on
+    bool virtualsStale = false;               // Some virtual output is stale (see IDLE)
+
+    // --- START/STOP DELIVERY ---
+    // A broadcast START or STOP wakes every top-level window on the desktop (the
+    // frontend and the game included), on every connect, drop and game change.
+    // Only registered clients care, so with NOTIFY_TARGETED they are told directly.
+    // It is still broadcast when somebody may be listening without being registered:
+    // nobody is registered yet (a client waiting for MAME to appear), or a client
+    // unregistered since the last broadcast (it may be waiting for the next game).
+    NotifyMode notifyMode = NOTIFY_TARGETED;
+    bool clientLeft = false;                  // A client unregistered since the last broadcast
+    std::vector<ClientHandle> notifyTargets;  // Scratch: registered clients, once each
+    uint64_t notifyBroadcasts = 0;            // Statistics for the tools
+    uint64_t notifyTargeted = 0;              // Messages sent to one client each
+
+    // --- CATCH-UP ---
+    // A client that registers mid-game would otherwise see nothing until each output
+    // happens to change, so lamps that are already lit stay dark. Instead it gets the
+    // current state (every output that is not 0, from lastValue) to itself, name
+    // first, a batch at a time from PumpCatchUp(). No START is sent: LEDBlinky answers
+    // a start right after registering by registering again, forever.
+    struct CatchUp { ClientHandle client; OutputID next; };
+    std::vector<CatchUp> catchUps;            // Clients still catching up
+    size_t catchUpBatch = CATCHUP_BATCH;
+    uint64_t catchUpUpdates = 0;              // Statistics for the tools
+
+    // --- FRAMER ---
+    LineFramer framer;                        // Splits the byte stream into lines
+    bool stopReceived = false;                // MAME said "mame_stop" (a clean exit)
+
+    // --- FLIGHT RECORDER ---
+    // A dump names outputs after the fact, but by then a new game may have reclaimed
+    // an ID and given it to another output. So every event carries the generation of
+    // the ID map it was recorded in (bumped whenever IDs can lose their names: a new
+    // ROM epoch, a session reset; never reset itself). Each ID remembers the
+    // generation it got its current name in, and reclaimed names are kept, the most
+    // recent FLIGHT_RECORDER_NAMES of them, with the generations they were valid for.
+    struct RetiredName {
+        OutputID id;
+        uint32_t from, until;                 // Valid for generations from..until-1
+        std::string name;
+    };
+    FlightRecorder* recorder = NULL;          // Optional, see BridgeFlightRecorder.h
+    uint32_t mapGeneration = 0;
+    std::vector<uint32_t> idGeneration;       // Per ID: generation it got its current name in
+    std::deque<RetiredName> retiredNames;
+
+    // --- LOGGING & STATUS ---
+    // Log text costs a string build for every line MAME sends ("RAW: ..."). A headless
+    // bridge has nobody to read it, so it turns logging off and no text is built at
+    // all; what it is doing is still available from Status().
+    bool logging = true;
+    bool connected = false;                   // Between OnConnect() and OnDisconnect()
+    uint64_t linesProcessed = 0;              // Statistics for Status()
+    uint64_t updatesPosted = 0;
+
+    // --- RECONNECT GRACE ---
+    // When the connection drops without "mame_stop" we don't turn everything off
+    // straight away. Clients keep their lights and IDs for reconnectGraceMs. If MAME
+    // comes back with the same ROM in time, the ID tables are kept and MAME's state
+    // dump after "mame_start" is reconciled against the last known values: only the
+    // outputs that changed while we were away reach the clients. Otherwise (other
+    // ROM, or the window runs out) clients get the usual STOP and a clean start.
+    enum GraceState { GRACE_NONE, GRACE_DISCONNECTED, GRACE_AWAITING_START };
+    uint64_t reconnectGraceMs = RECONNECT_GRACE_MS; // 0 = old behaviour, reset on every drop
+    GraceState grace = GRACE_NONE;
+    uint64_t graceStartMs = 0;
+    std::vector<int> lastValue;               // Last value sent to clients, per output ID
+    std::vector<uint8_t> unreconciled;        // 1 = not heard from since the reconnect
+    uint64_t reconnectsResumed = 0;           // Statistics for the tools
+    uint64_t updatesReconciled = 0;           // Updates not sent because nothing changed
+
+    // Milliseconds for the grace window. Replays point this at capture time.
+    std::function<uint64_t()> clock;
+
+    // --- PRIORITY LANE ---
+    // A gun's recoil solenoid has to fire within a millisecond of the shot, but MAME
+    // often sends it in the same packet as a flood of lamp changes, and every line
+    // ahead of it used to be posted (and logged) first. Outputs whose names match
+    // one of the priority patterns (by default recoil, rumble and solenoids, which
+    // most drivers call sol0, sol1, ...) are posted the moment their line is parsed.
+    // Every other output is only staged, and Feed() posts the staged outputs once the
+    // whole packet is read, with their latest value: a lamp that changes twice in one
+    // packet is sent once. Coalescing never hides a blink, though: an output that
+    // goes back to the value the clients have is sent both ways. Log lines written
+    // while a packet is being read wait for the end of it too.
+    // With the lane off (SetPriorityPatterns("none")) every update is posted straight
+    // away, in order, as before.
+    bool priorityLane = true;
+    std::vector<std::string> priorityPatterns;
+    std::vector<uint8_t> idClass;             // OutputClass per ID
+    struct Staged { OutputID id; int from, value; }; // from = the value the clients have
+    std::vector<Staged> staged;               // Bulk updates waiting for the end of the packet
+    std::vector<uint32_t> stagedSlot;         // Per ID: index in staged + 1, 0 = not staged
+    bool readingPacket = false;               // Inside Feed(): bulk updates and logs wait
+    std::vector<std::string> deferredLog;
+    uint64_t priorityUpdates = 0;             // Statistics for the tools
+    uint64_t updatesCoalesced = 0;            // Bulk updates replaced by a later one
+
+    // --- OUTPUT FILTERS ---
+    // Some drivers chatter while an output changes state: a door motor goes 1,0,1,1
+    // within a few milliseconds, a gauge wobbles between 127 and 128. Every wobble
+    // used to reach the clients (and flicker the lamp). Two filters, picked per output
+    // by pattern, run straight after the name is turned into an ID:
+    //   debounce ("*door*=30"): a new value is passed on once it has held for that
+    //     many milliseconds (a timer sends it, see TIMERS). If the output goes back
+    //     to what the clients have before then, they never hear of it.
+    //   hysteresis ("*gauge*=4"): changes smaller than that are dropped. They are
+    //     measured from what the clients have, so a slow drift still gets through.
+    //     Going to or from 0 always counts.
+    // An output's rules are looked up once, when it gets its ID, and kept as an index
+    // into a small table of the distinct settings in use. Outputs without a rule have
+    // no entry and cost one bounds check per update. Off by default.
+    struct OutputFilter {
+        uint32_t debounceMs;                  // 0 = no debounce
+        int hysteresis;                       // 0 = no hysteresis
+    };
+    std::vector<std::pair<std::string, uint32_t>> debounceRules;    // Pattern, settle time
+    std::vector<std::pair<std::string, uint32_t>> hysteresisRules;  // Pattern, smallest change
+    std::vector<OutputFilter> filters;        // Distinct settings in use
+    std::vector<uint8_t> filterOf;            // Per ID: index in filters + 1, 0 = not filtered
+    std::vector<int> debounceValue;           // Per ID: the value waiting to settle
+    uint64_t updatesFiltered = 0;             // Statistics: updates held back or dropped
+    uint64_t updatesDebounced = 0;            // ...and passed on after all, once settled
+
+    // --- PULSE STRETCHING ---
+    // A flasher or solenoid pulse can be shorter than a frame: MAME sends "flash0 = 1"
+    // and "flash0 = 0" a few milliseconds apart, or in the same packet. A client that
+    // only looks now and then, or a lamp controller that refreshes every 10 ms, never
+    // sees it. Outputs matching a stretch rule ("*flash*=50") stay on for at least
+    // that many milliseconds: a 0 that comes sooner is held back, and a timer sends it
+    // once the output has been on long enough (see TIMERS). A new value before then
+    // cancels the timer (the output never went off). Off by default.
+    std::vector<std::pair<std::string, uint32_t>> stretchRules;  // Pattern, minimum on-time
+    std::vector<uint32_t> minOnMs;            // Per ID, 0 = not stretched
+    std::vector<uint64_t> onSinceMs;          // Per ID: when the clients saw it go on
+    uint64_t pulsesStretched = 0;             // Statistics for the tools
+
+    // --- PWM DIMMING ---
+    // Many games dim a lamp by switching it on and off every frame or two, and MAME
+    // passes every switch on: a few dimmed lamps are hundreds of 0/1 messages a
+    // second, and a client that only shows on or off makes them flicker. Outputs
+    // matching a PWM pattern ("lamp*") are watched: the time they are on is added up
+    // over a sliding window, in slices, along with how often they switch. Once a lamp
+    // switches PWM_MIN_EDGES times within the window it counts as strobing, and the
+    // clients that asked for brightness (SetBrightnessClient(), or all of them with
+    // pwmAllClients) stop getting its 0s and 1s. Instead, every PWM_INTERVAL_MS, they
+    // get its duty cycle as a brightness from 0 to PWM_MAX_VALUE in PWM_LEVELS steps,
+    // and only when that changed (by more than 3/4 of a step, so a lamp halfway
+    // between two steps doesn't flicker between them). When the strobing stops they
+    // get the plain value again. Other clients, and lamps that are not strobing, see
+    // no difference.
+    struct PwmState {
+        bool filtered = false;                // Matches a PWM pattern
+        bool on = false;                      // Latest value from MAME is not 0
+        bool dimming = false;                 // Strobing: brightness clients get levels
+        uint8_t slice = 0;                    // Current slice of the window
+        int level = -1;                       // Brightness step the clients have (-1 = none yet)
+        uint64_t sliceStart = 0;              // When the current slice began (ms)
+        uint64_t counted = 0;                 // On-time is added up to here (ms)
+        uint16_t onMs[PWM_SLICES] = {};       // On-time per slice
+        uint8_t edges[PWM_SLICES] = {};       // Switches per slice
+    };
+    std::vector<std::string> pwmPatterns;
+    std::vector<PwmState> pwm;                // Per ID (only as far as the highest filtered ID)
+    std::vector<ClientHandle> brightnessClients;
+    bool pwmAllClients = false;               // Every client gets brightness
+    uint64_t pwmLevelsPosted = 0;             // Statistics for the tools
+    uint64_t pwmUpdatesHeld = 0;              // 0/1 updates brightness clients did not get
+
+    // --- RATE CAPS ---
+    // A driver gone wrong can send one output thousands of times a second, and a
+    // client like LEDBlinky handles every message on its window thread: it falls
+    // behind and the lights lag for seconds. Outputs matching a rate cap rule
+    // ("lamp*=200") reach the capped clients at most that many times a second. Each
+    // of them has a token bucket: an update takes a token, tokens come back at the
+    // capped rate, and up to RATE_CAP_BURST are saved up (so a quick on-off still gets
+    // through). With the bucket empty the capped clients are skipped, and a timer
+    // sends them the latest value once a token is back: when a burst ends they always
+    // have the output's final value. Clients that can keep up (SetFullRateClient())
+    // get every update. Off by default.
+    struct RateBucket {
+        uint32_t capHz = 0;                   // 0 = not capped
+        uint32_t credit = 0;                  // Tokens, in 1/1000ths
+        uint64_t refilledMs = 0;              // Tokens are counted up to here
+        bool held = false;                    // The capped clients are behind
+    };
+    std::vector<std::pair<std::string, uint32_t>> rateCapRules;  // Pattern, updates per second
+    std::vector<RateBucket> rate;             // Per ID (only as far as the highest capped ID)
+    std::vector<ClientHandle> fullRateClients;
+    uint64_t rateHeldUpdates = 0;             // Statistics: updates the capped clients skipped
+    uint64_t rateCatchUps = 0;                // Latest values sent once a token came back
+
+    // --- TIMERS ---
+    // Values waiting to settle (OUTPUT FILTERS), held-back pulse ends (PULSE
+    // STRETCHING), brightness updates (PWM DIMMING) and capped clients falling behind
+    // (RATE CAPS) share one wheel (see BridgeTimerWheel.h), keyed by output ID and CoreTimer:
+    // no timer object or allocation per event. RunTimers() must be called regularly
+    // (Feed() calls it too); TimerWaitMs() says when it is next due.
+    TimerWheel timers;
+
+    // --- IDLE ---
+    // A cabinet can sit for hours with MAME closed. Instead of trying to connect every
+    // 2 seconds, the retries start fast (MAME is usually just changing games) and back
+    // off, doubling each time up to retryMaxMs. A client registering is a sign that a
+    // game is about to start, so it brings the next attempt forward (retryNow).
+    // With no client registered an update only goes as far as the ID map and the
+    // value a client turning up mid-game is caught up with (TrackIdle()): nothing is
+    // logged, filtered, staged or timed. The virtual outputs whose inputs changed
+    // meanwhile are worked out again when the first client registers.
+    uint64_t retryDelayMs = CONNECT_RETRY_MIN_MS;
+    uint64_t retryMaxMs = CONNECT_RETRY_MAX_MS;
+    bool retryNow = false;                    // Set by RegisterClient() while disconnected
+
+    explicit BridgeCore(BridgeSink* s) : sink(s) { SetPriorityPatterns(PRIORITY_OUTPUTS); }
+
+    void Log(std::string msg) {
+        if (!logging) return;
+        if (readingPacket) deferredLog.push_back(std::move(msg));  // Moved, not copied
+        else sink->Log(msg);
+    }
+
+    BridgeStatus Status() const {
+        BridgeStatus st;
+        st.connected = connected;
+        st.holding = (grace != GRACE_NONE);
+        st.rom = currentRomName;
+        st.outputs = nameToID.size();
+        st.clients = clients.size();
+        st.catchingUp = catchUps.size();
+        st.lines = linesProcessed;
+        st.updates = updatesPosted;
+        st.reconnectsResumed = reconnectsResumed;
+        st.idsReclaimed = idsReclaimed;
+        return st;
+    }
+
+    uint64_t NowMs() const {
+        if (clock) return clock();
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Record(FlightSource source, OutputID id, int value) {
+        if (recorder) recorder->Record(source, (uint32_t)id, (int32_t)value, mapGeneration);
+    }
+
+    // The ID lost its name: keep it for flight recorder dumps. Call before the
+    // generation is bumped.
+    void RetireName(OutputID id, const std::string& name) {
+        if (!recorder) return;
+        retiredNames.push_back({ id, idGeneration[id], mapGeneration + 1, name });
+        if (retiredNames.size() > FLIGHT_RECORDER_NAMES) retiredNames.pop_front();
+    }
+
+    // The name an ID had in a generation ("" if it is no longer known)
+    std::string NameInGeneration(OutputID id, uint32_t generation) const {
+        if (id == 0) return currentRomName;
+        if ((size_t)id < idGeneration.size() && generation >= idGeneration[id] && idToName.count(id)) {
+            return GetNameForID(id);
+        }
+        for (auto it = retiredNames.rbegin(); it != retiredNames.rend(); ++it) {
+            if (it->id == id && generation >= it->from && generation < it->until) return it->name;
+        }
+        return std::string();
+    }
+
+    // ------------------------------------------------------------------------------
+    // ID MAPPING
+    // ------------------------------------------------------------------------------
+
+    // Manages unique IDs for output names.
+    // If "lamp0" is seen for the first time, it gets a new ID (e.g. 1).
+    // If "lamp0" is seen again, it returns the existing ID (1).
+    OutputID GetIDForName(const std::string& name) {
+        auto it = nameToID.find(name);
+        if (it == nameToID.end()) {
+            OutputID newID;
+            if (!freeIDs.empty()) {
+                std::pop_heap(freeIDs.begin(), freeIDs.end(), std::greater<OutputID>());
+                newID = freeIDs.back();
+                freeIDs.pop_back();
+            }
+            else {
+                newID = nextID++;
+                idEpoch.resize((size_t)nextID, 0);
+                idGeneration.resize((size_t)nextID, 0);
+            }
+            nameToID[name] = newID;
+            idToName[newID] = name;
+            idEpoch[newID] = romEpoch;
+            idGeneration[newID] = mapGeneration;
+            if ((size_t)newID >= idClass.size()) idClass.resize((size_t)newID + 1, OUTPUT_BULK);
+            idClass[newID] = (uint8_t)ClassifyOutput(name);
+            if (!debounceRules.empty() || !hysteresisRules.empty()) SetOutputFilter(newID, name);
+            if (!stretchRules.empty()) SetMinOnTime(newID, name);
+            if (!pwmPatterns.empty()) SetPwmFilter(newID, name);
+            if (!rateCapRules.empty()) SetRateCap(newID, name);
+            for (ClientRoute& route : routes) CompileRoute(route, newID, name);
+            for (ClientTransforms& named : transformClients) CompileTransform(named, newID, name);
+            if (!virtuals.Empty()) LinkVirtualInputs(newID, name);
+            idStrings.Set((uint32_t)newID, name);
+
+            // Only log new items (ID < 1000 prevents startup spam if IDs reset)
+            if (logging && newID < 1000) {
+                Log("[MAP] New Output: '" + name + "' -> ID " + std::to_string(newID));
+            }
+            return newID;
+        }
+        idEpoch[it->second] = romEpoch;
+        return it->second;
+    }
+
+    // Starts a new ROM epoch and reclaims the IDs the previous games no longer use
+    void BeginRomEpoch() {
+        romEpoch++;
+        uint64_t reclaimed = 0;
+        for (auto it = nameToID.begin(); it != nameToID.end();) {
+            OutputID id = it->second;
+            if (idEpoch[id] + 1 >= romEpoch) {
+                ++it;
+                continue;
+            }
+            RetireName(id, it->first);
+            idToName.erase(id);
+            idStrings.Clear((uint32_t)id);
+            if ((size_t)id < lastValue.size()) lastValue[id] = unreconciled[id] = 0;
+            if ((size_t)id < filterOf.size()) filterOf[id] = 0;
+            if ((size_t)id < minOnMs.size()) minOnMs[id] = 0;
+            timers.Cancel(TimerKey(id, TIMER_DEBOUNCE));
+            if ((size_t)id < pwm.size()) pwm[id] = PwmState();
+            timers.Cancel(TimerKey(id, TIMER_PWM_TICK));
+            if ((size_t)id < rate.size()) rate[id] = RateBucket();
+            timers.Cancel(TimerKey(id, TIMER_RATE_HOLD));
+            if (!virtuals.Empty()) UnlinkVirtualInputs(id, it->first);
+            freeIDs.push_back(id);
+            std::push_heap(freeIDs.begin(), freeIDs.end(), std::greater<OutputID>());
+            it = nameToID.erase(it);
+            reclaimed++;
+        }
+        idStrings.BeginEpoch();
+        if (reclaimed) {
+            mapGeneration++;  // After RetireName(), see FLIGHT RECORDER
+            idsReclaimed += reclaimed;
+            Log("[MAP] Reclaimed " + std::to_string(reclaimed) + " IDs from earlier games.");
+        }
+    }
+
+    // ID 0 is RESERVED for the Game Name (e.g. "pacman"), anything else is looked up
+    std::string GetNameForID(OutputID id) const {
+        if (id == 0) return currentRomName;
+        auto it = idToName.find(id);
+        return (it != idToName.end()) ? it->second : std::string();
+    }
+
+    // Builds the WM_COPYDATA payload answering "What is the name for ID X?"
+    // This is exactly how MAME native output lays it out.
+    std::vector<uint8_t> BuildIDStringReply(OutputID id) const {
+        std::string name = GetNameForID(id);
+        std::vector<uint8_t> buffer(IDStringSize(name));
+        WriteIDString(buffer.data(), (uint32_t)id, name);
+        return buffer;
+    }
+
+    // The same payload without building anything: the cached blob for the ID.
+    // IDs with no name (unknown or reclaimed) are answered from a scratch buffer.
+    // The pointer stays valid until the next call.
+    const uint8_t* IDStringReply(OutputID id, size_t& size) {
+        const uint8_t* blob = idStrings.Get((uint32_t)id, size);
+        if (blob) return blob;
+        std::string name = GetNameForID(id);
+        size = IDStringSize(name);
+        idStringScratch.resize(size);
+        WriteIDString(idStringScratch.data(), (uint32_t)id, name);
+        return idStringScratch.data();
+    }
+
+    // Keeps the ID 0 reply in step with the ROM name
+    void SetRomName(const std::string& rom) {
+        currentRomName = rom;
+        idToName[0] = rom;
+        idStrings.Set(0, rom);
+    }
+
+    // ------------------------------------------------------------------------------
+    // PRIORITY LANE
+    // ------------------------------------------------------------------------------
+
+    // Sets the priority patterns from a list like "*recoil*,*solenoid*" (',' or ';'
+    // between them). "none" turns the lane off (the outputs keep their class, for
+    // the statistics). Outputs that already have an ID are classified again.
+    void SetPriorityPatterns(const std::string& list) {
+        priorityLane = (list != "none");
+        if (!priorityLane) return;
+        priorityPatterns = SplitList(list);
+        for (const auto& entry : nameToID) {
+            if ((size_t)entry.second < idClass.size()) idClass[entry.second] = (uint8_t)ClassifyOutput(entry.first);
+        }
+    }
+
+    OutputClass ClassifyOutput(const std::string& name) const {
+        for (const std::string& pattern : priorityPatterns) {
+            if (MatchPattern(pattern.c_str(), name.c_str())) return OUTPUT_PRIORITY;
+        }
+        return OUTPUT_BULK;
+    }
+
+    OutputClass ClassOf(OutputID id) const {
+        return ((size_t)id < idClass.size()) ? (OutputClass)idClass[id] : OUTPUT_BULK;
+    }
+
+    void PostUpdate(OutputID id, int value) {
+        bool dimming = (size_t)id < pwm.size() && pwm[id].dimming;  // Brightness clients get it from PwmTick()
+        bool held = RateCapped(id) && !PassRateCap(id);               // Capped clients get it later
+        if (!dimming && !held && routes.empty() && transformClients.empty()) {
+            for (ClientHandle client : clients) {
+                sink->Post(client, MSG_UPDATE_STATE, id, value);
+            }
+            updatesPosted += clients.size();
+            return;
+        }
+        for (size_t i = 0; i < clients.size(); i++) {
+            ClientHandle client = clients[i];
+            if (!Routed(i, id)) updatesUnrouted++;
+            else if (dimming && IsBrightnessClient(client)) pwmUpdatesHeld++;
+            else if (held && IsCappedClient(client)) rateHeldUpdates++;
+            else {
+                sink->Post(client, MSG_UPDATE_STATE, id, Transformed(i, id, value));
+                updatesPosted++;
+            }
+        }
+    }
+
+    // Holds a bulk update until the end of the packet (see PRIORITY LANE)
+    void StageUpdate(OutputID id, int value) {
+        if ((size_t)id >= stagedSlot.size()) stagedSlot.resize(lastValue.size(), 0);
+        uint32_t slot = stagedSlot[id];
+        if (slot != 0) {
+            // Already waiting: the new value replaces it, unless the output is going
+            // back to what the clients had (a blink). Then it is staged a second time
+            // and both go out.
+            Staged& s = staged[slot - 1];
+            if (value != s.from || s.value == s.from) {
+                s.value = lastValue[id] = value;
+                updatesCoalesced++;
+                return;
+            }
+        }
+        staged.push_back({ id, lastValue[id], value });
+        stagedSlot[id] = (uint32_t)staged.size();
+        lastValue[id] = value;
+    }
+
+    // Posts the staged bulk updates, in the order they were first staged
+    void FlushStaged() {
+        for (const Staged& s : staged) {
+            stagedSlot[s.id] = 0;
+            PostUpdate(s.id, s.value);
+        }
+        staged.clear();
+    }
+
+    // Passes on the log lines held back while the packet was read
+    void FlushDeferredLog() {
+        for (const std::string& msg : deferredLog) sink->Log(msg);
+        deferredLog.clear();
+    }
+
+    // ------------------------------------------------------------------------------
+    // OUTPUT FILTERS
+    // ------------------------------------------------------------------------------
+
+    // Reads a rule list like "*door*=30,*gear*" (',' or ';' between them, the default
+    // value when a rule has none). "none" or "" is an empty list; rules of 0 are left out.
+    static std::vector<std::pair<std::string, uint32_t>> ParseRules(const std::string& list, uint32_t defaultValue) {
+        std::vector<std::pair<std::string, uint32_t>> rules;
+        if (list == "none") return rules;
+        for (std::string rule : SplitList(list)) {
+            size_t eq = rule.find('=');
+            uint32_t value = (eq == std::string::npos) ? defaultValue : (uint32_t)strtoul(rule.c_str() + eq + 1, NULL, 10);
+            if (eq != std::string::npos) rule.resize(eq);
+            if (!rule.empty() && value > 0) rules.push_back({ rule, value });
+        }
+        return rules;
+    }
+
+    // The value of the first rule that matches the name (0 = none)
+    static uint32_t MatchRule(const std::vector<std::pair<std::string, uint32_t>>& rules, const std::string& name) {
+        for (const auto& rule : rules) {
+            if (MatchPattern(rule.first.c_str(), name.c_str())) return rule.second;
+        }
+        return 0;
+    }
+
+    // Sets the debounce or hysteresis rules. Outputs that already have an ID pick up
+    // the new rules; values still settling are dropped.
+    void SetDebounce(const std::string& list) {
+        debounceRules = ParseRules(list, DEBOUNCE_MS);
+        RebuildFilters();
+    }
+
+    void SetHysteresis(const std::string& list) {
+        hysteresisRules = ParseRules(list, HYSTERESIS_DELTA);
+        RebuildFilters();
+    }
+
+    void RebuildFilters() {
+        CancelDebounces();
+        filters.clear();
+        filterOf.clear();
+        debounceValue.clear();
+        for (const auto& entry : nameToID) SetOutputFilter(entry.second, entry.first);
+    }
+
+    // Looks up an output's rules and points it at the table entry with those settings
+    void SetOutputFilter(OutputID id, const std::string& name) {
+        OutputFilter filter = { MatchRule(debounceRules, name), (int)MatchRule(hysteresisRules, name) };
+        uint8_t index = 0;
+        if (filter.debounceMs != 0 || filter.hysteresis != 0) {
+            for (size_t i = 0; i < filters.size() && index == 0; i++) {
+                if (filters[i].debounceMs == filter.debounceMs && filters[i].hysteresis == filter.hysteresis) index = (uint8_t)(i + 1);
+            }
+            if (index == 0 && filters.size() < 255) {
+                filters.push_back(filter);
+                index = (uint8_t)filters.size();
+            }
+        }
+        if (index == 0 && (size_t)id >= filterOf.size()) return;
+        if ((size_t)id >= filterOf.size()) {
+            filterOf.resize((size_t)id + 1, 0);
+            debounceValue.resize((size_t)id + 1, 0);
+        }
+        filterOf[id] = index;
+    }
+
+    uint8_t FilterOf(OutputID id) const {
+        return ((size_t)id < filterOf.size()) ? filterOf[id] : 0;
+    }
+
+    // Called for every update of a filtered output. Returns true if it is dropped or
+    // waiting to settle; otherwise it goes on as usual.
+    bool FilterUpdate(OutputID id, int value) {
+        const OutputFilter& filter = filters[filterOf[id] - 1];
+        int have = lastValue[id];
+        if (filter.hysteresis != 0 && value != 0 && have != 0 && std::abs(value - have) < filter.hysteresis) {
+            value = have;  // Too small a change: as good as none
+        }
+        if (filter.debounceMs == 0 && value != have) return false;
+        updatesFiltered++;
+        if (filter.debounceMs == 0) return true;
+        uint32_t key = TimerKey(id, TIMER_DEBOUNCE);
+        bool settling = timers.Pending(key);
+        if (value == have) {
+            // Back to what the clients have before the new value settled
+            if (settling) timers.Cancel(key);
+            return true;
+        }
+        if (settling && value == debounceValue[id]) return true;  // Still the same value, still settling
+        uint64_t now = NowMs();
+        debounceValue[id] = value;
+        timers.Schedule(key, now + filter.debounceMs, now);
+        return true;
+    }
+
+    // A debounced value held long enough: on to the clients
+    void EndDebounce(OutputID id) {
+        if ((size_t)id >= debounceValue.size() || (size_t)id >= lastValue.size()) return;
+        updatesDebounced++;
+        ForwardUpdate(id, debounceValue[id]);
+    }
+
+    // Drops the values still settling (a new game sends its own state)
+    void CancelDebounces() {
+        if (timers.Count() == 0) return;
+        for (OutputID id = 0; (size_t)id < filterOf.size(); id++) timers.Cancel(TimerKey(id, TIMER_DEBOUNCE));
+    }
+
+    // ------------------------------------------------------------------------------
+    // PULSE STRETCHING
+    // ------------------------------------------------------------------------------
+
+    // Sets the stretch rules from a list like "*flash*=50,*solenoid*" (',' or ';'
+    // between them, PULSE_STRETCH_MS when a rule has no time). "none" or "" turns
+    // stretching off. Outputs that already have an ID pick up the new rules.
+    void SetPulseStretch(const std::string& list) {
+        EndPulses();
+        stretchRules = ParseRules(list, PULSE_STRETCH_MS);
+        minOnMs.clear();
+        onSinceMs.clear();
+        for (const auto& entry : nameToID) SetMinOnTime(entry.second, entry.first);
+    }
+
+    // Looks up the minimum on-time of an output (the first rule that matches)
+    void SetMinOnTime(OutputID id, const std::string& name) {
+        uint32_t ms = MatchRule(stretchRules, name);
+        if (ms == 0 && (size_t)id >= minOnMs.size()) return;
+        if ((size_t)id >= minOnMs.size()) {
+            minOnMs.resize((size_t)id + 1, 0);
+            onSinceMs.resize((size_t)id + 1, 0);
+        }
+        minOnMs[id] = ms;
+    }
+
+    uint32_t MinOnTime(OutputID id) const {
+        return ((size_t)id < minOnMs.size()) ? minOnMs[id] : 0;
+    }
+
+    // Called for every update of a stretched output. Returns true if it is held back.
+    bool StretchPulse(OutputID id, int value) {
+        uint64_t now = NowMs();
+        if (value != 0) {
+            if (timers.Pending(TimerKey(id, TIMER_PULSE_END))) {
+                // Back on before the held-back 0 went out: the clients never saw it off
+                timers.Cancel(TimerKey(id, TIMER_PULSE_END));
+                if (lastValue[id] == value) return true;
+            }
+            if (lastValue[id] == 0) onSinceMs[id] = now;
+            return false;
+        }
+        if (lastValue[id] == 0) return false;
+        uint64_t due = onSinceMs[id] + minOnMs[id];
+        if (now >= due) return false;
+        timers.Schedule(TimerKey(id, TIMER_PULSE_END), due, now);
+        pulsesStretched++;
+        return true;
+    }
+
+    // Sends every held-back 0 now (a new game, or new rules)
+    void EndPulses() {
+        if (timers.Count() == 0) return;
+        for (OutputID id = 0; (size_t)id < minOnMs.size(); id++) {
+            if (!timers.Pending(TimerKey(id, TIMER_PULSE_END))) continue;
+            timers.Cancel(TimerKey(id, TIMER_PULSE_END));
+            EndPulse(id);
+        }
+    }
+
+    void EndPulse(OutputID id) {
+        if ((size_t)id >= lastValue.size() || lastValue[id] == 0) return;
+        lastValue[id] = 0;
+        PostUpdate(id, 0);
+    }
+
+    // ------------------------------------------------------------------------------
+    // PWM DIMMING
+    // ------------------------------------------------------------------------------
+
+    // Sets the outputs to watch for strobing from a list like "lamp*,*flasher*" (','
+    // or ';' between them). "none" or "" turns it off. Outputs that already have an
+    // ID pick up the new patterns (and start measuring from scratch).
+    void SetPwmPatterns(const std::string& list) {
+        for (OutputID id = 0; (size_t)id < pwm.size(); id++) {
+            if (pwm[id].dimming) EndDimming(id);
+        }
+        pwmPatterns.clear();
+        if (list != "none") pwmPatterns = SplitList(list);
+        pwm.clear();
+        for (const auto& entry : nameToID) SetPwmFilter(entry.second, entry.first);
+    }
+
+    void SetPwmFilter(OutputID id, const std::string& name) {
+        bool filtered = false;
+        for (const std::string& pattern : pwmPatterns) {
+            if (MatchPattern(pattern.c_str(), name.c_str())) {
+                filtered = true;
+                break;
+            }
+        }
+        if (!filtered && (size_t)id >= pwm.size()) return;
+        if ((size_t)id >= pwm.size()) pwm.resize((size_t)id + 1);
+        pwm[id] = PwmState();
+        pwm[id].filtered = filtered;
+        pwm[id].sliceStart = pwm[id].counted = NowMs();
+    }
+
+    bool PwmFiltered(OutputID id) const { return (size_t)id < pwm.size() && pwm[id].filtered; }
+
+    // Opts a client in to (or out of) brightness levels for strobing lamps. On
+    // Windows a client asks with "MAMEBridgeBrightness".
+    void SetBrightnessClient(ClientHandle client, bool on) {
+        auto it = std::find(brightnessClients.begin(), brightnessClients.end(), client);
+        if (on == (it != brightnessClients.end())) return;
+        if (on) brightnessClients.push_back(client);
+        else brightnessClients.erase(it);
+        for (OutputID id = 0; (size_t)id < pwm.size(); id++) {
+            if (!pwm[id].dimming) continue;
+            pwm[id].level = -1;  // The next tick brings everybody up to date...
+            if (!on && (size_t)id < lastValue.size() && ClientWants(client, id)) {
+                sink->Post(client, MSG_UPDATE_STATE, id, TransformedFor(client, id, lastValue[id]));  // ...or the plain value
+            }
+        }
+    }
+
+    bool IsBrightnessClient(ClientHandle client) const {
+        return pwmAllClients || std::find(brightnessClients.begin(), brightnessClients.end(), client) != brightnessClients.end();
+    }
+
+    // Posts to the brightness clients only, or to everybody else
+    void PostUpdateTo(OutputID id, int value, bool brightness) {
+        for (size_t i = 0; i < clients.size(); i++) {
+            ClientHandle client = clients[i];
+            if (!Routed(i, id)) continue;
+            if (IsBrightnessClient(client) != brightness) {
+                if (!brightness) pwmUpdatesHeld++;
+                continue;
+            }
+            sink->Post(client, MSG_UPDATE_STATE, id, Transformed(i, id, value));
+            updatesPosted++;
+        }
+    }
+
+    // Adds up the on-time to "now", moving the window on a slice at a time
+    static void PwmCount(PwmState& st, uint64_t now) {
+        const uint64_t sliceMs = PWM_WINDOW_MS / PWM_SLICES;
+        if (now <= st.counted) return;
+        if (now - st.sliceStart >= PWM_WINDOW_MS + sliceMs) {
+            // Quiet for longer than the window: it holds nothing but the current value
+            for (int i = 0; i < PWM_SLICES; i++) {
+                st.onMs[i] = st.on ? (uint16_t)sliceMs : 0;
+                st.edges[i] = 0;
+            }
+            st.sliceStart = now - now % sliceMs;
+            st.counted = st.sliceStart;
+        }
+        while (now >= st.sliceStart + sliceMs) {
+            if (st.on) st.onMs[st.slice] += (uint16_t)(st.sliceStart + sliceMs - st.counted);
+            st.sliceStart += sliceMs;
+            st.counted = st.sliceStart;
+            st.slice = (uint8_t)((st.slice + 1) % PWM_SLICES);
+            st.onMs[st.slice] = 0;
+            st.edges[st.slice] = 0;
+        }
+        if (st.on) st.onMs[st.slice] += (uint16_t)(now - st.counted);
+        st.counted = now;
+    }
+
+    static uint32_t PwmEdges(const PwmState& st) {
+        uint32_t edges = 0;
+        for (int i = 0; i < PWM_SLICES; i++) edges += st.edges[i];
+        return edges;
+    }
+
+    // Called for every update of a watched output, before it is posted
+    void TrackPwm(OutputID id, int value) {
+        PwmState& st = pwm[id];
+        uint64_t now = NowMs();
+        PwmCount(st, now);
+        if ((value != 0) == st.on) return;
+        st.on = (value != 0);
+        if (st.edges[st.slice] < 255) st.edges[st.slice]++;
+        if (!st.dimming && PwmEdges(st) >= PWM_MIN_EDGES) {
+            // Strobing: from now on the brightness clients get levels
+            st.dimming = true;
+            st.level = -1;
+            timers.Schedule(TimerKey(id, TIMER_PWM_TICK), now, now);
+        }
+    }
+
+    // Sends a strobing output's brightness (if it changed), or ends the dimming
+    void PwmTick(OutputID id) {
+        if (!PwmFiltered(id) || !pwm[id].dimming) return;
+        PwmState& st = pwm[id];
+        uint64_t now = NowMs();
+        PwmCount(st, now);
+        if (PwmEdges(st) < PWM_STEADY_EDGES) {
+            EndDimming(id);
+            return;
+        }
+        uint64_t onMs = 0;
+        for (int i = 0; i < PWM_SLICES; i++) onMs += st.onMs[i];
+        uint64_t windowMs = (PWM_SLICES - 1) * (PWM_WINDOW_MS / PWM_SLICES) + (now - st.sliceStart);
+        int quarters = (int)((onMs * PWM_LEVELS * 4) / windowMs);  // Duty cycle in 1/4 steps
+        if (st.level < 0 || std::abs(quarters - st.level * 4) > 3) {
+            st.level = std::min((quarters + 2) / 4, PWM_LEVELS);
+            PostUpdateTo(id, st.level * PWM_MAX_VALUE / PWM_LEVELS, true);
+            pwmLevelsPosted++;
+        }
+        timers.Schedule(TimerKey(id, TIMER_PWM_TICK), now + PWM_INTERVAL_MS, now);
+    }
+
+    // Steady again: the brightness clients get the plain value
+    void EndDimming(OutputID id) {
+        pwm[id].dimming = false;
+        timers.Cancel(TimerKey(id, TIMER_PWM_TICK));
+        if ((size_t)id < lastValue.size()) PostUpdateTo(id, lastValue[id], true);
+    }
+
+    // ------------------------------------------------------------------------------
+    // RATE CAPS
+    // ------------------------------------------------------------------------------
+
+    // Sets the rate caps from a list like "lamp*=200,led*=100" (',' or ';' between
+    // them, RATE_CAP_HZ when a rule has no rate). "none" or "" turns capping off.
+    // Outputs that already have an ID pick up the new caps.
+    void SetRateCaps(const std::string& list) {
+        EndRateHolds();
+        rateCapRules = ParseRules(list, RATE_CAP_HZ);
+        rate.clear();
+        for (const auto& entry : nameToID) SetRateCap(entry.second, entry.first);
+    }
+
+    // Looks up an output's cap and gives it a full bucket
+    void SetRateCap(OutputID id, const std::string& name) {
+        uint32_t hz = MatchRule(rateCapRules, name);
+        if (hz == 0 && (size_t)id >= rate.size()) return;
+        if ((size_t)id >= rate.size()) rate.resize((size_t)id + 1);
+        rate[id] = RateBucket();
+        rate[id].capHz = hz;
+        rate[id].credit = RATE_CAP_BURST * 1000;
+        rate[id].refilledMs = NowMs();
+    }
+
+    bool RateCapped(OutputID id) const { return (size_t)id < rate.size() && rate[id].capHz != 0; }
+
+    // Lets a client have every update of capped outputs (or caps it again). It is
+    // brought up to date on the outputs it was behind on.
+    void SetFullRateClient(ClientHandle client, bool on) {
+        auto it = std::find(fullRateClients.begin(), fullRateClients.end(), client);
+        if (on == (it != fullRateClients.end())) return;
+        if (!on) {
+            fullRateClients.erase(it);
+            return;
+        }
+        fullRateClients.push_back(client);
+        for (OutputID id = 0; (size_t)id < rate.size(); id++) {
+            if (rate[id].held && (size_t)id < lastValue.size() && ClientWants(client, id)) {
+                sink->Post(client, MSG_UPDATE_STATE, id, TransformedFor(client, id, lastValue[id]));
+            }
+        }
+    }
+
+    bool IsCappedClient(ClientHandle client) const {
+        return std::find(fullRateClients.begin(), fullRateClients.end(), client) == fullRateClients.end();
+    }
+
+    // Takes a token for an update of a capped output. Returns false if the bucket is
+    // empty: the output is then held, and a timer catches the capped clients up.
+    bool PassRateCap(OutputID id) {
+        RateBucket& bucket = rate[id];
+        uint64_t now = NowMs();
+        if (now > bucket.refilledMs) {
+            uint64_t credit = bucket.credit + (now - bucket.refilledMs) * bucket.capHz;
+            bucket.credit = (uint32_t)std::min<uint64_t>(credit, RATE_CAP_BURST * 1000);
+            bucket.refilledMs = now;
+        }
+        if (bucket.credit >= 1000) {
+            bucket.credit -= 1000;
+            if (bucket.held) {
+                bucket.held = false;
+                timers.Cancel(TimerKey(id, TIMER_RATE_HOLD));
+            }
+            return true;
+        }
+        if (!bucket.held) {
+            bucket.held = true;
+            uint64_t due = now + (1000 - bucket.credit + bucket.capHz - 1) / bucket.capHz;  // The next token
+            timers.Schedule(TimerKey(id, TIMER_RATE_HOLD), due, now);
+        }
+        return false;
+    }
+
+    // A token is back: the capped clients get the latest value
+    void EndRateHold(OutputID id) {
+        if (!RateCapped(id) || !rate[id].held) return;
+        rate[id].held = false;
+        if (!PassRateCap(id)) return;  // Not quite yet: held again, with a new timer
+        PostToCapped(id);
+    }
+
+    // Catches the capped clients up on every held output now (a new game, or new caps)
+    void EndRateHolds() {
+        for (OutputID id = 0; (size_t)id < rate.size(); id++) {
+            if (!rate[id].held) continue;
+            rate[id].held = false;
+            timers.Cancel(TimerKey(id, TIMER_RATE_HOLD));
+            PostToCapped(id);
+        }
+    }
+
+    void PostToCapped(OutputID id) {
+        if ((size_t)id >= lastValue.size()) return;
+        bool dimming = (size_t)id < pwm.size() && pwm[id].dimming;
+        for (size_t i = 0; i < clients.size(); i++) {
+            ClientHandle client = clients[i];
+            if (!Routed(i, id) || !IsCappedClient(client) || (dimming && IsBrightnessClient(client))) continue;
+            sink->Post(client, MSG_UPDATE_STATE, id, Transformed(i, id, lastValue[id]));
+            updatesPosted++;
+        }
+        rateCatchUps++;
+    }
+
+    // ------------------------------------------------------------------------------
+    // TIMERS
+    // ------------------------------------------------------------------------------
+
+    static uint32_t TimerKey(OutputID id, CoreTimer kind) {
+        return (uint32_t)id * CORE_TIMER_KINDS + (uint32_t)kind;
+    }
+
+    // Runs the timers that are due
+    void RunTimers() {
+        if (timers.Count() == 0) return;
+        timers.Advance(NowMs(), [this](uint32_t key) {
+            OutputID id = (OutputID)(key / CORE_TIMER_KINDS);
+            switch (key % CORE_TIMER_KINDS) {
+            case TIMER_PULSE_END: EndPulse(id); break;
+            case TIMER_PWM_TICK: PwmTick(id); break;
+            case TIMER_DEBOUNCE: EndDebounce(id); break;
+            case TIMER_RATE_HOLD: EndRateHold(id); break;
+            }
+        });
+    }
+
+    // Milliseconds until RunTimers() has something to do (UINT64_MAX = nothing)
+    uint64_t TimerWaitMs() const {
+        uint64_t next = timers.NextWakeMs();
+        if (next == 0) return UINT64_MAX;
+        uint64_t now = NowMs();
+        return (next > now) ? next - now : 0;
+    }
+
+    // ------------------------------------------------------------------------------
+    // CLIENTS
+    // ------------------------------------------------------------------------------
+
+    void RegisterClient(ClientHandle client) {
+        if (clients.empty() && connected) Log("[SYS] Client registered: logging outputs again.");
+        if (clients.empty() && virtualsStale) RefreshVirtuals();  // Before its catch-up reads them
+        clients.push_back(client);
+        clientRoute.push_back(RouteIndex(client));
+        clientTransform.push_back(TransformIndex(client));
+        Record(FR_REGISTER, 0, (int)client);
+        if (!connected) {
+            retryDelayMs = CONNECT_RETRY_MIN_MS;
+            retryNow = true;
+        }
+
+        // Mid-game: queue the current state for this client (see CATCH-UP)
+        if (currentRomName != "___empty" && catchUpBatch > 0) catchUps.push_back({ client, 0 });
+        for (PwmState& st : pwm) st.level = -1;  // Strobing lamps: the next tick sends the level
+    }
+
+    void UnregisterClient(ClientHandle client) {
+        Record(FR_UNREGISTER, 0, (int)client);
+        for (size_t i = 0; i < clients.size(); i++) {
+            if (clients[i] == client) {
+                clients.erase(clients.begin() + i);
+                clientRoute.erase(clientRoute.begin() + i);
+                clientTransform.erase(clientTransform.begin() + i);
+                clientLeft = true;
+                if (clients.empty()) Log("[SYS] No clients registered: outputs are tracked but not logged.");
+                break;
+            }
+        }
+        for (auto it = catchUps.begin(); it != catchUps.end(); ++it) {
+            if (it->client == client) {
+                catchUps.erase(it);
+                break;
+            }
+        }
+        if (std::find(clients.begin(), clients.end(), client) == clients.end()) {
+            brightnessClients.erase(std::remove(brightnessClients.begin(), brightnessClients.end(), client),
+                                    brightnessClients.end());
+            fullRateClients.erase(std::remove(fullRateClients.begin(), fullRateClients.end(), client),
+                                  fullRateClients.end());
+            SetClientRoute(client, "");
+            SetClientName(client, "");
+        }
+    }
+
+    // Delivers START or STOP (see START/STOP DELIVERY)
+    void Notify(BridgeMessage msg) {
+        if (notifyMode == NOTIFY_BROADCAST || clients.empty() || clientLeft) {
+            sink->Post(CLIENT_BROADCAST, msg, 0, 0);
+            notifyBroadcasts++;
+            clientLeft = false;
+            return;
+        }
+        // LEDBlinky registers again after every START, so the list can hold it twice
+        notifyTargets = clients;
+        std::sort(notifyTargets.begin(), notifyTargets.end());
+        notifyTargets.erase(std::unique(notifyTargets.begin(), notifyTargets.end()), notifyTargets.end());
+        for (ClientHandle client : notifyTargets) sink->Post(client, msg, 0, 0);
+        notifyTargeted += notifyTargets.size();
+    }
+
+    // Sends the next batch of catch-up updates to each client still catching up.
+    // Call it regularly (the Windows bridge uses a timer); the batch size and the
+    // call rate limit the burst. Returns true while there is more to send.
+    bool PumpCatchUp() {
+        for (auto it = catchUps.begin(); it != catchUps.end();) {
+            size_t sent = 0;
+            if (it->next == 0) {
+                sink->SendIDString(it->client, 0);  // The ROM name
+                it->next = 1;
+            }
+            while (sent < catchUpBatch && (size_t)it->next < lastValue.size()) {
+                OutputID id = it->next++;
+                int value = TransformedFor(it->client, id, lastValue[id]);  // Inverted lamps may be lit at 0
+                if (value == 0 || idToName.find(id) == idToName.end()) continue;
+                if ((size_t)id < pwm.size() && pwm[id].dimming && IsBrightnessClient(it->client)) continue;  // Gets a level
+                if (!ClientWants(it->client, id)) continue;
+                sink->SendIDString(it->client, id);
+                sink->Post(it->client, MSG_UPDATE_STATE, id, value);
+                sent++;
+            }
+            catchUpUpdates += sent;
+            if ((size_t)it->next >= lastValue.size()) it = catchUps.erase(it);
+            else ++it;
+        }
+        return !catchUps.empty();
+    }
+
+    // ------------------------------------------------------------------------------
+    // ROUTING
+    // ------------------------------------------------------------------------------
+
+    // Gives a client a route from a list like "lamp*,led*" (',' or ';' between them):
+    // from now on it only gets the outputs that match. "" takes the route away (the
+    // client gets everything again). Outputs it already has lit are left as they are.
+    void SetClientRoute(ClientHandle client, const std::string& list) {
+        std::vector<std::string> patterns = SplitList(list);
+        int32_t index = RouteIndex(client);
+        if (index >= 0 && routes[index].patterns == patterns) return;
+        if (index >= 0) routes.erase(routes.begin() + index);
+        if (!patterns.empty()) {
+            routes.push_back({ client, patterns, std::vector<uint64_t>() });
+            for (const auto& entry : nameToID) CompileRoute(routes.back(), entry.second, entry.first);
+        }
+        for (size_t i = 0; i < clients.size(); i++) clientRoute[i] = RouteIndex(clients[i]);
+    }
+
+    int32_t RouteIndex(ClientHandle client) const {
+        for (size_t i = 0; i < routes.size(); i++) {
+            if (routes[i].client == client) return (int32_t)i;
+        }
+        return -1;
+    }
+
+    // Sets or clears the route's bit for an ID
+    static void CompileRoute(ClientRoute& route, OutputID id, const std::string& name) {
+        size_t word = (size_t)id / 64;
+        uint64_t bit = 1ull << ((size_t)id % 64);
+        if (word >= route.wants.size()) route.wants.resize(word + 1, 0);
+        route.wants[word] &= ~bit;
+        for (const std::string& pattern : route.patterns) {
+            if (MatchPattern(pattern.c_str(), name.c_str())) {
+                route.wants[word] |= bit;
+                break;
+            }
+        }
+    }
+
+    static bool RouteWants(const ClientRoute& route, OutputID id) {
+        size_t word = (size_t)id / 64;
+        return word < route.wants.size() && ((route.wants[word] >> ((size_t)id % 64)) & 1) != 0;
+    }
+
+    // Does the client at this position in clients get the output?
+    bool Routed(size_t index, OutputID id) const {
+        int32_t route = clientRoute[index];
+        return route < 0 || RouteWants(routes[route], id);
+    }
+
+    bool ClientWants(ClientHandle client, OutputID id) const {
+        int32_t route = RouteIndex(client);
+        return route < 0 || RouteWants(routes[route], id);
+    }
+
+    // ------------------------------------------------------------------------------
+    // TRANSFORMS
+    // ------------------------------------------------------------------------------
+
+    // Sets the transform rules (see BridgeTransforms.h). Clients already named pick
+    // them up.
+    void SetTransforms(const TransformSet& set) {
+        transforms = set;
+        std::vector<ClientTransforms> named;
+        named.swap(transformClients);
+        for (const ClientTransforms& client : named) SetClientName(client.client, client.name);
+        for (size_t i = 0; i < clients.size(); i++) clientTransform[i] = TransformIndex(clients[i]);
+    }
+
+    // Names a client, which picks its transforms. "" forgets it (no transforms).
+    void SetClientName(ClientHandle client, const std::string& name) {
+        int32_t index = TransformIndex(client);
+        if (index >= 0 && transformClients[index].name == name) return;
+        if (index >= 0) transformClients.erase(transformClients.begin() + index);
+        bool named = false;
+        for (const TransformRule& rule : transforms.rules) {
+            if (!name.empty() && MatchPattern(rule.client.c_str(), name.c_str())) named = true;
+        }
+        if (named) {
+            transformClients.push_back({ client, name, std::vector<uint16_t>() });
+            for (const auto& entry : nameToID) CompileTransform(transformClients.back(), entry.second, entry.first);
+        }
+        for (size_t i = 0; i < clients.size(); i++) clientTransform[i] = TransformIndex(clients[i]);
+    }
+
+    int32_t TransformIndex(ClientHandle client) const {
+        for (size_t i = 0; i < transformClients.size(); i++) {
+            if (transformClients[i].client == client) return (int32_t)i;
+        }
+        return -1;
+    }
+
+    // Picks the program of the first rule that matches the client and the output
+    void CompileTransform(ClientTransforms& named, OutputID id, const std::string& name) const {
+        if ((size_t)id >= named.programOf.size()) named.programOf.resize((size_t)id + 1, 0);
+        named.programOf[id] = 0;
+        for (const TransformRule& rule : transforms.rules) {
+            if (MatchPattern(rule.client.c_str(), named.name.c_str()) && MatchPattern(rule.output.c_str(), name.c_str())) {
+                named.programOf[id] = rule.program;
+                break;
+            }
+        }
+    }
+
+    // The value the client at this position in clients gets
+    int Transformed(size_t index, OutputID id, int value) const {
+        return TransformWith(clientTransform[index], id, value);
+    }
+
+    int TransformedFor(ClientHandle client, OutputID id, int value) const {
+        return TransformWith(TransformIndex(client), id, value);
+    }
+
+    int TransformWith(int32_t named, OutputID id, int value) const {
+        if (named < 0) return value;
+        const std::vector<uint16_t>& programOf = transformClients[named].programOf;
+        return ((size_t)id < programOf.size()) ? transforms.Apply(programOf[id], value) : value;
+    }
+
+    // ------------------------------------------------------------------------------
+    // VIRTUAL OUTPUTS
+    // ------------------------------------------------------------------------------
+
+    // Sets the virtual outputs (see BridgeExpressions.h). Outputs MAME already
+    // handed out are linked up straight away.
+    void SetVirtualOutputs(const ExpressionSet& set) {
+        virtuals = set;
+        virtualState.clear();
+        virtualInputs.clear();
+        virtualInputOwner.clear();
+        inputSlots.clear();
+        readers.clear();
+        inputValue.clear();
+        for (size_t i = 0; i < virtuals.outputs.size(); i++) {
+            virtualState.push_back({ (uint32_t)virtualInputs.size(), 0, 0, false });
+            for (const std::string& input : virtuals.outputs[i].inputs) {
+                inputSlots[input].push_back((uint32_t)virtualInputs.size());
+                virtualInputs.push_back(0);
+                virtualInputOwner.push_back((uint32_t)i);
+            }
+        }
+        for (const auto& entry : nameToID) LinkVirtualInputs(entry.second, entry.first);
+    }
+
+    // An output got its ID: the virtual outputs that read it read that ID
+    void LinkVirtualInputs(OutputID id, const std::string& name) {
+        auto it = inputSlots.find(name);
+        if (it == inputSlots.end()) return;
+        if ((size_t)id >= readers.size()) {
+            readers.resize((size_t)id + 1);
+            inputValue.resize((size_t)id + 1, 0);
+        }
+        readers[id].clear();
+        for (uint32_t slot : it->second) {
+            virtualInputs[slot] = id;
+            readers[id].push_back(virtualInputOwner[slot]);  // Each name is one input of an output
+        }
+    }
+
+    // An ID is reclaimed: its readers read 0 until the name turns up again
+    void UnlinkVirtualInputs(OutputID id, const std::string& name) {
+        auto it = inputSlots.find(name);
+        if (it == inputSlots.end()) return;
+        for (uint32_t slot : it->second) virtualInputs[slot] = 0;
+        readers[id].clear();
+        inputValue[id] = 0;
+    }
+
+    // A new game: every virtual output starts over, from inputs that are all 0
+    void ResetVirtuals() {
+        for (VirtualState& st : virtualState) {
+            st.id = st.value = 0;
+            st.stale = false;
+        }
+        virtualsStale = false;
+        std::fill(inputValue.begin(), inputValue.end(), 0);
+    }
+
+    // An output the virtual outputs read was updated. Each that reads it is
+    // evaluated again and, if its value changed (or it has none yet), passed on like
+    // an update from MAME, which in turn updates those that read it.
+    void UpdateVirtuals(OutputID id, int value) {
+        bool changed = inputValue[id] != value;
+        inputValue[id] = value;
+        for (size_t k = 0; k < readers[id].size(); k++) {
+            uint32_t index = readers[id][k];
+            VirtualState& st = virtualState[index];
+            if (!changed && st.id != 0) continue;
+            uint32_t first = st.firstInput;
+            int result = virtuals.Evaluate(index, [this, first](uint32_t slot) {
+                return inputValue[virtualInputs[first + slot]];
+            });
+            virtualEvaluations++;
+            if (st.id != 0 && result == st.value) continue;
+            if (st.id == 0) st.id = GetIDForName(virtuals.outputs[index].name);  // May grow readers
+            else idEpoch[st.id] = romEpoch;
+            st.value = result;
+            virtualUpdates++;
+            OutputID out = st.id;
+            AcceptUpdate(out, result);
+            if ((size_t)out < readers.size() && !readers[out].empty()) UpdateVirtuals(out, result);
+        }
+    }
+
+    // Works out the virtual outputs again whose inputs changed while no client was
+    // registered (see TrackIdle()), and keeps their values for the catch-up. Those
+    // that read a virtual output that changed are marked in turn, so chains settle.
+    void RefreshVirtuals() {
+        while (virtualsStale) {
+            virtualsStale = false;
+            for (size_t index = 0; index < virtualState.size(); index++) {
+                VirtualState& st = virtualState[index];
+                if (!st.stale) continue;
+                st.stale = false;
+                uint32_t first = st.firstInput;
+                int result = virtuals.Evaluate(index, [this, first](uint32_t slot) {
+                    return inputValue[virtualInputs[first + slot]];
+                });
+                virtualEvaluations++;
+                if (st.id != 0 && result == st.value) continue;
+                if (st.id == 0) st.id = GetIDForName(virtuals.outputs[index].name);
+                else idEpoch[st.id] = romEpoch;
+                st.value = result;
+                TrackIdle(st.id, result);
+            }
+        }
+    }
+
+    // ------------------------------------------------------------------------------
+    // NETWORK PACKET PARSER
+    // ------------------------------------------------------------------------------
+
+    // Parses a single line from MAME (e.g., "mame_start = pacman" or "lamp0 = 1")
+    void ProcessLine(std::string line) {
+        // Debug: Log Raw Line (Optional)
+        if (logging && !clients.empty() && line.length() > 0) Log("RAW: " + line);
+        linesProcessed++;
+
+        std::string name, valStr;
+        if (ParseLine(line, name, valStr)) {
+            // LOGIC: Check Command Type
+
+            // Anything but an output update: what was staged belongs before it
+            if (!staged.empty() && (grace == GRACE_AWAITING_START || name == "mame_start" || name == "mame_stop")) {
+                FlushStaged();
+            }
+
+            // 0. RECONNECTED WITHIN THE GRACE WINDOW
+            if (grace == GRACE_AWAITING_START) {
+                grace = GRACE_NONE;
+                if (name == "mame_start" && valStr == currentRomName) {
+                    // Same game: keep everything, clients already have the start
+                    unreconciled.assign(lastValue.size(), 1);
+                    reconnectsResumed++;
+                    Record(FR_START, 0, 0);
+                    Log("[SYS] Reconnected to " + currentRomName + ", keeping " +
+                        std::to_string(nameToID.size()) + " outputs. Only changes are sent.");
+                    return;
+                }
+                // Different game (or no start at all): what the clients have is stale
+                ResetSession();
+                if (name != "mame_start") ForceStart();
+            }
+
+            // 1. GAME START
+            if (name == "mame_start") {
+                EndPulses();  // Before the IDs are reclaimed
+                CancelDebounces();
+                EndRateHolds();
+                BeginRomEpoch();
+                ResetVirtuals();
+                catchUps.clear();  // The new game starts from nothing
+                SetRomName(valStr);
+                Record(FR_START, 0, 0);
+                Log("[SYS] MAME Started. ROM: " + currentRomName);
+                // Tell clients the game name changed
+                Notify(MSG_MAME_START);
+                return;
+            }
+
+            // 2. MAME STOP (Ignore this command data)
+            // MAME sends "mame_stop = 1" on exit. We don't map this to an ID.
+            // We handle the stop event via socket disconnect instead.
+            if (name == "mame_stop") {
+                stopReceived = true;
+                Record(FR_STOP, 0, 0);
+                return;
+            }
+
+            // 3. GAME OUTPUT (e.g. lamp0, led1)
+            int val = std::atoi(valStr.c_str());
+            OutputID id = GetIDForName(name);
+            Record(FR_UPDATE, id, val);
+
+            // Nobody registered: keep the value for a catch-up, and that is all (see IDLE)
+            if (clients.empty()) {
+                TrackIdle(id, val);
+                return;
+            }
+            AcceptUpdate(id, val);
+
+            // Virtual outputs that read it are worked out again
+            if ((size_t)id < readers.size() && !readers[id].empty()) UpdateVirtuals(id, val);
+        }
+    }
+
+    // Takes a new value of an output, from MAME or a virtual output
+    void AcceptUpdate(OutputID id, int val) {
+        // Remember what the clients have, and skip MAME's state dump after a
+        // reconnect for outputs that did not change while we were away
+        if ((size_t)id >= lastValue.size()) {
+            lastValue.resize((size_t)id + 1, 0);
+            unreconciled.resize((size_t)id + 1, 0);
+        }
+        if (unreconciled[id]) {
+            unreconciled[id] = 0;
+            if (lastValue[id] == val) {
+                updatesReconciled++;
+                return;
+            }
+        }
+
+        // Chatter: wobbles are dropped, debounced values wait until they settle
+        if (FilterOf(id) != 0 && FilterUpdate(id, val)) return;
+
+        ForwardUpdate(id, val);
+    }
+
+    // Takes a new value of an output while no client is registered. A value still
+    // held back for it (settling, or the end of a pulse) would overwrite this one
+    // later, so it is dropped. The virtual outputs that read it are only marked.
+    void TrackIdle(OutputID id, int val) {
+        if ((size_t)id >= lastValue.size()) {
+            lastValue.resize((size_t)id + 1, 0);
+            unreconciled.resize((size_t)id + 1, 0);
+        }
+        lastValue[id] = val;
+        unreconciled[id] = 0;
+        if (timers.Count() != 0) {
+            timers.Cancel(TimerKey(id, TIMER_DEBOUNCE));
+            timers.Cancel(TimerKey(id, TIMER_PULSE_END));
+        }
+        if ((size_t)id < readers.size() && !readers[id].empty()) {
+            bool changed = inputValue[id] != val;
+            inputValue[id] = val;
+            for (uint32_t index : readers[id]) {
+                if (!changed && virtualState[index].id != 0) continue;
+                virtualState[index].stale = true;
+                virtualsStale = true;
+            }
+        }
+    }
+
+    // Passes an update on to the clients, through the stages that may hold it back
+    void ForwardUpdate(OutputID id, int val) {
+        // A strobing lamp is measured for the clients that want brightness
+        if (PwmFiltered(id)) TrackPwm(id, val);
+
+        // A short pulse: the 0 waits until the output has been on long enough
+        if (MinOnTime(id) != 0 && StretchPulse(id, val)) return;
+
+        // Forward state change to all connected clients (LEDBlinky):
+        // priority outputs now, the rest at the end of the packet
+        if (readingPacket && ClassOf(id) == OUTPUT_BULK) {
+            StageUpdate(id, val);
+            return;
+        }
+        lastValue[id] = val;
+        if (readingPacket && ClassOf(id) == OUTPUT_PRIORITY) priorityUpdates++;
+        PostUpdate(id, val);
+    }
+
+    // Writes the flight recorder to a file. Each event is named by the ID map
+    // generation it was recorded in (see NameInGeneration), so IDs reused by a later
+    // game keep their old names. Only the last FLIGHT_RECORDER_NAMES retired names
+    // are kept: older ones are left blank rather than guessed, and ID 0 is always
+    // the current ROM.
+    bool DumpFlightRecorder(const std::string& path, const std::string& reason) const {
+        if (!recorder) return false;
+        return recorder->Dump(path, reason, currentRomName,
+                              [this](uint32_t id, uint32_t generation) { return NameInGeneration((OutputID)id, generation); },
+                              FLIGHT_RECORDER_SECONDS, Status().ToString());
+    }
+
+    // ------------------------------------------------------------------------------
+    // CONNECTION LIFECYCLE
+    // ------------------------------------------------------------------------------
+
+    // Called once the TCP connection to MAME is up
+    void OnConnect() {
+        connected = true;
+        retryDelayMs = CONNECT_RETRY_MIN_MS;
+        framer.Clear();
+        stopReceived = false;
+        Record(FR_CONNECT, 0, 0);
+
+        // Back within the grace window: hold everything until we see which ROM it is
+        if (grace == GRACE_DISCONNECTED) {
+            if (NowMs() - graceStartMs <= reconnectGraceMs) {
+                grace = GRACE_AWAITING_START;
+                Log("[SYS] Reconnected within the grace window.");
+                return;
+            }
+            grace = GRACE_NONE;
+            ResetSession();
+        }
+        ForceStart();
+    }
+
+    // Tells clients we are live, before MAME has named the game
+    void ForceStart() {
+        // 1. RESET STATE
+        // Reset to defaults so clients are clean
+        SetRomName("___empty");
+
+        // 2. FORCE START
+        // Tell Windows Clients we are live immediately (fixes LEDBlinky attach issues)
+        Notify(MSG_MAME_START);
+        Log("[SYS] Sent Force Start Signal (___empty).");
+    }
+
+    // Feeds raw bytes from recv() into the framer. With the priority lane on, the
+    // bulk updates and log lines of the packet go out once all of it is read.
+    // Timers that are due (held-back pulse ends, brightness) go first.
+    void Feed(const char* data, size_t len) {
+        RunTimers();
+        readingPacket = priorityLane;
+        framer.Feed(data, len, [this](const std::string& line) { ProcessLine(line); });
+        readingPacket = false;
+        FlushStaged();
+        FlushDeferredLog();
+    }
+
+    // Called after the TCP connection to MAME has dropped
+    void OnDisconnect() {
+        connected = false;
+        Record(FR_DISCONNECT, 0, 0);
+        if (!stopReceived) sink->OnUnexpectedDisconnect();
+        framer.Clear();
+
+        // A drop in the middle of a game may just be a hiccup: hold the lights.
+        // A drop while already holding keeps the original deadline.
+        if (grace == GRACE_AWAITING_START) {
+            grace = GRACE_DISCONNECTED;
+            return;
+        }
+        if (!stopReceived && reconnectGraceMs > 0 && currentRomName != "___empty") {
+            grace = GRACE_DISCONNECTED;
+            graceStartMs = NowMs();
+            Log("[SYS] Connection lost. Holding state for " + std::to_string(reconnectGraceMs) + " ms.");
+            return;
+        }
+        ResetSession();
+    }
+
+    // How long to wait before the next connection attempt; call once per failed attempt.
+    // Inside the grace window it stays short, MAME may only have blinked.
+    uint64_t NextRetryDelayMs() {
+        retryNow = false;
+        if (grace != GRACE_NONE) return CONNECT_RETRY_MIN_MS;
+        uint64_t delay = retryDelayMs;
+        retryDelayMs = std::min<uint64_t>(retryDelayMs * 2, std::max<uint64_t>(retryMaxMs, CONNECT_RETRY_MIN_MS));
+        return delay;
+    }
+
+    // Call regularly (e.g. between reconnect attempts). Once the grace window has run
+    // out, or straight away with force (e.g. at the end of a replay), clients get the
+    // STOP they were spared.
+    void CheckReconnectGrace(bool force = false) {
+        if (grace == GRACE_NONE) return;
+        if (!force && NowMs() - graceStartMs <= reconnectGraceMs) return;
+
+        bool awaitingStart = (grace == GRACE_AWAITING_START);  // Back, but not with "mame_start"
+        grace = GRACE_NONE;
+        Log("[SYS] MAME did not come back in time.");
+        ResetSession();
+        if (awaitingStart) ForceStart();
+    }
+
+    // Turns the clients off and forgets this game's outputs
+    void ResetSession() {
+        // Send STOP to clients so they turn off lights
+        Notify(MSG_MAME_STOP);
+
+        // Clear ID maps for next run
+        for (const auto& entry : nameToID) RetireName(entry.second, entry.first);
+        if (!nameToID.empty()) mapGeneration++;
+        currentRomName = "___empty";
+        nameToID.clear();
+        idToName.clear();
+        nextID = 1;
+        lastValue.clear();
+        unreconciled.clear();
+        catchUps.clear();
+        idClass.clear();
+        filterOf.clear();
+        debounceValue.clear();
+        minOnMs.clear();
+        onSinceMs.clear();
+        pwm.clear();
+        rate.clear();
+        timers.Clear();  // STOP turns everything off anyway
+        staged.clear();
+        stagedSlot.clear();
+        romEpoch = 0;
+        idEpoch.clear();
+        idGeneration.clear();
+        freeIDs.clear();
+        idStrings.Reset();
+        readers.clear();
+        inputValue.clear();
+        std::fill(virtualInputs.begin(), virtualInputs.end(), 0);
+        for (VirtualState& st : virtualState) {
+            st.id = st.value = 0;
+            st.stale = false;
+        }
+        virtualsStale = false;
+    }
+};
@@ -0,0 +1,482 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                   MAME BRIDGE NET-TO-WIN : VIRTUAL OUTPUT EXPRESSIONS
+// ==================================================================================
+// Outputs the bridge makes up from MAME's: "any coin lamp lit", "player 1 recoil,
+// but not while paused". Clients see them like any other output, with an ID and a
+// name, and can't tell them apart.
+//
+// They come from a text file, one per line:
+//
+//   # name          = expression
+//   any_coin_lamp   = lamp3 | lamp4
+//   p1_recoil       = sol0 && !pause
+//   fuel_low        = fuel < 40 ? 1 : 0
+//   brightest       = max(lamp0, lamp1)
+//
+// An expression works on whole numbers like C: ! - ~, * / %, + -, < <= > >=,
+// == !=, &, ^, |, &&, ||, ?: (in that order of precedence), parentheses, min(a, b)
+// and max(a, b). Numbers are decimal, or hex with 0x. Dividing by 0 gives 0, and
+// a result too big for 64 bits stops at the largest (or smallest) value instead of
+// wrapping; the output then gets it clamped to 32 bits. Parentheses, ?: and unary
+// operators nest at most EXPRESSION_MAX_DEPTH deep. A name is an output's value, 0
+// until MAME first sends it. Names are letters, digits and _ . : and may name
+// another virtual output, as long as that one is defined further up (so there are
+// no loops).
+//
+// Each expression is compiled once into a flat list of stack instructions. Its
+// names become numbered inputs, which the core points at output IDs as MAME hands
+// the outputs out, and re-evaluates only when one of them changes (see VIRTUAL
+// OUTPUTS in BridgeCore.h).
+// ==================================================================================
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+// --- CONFIGURATION ---
+#define EXPRESSION_MAX_DEPTH 32    // Deepest the evaluation stack and the nesting may get
+
+// One instruction. They pop their operands off the stack and push the result.
+enum ExpressionCode : uint8_t {
+    EX_CONST,         // Push a
+    EX_INPUT,         // Push input a
+    EX_NOT, EX_NEG, EX_BITNOT,
+    EX_MUL, EX_DIV, EX_MOD, EX_ADD, EX_SUB,
+    EX_LT, EX_LE, EX_GT, EX_GE, EX_EQ, EX_NE,
+    EX_BITAND, EX_BITXOR, EX_BITOR, EX_AND, EX_OR,
+    EX_MIN, EX_MAX,
+    EX_SELECT         // condition ? b : c, all three on the stack
+};
+
+struct ExpressionOp {
+    ExpressionCode code;
+    int32_t a;
+};
+
+// A line of the file
+struct VirtualOutput {
+    std::string name;
+    std::string text;                  // The expression as written
+    uint32_t first, count;             // Its instructions in ops
+    std::vector<std::string> inputs;   // Names it reads, numbered as EX_INPUT counts them
+};
+
+class ExpressionSet {
+public:
+    std::vector<VirtualOutput> outputs;
+
+    bool Empty() const { return outputs.empty(); }
+
+    void Clear() {
+        outputs.clear();
+        m_ops.clear();
+    }
+
+    // Reads a virtual outputs file. On failure, error names the line and what is
+    // wrong, and the set is left empty.
+    bool Load(const std::string& path, std::string& error) {
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) {
+            error = "Could not open " + path;
+            return false;
+        }
+        std::string text;
+        char buffer[4096];
+        size_t got;
+        while ((got = fread(buffer, 1, sizeof(buffer), f)) > 0) text.append(buffer, got);
+        fclose(f);
+        if (Parse(text, error)) return true;
+        error = path + " " + error;
+        return false;
+    }
+
+    // Reads the definitions from text in the file's format
+    bool Parse(const std::string& text, std::string& error) {
+        Clear();
+        size_t start = 0;
+        int lineNumber = 0;
+        while (start < text.size()) {
+            size_t end = text.find('\n', start);
+            if (end == std::string::npos) end = text.size();
+            std::string line = text.substr(start, end - start);
+            start = end + 1;
+            lineNumber++;
+            size_t hash = line.find('#');
+            if (hash != std::string::npos) line.resize(hash);
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+            if (!ParseDefinition(line, error)) {
+                error = "line " + std::to_string(lineNumber) + ": " + error;
+                Clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The value of output "index", reading its inputs through input(number)
+    template <typename F>
+    int Evaluate(size_t index, F input) const {
+        int64_t stack[EXPRESSION_MAX_DEPTH];
+        int top = -1;
+        const VirtualOutput& out = outputs[index];
+        for (uint32_t i = out.first; i < out.first + out.count; i++) {
+            const ExpressionOp& op = m_ops[i];
+            switch (op.code) {
+            case EX_CONST: stack[++top] = op.a; break;
+            case EX_INPUT: stack[++top] = input((uint32_t)op.a); break;
+            case EX_NOT: stack[top] = !stack[top]; break;
+            case EX_NEG: stack[top] = Negate(stack[top]); break;
+            case EX_BITNOT: stack[top] = ~stack[top]; break;
+            case EX_SELECT: top -= 2; stack[top] = stack[top] ? stack[top + 1] : stack[top + 2]; break;
+            case EX_MUL: top--; stack[top] = Multiply(stack[top], stack[top + 1]); break;
+            case EX_DIV: top--; stack[top] = Divide(stack[top], stack[top + 1]); break;
+            case EX_MOD: top--; stack[top] = (stack[top + 1] == 0 || stack[top + 1] == -1) ? 0 : stack[top] % stack[top + 1]; break;
+            case EX_ADD: top--; stack[top] = Add(stack[top], stack[top + 1]); break;
+            case EX_SUB: top--; stack[top] = Subtract(stack[top], stack[top + 1]); break;
+            case EX_LT: top--; stack[top] = stack[top] < stack[top + 1]; break;
+            case EX_LE: top--; stack[top] = stack[top] <= stack[top + 1]; break;
+            case EX_GT: top--; stack[top] = stack[top] > stack[top + 1]; break;
+            case EX_GE: top--; stack[top] = stack[top] >= stack[top + 1]; break;
+            case EX_EQ: top--; stack[top] = stack[top] == stack[top + 1]; break;
+            case EX_NE: top--; stack[top] = stack[top] != stack[top + 1]; break;
+            case EX_BITAND: top--; stack[top] &= stack[top + 1]; break;
+            case EX_BITXOR: top--; stack[top] ^= stack[top + 1]; break;
+            case EX_BITOR: top--; stack[top] |= stack[top + 1]; break;
+            case EX_AND: top--; stack[top] = stack[top] && stack[top + 1]; break;
+            case EX_OR: top--; stack[top] = stack[top] || stack[top + 1]; break;
+            case EX_MIN: top--; stack[top] = std::min(stack[top], stack[top + 1]); break;
+            case EX_MAX: top--; stack[top] = std::max(stack[top], stack[top + 1]); break;
+            }
+        }
+        int64_t v = stack[0];
+        if (v > INT32_MAX) return INT32_MAX;
+        if (v < INT32_MIN) return INT32_MIN;
+        return (int)v;
+    }
+
+private:
+    std::vector<ExpressionOp> m_ops;
+
+    // Compiler state for the line being read
+    const char* m_at = NULL;
+    VirtualOutput* m_out = NULL;
+    int m_depth = 0, m_maxDepth = 0;
+    int m_nesting = 0;                 // Recursive productions entered and not left
+    std::string m_error;
+
+    // --- Saturating 64-bit arithmetic: inputs can be anything MAME sends ---
+
+    static int64_t Add(int64_t a, int64_t b) {
+        if (b > 0 && a > INT64_MAX - b) return INT64_MAX;
+        if (b < 0 && a < INT64_MIN - b) return INT64_MIN;
+        return a + b;
+    }
+
+    static int64_t Subtract(int64_t a, int64_t b) {
+        if (b < 0 && a > INT64_MAX + b) return INT64_MAX;
+        if (b > 0 && a < INT64_MIN + b) return INT64_MIN;
+        return a - b;
+    }
+
+    static int64_t Negate(int64_t a) {
+        return (a == INT64_MIN) ? INT64_MAX : -a;
+    }
+
+    static int64_t Multiply(int64_t a, int64_t b) {
+        if (a == 0 || b == 0) return 0;
+        bool negative = (a < 0) != (b < 0);
+        uint64_t ua = (a < 0) ? 0 - (uint64_t)a : (uint64_t)a;
+        uint64_t ub = (b < 0) ? 0 - (uint64_t)b : (uint64_t)b;
+        if (ua > (uint64_t)INT64_MAX / ub) return negative ? INT64_MIN : INT64_MAX;
+        int64_t product = (int64_t)(ua * ub);
+        return negative ? -product : product;
+    }
+
+    static int64_t Divide(int64_t a, int64_t b) {
+        if (b == 0) return 0;
+        if (b == -1) return Negate(a);   // INT64_MIN / -1 does not fit
+        return a / b;
+    }
+
+    static bool IsNameChar(char c) {
+        return isalnum((unsigned char)c) || c == '_' || c == '.' || c == ':';
+    }
+
+    bool ParseDefinition(const std::string& line, std::string& error) {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos || (eq + 1 < line.size() && line[eq + 1] == '=')) {
+            error = "expected NAME = EXPRESSION";
+            return false;
+        }
+        size_t begin = line.find_first_not_of(" \t"), end = line.find_last_not_of(" \t", eq - 1);
+        std::string name = (begin < eq && end != std::string::npos) ? line.substr(begin, end - begin + 1) : "";
+        bool valid = !name.empty() && !isdigit((unsigned char)name[0]);
+        for (char c : name) valid = valid && IsNameChar(c);
+        if (!valid) {
+            error = "'" + name + "' is not an output name";
+            return false;
+        }
+        for (const VirtualOutput& out : outputs) {
+            if (out.name == name) {
+                error = name + " is defined twice";
+                return false;
+            }
+        }
+
+        VirtualOutput out;
+        out.name = name;
+        out.text = line.substr(eq + 1);
+        size_t last = out.text.find_last_not_of(" \t\r");
+        out.text.erase(last == std::string::npos ? 0 : last + 1);
+        out.text.erase(0, out.text.find_first_not_of(" \t"));
+        out.first = (uint32_t)m_ops.size();
+        m_at = out.text.c_str();
+        m_out = &out;
+        m_depth = m_maxDepth = 0;
+        m_nesting = 0;
+        m_error.clear();
+        bool ok = ParseTernary();
+        SkipSpace();
+        if (ok && *m_at != 0) {
+            m_error = std::string("unexpected '") + *m_at + "'";
+            ok = false;
+        }
+        if (ok && m_maxDepth > EXPRESSION_MAX_DEPTH) {
+            m_error = "expression too deep";
+            ok = false;
+        }
+        if (ok) {
+            // Only outputs defined further up, so evaluating never loops
+            for (const std::string& input : out.inputs) {
+                if (input == name) {
+                    m_error = name + " reads itself";
+                    ok = false;
+                }
+            }
+        }
+        m_out = NULL;
+        if (!ok) {
+            error = m_error;
+            return false;
+        }
+        out.count = (uint32_t)m_ops.size() - out.first;
+        outputs.push_back(out);
+
+        // An output defined further down can't be read by one further up
+        for (size_t i = 0; i + 1 < outputs.size(); i++) {
+            for (const std::string& input : outputs[i].inputs) {
+                if (input == name) {
+                    error = outputs[i].name + " reads " + name + ", which is defined below it";
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // --- Recursive descent, one level per precedence, emitting as it goes ---
+
+    void SkipSpace() {
+        while (*m_at == ' ' || *m_at == '\t' || *m_at == '\r') m_at++;
+    }
+
+    // Takes the operator if it is next (and not the start of a longer one)
+    bool Take(const char* op, const char* notBefore = "") {
+        SkipSpace();
+        size_t len = strlen(op);
+        if (strncmp(m_at, op, len) != 0) return false;
+        if (m_at[len] != 0 && strchr(notBefore, m_at[len])) return false;
+        m_at += len;
+        return true;
+    }
+
+    void Emit(ExpressionCode code, int32_t a = 0) {
+        m_ops.push_back({ code, a });
+        if (code == EX_CONST || code == EX_INPUT) {
+            if (++m_depth > m_maxDepth) m_maxDepth = m_depth;
+        }
+        else if (code == EX_SELECT) m_depth -= 2;
+        else if (code >= EX_MUL) m_depth--;
+    }
+
+    bool Fail(const std::string& what) {
+        if (m_error.empty()) m_error = what;
+        return false;
+    }
+
+    // Counts a level of nesting on the way into ParseTernary or a unary operator,
+    // so "((((..." and "!!!!..." fail long before they run out of stack
+    bool Nest() {
+        if (++m_nesting > EXPRESSION_MAX_DEPTH) return Fail("expression nested too deep");
+        return true;
+    }
+
+    bool ParseTernary() {
+        if (!Nest()) return false;
+        bool ok = ParseOr();
+        if (ok && Take("?")) {
+            ok = ParseTernary() && (Take(":") || Fail("expected ':'")) && ParseTernary();
+            if (ok) Emit(EX_SELECT);
+        }
+        m_nesting--;
+        return ok;
+    }
+
+    bool ParseOr() {
+        if (!ParseAnd()) return false;
+        while (Take("||")) {
+            if (!ParseAnd()) return false;
+            Emit(EX_OR);
+        }
+        return true;
+    }
+
+    bool ParseAnd() {
+        if (!ParseBitOr()) return false;
+        while (Take("&&")) {
+            if (!ParseBitOr()) return false;
+            Emit(EX_AND);
+        }
+        return true;
+    }
+
+    bool ParseBitOr() {
+        if (!ParseBitXor()) return false;
+        while (Take("|", "|")) {
+            if (!ParseBitXor()) return false;
+            Emit(EX_BITOR);
+        }
+        return true;
+    }
+
+    bool ParseBitXor() {
+        if (!ParseBitAnd()) return false;
+        while (Take("^")) {
+            if (!ParseBitAnd()) return false;
+            Emit(EX_BITXOR);
+        }
+        return true;
+    }
+
+    bool ParseBitAnd() {
+        if (!ParseEquality()) return false;
+        while (Take("&", "&")) {
+            if (!ParseEquality()) return false;
+            Emit(EX_BITAND);
+        }
+        return true;
+    }
+
+    bool ParseEquality() {
+        if (!ParseRelational()) return false;
+        for (;;) {
+            ExpressionCode code;
+            if (Take("==")) code = EX_EQ;
+            else if (Take("!=")) code = EX_NE;
+            else return true;
+            if (!ParseRelational()) return false;
+            Emit(code);
+        }
+    }
+
+    bool ParseRelational() {
+        if (!ParseAdditive()) return false;
+        for (;;) {
+            ExpressionCode code;
+            if (Take("<=")) code = EX_LE;
+            else if (Take(">=")) code = EX_GE;
+            else if (Take("<")) code = EX_LT;
+            else if (Take(">")) code = EX_GT;
+            else return true;
+            if (!ParseAdditive()) return false;
+            Emit(code);
+        }
+    }
+
+    bool ParseAdditive() {
+        if (!ParseMultiplicative()) return false;
+        for (;;) {
+            ExpressionCode code;
+            if (Take("+")) code = EX_ADD;
+            else if (Take("-")) code = EX_SUB;
+            else return true;
+            if (!ParseMultiplicative()) return false;
+            Emit(code);
+        }
+    }
+
+    bool ParseMultiplicative() {
+        if (!ParseUnary()) return false;
+        for (;;) {
+            ExpressionCode code;
+            if (Take("*")) code = EX_MUL;
+            else if (Take("/")) code = EX_DIV;
+            else if (Take("%")) code = EX_MOD;
+            else return true;
+            if (!ParseUnary()) return false;
+            Emit(code);
+        }
+    }
+
+    bool ParseUnary() {
+        ExpressionCode code;
+        if (Take("!", "=")) code = EX_NOT;
+        else if (Take("-")) code = EX_NEG;
+        else if (Take("~")) code = EX_BITNOT;
+        else return ParsePrimary();
+        if (!Nest()) return false;
+        bool ok = ParseUnary();
+        if (ok) Emit(code);
+        m_nesting--;
+        return ok;
+    }
+
+    bool ParsePrimary() {
+        SkipSpace();
+        if (Take("(")) {
+            if (!ParseTernary()) return false;
+            return Take(")") ? true : Fail("expected ')'");
+        }
+        if (isdigit((unsigned char)*m_at)) {
+            char* end = NULL;
+            bool hex = m_at[0] == '0' && (m_at[1] == 'x' || m_at[1] == 'X');
+            long long value = strtoll(m_at, &end, hex ? 16 : 10);
+            if (IsNameChar(*end)) return Fail("bad number");
+            if (value > INT32_MAX || value < INT32_MIN) return Fail("number out of range");
+            m_at = end;
+            Emit(EX_CONST, (int32_t)value);
+            return true;
+        }
+        if (!IsNameChar(*m_at)) return Fail(*m_at ? std::string("unexpected '") + *m_at + "'" : "expression ends too soon");
+        const char* begin = m_at;
+        while (IsNameChar(*m_at)) m_at++;
+        std::string name(begin, m_at - begin);
+
+        // min(a, b) and max(a, b)
+        if ((name == "min" || name == "max") && Take("(")) {
+            if (!ParseTernary()) return false;
+            if (!Take(",")) return Fail("expected ','");
+            if (!ParseTernary()) return false;
+            if (!Take(")")) return Fail("expected ')'");
+            Emit(name == "min" ? EX_MIN : EX_MAX);
+            return true;
+        }
+
+        // An input: the same name is the same input
+        std::vector<std::string>& inputs = m_out->inputs;
+        size_t slot = std::find(inputs.begin(), inputs.end(), name) - inputs.begin();
+        if (slot == inputs.size()) inputs.push_back(name);
+        Emit(EX_INPUT, (int32_t)slot);
+        return true;
+    }
+};
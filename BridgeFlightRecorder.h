@@ -0,0 +1,137 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                     MAME BRIDGE NET-TO-WIN : FLIGHT RECORDER
+// ==================================================================================
+// Keeps the most recent bridge events in memory so we can see exactly what happened
+// right before a lighting glitch, without writing a full capture to disk.
+//
+// The ring is allocated once at startup. Recording an event is a handful of stores
+// and one atomic add: no locks, no allocation, safe from any thread. When asked,
+// the last N seconds are written to a text file.
+// ==================================================================================
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdio>
+#include <cstdint>
+
+// --- CONFIGURATION ---
+#define FLIGHT_RECORDER_EVENTS 65536  // Ring size (power of two), about 2 MB
+#define FLIGHT_RECORDER_SECONDS 30    // How far back a dump goes
+#define FLIGHT_RECORDER_NAMES 4096    // Names of reclaimed IDs kept for dumps (see BridgeCore FLIGHT RECORDER)
+
+// Where an event came from
+enum FlightSource : uint16_t {
+    FR_CONNECT,      // Connected to MAME
+    FR_DISCONNECT,   // Lost the connection to MAME
+    FR_START,        // "mame_start" received
+    FR_STOP,         // "mame_stop" received
+    FR_UPDATE,       // Output update received from MAME (id, value)
+    FR_REGISTER,     // Client registered (value = client handle)
+    FR_UNREGISTER,   // Client unregistered (value = client handle)
+    FR_ID_REQUEST    // Client asked for the name of an ID (id)
+};
+
+class FlightRecorder {
+public:
+    FlightRecorder() : m_events(FLIGHT_RECORDER_EVENTS), m_head(0), m_start(std::chrono::steady_clock::now()) {}
+
+    // Hot path: called for every event. "generation" tells which output the ID
+    // named at the time (the core's ID map generation), so a dump can name it even
+    // after the ID went to another output.
+    void Record(FlightSource source, uint32_t id, int32_t value, uint32_t generation = 0) {
+        uint64_t index = m_head.fetch_add(1, std::memory_order_relaxed);
+        Event& e = m_events[index & (FLIGHT_RECORDER_EVENTS - 1)];
+
+        // Sequence number 0 marks the slot as "being written" for Dump()
+        e.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        e.timeUs = NowUs();
+        e.source = source;
+        e.id = id;
+        e.value = value;
+        e.generation = generation;
+        e.seq.store(index + 1, std::memory_order_release);
+    }
+
+    // Writes the last "seconds" of events to a text file, oldest first.
+    // nameOf turns an output ID (and the generation it was recorded in) into its name
+    // for the report; status, if given, is a one-line summary of the bridge at the
+    // time (see BridgeStatus).
+    bool Dump(const std::string& path, const std::string& reason, const std::string& romName,
+              const std::function<std::string(uint32_t, uint32_t)>& nameOf,
+              uint64_t seconds = FLIGHT_RECORDER_SECONDS, const std::string& status = std::string()) const {
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f) return false;
+
+        static const char* sourceNames[] = {
+            "CONNECT", "DISCONNECT", "START", "STOP", "UPDATE", "REGISTER", "UNREGISTER", "ID_REQUEST"
+        };
+
+        uint64_t now = NowUs();
+        uint64_t cutoff = (now > seconds * 1000000) ? now - seconds * 1000000 : 0;
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        uint64_t first = (head > FLIGHT_RECORDER_EVENTS) ? head - FLIGHT_RECORDER_EVENTS : 0;
+
+        fprintf(f, "# MAME Bridge NetToWin flight recorder\n");
+        fprintf(f, "# Reason: %s\n", reason.c_str());
+        fprintf(f, "# ROM: %s\n", romName.c_str());
+        if (!status.empty()) fprintf(f, "# Status: %s\n", status.c_str());
+        fprintf(f, "# Times are seconds before the dump\n");
+        fprintf(f, "# %9s  %-10s  %6s  %-24s  %s\n", "time", "source", "id", "name", "value");
+
+        for (uint64_t i = first; i < head; i++) {
+            const Event& e = m_events[i & (FLIGHT_RECORDER_EVENTS - 1)];
+
+            // Copy the slot, then make sure it was not overwritten while we copied it
+            uint64_t seq = e.seq.load(std::memory_order_acquire);
+            uint64_t timeUs = e.timeUs;
+            FlightSource source = e.source;
+            uint32_t id = e.id;
+            int32_t value = e.value;
+            uint32_t generation = e.generation;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq != i + 1 || e.seq.load(std::memory_order_relaxed) != seq) continue;
+            if (timeUs < cutoff) continue;
+
+            double ago = (now >= timeUs) ? (double)(now - timeUs) / 1e6 : 0.0;
+            if (source == FR_UPDATE || source == FR_ID_REQUEST) {
+                fprintf(f, "%11.6f  %-10s  %6u  %-24s  %d\n", -ago, sourceNames[source], id, nameOf(id, generation).c_str(), value);
+            }
+            else if (source == FR_REGISTER || source == FR_UNREGISTER) {
+                fprintf(f, "%11.6f  %-10s  %6s  %-24s  client 0x%08x\n", -ago, sourceNames[source], "", "", (uint32_t)value);
+            }
+            else {
+                fprintf(f, "%11.6f  %-10s\n", -ago, sourceNames[source]);
+            }
+        }
+        fclose(f);
+        return true;
+    }
+
+private:
+    struct Event {
+        std::atomic<uint64_t> seq{0};  // Index + 1 of the event in this slot (0 = empty/busy)
+        uint64_t timeUs = 0;
+        uint32_t id = 0;
+        int32_t value = 0;
+        uint32_t generation = 0;
+        FlightSource source = FR_UPDATE;
+    };
+
+    std::vector<Event> m_events;
+    std::atomic<uint64_t> m_head;
+    std::chrono::steady_clock::time_point m_start;
+
+    uint64_t NowUs() const {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - m_start).count();
+    }
+};
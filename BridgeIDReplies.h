@@ -0,0 +1,299 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                   MAME BRIDGE NET-TO-WIN : ID STRING REPLY SERVICE
+// ==================================================================================
+// Answers "MAMEOutputGetIDString" without letting one bad client stall the bridge.
+//
+// The reply is a WM_COPYDATA message, and WM_COPYDATA can only be *sent* (it waits
+// for the client to process it). If the client is hung, a plain SendMessage never
+// returns, and whatever thread made the call is stuck with it. So:
+//   1. The request is only queued (IDReplyQueue), and the bridge window returns.
+//   2. A dedicated thread takes requests off the queue and sends each reply with
+//      a timeout (IDReplyService).
+//   3. Every client has a health record (ClientHealth). A client that keeps timing
+//      out is quarantined: its replies are dropped for a while instead of costing
+//      a timeout each, then it is probed with a short timeout before being trusted
+//      again. Quarantine doubles on every relapse, up to a limit.
+//
+// Each request carries a copy of its reply, made by the core thread when it was
+// queued, so the reply thread never reads the core while it is being fed.
+//
+// Nothing in here is Windows specific; the actual send is a callback, so the tools
+// can drive it with simulated clients that answer slowly or not at all.
+// ==================================================================================
+
+#pragma once
+
+#include "BridgeCore.h"
+
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+
+// --- CONFIGURATION ---
+#define ID_REPLY_TIMEOUT_MS 250          // Longest a healthy client may take to accept a reply
+#define ID_REPLY_PROBE_TIMEOUT_MS 50     // Timeout for a client coming out of quarantine
+#define ID_REPLY_FAILURES 3              // Timeouts in a row before a client is quarantined
+#define ID_REPLY_QUARANTINE_MS 2000      // First quarantine, doubled on every relapse...
+#define ID_REPLY_QUARANTINE_MAX_MS 60000 // ...up to this
+#define ID_REPLY_QUEUE_MAX 8192          // Pending requests kept (a flood beyond this is dropped)
+#define ID_REPLY_INLINE 64               // Replies up to this size are kept in the request itself
+
+// ==================================================================================
+//                                  CLIENT HEALTH
+// ==================================================================================
+
+enum ClientHealthState {
+    CLIENT_HEALTHY,      // Replies go out with the normal timeout
+    CLIENT_PROBING,      // Just out of quarantine, or timing out: short timeout
+    CLIENT_QUARANTINED   // Replies are dropped until the quarantine ends
+};
+
+class ClientHealth {
+public:
+    // Decides whether a reply to this client should be sent now, and with what timeout
+    bool ShouldSend(ClientHandle client, uint64_t nowMs, uint32_t& timeoutMs) {
+        Record& r = m_clients[client];
+        if (r.state == CLIENT_QUARANTINED) {
+            if (nowMs < r.quarantineUntil) {
+                r.dropped++;
+                return false;
+            }
+            // One failed probe is enough to send it straight back
+            r.state = CLIENT_PROBING;
+            r.failures = ID_REPLY_FAILURES - 1;
+        }
+        timeoutMs = (r.state == CLIENT_HEALTHY) ? ID_REPLY_TIMEOUT_MS : ID_REPLY_PROBE_TIMEOUT_MS;
+        return true;
+    }
+
+    // Reports how a send went. Returns true if this put the client into quarantine.
+    bool OnResult(ClientHandle client, bool delivered, uint64_t nowMs) {
+        Record& r = m_clients[client];
+        if (delivered) {
+            r.state = CLIENT_HEALTHY;
+            r.failures = 0;
+            r.quarantineMs = ID_REPLY_QUARANTINE_MS;
+            return false;
+        }
+
+        r.timeouts++;
+        r.failures++;
+        if (r.failures >= ID_REPLY_FAILURES) {
+            // Still not answering: back off, for longer each time
+            r.state = CLIENT_QUARANTINED;
+            r.quarantineUntil = nowMs + r.quarantineMs;
+            r.quarantineMs = std::min<uint64_t>(r.quarantineMs * 2, ID_REPLY_QUARANTINE_MAX_MS);
+            r.failures = 0;
+            return true;
+        }
+        r.state = CLIENT_PROBING;
+        return false;
+    }
+
+    // Client unregistered (or its window is gone)
+    void Forget(ClientHandle client) { m_clients.erase(client); }
+
+    ClientHealthState State(ClientHandle client) const {
+        auto it = m_clients.find(client);
+        return (it != m_clients.end()) ? it->second.state : CLIENT_HEALTHY;
+    }
+    uint64_t Timeouts(ClientHandle client) const {
+        auto it = m_clients.find(client);
+        return (it != m_clients.end()) ? it->second.timeouts : 0;
+    }
+    uint64_t Dropped(ClientHandle client) const {
+        auto it = m_clients.find(client);
+        return (it != m_clients.end()) ? it->second.dropped : 0;
+    }
+
+private:
+    struct Record {
+        ClientHealthState state = CLIENT_HEALTHY;
+        uint32_t failures = 0;                     // Timeouts in a row
+        uint64_t quarantineUntil = 0;
+        uint64_t quarantineMs = ID_REPLY_QUARANTINE_MS;
+        uint64_t timeouts = 0, dropped = 0;        // Totals, for the log and the tools
+    };
+    std::map<ClientHandle, Record> m_clients;
+};
+
+// ==================================================================================
+//                                  REQUEST QUEUE
+// ==================================================================================
+// Filled by the core thread, drained by the reply thread. A request already
+// waiting is not queued twice (clients often ask again when no answer comes), but
+// its reply is brought up to date (ID 0 is renamed with every game). The requests
+// waiting are indexed by client and ID, so spotting a repeat is one lookup however
+// long the queue is.
+class IDReplyQueue {
+public:
+    struct Request {
+        ClientHandle client = 0;
+        OutputID id = 0;
+        uint32_t size = 0;
+        uint8_t inlineData[ID_REPLY_INLINE];  // Typical names (no allocation)...
+        std::vector<uint8_t> longData;        // ...and the rare long one
+
+        void SetReply(const uint8_t* data, size_t len) {
+            size = (uint32_t)len;
+            if (len <= ID_REPLY_INLINE) {
+                memcpy(inlineData, data, len);
+                longData.clear();
+            }
+            else longData.assign(data, data + len);
+        }
+        const uint8_t* Data() const { return (size <= ID_REPLY_INLINE) ? inlineData : longData.data(); }
+    };
+
+    // Queues the reply (data, size) for a client. Returns false if the request was
+    // a duplicate or the queue is full.
+    bool Push(ClientHandle client, OutputID id, const uint8_t* data, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_waiting.find(Key{ client, id });
+            if (it != m_waiting.end()) {
+                it->second->SetReply(data, size);
+                return false;
+            }
+            if (m_requests.size() >= ID_REPLY_QUEUE_MAX) return false;
+            m_requests.emplace_back();
+            m_requests.back().client = client;
+            m_requests.back().id = id;
+            m_requests.back().SetReply(data, size);
+            m_waiting[Key{ client, id }] = &m_requests.back();
+        }
+        m_ready.notify_one();
+        return true;
+    }
+
+    // Waits for a request. Returns false if Wake() was called first.
+    bool Pop(Request& out) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_ready.wait(lock, [this] { return m_woken || !m_requests.empty(); });
+        if (m_requests.empty()) {
+            m_woken = false;
+            return false;
+        }
+        m_waiting.erase(Key{ m_requests.front().client, m_requests.front().id });
+        out = std::move(m_requests.front());
+        m_requests.pop_front();
+        return true;
+    }
+
+    // Drops everything still waiting for one client (e.g. it unregistered)
+    void DropClient(ClientHandle client) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_requests.begin(); it != m_requests.end();) {
+            if (it->client == client) it = m_requests.erase(it);
+            else ++it;
+        }
+        // Erasing from the middle moves the others: index them again
+        m_waiting.clear();
+        for (Request& r : m_requests) m_waiting[Key{ r.client, r.id }] = &r;
+    }
+
+    // Requests waiting
+    size_t Size() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_requests.size();
+    }
+
+    // Makes a waiting Pop() return (there is something else to do)
+    void Wake() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_woken = true;
+        }
+        m_ready.notify_all();
+    }
+
+private:
+    struct Key {
+        ClientHandle client;
+        OutputID id;
+        bool operator==(const Key& o) const { return client == o.client && id == o.id; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            return std::hash<uint64_t>()(((uint64_t)k.client * 0x9E3779B97F4A7C15ull) ^ (uint64_t)k.id);
+        }
+    };
+
+    bool m_woken = false;
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<Request> m_requests;
+    // Each request in m_requests by client and ID. Adding at the back and taking
+    // from the front leaves the others where they are in a deque.
+    std::unordered_map<Key, Request*, KeyHash> m_waiting;
+};
+
+// ==================================================================================
+//                                  REPLY THREAD
+// ==================================================================================
+// Run() is the body of the reply thread and serves requests until "running" goes false
+// (followed by queue.Wake(), so a thread waiting for work notices).
+//   send(request, timeoutMs) delivers request.Data() and returns false on a timeout.
+//   onQuarantine(client) is told when a client is put in quarantine (for the log).
+// The health table is only touched by the reply thread; other threads hand
+// unregistered clients over with ForgetClient().
+struct IDReplyService {
+    IDReplyQueue queue;
+    ClientHealth health;
+    std::function<bool(const IDReplyQueue::Request&, uint32_t)> send;
+    std::function<void(ClientHandle)> onQuarantine;
+    std::atomic<uint64_t> sent{0}, timedOut{0}, dropped{0};
+    bool useHealth = true;   // false: every reply gets the full timeout (for comparison)
+
+    // Clients to forget, handed over from other threads
+    std::mutex forgetMutex;
+    std::vector<ClientHandle> forget;
+
+    void ForgetClient(ClientHandle client) {
+        queue.DropClient(client);
+        {
+            std::lock_guard<std::mutex> lock(forgetMutex);
+            forget.push_back(client);
+        }
+        queue.Wake();
+    }
+
+    static uint64_t NowMs() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Run(const std::atomic<bool>& running) {
+        IDReplyQueue::Request req;
+        while (running) {
+            {
+                std::lock_guard<std::mutex> lock(forgetMutex);
+                for (ClientHandle c : forget) health.Forget(c);
+                forget.clear();
+            }
+            if (!queue.Pop(req)) continue;  // Sleeps until there is work: no idle wake-ups
+
+            uint32_t timeoutMs = ID_REPLY_TIMEOUT_MS;
+            if (useHealth && !health.ShouldSend(req.client, NowMs(), timeoutMs)) {
+                dropped++;
+                continue;
+            }
+            bool delivered = send(req, timeoutMs);
+            if (delivered) sent++;
+            else timedOut++;
+            if (useHealth && health.OnResult(req.client, delivered, NowMs()) && onQuarantine) onQuarantine(req.client);
+        }
+    }
+};
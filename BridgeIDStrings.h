@@ -0,0 +1,131 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                     MAME BRIDGE NET-TO-WIN : ID STRING ARENA
+// ==================================================================================
+// Ready-to-send answers to "MAMEOutputGetIDString".
+//
+// Clients ask for the name of every ID when they start, and again after every
+// reconnect or game change. Instead of building a fresh buffer for each request,
+// the reply (a copydata_id_string: the ID followed by the name and its 0) is
+// built once, when the ID is handed out, into a large shared block of memory.
+// Answering is then a table lookup: no allocation, no copying.
+//
+// Blobs never move once written, so a reply being sent stays valid while new IDs
+// are added. Space from IDs reclaimed by the core (see ROM EPOCHS in BridgeCore.h)
+// is recovered by compacting into fresh chunks; the old chunks are only freed at
+// the following epoch, once nothing can still be sending from them.
+// ==================================================================================
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+
+// --- CONFIGURATION ---
+#define ID_STRING_CHUNK 65536  // Bytes per arena chunk (about 3000 typical names)
+
+// MAME's reply layout for "MAMEOutputGetIDString", sent via WM_COPYDATA
+struct copydata_id_string { uint32_t id; char string[1]; };
+
+// Size of the reply for a name, laid out exactly like MAME native output
+inline size_t IDStringSize(const std::string& name) {
+    return sizeof(copydata_id_string) + name.length() + 1;
+}
+
+// Writes the reply for (id, name) to "out", which must hold IDStringSize(name) bytes
+inline void WriteIDString(uint8_t* out, uint32_t id, const std::string& name) {
+    memset(out, 0, IDStringSize(name));
+    copydata_id_string* pData = (copydata_id_string*)out;
+    pData->id = id;
+    memcpy(pData->string, name.c_str(), name.length() + 1);
+}
+
+class IDStringArena {
+public:
+    // Builds the reply for an ID (replacing any earlier one)
+    void Set(uint32_t id, const std::string& name) {
+        Clear(id);
+        uint32_t size = (uint32_t)IDStringSize(name);
+        uint8_t* blob = Allocate(size);
+        WriteIDString(blob, id, name);
+        if (id >= m_entries.size()) m_entries.resize((size_t)id + 1);
+        m_entries[id] = { blob, size };
+        m_liveBytes += size;
+    }
+
+    // The reply for an ID, or NULL if there is none
+    const uint8_t* Get(uint32_t id, size_t& size) const {
+        if (id >= m_entries.size() || !m_entries[id].data) return NULL;
+        size = m_entries[id].size;
+        return m_entries[id].data;
+    }
+
+    // Forgets an ID's reply (its space is recovered by the next compaction)
+    void Clear(uint32_t id) {
+        if (id >= m_entries.size() || !m_entries[id].data) return;
+        m_liveBytes -= m_entries[id].size;
+        m_deadBytes += m_entries[id].size;
+        m_entries[id] = { NULL, 0 };
+    }
+
+    // Called once per ROM epoch: frees the chunks retired by the last compaction,
+    // and compacts if more than half of the arena is dead space.
+    void BeginEpoch() {
+        m_retired.clear();
+        if (m_deadBytes < ID_STRING_CHUNK || m_deadBytes < m_liveBytes) return;
+
+        m_retired.swap(m_chunks);
+        m_used = 0;
+        m_deadBytes = 0;
+        for (Entry& e : m_entries) {
+            if (!e.data) continue;
+            uint8_t* blob = Allocate(e.size);
+            memcpy(blob, e.data, e.size);
+            e.data = blob;
+        }
+    }
+
+    // Forgets everything (the old chunks are kept until the next epoch)
+    void Reset() {
+        m_retired.clear();
+        for (auto& c : m_chunks) m_retired.push_back(std::move(c));
+        m_chunks.clear();
+        m_entries.clear();
+        m_used = 0;
+        m_liveBytes = m_deadBytes = 0;
+    }
+
+    size_t LiveBytes() const { return m_liveBytes; }
+    size_t ChunkCount() const { return m_chunks.size() + m_retired.size(); }
+
+private:
+    struct Entry {
+        const uint8_t* data;
+        uint32_t size;
+    };
+
+    std::vector<std::unique_ptr<uint8_t[]>> m_chunks;   // Current chunks, the last one is being filled
+    std::vector<std::unique_ptr<uint8_t[]>> m_retired;  // Replaced by a compaction, freed next epoch
+    std::vector<Entry> m_entries;                       // Index = output ID
+    size_t m_used = 0;                                  // Bytes used in the last chunk
+    size_t m_chunkSize = 0;                             // Size of the last chunk
+    size_t m_liveBytes = 0, m_deadBytes = 0;
+
+    uint8_t* Allocate(size_t size) {
+        size = (size + 3) & ~(size_t)3;  // Keep every blob's ID field aligned
+        if (m_chunks.empty() || m_used + size > m_chunkSize) {
+            // Names longer than a chunk get a chunk of their own
+            m_chunkSize = (size > ID_STRING_CHUNK) ? size : ID_STRING_CHUNK;
+            m_chunks.emplace_back(new uint8_t[m_chunkSize]);
+            m_used = 0;
+        }
+        uint8_t* p = m_chunks.back().get() + m_used;
+        m_used += size;
+        return p;
+    }
+};
@@ -0,0 +1,106 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                       MAME BRIDGE NET-TO-WIN : CORE MAILBOX
+// ==================================================================================
+// Hands client requests over to the thread that owns the core.
+//
+// The core (BridgeCore.h) is not thread safe, and doesn't need to be: it is only
+// ever touched by the thread feeding it MAME's data (network or replay). Everything
+// that happens elsewhere - a client registering with the bridge window, asking for
+// a name, the tray menu saving the flight recorder - is posted here as a small
+// command and carried out by that thread the next time it wakes.
+//
+// The mailbox is a bounded ring (Dmitry Vyukov's MPMC queue): each slot carries a
+// sequence number telling producers and the consumer whose turn it is, so pushing
+// and popping are a compare-and-swap and two atomic stores. No locks, no allocation,
+// so the bridge window never waits for the network thread or the other way round.
+// ==================================================================================
+
+#pragma once
+
+#include "BridgeCore.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// --- CONFIGURATION ---
+#define MAILBOX_SLOTS 4096  // Commands waiting at most (power of two)
+
+// What the other threads can ask of the core thread
+enum BridgeCommandType {
+    CMD_REGISTER,        // A client registered (client)
+    CMD_UNREGISTER,      // A client unregistered (client)
+    CMD_GET_ID_STRING,   // A client asked for the name of an ID (client, id)
+    CMD_BRIGHTNESS,      // A client opted in to brightness levels (client, id = 1) or out (id = 0)
+    CMD_FULL_RATE,       // A client asked for every update of rate-capped outputs (id = 1) or not (id = 0)
+    CMD_SAVE_FLIGHT      // Save the flight recorder (tray menu)
+};
+
+struct BridgeCommand {
+    BridgeCommandType type;
+    ClientHandle client;
+    OutputID id;
+};
+
+template <typename T, size_t N>
+class MailboxRing {
+    static_assert((N & (N - 1)) == 0, "MailboxRing size must be a power of two");
+
+public:
+    MailboxRing() {
+        for (size_t i = 0; i < N; i++) m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Any thread. Returns false if the ring is full.
+    bool Push(const T& item) {
+        size_t pos = m_pushPos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &m_slots[pos & (N - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                // Free slot: claim it (another producer may get there first)
+                if (m_pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if (diff < 0) return false;  // Still holds an item a lap behind: full
+            else pos = m_pushPos.load(std::memory_order_relaxed);
+        }
+        slot->item = item;
+        slot->seq.store(pos + 1, std::memory_order_release);  // Publish it to the consumer
+        return true;
+    }
+
+    // Any thread. Returns false if the ring is empty.
+    bool Pop(T& out) {
+        size_t pos = m_popPos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &m_slots[pos & (N - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (m_popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if (diff < 0) return false;  // Not written yet: empty
+            else pos = m_popPos.load(std::memory_order_relaxed);
+        }
+        out = slot->item;
+        slot->seq.store(pos + N, std::memory_order_release);  // Free for the next lap
+        return true;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        T item;
+    };
+    Slot m_slots[N];
+    alignas(64) std::atomic<size_t> m_pushPos{0};  // Own cache lines, producers and the
+    alignas(64) std::atomic<size_t> m_popPos{0};   // consumer don't slow each other down
+};
+
+typedef MailboxRing<BridgeCommand, MAILBOX_SLOTS> BridgeMailbox;
@@ -0,0 +1,209 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                      MAME BRIDGE NET-TO-WIN : TIMER WHEEL
+// ==================================================================================
+// Timers for the core thread, keyed by a small number (an output ID), e.g. "send
+// lamp7's 0 at 12:00:00.040" (see TIMERS in BridgeCore.h).
+//
+// A hierarchical timing wheel: three rings of 64 slots. The first ring has a slot for
+// each of the next 64 milliseconds, the second one for each of the next 64 blocks of
+// 64 ms (4 s), the third one for blocks of 4 s (about 4 1/2 minutes). A timer goes
+// into the ring its deadline falls in; each time the first ring comes round, the
+// next slot of the second ring is spread out over it (and likewise for the third).
+// Scheduling and cancelling are a few index writes, whatever the number of timers.
+//
+// Each key has at most one timer, and its links live in arrays indexed by the key:
+// nothing is allocated per timer (the arrays only grow with the highest key). A
+// bitmap per ring says which slots are in use, so advancing over idle time and
+// finding the next deadline skip empty slots.
+//
+// Time is whatever the caller passes in (milliseconds), so replays and the tools can
+// run it on a virtual clock.
+// ==================================================================================
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+// --- CONFIGURATION ---
+#define TIMER_WHEEL_LEVELS 3       // Rings
+#define TIMER_WHEEL_BITS 6         // 64 slots per ring
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_NONE 0xffffffffu
+
+class TimerWheel {
+public:
+    TimerWheel() { Clear(); }
+
+    // (Re)schedules the timer of "key" for dueMs. nowMs is the caller's clock; it
+    // only sets the wheel's time when nothing is pending (e.g. the first timer).
+    void Schedule(uint32_t key, uint64_t dueMs, uint64_t nowMs) {
+        if (key >= m_next.size()) Grow(key + 1);
+        if (Pending(key)) Unlink(key);
+        if (m_count == 0 && nowMs > m_now) m_now = nowMs;
+        if (dueMs <= m_now) dueMs = m_now + 1;  // Already due: the next tick
+        m_due[key] = dueMs;
+        Link(key);
+    }
+
+    void Cancel(uint32_t key) {
+        if (Pending(key)) Unlink(key);
+    }
+
+    bool Pending(uint32_t key) const { return key < m_due.size() && m_due[key] != 0; }
+    size_t Count() const { return m_count; }
+
+    // Moves time forward to nowMs and calls onExpire(key) for every timer that came
+    // due, in deadline order. onExpire may schedule new timers.
+    template <typename F>
+    void Advance(uint64_t nowMs, F onExpire) {
+        while (m_now < nowMs) {
+            if (m_count == 0) {
+                m_now = nowMs;
+                break;
+            }
+            uint64_t tick = NextTick();
+            if (tick > nowMs) {
+                m_now = nowMs;
+                break;
+            }
+            m_now = tick;
+            if ((tick & (TIMER_WHEEL_SLOTS - 1)) == 0) Cascade(tick);
+            FireSlot((uint32_t)(tick & (TIMER_WHEEL_SLOTS - 1)), onExpire);
+        }
+    }
+
+    // The earliest time worth advancing to: the next deadline in the first ring, or
+    // the moment it comes round. 0 = nothing pending.
+    uint64_t NextWakeMs() const { return (m_count == 0) ? 0 : NextTick(); }
+
+    void Clear() {
+        for (uint32_t& head : m_heads) head = TIMER_WHEEL_NONE;
+        for (uint64_t& used : m_used) used = 0;
+        std::fill(m_due.begin(), m_due.end(), 0);
+        std::fill(m_prev.begin(), m_prev.end(), TIMER_WHEEL_NONE);
+        m_count = 0;
+    }
+
+private:
+    uint64_t m_now = 0;                            // Time the wheel has advanced to
+    size_t m_count = 0;
+    uint32_t m_heads[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+    uint64_t m_used[TIMER_WHEEL_LEVELS];           // Bit per non-empty slot
+    std::vector<uint32_t> m_next, m_prev;          // Links per key
+    std::vector<uint32_t> m_slot;                  // Slot per key
+    std::vector<uint64_t> m_due;                   // Deadline per key, 0 = no timer
+
+    static uint32_t CountTrailingZeros(uint64_t v) {
+#if defined(__GNUC__)
+        return (uint32_t)__builtin_ctzll(v);
+#else
+        uint32_t n = 0;
+        while ((v & 1) == 0) { v >>= 1; n++; }
+        return n;
+#endif
+    }
+
+    // The next tick with something to do: a used slot of the first ring, or (if the
+    // rings above hold anything) the first ring coming round. Empty ticks are skipped.
+    uint64_t NextTick() const {
+        uint64_t tick = m_now + 1;
+        uint64_t next = UINT64_MAX;
+        uint64_t ahead = m_used[0] >> (tick & (TIMER_WHEEL_SLOTS - 1));
+        if (ahead != 0) next = tick + CountTrailingZeros(ahead);
+        bool above = false;
+        for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) above |= (m_used[level] != 0);
+        if (above || ahead == 0) {
+            uint64_t round = (tick + TIMER_WHEEL_SLOTS - 1) & ~(uint64_t)(TIMER_WHEEL_SLOTS - 1);
+            if (round < next) next = round;
+        }
+        return next;
+    }
+
+    void Grow(size_t size) {
+        m_next.resize(size, TIMER_WHEEL_NONE);
+        m_prev.resize(size, TIMER_WHEEL_NONE);
+        m_slot.resize(size, 0);
+        m_due.resize(size, 0);
+    }
+
+    // The ring a deadline belongs in: the lowest whose reach covers it
+    uint32_t SlotFor(uint64_t due) const {
+        uint64_t delta = due - m_now;
+        for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            uint32_t shift = level * TIMER_WHEEL_BITS;
+            if (delta < ((uint64_t)TIMER_WHEEL_SLOTS << shift) || level == TIMER_WHEEL_LEVELS - 1) {
+                // Beyond the last ring: park it in the furthest slot, it cascades down
+                if (level == TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t)TIMER_WHEEL_SLOTS << shift)) {
+                    due = m_now + ((uint64_t)(TIMER_WHEEL_SLOTS - 1) << shift);
+                }
+                return level * TIMER_WHEEL_SLOTS + (uint32_t)((due >> shift) & (TIMER_WHEEL_SLOTS - 1));
+            }
+        }
+        return 0;
+    }
+
+    void Link(uint32_t key) {
+        uint32_t slot = SlotFor(m_due[key]);
+        m_slot[key] = slot;
+        m_next[key] = m_heads[slot];
+        m_prev[key] = TIMER_WHEEL_NONE;
+        if (m_heads[slot] != TIMER_WHEEL_NONE) m_prev[m_heads[slot]] = key;
+        m_heads[slot] = key;
+        m_used[slot / TIMER_WHEEL_SLOTS] |= 1ull << (slot % TIMER_WHEEL_SLOTS);
+        m_count++;
+    }
+
+    void Unlink(uint32_t key) {
+        uint32_t slot = m_slot[key];
+        uint32_t next = m_next[key];
+        if (m_heads[slot] == key) {
+            m_heads[slot] = next;
+            if (next != TIMER_WHEEL_NONE) m_prev[next] = TIMER_WHEEL_NONE;
+            else m_used[slot / TIMER_WHEEL_SLOTS] &= ~(1ull << (slot % TIMER_WHEEL_SLOTS));
+        }
+        else {
+            m_next[m_prev[key]] = next;
+            if (next != TIMER_WHEEL_NONE) m_prev[next] = m_prev[key];
+        }
+        m_next[key] = m_prev[key] = TIMER_WHEEL_NONE;
+        m_due[key] = 0;
+        m_count--;
+    }
+
+    // The first ring came round at "tick": spread out the slot of each ring above that
+    // starts now, the highest first (its timers may land in the ring below)
+    void Cascade(uint64_t tick) {
+        for (uint32_t level = TIMER_WHEEL_LEVELS - 1; level >= 1; level--) {
+            uint32_t shift = level * TIMER_WHEEL_BITS;
+            if ((tick & (((uint64_t)1 << shift) - 1)) != 0) continue;
+            Relink(level * TIMER_WHEEL_SLOTS + (uint32_t)((tick >> shift) & (TIMER_WHEEL_SLOTS - 1)));
+        }
+    }
+
+    // Takes every timer out of a slot and puts it back where it belongs now
+    void Relink(uint32_t slot) {
+        uint32_t key = m_heads[slot];
+        while (key != TIMER_WHEEL_NONE) {
+            uint32_t next = m_next[key];
+            uint64_t due = m_due[key];
+            Unlink(key);
+            m_due[key] = due;
+            Link(key);
+            key = next;
+        }
+    }
+
+    template <typename F>
+    void FireSlot(uint32_t slot, F onExpire) {
+        while (m_heads[slot] != TIMER_WHEEL_NONE) {
+            uint32_t key = m_heads[slot];
+            Unlink(key);
+            onExpire(key);
+        }
+    }
+};
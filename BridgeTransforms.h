@@ -0,0 +1,311 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                    MAME BRIDGE NET-TO-WIN : VALUE TRANSFORMS
+// ==================================================================================
+// Changes the values a client gets, per output and per client: a lamp wired
+// active-low wants 0 and 1 swapped, a controller that takes 0-100 wants MAME's
+// 0-255 scaled down, a shaker wants a gauge turned into on/off.
+//
+// Transforms come from a text file, one rule per line:
+//
+//   # client   output       transform...
+//   *          lamp_low*    invert
+//   2          gauge*       scale 0 255 0 100  clamp 0 100
+//   ledblinky* fuel         threshold 128
+//   *          mode         remap 0=3 1=2 2=1
+//
+// The client is a pattern on the client's name (on Windows the name of its
+// program, in the tools its number), the output a pattern on the output name, and
+// for each update the first rule that matches both applies. A rule can chain any
+// number of steps, applied left to right:
+//   invert             0 becomes 1, anything else 0
+//   invert MAX         MAX - value
+//   scale A B C D      A..B onto C..D, rounded (not clamped)
+//   clamp LO HI        values below LO become LO, above HI become HI
+//   threshold T        1 from T up, 0 below
+//   remap X=Y ...      the listed values become others, the rest stay as they are
+// Every number must fit in 32 bits. Between steps the value is 64 bits wide, so a
+// chain of scales can go past that range and come back; only the result is
+// clamped to 32 bits.
+//
+// Each distinct chain is compiled once into a program: its steps (opcodes), and
+// its result for every value from 0 to 255, which is what almost every output
+// sends. Applying it is then a bounds check and a table read; only values outside
+// that range run the steps. Which program an output gets is worked out by the core
+// when the output gets its ID (see TRANSFORMS in BridgeCore.h).
+// ==================================================================================
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cctype>
+#include <cmath>
+
+// --- CONFIGURATION ---
+#define TRANSFORM_TABLE_SIZE 256   // Values 0..255 are looked up, the rest computed
+#define TRANSFORM_MAX_PROGRAMS 65535
+#define TRANSFORM_VALUE_LIMIT 4611686018427387904.0  // 2^62: a scale's result is kept within +/- this
+
+// One step of a program
+enum TransformCode : uint8_t {
+    XF_INVERT,        // value ? 0 : 1
+    XF_SUBTRACT,      // a - value
+    XF_SCALE,         // a..b onto c..d (c and d in the next step's a and b)
+    XF_SCALE_TO,      // Carries c and d for XF_SCALE, does nothing itself
+    XF_CLAMP,         // Between a and b
+    XF_THRESHOLD,     // value >= a
+    XF_REMAP          // b pairs of (from, to) in the remap pool, from index a
+};
+
+struct TransformOp {
+    TransformCode code;
+    int32_t a, b;
+};
+
+// A compiled chain of steps
+struct TransformProgram {
+    std::string text;        // The steps as written, to share programs between rules
+    uint32_t first, count;   // Its steps in ops
+    uint32_t table;          // Its results for 0..TRANSFORM_TABLE_SIZE-1 in tables
+};
+
+// A line of the file
+struct TransformRule {
+    std::string client;      // Pattern on the client's name
+    std::string output;      // Pattern on the output's name
+    uint16_t program;        // Index in programs + 1
+};
+
+class TransformSet {
+public:
+    std::vector<TransformRule> rules;
+    std::vector<TransformProgram> programs;
+
+    bool Empty() const { return rules.empty(); }
+
+    void Clear() {
+        rules.clear();
+        programs.clear();
+        m_ops.clear();
+        m_remap.clear();
+        m_tables.clear();
+    }
+
+    // Reads a transform file. On failure, error names the line and what is wrong,
+    // and the set is left empty.
+    bool Load(const std::string& path, std::string& error) {
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) {
+            error = "Could not open " + path;
+            return false;
+        }
+        std::string text;
+        char buffer[4096];
+        size_t got;
+        while ((got = fread(buffer, 1, sizeof(buffer), f)) > 0) text.append(buffer, got);
+        fclose(f);
+        if (Parse(text, error)) return true;
+        error = path + " " + error;
+        return false;
+    }
+
+    // Reads the rules from text in the file's format
+    bool Parse(const std::string& text, std::string& error) {
+        Clear();
+        size_t start = 0;
+        int lineNumber = 0;
+        while (start < text.size()) {
+            size_t end = text.find('\n', start);
+            if (end == std::string::npos) end = text.size();
+            std::string line = text.substr(start, end - start);
+            start = end + 1;
+            lineNumber++;
+            size_t hash = line.find('#');
+            if (hash != std::string::npos) line.resize(hash);
+            std::vector<std::string> words = Words(line);
+            if (words.empty()) continue;
+            if (!ParseRule(words, error)) {
+                if (!m_outOfRange.empty()) error = "'" + m_outOfRange + "' does not fit in 32 bits";
+                error = "line " + std::to_string(lineNumber) + ": " + error;
+                Clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The value a client gets for "value" through program (index + 1, 0 = none)
+    int Apply(uint16_t program, int value) const {
+        if (program == 0) return value;
+        const TransformProgram& p = programs[program - 1];
+        if ((uint32_t)value < TRANSFORM_TABLE_SIZE) return m_tables[p.table + (uint32_t)value];
+        return Run(p, value);
+    }
+
+private:
+    std::vector<TransformOp> m_ops;
+    std::vector<int32_t> m_remap;     // XF_REMAP pairs
+    std::vector<int32_t> m_tables;    // TRANSFORM_TABLE_SIZE results per program
+    std::string m_outOfRange;         // A number in the rule being read that is too big
+
+    static std::vector<std::string> Words(const std::string& line) {
+        std::vector<std::string> words;
+        size_t i = 0;
+        while (i < line.size()) {
+            while (i < line.size() && isspace((unsigned char)line[i])) i++;
+            size_t begin = i;
+            while (i < line.size() && !isspace((unsigned char)line[i])) i++;
+            if (i > begin) words.push_back(line.substr(begin, i - begin));
+        }
+        return words;
+    }
+
+    // Reads a whole word as a number. One that is too big for 32 bits is not read,
+    // and is remembered so the error can say so instead of what was expected.
+    bool Number(const std::string& word, int32_t& out) {
+        char* end = NULL;
+        long long value = strtoll(word.c_str(), &end, 10);
+        if (word.empty() || *end != 0) return false;
+        if (value < INT32_MIN || value > INT32_MAX) {
+            m_outOfRange = word;
+            return false;
+        }
+        out = (int32_t)value;
+        return true;
+    }
+
+    bool ParseRule(const std::vector<std::string>& words, std::string& error) {
+        if (words.size() < 3) {
+            error = "expected a client, an output and a transform";
+            return false;
+        }
+        m_outOfRange.clear();
+
+        // The steps as one string: identical chains share a program
+        std::string text;
+        for (size_t i = 2; i < words.size(); i++) text += (i > 2 ? " " : "") + words[i];
+        for (size_t i = 0; i < programs.size(); i++) {
+            if (programs[i].text != text) continue;
+            rules.push_back({ words[0], words[1], (uint16_t)(i + 1) });
+            return true;
+        }
+        if (programs.size() >= TRANSFORM_MAX_PROGRAMS) {
+            error = "too many different transforms";
+            return false;
+        }
+
+        TransformProgram program = { text, (uint32_t)m_ops.size(), 0, 0 };
+        size_t i = 2;
+        while (i < words.size()) {
+            const std::string& step = words[i++];
+            int32_t n[4] = {};
+            auto take = [&](int count) {
+                for (int k = 0; k < count; k++) {
+                    if (i >= words.size() || !Number(words[i], n[k])) return false;
+                    i++;
+                }
+                return true;
+            };
+            if (step == "invert") {
+                if (i < words.size() && Number(words[i], n[0])) {
+                    i++;
+                    m_ops.push_back({ XF_SUBTRACT, n[0], 0 });
+                }
+                else m_ops.push_back({ XF_INVERT, 0, 0 });
+            }
+            else if (step == "scale") {
+                if (!take(4) || n[0] == n[1]) {
+                    error = "scale needs FROM_LOW FROM_HIGH TO_LOW TO_HIGH (and FROM_LOW != FROM_HIGH)";
+                    return false;
+                }
+                m_ops.push_back({ XF_SCALE, n[0], n[1] });
+                m_ops.push_back({ XF_SCALE_TO, n[2], n[3] });
+            }
+            else if (step == "clamp") {
+                if (!take(2) || n[0] > n[1]) {
+                    error = "clamp needs LOW HIGH";
+                    return false;
+                }
+                m_ops.push_back({ XF_CLAMP, n[0], n[1] });
+            }
+            else if (step == "threshold") {
+                if (!take(1)) {
+                    error = "threshold needs a value";
+                    return false;
+                }
+                m_ops.push_back({ XF_THRESHOLD, n[0], 0 });
+            }
+            else if (step == "remap") {
+                TransformOp op = { XF_REMAP, (int32_t)m_remap.size(), 0 };
+                while (i < words.size() && words[i].find('=') != std::string::npos) {
+                    const std::string& pair = words[i++];
+                    size_t eq = pair.find('=');
+                    if (!Number(pair.substr(0, eq), n[0]) || !Number(pair.substr(eq + 1), n[1])) {
+                        error = "remap needs FROM=TO pairs, not '" + pair + "'";
+                        return false;
+                    }
+                    m_remap.push_back(n[0]);
+                    m_remap.push_back(n[1]);
+                    op.b++;
+                }
+                if (op.b == 0) {
+                    error = "remap needs FROM=TO pairs";
+                    return false;
+                }
+                m_ops.push_back(op);
+            }
+            else {
+                error = "unknown transform '" + step + "'";
+                return false;
+            }
+        }
+        program.count = (uint32_t)m_ops.size() - program.first;
+
+        // The table: every value the lookup covers, run through the steps once
+        program.table = (uint32_t)m_tables.size();
+        for (int value = 0; value < TRANSFORM_TABLE_SIZE; value++) m_tables.push_back(Run(program, value));
+        programs.push_back(program);
+        rules.push_back({ words[0], words[1], (uint16_t)programs.size() });
+        return true;
+    }
+
+    int Run(const TransformProgram& p, int value) const {
+        int64_t v = value;
+        for (uint32_t i = p.first; i < p.first + p.count; i++) {
+            const TransformOp& op = m_ops[i];
+            switch (op.code) {
+            case XF_INVERT: v = (v == 0) ? 1 : 0; break;
+            case XF_SUBTRACT: v = (int64_t)op.a - v; break;
+            case XF_SCALE: {
+                // Widened before subtracting: the ends can be a full 32-bit range apart
+                const TransformOp& to = m_ops[i + 1];
+                double scaled = (double)(v - op.a) * (double)((int64_t)to.b - to.a) / (double)((int64_t)op.b - op.a);
+                if (scaled > TRANSFORM_VALUE_LIMIT) scaled = TRANSFORM_VALUE_LIMIT;
+                if (scaled < -TRANSFORM_VALUE_LIMIT) scaled = -TRANSFORM_VALUE_LIMIT;
+                v = to.a + llround(scaled);
+                break;
+            }
+            case XF_SCALE_TO: break;
+            case XF_CLAMP: v = (v < op.a) ? op.a : (v > op.b) ? op.b : v; break;
+            case XF_THRESHOLD: v = (v >= op.a) ? 1 : 0; break;
+            case XF_REMAP:
+                for (int32_t k = 0; k < op.b; k++) {
+                    if (m_remap[op.a + 2 * k] == v) {
+                        v = m_remap[op.a + 2 * k + 1];
+                        break;
+                    }
+                }
+                break;
+            }
+        }
+        if (v > INT32_MAX) return INT32_MAX;
+        if (v < INT32_MIN) return INT32_MIN;
+        return (int)v;
+    }
+};
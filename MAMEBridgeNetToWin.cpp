@@ -39,6 +39,13 @@
 #include <iomanip>
 #include <algorithm>
 #include <cctype>
+#include <ctime>
+#include "BridgeCore.h"
+#include "BridgeCapture.h"
+#include "BridgeCaptureIndex.h"
+#include "BridgeIDReplies.h"
+#include "BridgeMailbox.h"
+#include "BridgeBusyPoll.h"
 
 // Link against required Windows libraries for Sockets and GUI controls
 #pragma comment(lib, "ws2_32.lib")
@@ -51,6 +58,8 @@
 #define GUI_WINDOW_CLASS "NetToWinGUI"    // Class name for our visible log window
 #define WM_SHELLNOTIFY (WM_USER + 1)      // Custom message for Tray Icon events
 #define WM_APPEND_LOG  (WM_USER + 2)      // Custom message for thread-safe logging
+#define STOP_EVENT_NAME "Global\\MAMEBridgeNetToWin_Stop"  // Set by --stop (MAME's own window has our class name)
+#define CATCHUP_INTERVAL_MS 10            // New clients get one catch-up batch (CATCHUP_BATCH updates) per tick
 
 // Tray Icon Menu IDs
 #define ID_TRAY_APP_ICON 1001
@@ -59,10 +68,11 @@
 #define ID_TRAY_ABOUT    1004
 #define ID_TRAY_GITHUB   1005
 #define ID_TRAY_AUTOSTART 1006
+#define ID_TRAY_FLIGHTREC 1007
 
 // Info Strings
 #define TOOL_NAME "MAME Bridge NetToWin"
-#define TOOL_VERSION "3.6.0"
+#define TOOL_VERSION BRIDGE_VERSION // Shared with the tools, see BridgeCore.h
 #define TOOL_AUTHOR "DJ GLiTCH"
 #define GITHUB_LINK "https://github.com/djGLiTCH/MAME-Bridge-NetToWin"
 #define REG_RUN_PATH "Software\\Microsoft\\Windows\\CurrentVersion\\Run"
@@ -70,19 +80,37 @@
 
 // --- GLOBALS ---
 HWND g_hwndGUI = NULL;      // Handle to the visible Log Window
-HWND g_hwndBridge = NULL;   // Handle to the hidden "Bridge" Window (Impersonates MAME)
+HWND g_hwndBridge = NULL;   // Handle to the hidden "Bridge" Window (Impersonates MAME), on its own thread
 HWND g_hLogCtrl = NULL;     // Handle to the text box inside the log window
 NOTIFYICONDATA g_nid;       // Struct for the System Tray Icon
 std::atomic<bool> g_running(true); // Flag to control the Network Thread loop
-std::vector<HWND> g_clients;       // List of connected clients (e.g. LEDBlinky)
-
-// --- ID MAPPING ---
-// MAME uses integer IDs for outputs (e.g., ID 10 = "lamp0").
-// Since we don't know MAME's internal IDs, we generate our own on the fly.
-std::map<std::string, LPARAM> g_nameToID; // Maps "lamp0" -> 1
-std::map<LPARAM, std::string> g_idToName; // Maps 1 -> "lamp0"
-LPARAM g_nextID = 1;
-std::string g_currentRomName = "___empty"; // Stores current game name (e.g., "pacman")
+uint64_t g_reconnectGraceMs = RECONNECT_GRACE_MS; // --grace <ms>: hold the lights this long on a drop (0 = off)
+uint64_t g_retryMaxMs = CONNECT_RETRY_MAX_MS;     // --retry-max <ms>: longest wait between connection attempts
+std::string g_priority = PRIORITY_OUTPUTS;        // --priority <patterns>: outputs sent ahead of the lamps ("none" = off)
+uint32_t g_busyPollUs = 0;                        // --busy-poll <us>: spin on recv() this long before sleeping (0 = off)
+std::string g_debounce;                           // --debounce <rules>: settle time per chattering output ("" = off)
+std::string g_hysteresis;                         // --hysteresis <rules>: smallest change passed on per output ("" = off)
+std::string g_stretch;                            // --stretch <rules>: minimum on-time per output ("" = off)
+std::string g_pwm;                                // --pwm <patterns>: outputs turned into brightness when strobing
+bool g_pwmAll = false;                            // --pwm-all: every client gets brightness, not just those that ask
+std::string g_rateCap;                            // --rate-cap <rules>: most updates per second per output ("" = off)
+std::vector<std::pair<std::string, std::string>> g_routes; // --route <program>=<patterns>: outputs a client program gets
+std::string g_transformsPath;                     // --transforms <file>: values changed per client program ("" = off)
+std::string g_virtualsPath;                       // --virtuals <file>: outputs worked out from others ("" = off)
+NotifyMode g_notifyMode = NOTIFY_TARGETED; // --notify broadcast: START/STOP to every window, like MAME
+bool g_headless = false;    // --headless: no log window, no tray icon, no log text
+bool g_stopOther = false;   // --stop: tell the running bridge to exit (how a headless one is stopped)
+DWORD g_mainThreadId = 0;   // Runs the message loop that keeps the app alive
+
+// --- SESSION CAPTURE / REPLAY (see BridgeCapture.h) ---
+std::string g_recordPath;   // --record <file>: capture everything MAME sends
+std::string g_replayPath;   // --replay <file>: play a capture instead of connecting to MAME
+double g_replaySpeed = 1.0; // --speed <N>: 1 = real time, 0 = as fast as possible
+double g_replayFrom = 0;    // --from <S>: start a compact capture S seconds in
+CaptureWriter g_capture;
+
+// --- FLIGHT RECORDER (see BridgeFlightRecorder.h) ---
+FlightRecorder g_flight;    // Last few seconds of traffic, always on
 
 // --- WINDOWS MESSAGE IDS ---
 // These are special unique IDs registered at runtime.
@@ -93,6 +121,9 @@ UINT om_mame_update_state;
 UINT om_mame_register_client;
 UINT om_mame_unregister_client;
 UINT om_mame_get_id_string;
+UINT om_bridge_stop;        // Our own: "MAMEBridgeNetToWinStop", posted when STOP_EVENT_NAME is set
+UINT om_bridge_brightness;  // Our own: "MAMEBridgeBrightness", a client opting in to brightness levels
+UINT om_bridge_full_rate;   // Our own: "MAMEBridgeFullRate", a client that keeps up with capped outputs
 
 // ==================================================================================
 //                                  HELPER FUNCTIONS
@@ -138,6 +169,44 @@ void ToggleAutostart() {
     }
 }
 
+// Reads the optional command line switches
+// (--record, --replay, --speed, --from, --grace, --retry-max, --priority, --busy-poll,
+//  --debounce, --hysteresis, --stretch, --pwm, --pwm-all, --rate-cap, --route, --transforms, --virtuals,
+//  --notify, --headless, --stop)
+void ParseCommandLine() {
+    for (int i = 1; i < __argc; i++) {
+        std::string arg = __argv[i];
+        bool hasNext = (i + 1 < __argc);
+        if (arg == "--record" && hasNext) g_recordPath = __argv[++i];
+        else if (arg == "--replay" && hasNext) g_replayPath = __argv[++i];
+        else if (arg == "--speed" && hasNext) g_replaySpeed = atof(__argv[++i]);
+        else if (arg == "--from" && hasNext) g_replayFrom = atof(__argv[++i]);
+        else if (arg == "--grace" && hasNext) g_reconnectGraceMs = strtoull(__argv[++i], NULL, 10);
+        else if (arg == "--retry-max" && hasNext) g_retryMaxMs = strtoull(__argv[++i], NULL, 10);
+        else if (arg == "--priority" && hasNext) g_priority = __argv[++i];
+        else if (arg == "--busy-poll" && hasNext) g_busyPollUs = (uint32_t)strtoul(__argv[++i], NULL, 10);
+        else if (arg == "--debounce" && hasNext) g_debounce = __argv[++i];
+        else if (arg == "--hysteresis" && hasNext) g_hysteresis = __argv[++i];
+        else if (arg == "--stretch" && hasNext) g_stretch = __argv[++i];
+        else if (arg == "--pwm" && hasNext) g_pwm = __argv[++i];
+        else if (arg == "--pwm-all") g_pwmAll = true;
+        else if (arg == "--rate-cap" && hasNext) g_rateCap = __argv[++i];
+        else if (arg == "--route" && hasNext) {
+            // "ledblinky*=lamp*,led*": the program name pattern, then the outputs
+            std::string route = __argv[++i];
+            size_t eq = route.find('=');
+            if (eq != std::string::npos) g_routes.push_back({ route.substr(0, eq), route.substr(eq + 1) });
+        }
+        else if (arg == "--transforms" && hasNext) g_transformsPath = __argv[++i];
+        else if (arg == "--virtuals" && hasNext) g_virtualsPath = __argv[++i];
+        else if (arg == "--notify" && hasNext) {
+            g_notifyMode = (std::string(__argv[++i]) == "broadcast") ? NOTIFY_BROADCAST : NOTIFY_TARGETED;
+        }
+        else if (arg == "--headless") g_headless = true;
+        else if (arg == "--stop") g_stopOther = true;
+    }
+}
+
 // Thread-safe logging helper. Sends text to the GUI thread to display.
 void Log(const std::string& msg) {
     if (g_hwndGUI) {
@@ -146,24 +215,192 @@ void Log(const std::string& msg) {
     }
 }
 
-// Manages unique IDs for output names.
-// If "lamp0" is seen for the first time, it gets a new ID (e.g. 1).
-// If "lamp0" is seen again, it returns the existing ID (1).
-LPARAM GetIDForName(const std::string& name) {
-    if (g_nameToID.find(name) == g_nameToID.end()) {
-        LPARAM newID = g_nextID++;
-        g_nameToID[name] = newID;
-        g_idToName[newID] = name;
-        
-        // Only log new items (ID < 1000 prevents startup spam if IDs reset)
-        if (newID < 1000) { 
-            std::stringstream ss;
-            ss << "[MAP] New Output: '" << name << "' -> ID " << newID;
-            Log(ss.str());
+// ==================================================================================
+//                                  WINDOWS SINK
+// ==================================================================================
+void SaveFlightRecorder(const std::string& reason);
+
+// Delivers the core's messages as native MAME window messages.
+struct Win32Sink : BridgeSink {
+    void Post(ClientHandle target, BridgeMessage msg, OutputID id, int value) override {
+        if (msg == MSG_UPDATE_STATE) PostMessage((HWND)target, om_mame_update_state, (WPARAM)id, (LPARAM)value);
+        else if (msg == MSG_MAME_START) PostMessage((HWND)target, om_mame_start, (WPARAM)g_hwndBridge, 0);
+        else if (msg == MSG_MAME_STOP) PostMessage((HWND)target, om_mame_stop, (WPARAM)g_hwndBridge, 0);
+    }
+    void Log(const std::string& msg) override { ::Log(msg); }
+    void OnUnexpectedDisconnect() override { SaveFlightRecorder("Unexpected disconnect from MAME"); }
+    void SendIDString(ClientHandle client, OutputID id) override;
+};
+
+Win32Sink g_sink;
+BridgeCore g_core(&g_sink); // Framer, parser, ID maps and client list (see BridgeCore.h)
+
+// --- ID STRING REPLIES (see BridgeIDReplies.h) ---
+// Replies are sent from their own thread, with a timeout, so a hung client can't
+// freeze the bridge window (and with it the log, the tray menu and every other client).
+IDReplyService g_idReplies;
+
+// Queues the answer to "What is the name for ID X?" for the reply thread.
+// The reply is prebuilt by the core (see BridgeIDStrings.h) and copied into the
+// request here, on the core thread. Catch-up priming uses the same path.
+void QueueIDStringReply(ClientHandle client, OutputID id) {
+    size_t size;
+    const uint8_t* reply = g_core.IDStringReply(id, size);
+    g_idReplies.queue.Push(client, id, reply, size);
+}
+
+void Win32Sink::SendIDString(ClientHandle client, OutputID id) { QueueIDStringReply(client, id); }
+
+// Sends a queued reply as a WM_COPYDATA message (reply thread).
+// This is exactly how MAME native output works.
+// Returns false if the client did not take it within timeoutMs.
+bool SendIDStringReply(const IDReplyQueue::Request& req, UINT timeoutMs) {
+    COPYDATASTRUCT copyData = { 1, (DWORD)req.size, (void*)req.Data() };
+    DWORD_PTR result;
+    return SendMessageTimeout((HWND)req.client, WM_COPYDATA, (WPARAM)g_hwndBridge, (LPARAM)&copyData,
+                              SMTO_BLOCK | SMTO_ABORTIFHUNG, timeoutMs, &result) != 0;
+}
+
+// Saves the flight recorder next to the EXE (e.g. "FlightRecorder_20240131_201500.txt")
+void SaveFlightRecorder(const std::string& reason) {
+    char exePath[MAX_PATH];
+    GetModuleFileName(NULL, exePath, MAX_PATH);
+    std::string dir = exePath;
+    dir = dir.substr(0, dir.find_last_of("\\/") + 1);
+
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", localtime(&now));
+    std::string path = dir + "FlightRecorder_" + stamp + ".txt";
+
+    if (g_core.DumpFlightRecorder(path, reason)) Log("[REC] Flight recorder saved: " + path);
+    else Log("[REC] Could not save flight recorder: " + path);
+}
+
+// ==================================================================================
+//                                  CORE MAILBOX
+// ==================================================================================
+// Only the thread feeding the core (network or replay) touches g_core. The bridge
+// window and the tray menu post their requests to g_mailbox (see BridgeMailbox.h)
+// and set g_coreWake; that thread carries them out in ServiceCore().
+BridgeMailbox g_mailbox;
+HANDLE g_coreWake = NULL;     // Auto-reset event: "the mailbox has something"
+ULONGLONG g_nextCatchUp = 0;  // When the next catch-up batch is due
+
+// Hands a request to the core thread (any thread)
+void PostToCore(BridgeCommandType type, ClientHandle client, OutputID id) {
+    if (!g_mailbox.Push({ type, client, id })) {
+        Log("[WIN] Mailbox full, request dropped.");
+        return;
+    }
+    SetEvent(g_coreWake);
+}
+
+// The file name of the program a client window belongs to (e.g. "LEDBlinky.exe")
+std::string ClientProgramName(HWND hwnd) {
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!process) return std::string();
+    char path[MAX_PATH];
+    DWORD size = MAX_PATH;
+    std::string name;
+    if (QueryFullProcessImageNameA(process, 0, path, &size)) {
+        name = path;
+        size_t slash = name.find_last_of("\\/");
+        if (slash != std::string::npos) name.erase(0, slash + 1);
+    }
+    CloseHandle(process);
+    return name;
+}
+
+// Tells the core which program a client is: it gets the route of the first --route
+// whose program pattern matches it (see BridgeCore ROUTING), and the --transforms
+// rules for that program (see BridgeCore TRANSFORMS). LEDBlinky registers again after
+// every start, so this runs often; the core ignores a route or name that did not change.
+void IdentifyClient(ClientHandle client) {
+    if (g_routes.empty() && g_core.transforms.Empty()) return;
+    std::string program = ClientProgramName((HWND)client);
+    for (const auto& route : g_routes) {
+        if (!MatchPattern(route.first.c_str(), program.c_str())) continue;
+        if (g_core.RouteIndex(client) < 0) Log("[WIN] " + program + " only gets " + route.second);
+        g_core.SetClientRoute(client, route.second);
+        break;
+    }
+    if (g_core.transforms.Empty()) return;
+    bool known = g_core.TransformIndex(client) >= 0;
+    g_core.SetClientName(client, program);
+    if (!known && g_core.TransformIndex(client) >= 0) Log("[WIN] " + program + " gets transformed values.");
+}
+
+// Carries out everything posted so far, runs the core timers that are due, and feeds
+// new clients their next catch-up batch when it is due. Core thread only.
+void ServiceCore() {
+    BridgeCommand cmd;
+    while (g_mailbox.Pop(cmd)) {
+        if (cmd.type == CMD_REGISTER) {
+            g_core.RegisterClient(cmd.client);
+            IdentifyClient(cmd.client);
+            Log("[WIN] Client Registered!");
+
+            // NOTE: We do NOT send "mame_start" here anymore.
+            // Sending "start" immediately after "register" causes LEDBlinky to
+            // register again, creating an infinite loop.
+            // Mid-game, the client is brought up to date instead (see BridgeCore CATCH-UP),
+            // a batch per tick so a big game doesn't flood its message queue.
+            if (!g_core.catchUps.empty()) Log("[WIN] Sending current state to the new client.");
         }
-        return newID;
+        else if (cmd.type == CMD_UNREGISTER) {
+            g_core.UnregisterClient(cmd.client);
+            g_idReplies.ForgetClient(cmd.client);
+            Log("[WIN] Client Unregistered");
+        }
+        else if (cmd.type == CMD_GET_ID_STRING) {
+            g_core.Record(FR_ID_REQUEST, cmd.id, 0);
+            QueueIDStringReply(cmd.client, cmd.id);
+        }
+        else if (cmd.type == CMD_BRIGHTNESS) {
+            g_core.SetBrightnessClient(cmd.client, cmd.id != 0);
+            Log(cmd.id ? "[WIN] Client asked for brightness levels." : "[WIN] Client asked for plain values.");
+        }
+        else if (cmd.type == CMD_FULL_RATE) {
+            g_core.SetFullRateClient(cmd.client, cmd.id != 0);
+            Log(cmd.id ? "[WIN] Client asked for every update." : "[WIN] Client asked for capped updates.");
+        }
+        else if (cmd.type == CMD_SAVE_FLIGHT) {
+            SaveFlightRecorder("Requested from tray menu");
+        }
+    }
+
+    g_core.RunTimers();  // Settled values, pulse ends, brightness updates, rate cap catch-ups
+
+    if (!g_core.catchUps.empty() && GetTickCount64() >= g_nextCatchUp) {
+        g_core.PumpCatchUp();
+        g_nextCatchUp = GetTickCount64() + CATCHUP_INTERVAL_MS;
+    }
+}
+
+// How long the core thread may wait before ServiceCore() is due again
+DWORD ServiceTimeout(DWORD idleMs) {
+    DWORD timeout = idleMs;
+    if (!g_core.catchUps.empty() && timeout > CATCHUP_INTERVAL_MS) timeout = CATCHUP_INTERVAL_MS;
+    uint64_t timerMs = g_core.TimerWaitMs();  // The next core timer (see BridgeCore TIMERS)
+    if (timerMs < timeout) timeout = (DWORD)timerMs;
+    return timeout;
+}
+
+// Waits (serving the mailbox) until the given time, give or take a millisecond.
+// With untilRetry it also stops as soon as a client registering asks for a
+// connection attempt (see BridgeCore IDLE).
+void ServiceCoreUntil(std::chrono::steady_clock::time_point until, bool untilRetry = false) {
+    for (;;) {
+        if (untilRetry && g_core.retryNow) break;
+        long long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            until - std::chrono::steady_clock::now()).count();
+        if (left <= 0) break;
+        WaitForSingleObject(g_coreWake, ServiceTimeout((DWORD)left));
+        ServiceCore();
     }
-    return g_nameToID[name];
 }
 
 // ==================================================================================
@@ -171,55 +408,51 @@ LPARAM GetIDForName(const std::string& name) {
 // ==================================================================================
 // This hidden window listens for messages from clients (LEDBlinky).
 // It mimics the behavior of the official MAME Output Window.
+// It runs on its own thread (see BridgeWindowThread) and hands every request to the
+// core thread (see CORE MAILBOX), so it never waits for the network or the log window.
 LRESULT CALLBACK BridgeWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
     
     // Client wants to register (e.g. LEDBlinky starting up)
     if (msg == om_mame_register_client) {
-        HWND client = (HWND)wParam;
-        g_clients.push_back(client);
-        Log("[WIN] Client Registered!");
-        
-        // NOTE: We do NOT send "mame_start" here anymore.
-        // Sending "start" immediately after "register" causes LEDBlinky to 
-        // register again, creating an infinite loop.
+        PostToCore(CMD_REGISTER, (ClientHandle)wParam, 0);
         return 1;
     }
     
     // Client is closing
     else if (msg == om_mame_unregister_client) {
-        HWND client = (HWND)wParam;
-        for (auto it = g_clients.begin(); it != g_clients.end(); ++it) {
-            if (*it == client) {
-                g_clients.erase(it);
-                break;
-            }
-        }
-        Log("[WIN] Client Unregistered");
+        PostToCore(CMD_UNREGISTER, (ClientHandle)wParam, 0);
         return 1;
     }
     
     // Client asks: "What is the name for ID X?"
     else if (msg == om_mame_get_id_string) {
-        LPARAM id = (LPARAM)lParam; // The ID they are asking about
-        std::string name = "";
-
-        // ID 0 is RESERVED for the Game Name (e.g. "pacman")
-        if (id == 0) name = g_currentRomName;
-        // Any other ID is looked up in our map
-        else if (g_idToName.count(id)) name = g_idToName[id];
-
-        // We must reply using a WM_COPYDATA message structure.
-        // This is exactly how MAME native output works.
-        struct copydata_id_string { uint32_t id; char string[1]; };
-        int dataLen = sizeof(copydata_id_string) + name.length() + 1;
-        std::vector<uint8_t> buffer(dataLen);
-        copydata_id_string* pData = (copydata_id_string*)buffer.data();
-        pData->id = (uint32_t)id;
-        strcpy(pData->string, name.c_str());
-
-        COPYDATASTRUCT copyData = { 1, (DWORD)dataLen, pData };
-        // Reply to the client window (stored in wParam)
-        SendMessage((HWND)wParam, WM_COPYDATA, (WPARAM)g_hwndBridge, (LPARAM)&copyData);
+        // We must reply using a WM_COPYDATA message structure, which has to be sent
+        // (not posted). The reply thread does that, so we can return straight away.
+        // Reply to the client window (stored in wParam), about the ID in lParam
+        PostToCore(CMD_GET_ID_STRING, (ClientHandle)wParam, (OutputID)lParam);
+        return 1;
+    }
+
+    // Client wants strobing lamps as brightness levels (lParam 1) or plain values (0).
+    // Not part of MAME's protocol: only clients written for the bridge send it.
+    else if (msg == om_bridge_brightness) {
+        PostToCore(CMD_BRIGHTNESS, (ClientHandle)wParam, (OutputID)lParam);
+        return 1;
+    }
+
+    // Client keeps up with every update of rate-capped outputs (lParam 1), or wants
+    // them capped like everybody else (0). Also only sent by clients written for it.
+    else if (msg == om_bridge_full_rate) {
+        PostToCore(CMD_FULL_RATE, (ClientHandle)wParam, (OutputID)lParam);
+        return 1;
+    }
+
+    // "MAME-Bridge-NetToWin.exe --stop" wants us gone (the only way out when headless).
+    // It sets our stop event, and StopWatchThread passes that on as this message.
+    else if (msg == om_bridge_stop) {
+        g_running = false;
+        PostThreadMessage(g_mainThreadId, WM_QUIT, 0, 0);
+        PostQuitMessage(0);
         return 1;
     }
     return DefWindowProc(hwnd, msg, wParam, lParam);
@@ -267,6 +500,7 @@ LRESULT CALLBACK GUIWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             // Build Menu
             AppendMenu(hMenu, MF_STRING, ID_TRAY_SHOW, "Show Logs");
             AppendMenu(hMenu, flags, ID_TRAY_AUTOSTART, "Autostart");
+            AppendMenu(hMenu, MF_STRING, ID_TRAY_FLIGHTREC, "Save Flight Recorder");
             AppendMenu(hMenu, MF_STRING, ID_TRAY_ABOUT, "About");
             AppendMenu(hMenu, MF_STRING, ID_TRAY_GITHUB, "GitHub");
             AppendMenu(hMenu, MF_SEPARATOR, 0, NULL);
@@ -280,6 +514,7 @@ LRESULT CALLBACK GUIWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             if (cmd == ID_TRAY_SHOW) { ShowWindow(hwnd, SW_SHOW); ShowWindow(hwnd, SW_RESTORE); }
             if (cmd == ID_TRAY_GITHUB) ShellExecute(0, 0, GITHUB_LINK, 0, 0, SW_SHOW);
             if (cmd == ID_TRAY_AUTOSTART) ToggleAutostart();
+            if (cmd == ID_TRAY_FLIGHTREC) PostToCore(CMD_SAVE_FLIGHT, 0, 0);
             
             if (cmd == ID_TRAY_ABOUT) {
                 std::string desc = LoadDescriptionFromResource();
@@ -315,78 +550,23 @@ LRESULT CALLBACK GUIWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
     return DefWindowProc(hwnd, msg, wParam, lParam);
 }
 
-// ==================================================================================
-//                              NETWORK PACKET PARSER
-// ==================================================================================
-
-// Helper: Remove invisible chars, quotes, and whitespace artifacts
-std::string CleanString(std::string input) {
-    std::string output = "";
-    for (char c : input) {
-        if (isalnum(c) || c == '_' || c == '.') {
-            output += c;
-        }
-    }
-    return output;
-}
-
-// Parses a single line from MAME (e.g., "mame_start = pacman" or "lamp0 = 1")
-void ProcessLine(std::string line) {
-    // Debug: Log Raw Line (Optional)
-    if (line.length() > 0) Log("RAW: " + line);
-
-    // Basic Trim
-    if (!line.empty() && line.back() == '\r') line.pop_back();
-    if (line.empty()) return;
-
-    size_t eqPos = line.find("=");
-    if (eqPos != std::string::npos) {
-        std::string rawName = line.substr(0, eqPos);
-        std::string rawVal = line.substr(eqPos + 1);
-
-        // CLEANING: Strip quotes and garbage characters
-        std::string name = CleanString(rawName);
-        std::string valStr = CleanString(rawVal);
-        
-        // LOGIC: Check Command Type
-
-        // 1. GAME START
-        if (name == "mame_start") {
-            g_currentRomName = valStr;
-            g_idToName[0] = g_currentRomName;
-            Log("[SYS] MAME Started. ROM: " + g_currentRomName);
-            // Broadcast START so clients know the game name changed
-            PostMessage(HWND_BROADCAST, om_mame_start, (WPARAM)g_hwndBridge, 0);
-            return;
-        }
-
-        // 2. MAME STOP (Ignore this command data)
-        // MAME sends "mame_stop = 1" on exit. We don't map this to an ID.
-        // We handle the stop event via socket disconnect instead.
-        if (name == "mame_stop") return;
-
-        // 3. GAME OUTPUT (e.g. lamp0, led1)
-        int val = std::atoi(valStr.c_str());
-        LPARAM id = GetIDForName(name);
-        
-        // Forward state change to all connected clients (LEDBlinky)
-        for (HWND client : g_clients) {
-            PostMessage(client, om_mame_update_state, (WPARAM)id, (LPARAM)val);
-        }
-    }
-}
-
 // ==================================================================================
 //                                  NETWORK THREAD
 // ==================================================================================
 // This runs in the background, connecting to MAME via TCP and reading data.
 void NetworkThread() {
     Log("[SYS] Network Thread Started. Waiting for MAME...");
+
+    if (!g_recordPath.empty()) {
+        if (g_capture.Open(g_recordPath)) Log("[CAP] Recording session to: " + g_recordPath);
+        else Log("[CAP] Could not create capture file: " + g_recordPath);
+    }
     
+    // Initialize Winsock (once: retries while MAME is away should cost nothing)
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+
     while (g_running) {
-        // Initialize Winsock
-        WSADATA wsaData;
-        WSAStartup(MAKEWORD(2, 2), &wsaData);
         SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
         sockaddr_in server = { AF_INET, htons(MAME_PORT) };
         server.sin_addr.s_addr = inet_addr(MAME_IP);
@@ -394,16 +574,10 @@ void NetworkThread() {
         // Attempt Connection
         if (connect(sock, (struct sockaddr*)&server, sizeof(server)) == 0) {
             Log("[NET] Connected to MAME!");
+            g_capture.WriteEvent(CAP_CONNECT);
 
-            // 1. RESET STATE
-            // Reset to defaults so clients are clean
-            g_currentRomName = "___empty"; 
-            g_idToName[0] = "___empty";    
-
-            // 2. FORCE START
-            // Tell Windows Clients we are live immediately (fixes LEDBlinky attach issues)
-            PostMessage(HWND_BROADCAST, om_mame_start, (WPARAM)g_hwndBridge, 0);
-            Log("[SYS] Sent Force Start Signal (___empty).");
+            // 1. RESET STATE & 2. FORCE START (see BridgeCore::OnConnect)
+            g_core.OnConnect();
 
             // 3. WAKE UP MAME
             // Send a newline to MAME to ensure it sends the initial state
@@ -411,43 +585,156 @@ void NetworkThread() {
             send(sock, wakeUp, 2, 0);
 
             // 4. READ LOOP
+            // Sleeps until MAME sends something or the mailbox is posted to, whichever
+            // comes first. The socket is non-blocking from here on: each wake-up reads
+            // everything that has arrived. With --busy-poll it spins on recv() for a
+            // while before going to sleep (see BridgeBusyPoll.h).
             char buffer[4096];
-            std::string netBuffer = ""; // Persistent buffer for fragmented packets
-            int n;
-            
-            while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
-                netBuffer.append(buffer, n);
-                size_t pos = 0;
-                
-                // CRITICAL: MAME uses '\r' (Carriage Return) as a line terminator, NOT '\n'.
-                // We must split on '\r' to correctly process messages.
-                while ((pos = netBuffer.find('\r')) != std::string::npos) {
-                    std::string line = netBuffer.substr(0, pos);
-                    ProcessLine(line);
-                    netBuffer.erase(0, pos + 1);
+            int n = 0, err = 0;
+            auto readSome = [&] {
+                n = recv(sock, buffer, sizeof(buffer), 0);
+                err = (n < 0) ? WSAGetLastError() : 0;
+                return n;
+            };
+            WSAEVENT netEvent = WSACreateEvent();
+            WSAEventSelect(sock, netEvent, FD_READ | FD_CLOSE);
+            HANDLE waits[2] = { netEvent, g_coreWake };
+            BusyPoller busyPoll;
+            busyPoll.Configure(g_busyPollUs);
+            bool open = true;
+
+            while (open) {
+                long spun = busyPoll.Spin([&]() -> long {
+                    if (readSome() > 0) return n;
+                    return (n < 0 && err == WSAEWOULDBLOCK) ? 0 : -1;
+                }, ServiceCore);
+
+                if (spun == 0) {
+                    DWORD woke = WaitForMultipleObjects(2, waits, FALSE, ServiceTimeout(INFINITE));
+                    ServiceCore();
+                    if (woke != WAIT_OBJECT_0) continue;
+                    WSAResetEvent(netEvent);
+                    if (readSome() > 0) busyPoll.OnWake();
                 }
+
+                // The mailbox and the timers are served after every read: while MAME
+                // keeps the socket busy this loop never gets back to the wait, and
+                // registrations, pulse ends or a stop request must not queue behind it
+                while (n > 0) {
+                    g_capture.WriteData(buffer, n);
+                    g_core.Feed(buffer, n);
+                    ServiceCore();
+                    if (!g_running) break;
+                    readSome();
+                }
+                // 0 = MAME closed the connection; WSAEWOULDBLOCK = nothing more for now
+                // (a break above, when shutting down, leaves err at 0 and closes it too)
+                if (n == 0 || err != WSAEWOULDBLOCK) open = false;
             }
+            WSAEventSelect(sock, NULL, 0);
+            WSACloseEvent(netEvent);
             
             // 5. DISCONNECT & CLEANUP
             Log("[NET] Disconnected from MAME.");
+            if (busyPoll.Enabled()) {
+                Log("[NET] Busy-poll: " + std::to_string(busyPoll.caught) + " of " + std::to_string(busyPoll.spins) +
+                    " spins caught data, " + std::to_string(busyPoll.wakes) + " wake-ups from sleep.");
+            }
+            g_capture.WriteEvent(CAP_DISCONNECT);
+            g_capture.Flush();
             
-            // Send STOP to clients so they turn off lights
-            PostMessage(HWND_BROADCAST, om_mame_stop, (WPARAM)g_hwndBridge, 0);
-            
-            // Clear ID maps for next run
-            g_currentRomName = "___empty";
-            g_nameToID.clear();
-            g_idToName.clear();
-            g_nextID = 1;
+            // Send STOP to clients so they turn off lights, and clear ID maps for next run
+            // (held back for the reconnect grace window if MAME didn't say goodbye)
+            g_core.OnDisconnect();
 
         } else {
-            // If connection fails, wait 2 seconds and retry
-            Sleep(2000);
+            // If connection fails, wait and retry, longer each time while MAME stays away
+            // (see BridgeCore IDLE). Clients are still served meanwhile, and one
+            // registering cuts the wait short.
+            uint64_t retryMs = g_core.NextRetryDelayMs();
+            ServiceCoreUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(retryMs), true);
+            g_core.CheckReconnectGrace();
         }
         
         // Clean up socket
         closesocket(sock);
-        WSACleanup();
+    }
+    WSACleanup();
+}
+
+// ==================================================================================
+//                                  REPLAY THREAD
+// ==================================================================================
+// Used instead of the Network Thread with --replay. Plays a recorded session to the
+// registered clients, so a field report can be reproduced without the game.
+// Raw captures play from the start; compact ones (BridgeCaptureIndex.h) can start
+// anywhere with --from.
+void PlayReplay() {
+    CaptureReader reader;
+    IndexedCapture compact;
+    bool isCompact = false;
+    if (!reader.Open(g_replayPath)) {
+        if (!compact.Open(g_replayPath)) {
+            Log("[CAP] Could not open capture file: " + g_replayPath);
+            return;
+        }
+        isCompact = true;
+    }
+
+    std::stringstream ss;
+    ss << "[CAP] Replaying " << g_replayPath << " at ";
+    if (g_replaySpeed > 0) ss << g_replaySpeed << "x speed";
+    else ss << "full speed";
+    if (isCompact && g_replayFrom > 0) ss << " from " << g_replayFrom << " s";
+    else if (g_replayFrom > 0) ss << " (--from needs a compact capture, starting at 0)";
+    Log(ss.str());
+
+    // Clients are served between records, and while waiting for the next one
+    auto onRecord = [](uint64_t) { ServiceCore(); };
+    auto waitUntil = [](std::chrono::steady_clock::time_point due) {
+        ServiceCoreUntil(due);
+        std::this_thread::sleep_until(due);  // The last fraction of a millisecond
+    };
+    uint64_t records = isCompact
+        ? ReplayCompact(compact, g_core, g_replaySpeed, (uint64_t)(g_replayFrom * 1e6), &g_running, onRecord, waitUntil)
+        : ReplayCapture(reader, g_core, g_replaySpeed, &g_running, onRecord, waitUntil);
+    Log("[CAP] Replay finished (" + std::to_string(records) + (isCompact ? " events)." : " records)."));
+}
+
+void ReplayThread() {
+    PlayReplay();
+
+    // Keep serving the clients until the bridge exits
+    while (g_running) {
+        WaitForSingleObject(g_coreWake, ServiceTimeout(INFINITE));
+        ServiceCore();
+    }
+}
+
+// ==================================================================================
+//                                BRIDGE WINDOW THREAD
+// ==================================================================================
+// The hidden "MAMEOutput" window gets a thread and message loop of its own, at high
+// priority. Clients registering or asking for names are answered straight away,
+// even while the log window repaints, the tray menu is open or an About box is up.
+void BridgeWindowThread(HANDLE ready) {
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+    g_hwndBridge = CreateWindow(BRIDGE_WINDOW_CLASS, "Bridge", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, GetModuleHandle(NULL), NULL);
+    SetEvent(ready);
+
+    MSG msg;
+    while (GetMessage(&msg, NULL, 0, 0)) DispatchMessage(&msg);
+}
+
+// ==================================================================================
+//                                 STOP WATCH THREAD
+// ==================================================================================
+// "--stop" can't look for our window: the bridge window has MAME's class name, so
+// with MAME's native output running it could find MAME instead. It sets our named
+// stop event, and this thread (asleep until then) hands it to the bridge window.
+void StopWatchThread(HANDLE stopEvent) {
+    if (WaitForSingleObject(stopEvent, INFINITE) == WAIT_OBJECT_0) {
+        PostMessage(g_hwndBridge, om_bridge_stop, 0, 0);
     }
 }
 
@@ -455,46 +742,117 @@ void NetworkThread() {
 //                                MAIN ENTRY POINT
 // ==================================================================================
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrev, LPSTR lpCmdLine, int nCmdShow) {
+    ParseCommandLine();
+    om_bridge_stop = RegisterWindowMessage("MAMEBridgeNetToWinStop");
+
+    // --stop: ask the running bridge to exit, then leave
+    if (g_stopOther) {
+        HANDLE other = OpenEvent(EVENT_MODIFY_STATE, FALSE, STOP_EVENT_NAME);
+        if (!other) return 1;  // No bridge running
+        SetEvent(other);
+        CloseHandle(other);
+        return 0;
+    }
     
     // 0. SINGLE INSTANCE CHECK
     // Ensure only one copy of this tool runs at a time using a named Mutex.
     HANDLE hMutex = CreateMutex(NULL, TRUE, "Global\\MAMEBridgeNetToWin_Mutex");
     if (GetLastError() == ERROR_ALREADY_EXISTS) {
-        MessageBox(NULL, "MAME Bridge NetToWin is already running.", "Error", MB_OK | MB_ICONERROR);
+        if (!g_headless) MessageBox(NULL, "MAME Bridge NetToWin is already running.", "Error", MB_OK | MB_ICONERROR);
         return 1;
     }
+    g_mainThreadId = GetCurrentThreadId();
 
     // 1. REGISTER WINDOW CLASSES
+    // Headless: no log window, no tray icon, and the core builds no log text
+    // (nothing would show it). The bridge status is at the top of every flight
+    // recorder file, which is still saved on an unexpected disconnect.
     WNDCLASS wcB = { 0 }; wcB.lpszClassName = BRIDGE_WINDOW_CLASS; wcB.lpfnWndProc = BridgeWndProc; wcB.hInstance = hInstance; RegisterClass(&wcB);
-    WNDCLASS wcG = { 0 }; wcG.lpszClassName = GUI_WINDOW_CLASS; wcG.lpfnWndProc = GUIWndProc; wcG.hInstance = hInstance; wcG.hIcon = LoadIcon(hInstance, "EXE_ICON"); wcG.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1); RegisterClass(&wcG);
-
-    // 2. CREATE WINDOWS
-    g_hwndBridge = CreateWindow(BRIDGE_WINDOW_CLASS, "Bridge", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, hInstance, NULL);
-    g_hwndGUI = CreateWindow(GUI_WINDOW_CLASS, TOOL_NAME, WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, 600, 400, NULL, NULL, hInstance, NULL);
-
-    // 3. SETUP TRAY ICON
-    g_nid.cbSize = sizeof(NOTIFYICONDATA); g_nid.hWnd = g_hwndGUI; g_nid.uID = ID_TRAY_APP_ICON;
-    g_nid.uFlags = NIF_ICON | NIF_MESSAGE | NIF_TIP; g_nid.uCallbackMessage = WM_SHELLNOTIFY;
-    g_nid.hIcon = wcG.hIcon; strcpy(g_nid.szTip, TOOL_NAME); Shell_NotifyIcon(NIM_ADD, &g_nid);
+    WNDCLASS wcG = { 0 };
+    if (!g_headless) {
+        wcG.lpszClassName = GUI_WINDOW_CLASS; wcG.lpfnWndProc = GUIWndProc; wcG.hInstance = hInstance; wcG.hIcon = LoadIcon(hInstance, "EXE_ICON"); wcG.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1); RegisterClass(&wcG);
+    }
 
-    // 4. REGISTER MAME MESSAGES
+    // 2. REGISTER MAME MESSAGES
     // These strings MUST match what LEDBlinky/MameHooker expect.
+    // (Before the bridge window exists: until then they would all be 0, i.e. WM_NULL.)
     om_mame_start = RegisterWindowMessage("MAMEOutputStart");
     om_mame_stop = RegisterWindowMessage("MAMEOutputStop");
     om_mame_update_state = RegisterWindowMessage("MAMEOutputUpdateState");
     om_mame_register_client = RegisterWindowMessage("MAMEOutputRegister");
     om_mame_unregister_client = RegisterWindowMessage("MAMEOutputUnregister");
     om_mame_get_id_string = RegisterWindowMessage("MAMEOutputGetIDString");
+    om_bridge_brightness = RegisterWindowMessage("MAMEBridgeBrightness");
+    om_bridge_full_rate = RegisterWindowMessage("MAMEBridgeFullRate");
+
+    // 3. CREATE WINDOWS
+    // The bridge window lives on its own thread (see BridgeWindowThread); wait until it exists
+    g_coreWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    HANDLE bridgeReady = CreateEvent(NULL, TRUE, FALSE, NULL);
+    std::thread bridgeThread(BridgeWindowThread, bridgeReady);
+    bridgeThread.detach();
+    WaitForSingleObject(bridgeReady, INFINITE);
+    CloseHandle(bridgeReady);
+    HANDLE stopEvent = CreateEvent(NULL, TRUE, FALSE, STOP_EVENT_NAME);
+    if (stopEvent) {
+        std::thread stopThread(StopWatchThread, stopEvent);
+        stopThread.detach();
+    }
+    if (!g_headless) {
+        g_hwndGUI = CreateWindow(GUI_WINDOW_CLASS, TOOL_NAME, WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, 600, 400, NULL, NULL, hInstance, NULL);
 
-    // 5. START NETWORK THREAD
-    std::thread netThread(NetworkThread);
+        // 4. SETUP TRAY ICON
+        g_nid.cbSize = sizeof(NOTIFYICONDATA); g_nid.hWnd = g_hwndGUI; g_nid.uID = ID_TRAY_APP_ICON;
+        g_nid.uFlags = NIF_ICON | NIF_MESSAGE | NIF_TIP; g_nid.uCallbackMessage = WM_SHELLNOTIFY;
+        g_nid.hIcon = wcG.hIcon; strcpy(g_nid.szTip, TOOL_NAME); Shell_NotifyIcon(NIM_ADD, &g_nid);
+    }
+
+    // 5. START NETWORK THREAD (or the Replay Thread when --replay is given)
+    g_core.logging = !g_headless;
+    g_core.recorder = &g_flight;
+    g_core.reconnectGraceMs = g_reconnectGraceMs;
+    g_core.retryMaxMs = g_retryMaxMs;
+    g_core.SetPriorityPatterns(g_priority);
+    g_core.SetDebounce(g_debounce);
+    g_core.SetHysteresis(g_hysteresis);
+    g_core.SetPulseStretch(g_stretch);
+    g_core.SetPwmPatterns(g_pwm);
+    g_core.pwmAllClients = g_pwmAll;
+    g_core.SetRateCaps(g_rateCap);
+    if (!g_transformsPath.empty()) {
+        TransformSet transforms;
+        std::string error;
+        if (transforms.Load(g_transformsPath, error)) g_core.SetTransforms(transforms);
+        else Log("[SYS] Transforms not loaded: " + error);
+    }
+    if (!g_virtualsPath.empty()) {
+        ExpressionSet virtuals;
+        std::string error;
+        if (virtuals.Load(g_virtualsPath, error)) g_core.SetVirtualOutputs(virtuals);
+        else Log("[SYS] Virtual outputs not loaded: " + error);
+    }
+    g_core.notifyMode = g_notifyMode;
+    std::thread netThread(g_replayPath.empty() ? NetworkThread : ReplayThread);
     netThread.detach();
 
-    // 6. MESSAGE LOOP (Keeps the app alive)
+    // 6. START ID STRING REPLY THREAD
+    g_idReplies.send = [](const IDReplyQueue::Request& req, uint32_t timeoutMs) {
+        return SendIDStringReply(req, timeoutMs);
+    };
+    g_idReplies.onQuarantine = [](ClientHandle client) {
+        std::stringstream ss;
+        ss << "[WIN] Client 0x" << std::hex << client << " is not answering. Pausing its ID replies.";
+        Log(ss.str());
+    };
+    std::thread replyThread([] { g_idReplies.Run(g_running); });
+    replyThread.detach();
+
+    // 7. MESSAGE LOOP (Keeps the app alive; log window and tray only)
     MSG msg;
     while (GetMessage(&msg, NULL, 0, 0)) { TranslateMessage(&msg); DispatchMessage(&msg); }
     
     // Cleanup
+    if (!g_headless) Shell_NotifyIcon(NIM_DELETE, &g_nid);
     ReleaseMutex(hMutex); CloseHandle(hMutex);
     return 0;
 }
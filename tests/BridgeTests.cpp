@@ -0,0 +1,1904 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                        MAME BRIDGE NET-TO-WIN : TESTS
+// ==================================================================================
+// Checks the portable parts of the bridge (BridgeCore.h and friends) with a
+// recording sink in place of the Windows message layer and a virtual clock in
+// place of the real one, so every run sees exactly the same thing.
+//
+// COVERED:
+//   Reconnect/*      The reconnect grace window: a hiccup with the same ROM only
+//                    sends what changed (counted against grace 0), other ROMs and
+//                    late reconnects still reset
+//   IDStrings/*      The ID string arena (BridgeIDStrings.h): every cached reply is
+//                    byte for byte what WriteIDString builds, through Set/Clear,
+//                    compaction in BeginEpoch, Reset, and the core's ROM switches
+//   IDReplies/*      The ID string reply service (BridgeIDReplies.h): repeats are
+//                    merged, quarantine and back-off on a virtual clock, and a reply
+//                    thread serving a healthy client next to one that never answers
+//   Notify/*         START/STOP delivery: windows woken by broadcasts against
+//                    targeted posts over a session of game changes and drops, and
+//                    the broadcasts still needed for discovery
+//   Idle/*           No client registered: updates only reach the ID map and the
+//                    state table, and the first client still catches up on the
+//                    right values (virtual outputs included)
+//   Stretch/*        Pulse stretching on a virtual clock: short pulses last their
+//                    minimum on-time, and a replay (raw or compact) ends them at
+//                    their own deadline, not when the next record comes along
+//   Transforms/*     Value transforms (BridgeTransforms.h): each step, chains that
+//                    go past 32 bits, numbers that do not fit, error lines, shared
+//                    programs, and a client getting its own values from the core
+//   Expressions/*    Virtual output expressions (BridgeExpressions.h): precedence,
+//                    division by zero, results too big for 64 bits, the nesting
+//                    limit on "((((" and "!!!!", and error lines
+//   Priority/*       The priority lane: solenoids go out ahead of a lamp flood in the
+//                    same packet, bulk updates are coalesced to their last value,
+//                    and a blink inside one packet still goes out both ways
+//   CatchUp/*        A client registering mid-game: it gets every lit output, each
+//                    name before its value, at most a batch per PumpCatchUp()
+//   PWM/*            PWM dimming on a virtual clock: a strobe is only detected after
+//                    PWM_MIN_EDGES switches, its duty cycle comes out as the right
+//                    level, it goes back to 0/1 when it stops, and clients that did
+//                    not ask for brightness get the 0s and 1s throughout
+//   Filter/*         Debounce and hysteresis on a virtual clock: chatter inside the
+//                    window never reaches the client, the settled value does when
+//                    the window ends, and a band drops small swings but passes
+//                    changes that reach its edges
+//   RateCap/*        The token-bucket rate cap on a virtual clock: a burst is
+//                    throttled to the cap, the final value always arrives once a
+//                    token is back, and other outputs and full-rate clients get
+//                    every update
+//   Routing/*        Per-client routes: a client with patterns only gets what matches,
+//                    one without gets everything, and the bits are set for outputs
+//                    that get their ID (or a reused one) after the route was given
+//
+// USAGE:
+//   bridgetests                    Run everything; exit code 1 if anything failed
+//   bridgetests --filter Reconnect Only run tests whose name contains "Reconnect"
+// ==================================================================================
+
+// Compile on Linux:
+// g++ -O2 -std=c++17 tests/BridgeTests.cpp -o bridgetests -pthread
+//
+// Compile with MSYS2 MINGW64:
+// g++ -O2 tests/BridgeTests.cpp -o BridgeTests.exe -static
+
+#include "../BridgeCore.h"
+#include "../BridgeIDStrings.h"
+#include "../BridgeIDReplies.h"
+#include "../BridgeCapture.h"
+#include "../BridgeCaptureIndex.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+
+// ==================================================================================
+//                                     HARNESS
+// ==================================================================================
+
+struct TestCase {
+    std::string name;
+    std::function<void()> run;
+};
+
+static std::vector<TestCase> g_tests;
+static int g_failures = 0;   // Failed checks in the current test
+
+static void Add(const std::string& name, std::function<void()> run) { g_tests.push_back({ name, run }); }
+
+// Keeps going after a failed check, so one run shows everything that is wrong
+#define CHECK(cond) do { \
+    if (!(cond)) { printf("    FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); g_failures++; } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long long a_ = (long long)(a), b_ = (long long)(b); \
+    if (a_ != b_) { printf("    FAILED %s:%d: %s == %s (%lld vs %lld)\n", __FILE__, __LINE__, #a, #b, a_, b_); g_failures++; } \
+} while (0)
+
+// ==================================================================================
+//                                   MOCK SINK
+// ==================================================================================
+// Stands in for the window layer: every post is kept, in order.
+
+struct Posted {
+    ClientHandle target;
+    BridgeMessage msg;
+    OutputID id;
+    int value;
+};
+
+struct RecordingSink : BridgeSink {
+    std::vector<Posted> posts;
+    std::vector<std::pair<ClientHandle, OutputID>> idStrings;
+
+    void Post(ClientHandle target, BridgeMessage msg, OutputID id, int value) override {
+        posts.push_back({ target, msg, id, value });
+    }
+    void SendIDString(ClientHandle client, OutputID id) override { idStrings.push_back({ client, id }); }
+
+    size_t Count(BridgeMessage msg) const {
+        size_t n = 0;
+        for (const Posted& p : posts) n += (p.msg == msg);
+        return n;
+    }
+    void Clear() { posts.clear(); idStrings.clear(); }
+};
+
+// The desktop as the window layer sees it: a broadcast wakes every top-level
+// window, a targeted post only its client
+struct DesktopSink : RecordingSink {
+    size_t topLevelWindows = 40;             // Frontend, game, tray apps, ...
+    size_t woken = 0;
+
+    void Post(ClientHandle target, BridgeMessage msg, OutputID id, int value) override {
+        RecordingSink::Post(target, msg, id, value);
+        if (msg != MSG_UPDATE_STATE) woken += (target == CLIENT_BROADCAST) ? topLevelWindows : 1;
+    }
+    size_t Broadcasts() const {
+        size_t n = 0;
+        for (const Posted& p : posts) n += (p.target == CLIENT_BROADCAST);
+        return n;
+    }
+};
+
+// A core on a virtual clock, fed whole lines as MAME would send them
+struct TestBridge {
+    RecordingSink sink;
+    BridgeCore core;
+    uint64_t nowMs = 0;
+
+    TestBridge() : core(&sink) {
+        core.logging = false;
+        core.clock = [this] { return nowMs; };
+    }
+
+    void Send(const std::string& text) { core.Feed(text.data(), text.size()); }
+    void Advance(uint64_t ms) { nowMs += ms; core.RunTimers(); }
+};
+
+// ==================================================================================
+//                                RECONNECT GRACE
+// ==================================================================================
+
+// MAME's state dump after "mame_start": every output, whether it changed or not
+static std::string StateDump(const std::string& rom, int outputs, int changed) {
+    std::string text = "mame_start = " + rom + "\r\n";
+    for (int i = 0; i < outputs; i++) {
+        text += "lamp" + std::to_string(i) + " = " + std::to_string(i < changed ? 0 : 1) + "\r\n";
+    }
+    return text;
+}
+
+// A game with 200 lit lamps drops for 1.5 s and comes back with 5 of them off.
+// Returns the messages the clients got from the drop onwards.
+static size_t ReplayHiccup(uint64_t graceMs, RecordingSink* out = NULL) {
+    TestBridge t;
+    t.core.reconnectGraceMs = graceMs;
+    t.core.RegisterClient(1);
+    t.core.OnConnect();
+    t.Send(StateDump("sf2", 200, 0));
+    t.sink.Clear();
+
+    t.core.OnDisconnect();
+    t.Advance(1500);
+    t.core.CheckReconnectGrace();
+    t.core.OnConnect();
+    t.Send(StateDump("sf2", 200, 5));
+    if (out) *out = t.sink;
+    return t.sink.posts.size();
+}
+
+static void RegisterReconnect() {
+    Add("Reconnect/same_rom_sends_only_changes", [] {
+        RecordingSink sink;
+        size_t withGrace = ReplayHiccup(RECONNECT_GRACE_MS, &sink);
+        size_t without = ReplayHiccup(0);
+
+        // No STOP, no START, and only the five lamps that went off
+        CHECK_EQ(sink.Count(MSG_MAME_STOP), 0);
+        CHECK_EQ(sink.Count(MSG_MAME_START), 0);
+        CHECK_EQ(sink.Count(MSG_UPDATE_STATE), 5);
+        for (const Posted& p : sink.posts) CHECK_EQ(p.value, 0);
+        CHECK_EQ(withGrace, 5);
+
+        // Without the grace window: STOP, forced START, START for the ROM, then all 200
+        CHECK_EQ(without, 203);
+        printf("    messages after the hiccup: %zu with grace, %zu without (%.1f%% saved)\n",
+               withGrace, without, 100.0 * (double)(without - withGrace) / (double)without);
+    });
+
+    Add("Reconnect/same_rom_keeps_ids", [] {
+        TestBridge t;
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        t.Send(StateDump("sf2", 10, 0));
+        OutputID before = t.core.nameToID["lamp7"];
+
+        t.core.OnDisconnect();
+        t.Advance(100);
+        t.core.OnConnect();
+        t.Send(StateDump("sf2", 10, 0));
+        CHECK_EQ(t.core.nameToID["lamp7"], before);
+        CHECK_EQ(t.core.reconnectsResumed, 1);
+        CHECK_EQ(t.core.updatesReconciled, 10);
+    });
+
+    Add("Reconnect/other_rom_resets", [] {
+        TestBridge t;
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        t.Send(StateDump("sf2", 10, 0));
+        t.sink.Clear();
+
+        t.core.OnDisconnect();
+        t.Advance(100);
+        t.core.OnConnect();
+        t.Send(StateDump("mk2", 10, 0));
+        CHECK_EQ(t.sink.Count(MSG_MAME_STOP), 1);
+        CHECK_EQ(t.sink.Count(MSG_UPDATE_STATE), 10);
+        CHECK_EQ(t.core.reconnectsResumed, 0);
+        CHECK(t.core.currentRomName == "mk2");
+    });
+
+    Add("Reconnect/window_runs_out", [] {
+        TestBridge t;
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        t.Send(StateDump("sf2", 10, 0));
+        t.sink.Clear();
+
+        t.core.OnDisconnect();
+        t.Advance(RECONNECT_GRACE_MS - 1);
+        t.core.CheckReconnectGrace();
+        CHECK_EQ(t.sink.Count(MSG_MAME_STOP), 0);
+        t.Advance(2);
+        t.core.CheckReconnectGrace();
+        CHECK_EQ(t.sink.Count(MSG_MAME_STOP), 1);
+        CHECK(t.core.nameToID.empty());
+    });
+
+    Add("Reconnect/clean_stop_resets", [] {
+        TestBridge t;
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        t.Send(StateDump("sf2", 10, 0));
+        t.Send("mame_stop = 1\r\n");
+        t.sink.Clear();
+
+        t.core.OnDisconnect();
+        CHECK_EQ(t.sink.Count(MSG_MAME_STOP), 1);
+        CHECK(t.core.grace == BridgeCore::GRACE_NONE);
+    });
+}
+
+// ==================================================================================
+//                                   ID STRINGS
+// ==================================================================================
+
+// The arena's reply for an ID is exactly the one built from scratch
+static bool ReplyMatches(const IDStringArena& arena, uint32_t id, const std::string& name) {
+    size_t size = 0;
+    const uint8_t* blob = arena.Get(id, size);
+    if (!blob || size != IDStringSize(name)) return false;
+    std::vector<uint8_t> expected(size);
+    WriteIDString(expected.data(), id, name);
+    return memcmp(blob, expected.data(), size) == 0;
+}
+
+static std::string LampName(int i) { return "lamp" + std::to_string(i); }
+
+static void RegisterIDStrings() {
+    Add("IDStrings/set_get_clear", [] {
+        IDStringArena arena;
+        size_t size = 0;
+        CHECK(arena.Get(3, size) == NULL);
+
+        arena.Set(0, "pacman");
+        arena.Set(3, "lamp0");
+        CHECK(ReplyMatches(arena, 0, "pacman"));
+        CHECK(ReplyMatches(arena, 3, "lamp0"));
+        CHECK(arena.Get(2, size) == NULL);
+        CHECK_EQ(arena.LiveBytes(), IDStringSize("pacman") + IDStringSize("lamp0"));
+
+        // The layout MAME uses: the ID, then the name and its 0
+        const uint8_t* blob = arena.Get(3, size);
+        CHECK_EQ(((const copydata_id_string*)blob)->id, 3);
+        CHECK(strcmp(((const copydata_id_string*)blob)->string, "lamp0") == 0);
+
+        // Replacing a name, then clearing it
+        arena.Set(0, "mspacman");
+        CHECK(ReplyMatches(arena, 0, "mspacman"));
+        arena.Clear(3);
+        arena.Clear(3);  // Twice is harmless
+        arena.Clear(99); // As is an ID it never had
+        CHECK(arena.Get(3, size) == NULL);
+        CHECK_EQ(arena.LiveBytes(), IDStringSize("mspacman"));
+    });
+
+    Add("IDStrings/blobs_stay_put", [] {
+        // A reply being sent must survive new IDs being added, chunk after chunk
+        IDStringArena arena;
+        arena.Set(1, "lamp0");
+        size_t size = 0;
+        const uint8_t* first = arena.Get(1, size);
+        for (int i = 2; i < 20000; i++) arena.Set((uint32_t)i, LampName(i));
+        CHECK(arena.Get(1, size) == first);
+        CHECK(ReplyMatches(arena, 1, "lamp0"));
+        CHECK(ReplyMatches(arena, 19999, LampName(19999)));
+        CHECK(arena.ChunkCount() > 1);
+
+        // A name longer than a chunk gets one of its own
+        std::string huge(ID_STRING_CHUNK + 100, 'x');
+        arena.Set(20000, huge);
+        CHECK(ReplyMatches(arena, 20000, huge));
+    });
+
+    Add("IDStrings/begin_epoch_compacts", [] {
+        IDStringArena arena;
+        for (int i = 1; i <= 10000; i++) arena.Set((uint32_t)i, LampName(i));
+        size_t chunksBefore = arena.ChunkCount();
+        CHECK(chunksBefore > 2);
+
+        // Not enough dead space yet: nothing moves
+        size_t size = 0;
+        const uint8_t* kept = arena.Get(10000, size);
+        arena.Clear(1);
+        arena.BeginEpoch();
+        CHECK(arena.Get(10000, size) == kept);
+        CHECK_EQ(arena.ChunkCount(), chunksBefore);
+
+        // Nine in ten cleared: the survivors are copied into fresh chunks, and the
+        // old ones are kept for one more epoch (a reply may still be going out)
+        for (int i = 1; i <= 10000; i++) if (i % 10 != 0) arena.Clear((uint32_t)i);
+        arena.BeginEpoch();
+        CHECK(arena.Get(10000, size) != kept);
+        CHECK(arena.ChunkCount() > chunksBefore);
+        for (int i = 10; i <= 10000; i += 10) CHECK(ReplyMatches(arena, (uint32_t)i, LampName(i)));
+        CHECK(arena.Get(11, size) == NULL);
+        size_t live = 0;
+        for (int i = 10; i <= 10000; i += 10) live += IDStringSize(LampName(i));
+        CHECK_EQ(arena.LiveBytes(), live);
+
+        // Next epoch: the old chunks go, the survivors need only one
+        arena.BeginEpoch();
+        CHECK_EQ(arena.ChunkCount(), 1);
+        for (int i = 10; i <= 10000; i += 10) CHECK(ReplyMatches(arena, (uint32_t)i, LampName(i)));
+    });
+
+    Add("IDStrings/reset", [] {
+        IDStringArena arena;
+        for (int i = 0; i < 5000; i++) arena.Set((uint32_t)i, LampName(i));
+        size_t chunks = arena.ChunkCount();
+        arena.Reset();
+        size_t size = 0;
+        CHECK(arena.Get(0, size) == NULL);
+        CHECK(arena.Get(4999, size) == NULL);
+        CHECK_EQ(arena.LiveBytes(), 0);
+        CHECK_EQ(arena.ChunkCount(), chunks);  // Freed at the next epoch
+
+        // The same IDs with other names
+        arena.Set(0, "galaga");
+        arena.Set(4999, "sol0");
+        CHECK(ReplyMatches(arena, 0, "galaga"));
+        CHECK(ReplyMatches(arena, 4999, "sol0"));
+        arena.BeginEpoch();
+        CHECK_EQ(arena.ChunkCount(), 1);
+        CHECK(ReplyMatches(arena, 4999, "sol0"));
+    });
+
+    Add("IDStrings/core_replies_across_games", [] {
+        // Every ID the core can be asked about, over many game switches that
+        // reclaim IDs: the cached reply is always the one BuildIDStringReply makes
+        TestBridge t;
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        int mismatches = 0;
+        for (int game = 0; game < 200; game++) {
+            std::string text = "mame_start = game" + std::to_string(game) + "\r\n";
+            for (int i = 0; i < 40; i++) text += "g" + std::to_string(game % 7) + "_out" + std::to_string(i) + " = 1\r\n";
+            t.Send(text);
+            for (OutputID id = 0; id <= t.core.nextID; id++) {
+                size_t size = 0;
+                const uint8_t* reply = t.core.IDStringReply(id, size);
+                std::vector<uint8_t> expected = t.core.BuildIDStringReply(id);
+                if (size != expected.size() || memcmp(reply, expected.data(), size) != 0) mismatches++;
+            }
+        }
+        CHECK_EQ(mismatches, 0);
+        CHECK(t.core.idsReclaimed > 0);
+        CHECK(t.core.nextID <= 81);  // Two games' worth of IDs, however many games
+
+        // After the session is reset only the ROM name (ID 0) has a name
+        t.core.stopReceived = true;
+        t.core.OnDisconnect();
+        size_t size = 0;
+        const uint8_t* reply = t.core.IDStringReply(5, size);
+        CHECK_EQ(size, IDStringSize(""));
+        CHECK_EQ(((const copydata_id_string*)reply)->id, 5);
+        CHECK_EQ(((const copydata_id_string*)reply)->string[0], 0);
+    });
+}
+
+// ==================================================================================
+//                                   ID REPLIES
+// ==================================================================================
+
+static std::vector<uint8_t> Reply(OutputID id, const std::string& name) {
+    std::vector<uint8_t> data(IDStringSize(name));
+    WriteIDString(data.data(), (uint32_t)id, name);
+    return data;
+}
+
+static void RegisterIDReplies() {
+    Add("IDReplies/queue_merges_repeats", [] {
+        IDReplyQueue queue;
+        std::vector<uint8_t> a = Reply(0, "pacman"), b = Reply(0, "galaga"), c = Reply(4, "lamp3");
+        CHECK(queue.Push(1, 0, a.data(), a.size()));
+        CHECK(queue.Push(1, 4, c.data(), c.size()));
+        CHECK(queue.Push(2, 0, a.data(), a.size()));   // Another client: its own request
+        CHECK(!queue.Push(1, 0, b.data(), b.size()));  // Asked again: merged, reply updated
+        CHECK_EQ(queue.Size(), 3);
+
+        IDReplyQueue::Request req;
+        CHECK(queue.Pop(req));
+        CHECK_EQ(req.client, 1);
+        CHECK_EQ(req.id, 0);
+        CHECK(req.size == b.size() && memcmp(req.Data(), b.data(), b.size()) == 0);
+
+        // Once taken it can be asked for again
+        CHECK(queue.Push(1, 0, a.data(), a.size()));
+
+        // Dropping a client leaves the others' requests findable
+        queue.DropClient(2);
+        CHECK_EQ(queue.Size(), 2);
+        CHECK(!queue.Push(1, 4, c.data(), c.size()));
+        CHECK(!queue.Push(1, 0, b.data(), b.size()));
+        CHECK(queue.Push(2, 0, a.data(), a.size()));
+        CHECK(queue.Pop(req));
+        CHECK_EQ(req.id, 4);
+        CHECK(queue.Pop(req));
+        CHECK(req.client == 1 && req.id == 0 && memcmp(req.Data(), b.data(), b.size()) == 0);
+        CHECK(queue.Pop(req));
+        CHECK_EQ(req.client, 2);
+        CHECK_EQ(queue.Size(), 0);
+    });
+
+    Add("IDReplies/queue_limits", [] {
+        IDReplyQueue queue;
+        std::vector<uint8_t> data = Reply(1, "lamp0");
+        int queued = 0;
+        for (int i = 0; i < ID_REPLY_QUEUE_MAX + 100; i++) queued += queue.Push(1, i, data.data(), data.size());
+        CHECK_EQ(queued, ID_REPLY_QUEUE_MAX);
+        CHECK(!queue.Push(1, 5, data.data(), data.size()));  // Still merged when full
+
+        // A long name is kept outside the request
+        IDReplyQueue other;
+        std::vector<uint8_t> longReply = Reply(7, std::string(300, 'n'));
+        other.Push(1, 7, longReply.data(), longReply.size());
+        IDReplyQueue::Request req;
+        CHECK(other.Pop(req));
+        CHECK(req.size == longReply.size() && memcmp(req.Data(), longReply.data(), longReply.size()) == 0);
+
+        // Wake() makes a waiting Pop() give up
+        other.Wake();
+        CHECK(!other.Pop(req));
+    });
+
+    Add("IDReplies/quarantine_and_backoff", [] {
+        ClientHealth health;
+        uint64_t now = 1000;
+        uint32_t timeout = 0;
+        CHECK(health.ShouldSend(9, now, timeout));
+        CHECK_EQ(timeout, ID_REPLY_TIMEOUT_MS);
+
+        // Timeouts in a row: short timeouts first, then quarantine
+        for (int i = 1; i < ID_REPLY_FAILURES; i++) {
+            CHECK(!health.OnResult(9, false, now));
+            CHECK(health.State(9) == CLIENT_PROBING);
+            CHECK(health.ShouldSend(9, now, timeout));
+            CHECK_EQ(timeout, ID_REPLY_PROBE_TIMEOUT_MS);
+        }
+        CHECK(health.OnResult(9, false, now));
+        CHECK(health.State(9) == CLIENT_QUARANTINED);
+        CHECK(!health.ShouldSend(9, now + ID_REPLY_QUARANTINE_MS - 1, timeout));
+        CHECK_EQ(health.Dropped(9), 1);
+
+        // Quarantine over: one probe, which fails, and it is back for twice as long
+        now += ID_REPLY_QUARANTINE_MS;
+        CHECK(health.ShouldSend(9, now, timeout));
+        CHECK_EQ(timeout, ID_REPLY_PROBE_TIMEOUT_MS);
+        CHECK(health.OnResult(9, false, now));
+        CHECK(!health.ShouldSend(9, now + 2 * ID_REPLY_QUARANTINE_MS - 1, timeout));
+        now += 2 * ID_REPLY_QUARANTINE_MS;
+
+        // The back-off stops growing at the limit
+        uint64_t quarantine = 4 * ID_REPLY_QUARANTINE_MS;
+        for (int i = 0; i < 20; i++) {
+            CHECK(health.ShouldSend(9, now, timeout));
+            CHECK(health.OnResult(9, false, now));
+            CHECK(!health.ShouldSend(9, now + quarantine - 1, timeout));
+            now += quarantine;
+            quarantine = std::min<uint64_t>(quarantine * 2, ID_REPLY_QUARANTINE_MAX_MS);
+        }
+        CHECK_EQ(quarantine, ID_REPLY_QUARANTINE_MAX_MS);
+
+        // Answering again: healthy, and the next quarantine starts short again
+        now += ID_REPLY_QUARANTINE_MAX_MS;
+        CHECK(health.ShouldSend(9, now, timeout));
+        CHECK(!health.OnResult(9, true, now));
+        CHECK(health.State(9) == CLIENT_HEALTHY);
+        for (int i = 0; i < ID_REPLY_FAILURES; i++) health.OnResult(9, false, now);
+        CHECK(!health.ShouldSend(9, now + ID_REPLY_QUARANTINE_MS - 1, timeout));
+        CHECK(health.ShouldSend(9, now + ID_REPLY_QUARANTINE_MS, timeout));
+
+        health.Forget(9);
+        CHECK(health.State(9) == CLIENT_HEALTHY);
+        CHECK_EQ(health.Timeouts(9), 0);
+    });
+
+    // Client 1 answers, client 2 is hung: every send to it runs into the timeout.
+    // The send is simulated, so the time the reply thread would have been blocked
+    // is added up instead of waited for.
+    struct HungPeerRun {
+        uint64_t sent = 0, timedOut = 0, dropped = 0, quarantines = 0;
+        uint64_t blockedMs = 0;                 // Time spent waiting on client 2
+        std::vector<OutputID> healthyGot;       // IDs client 1 got, in order
+    };
+    static auto runHungPeer = [](bool useHealth, int requests) {
+        HungPeerRun run;
+        IDReplyService service;
+        service.useHealth = useHealth;
+        service.send = [&run](const IDReplyQueue::Request& req, uint32_t timeoutMs) {
+            if (req.client == 2) {
+                run.blockedMs += timeoutMs;
+                return false;
+            }
+            run.healthyGot.push_back(req.id);
+            return true;
+        };
+        service.onQuarantine = [&run](ClientHandle) { run.quarantines++; };
+
+        std::vector<uint8_t> data = Reply(1, "lamp0");
+        for (int i = 1; i <= requests; i++) {
+            service.queue.Push(2, i, data.data(), data.size());
+            service.queue.Push(1, i, data.data(), data.size());
+        }
+        std::atomic<bool> running(true);
+        std::thread thread([&] { service.Run(running); });
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (service.sent + service.timedOut + service.dropped < (uint64_t)(2 * requests) &&
+               std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        running = false;
+        service.queue.Wake();
+        thread.join();
+        run.sent = service.sent;
+        run.timedOut = service.timedOut;
+        run.dropped = service.dropped;
+        return run;
+    };
+
+    Add("IDReplies/hung_peer_is_quarantined", [] {
+        HungPeerRun run = runHungPeer(true, 100);
+
+        // The healthy client gets every reply, in order
+        CHECK_EQ(run.sent, 100);
+        CHECK_EQ(run.healthyGot.size(), 100);
+        bool inOrder = true;
+        for (size_t i = 0; i < run.healthyGot.size(); i++) inOrder &= (run.healthyGot[i] == (OutputID)(i + 1));
+        CHECK(inOrder);
+
+        // The hung one costs one full timeout and two short ones, then is dropped
+        CHECK_EQ(run.timedOut, ID_REPLY_FAILURES);
+        CHECK_EQ(run.quarantines, 1);
+        CHECK_EQ(run.dropped, 100 - ID_REPLY_FAILURES);
+        CHECK_EQ(run.blockedMs, ID_REPLY_TIMEOUT_MS + (ID_REPLY_FAILURES - 1) * ID_REPLY_PROBE_TIMEOUT_MS);
+
+        HungPeerRun without = runHungPeer(false, 100);
+        CHECK_EQ(without.timedOut, 100);
+        CHECK_EQ(without.blockedMs, 100 * ID_REPLY_TIMEOUT_MS);
+        printf("    reply thread blocked by the hung client: %llu ms with health tracking, %llu ms without\n",
+               (unsigned long long)run.blockedMs, (unsigned long long)without.blockedMs);
+    });
+
+    Add("IDReplies/forget_client", [] {
+        IDReplyService service;
+        service.send = [](const IDReplyQueue::Request&, uint32_t) { return false; };
+        std::vector<uint8_t> data = Reply(1, "lamp0");
+        for (int i = 1; i <= 10; i++) service.queue.Push(2, i, data.data(), data.size());
+
+        // It unregisters while its requests are still waiting: they are dropped
+        service.ForgetClient(2);
+        CHECK_EQ(service.queue.Size(), 0);
+        std::atomic<bool> running(true);
+        std::thread thread([&] { service.Run(running); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        running = false;
+        service.queue.Wake();
+        thread.join();
+        CHECK_EQ(service.timedOut, 0);
+    });
+}
+
+// ==================================================================================
+//                                 START/STOP DELIVERY
+// ==================================================================================
+
+// Two registered clients (LEDBlinky registers twice after every START) through a
+// frontend session: 20 game changes, each after a clean exit or a ROM switch
+static DesktopSink FrontendSession(NotifyMode mode) {
+    DesktopSink sink;
+    BridgeCore core(&sink);
+    core.logging = false;
+    core.notifyMode = mode;
+    core.RegisterClient(1);
+    core.RegisterClient(2);
+    core.RegisterClient(1);
+    for (int game = 0; game < 20; game++) {
+        core.OnConnect();
+        std::string text = "mame_start = game" + std::to_string(game) + "\r\nlamp0 = 1\r\n";
+        if (game % 2 == 0) text += "mame_start = game" + std::to_string(game) + "b\r\nlamp0 = 0\r\n";
+        text += "mame_stop = 1\r\n";
+        core.Feed(text.data(), text.size());
+        core.OnDisconnect();
+    }
+    return sink;
+}
+
+static void RegisterNotify() {
+    Add("Notify/targeted_wakes_only_clients", [] {
+        DesktopSink broadcast = FrontendSession(NOTIFY_BROADCAST);
+        DesktopSink targeted = FrontendSession(NOTIFY_TARGETED);
+
+        // Per game: forced START, START (two on a ROM switch), STOP = 3 or 4 notices
+        size_t notices = 20 * 3 + 10;
+        CHECK_EQ(broadcast.Broadcasts(), notices);
+        CHECK_EQ(broadcast.woken, notices * broadcast.topLevelWindows);
+
+        // Targeted: each notice once per client (client 1 only once, though registered twice)
+        CHECK_EQ(targeted.Broadcasts(), 0);
+        CHECK_EQ(targeted.Count(MSG_MAME_START) + targeted.Count(MSG_MAME_STOP), notices * 2);
+        CHECK_EQ(targeted.woken, notices * 2);
+        CHECK_EQ(broadcast.Count(MSG_UPDATE_STATE), targeted.Count(MSG_UPDATE_STATE));
+        printf("    windows woken by START/STOP: %zu broadcast, %zu targeted\n", broadcast.woken, targeted.woken);
+    });
+
+    Add("Notify/broadcast_for_discovery", [] {
+        RecordingSink sink;
+        BridgeCore core(&sink);
+        core.logging = false;
+
+        // Nobody registered yet: a client may be waiting for MAME to appear
+        core.OnConnect();
+        CHECK_EQ(sink.posts.size(), 1);
+        CHECK_EQ(sink.posts[0].target, CLIENT_BROADCAST);
+
+        // Registered: told directly
+        core.RegisterClient(7);
+        core.Notify(MSG_MAME_START);
+        CHECK_EQ(sink.posts.back().target, 7);
+        CHECK_EQ(core.notifyTargeted, 1);
+
+        // A client left: the next notice is broadcast once (it may be waiting for
+        // the next game), then it is back to direct posts
+        core.RegisterClient(8);
+        core.UnregisterClient(8);
+        sink.Clear();
+        core.Notify(MSG_MAME_STOP);
+        core.Notify(MSG_MAME_START);
+        CHECK_EQ(sink.posts.size(), 2);
+        CHECK_EQ(sink.posts[0].target, CLIENT_BROADCAST);
+        CHECK_EQ(sink.posts[1].target, 7);
+        CHECK_EQ(core.notifyBroadcasts, 2);
+
+        // The last client gone: broadcast again
+        core.UnregisterClient(7);
+        sink.Clear();
+        core.Notify(MSG_MAME_START);
+        core.Notify(MSG_MAME_START);
+        CHECK_EQ(sink.posts[0].target, CLIENT_BROADCAST);
+        CHECK_EQ(sink.posts[1].target, CLIENT_BROADCAST);
+    });
+}
+
+// ==================================================================================
+//                                      IDLE
+// ==================================================================================
+
+// The values client 1 would show, from everything it was posted
+static std::map<OutputID, int> Shown(const RecordingSink& sink, ClientHandle client) {
+    std::map<OutputID, int> shown;
+    for (const Posted& p : sink.posts) {
+        if (p.msg == MSG_UPDATE_STATE && p.target == client) shown[p.id] = p.value;
+    }
+    return shown;
+}
+
+static void RegisterIdle() {
+    Add("Idle/no_client_only_tracks_state", [] {
+        TestBridge t;
+        t.core.SetDebounce("*door*=30");
+        t.core.SetPulseStretch("*flash*=50");
+        t.core.OnConnect();
+        t.Send("mame_start = sf2\r\nlamp0 = 1\r\ndoor0 = 1\r\nflash0 = 1\r\nflash0 = 0\r\n");
+
+        // Nothing posted, nothing filtered or timed, but the IDs and values are there
+        CHECK_EQ(t.sink.Count(MSG_UPDATE_STATE), 0);
+        CHECK_EQ(t.core.timers.Count(), 0);
+        CHECK_EQ(t.core.updatesFiltered, 0);
+        CHECK_EQ(t.core.pulsesStretched, 0);
+        CHECK_EQ(t.core.lastValue[t.core.nameToID["door0"]], 1);
+        CHECK_EQ(t.core.lastValue[t.core.nameToID["flash0"]], 0);
+
+        // The first client catches up on exactly the current state
+        t.core.RegisterClient(1);
+        while (t.core.PumpCatchUp()) {}
+        std::map<OutputID, int> shown = Shown(t.sink, 1);
+        CHECK_EQ(shown.size(), 2);
+        CHECK_EQ(shown[t.core.nameToID["lamp0"]], 1);
+        CHECK_EQ(shown[t.core.nameToID["door0"]], 1);
+
+        // From then on the filters run as usual
+        t.Send("door0 = 0\r\n");
+        CHECK_EQ(t.core.updatesFiltered, 1);
+        t.Advance(30);
+        CHECK_EQ(Shown(t.sink, 1)[t.core.nameToID["door0"]], 0);
+    });
+
+    Add("Idle/held_values_do_not_come_back", [] {
+        // A debounce is settling when the last client leaves; the output changes
+        // again while nobody is registered. The old value must not win later.
+        TestBridge t;
+        t.core.SetDebounce("*door*=30");
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        t.Send("mame_start = sf2\r\ndoor0 = 1\r\n");
+        t.Advance(40);
+        t.Send("door0 = 0\r\n");
+        CHECK_EQ(t.core.timers.Count(), 1);
+
+        t.core.UnregisterClient(1);
+        t.Send("door0 = 1\r\n");
+        CHECK_EQ(t.core.timers.Count(), 0);
+        t.Advance(100);
+        CHECK_EQ(t.core.lastValue[t.core.nameToID["door0"]], 1);
+    });
+
+    Add("Idle/virtual_outputs_caught_up", [] {
+        TestBridge t;
+        ExpressionSet set;
+        std::string error;
+        CHECK(set.Parse("any = lamp3 | lamp4\np1 = sol0 && !pause\nboth = any + p1\n", error));
+        t.core.SetVirtualOutputs(set);
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        t.Send("mame_start = sf2\r\nlamp3 = 1\r\n");
+        CHECK_EQ(Shown(t.sink, 1)[t.core.nameToID["both"]], 1);
+
+        // Changes while nobody listens: nothing evaluated until someone registers
+        t.core.UnregisterClient(1);
+        uint64_t evaluations = t.core.virtualEvaluations;
+        t.Send("lamp3 = 0\r\nsol0 = 1\r\npause = 0\r\n");
+        CHECK_EQ(t.core.virtualEvaluations, evaluations);
+        CHECK(t.core.nameToID.count("p1") == 0);
+
+        t.sink.Clear();
+        t.core.RegisterClient(2);
+        while (t.core.PumpCatchUp()) {}
+        std::map<OutputID, int> shown = Shown(t.sink, 2);
+        CHECK_EQ(shown.count(t.core.nameToID["any"]), 0);  // Now 0: not part of the catch-up
+        CHECK_EQ(shown[t.core.nameToID["p1"]], 1);
+        CHECK_EQ(shown[t.core.nameToID["both"]], 1);
+        CHECK_EQ(t.core.lastValue[t.core.nameToID["any"]], 0);
+
+        // And they carry on from there
+        t.Send("pause = 1\r\n");
+        shown = Shown(t.sink, 2);
+        CHECK_EQ(shown[t.core.nameToID["p1"]], 0);
+        CHECK_EQ(shown[t.core.nameToID["both"]], 0);
+    });
+}
+
+// ==================================================================================
+//                                PULSE STRETCHING
+// ==================================================================================
+
+// Keeps the core's clock with every update, to see when the client got it, and
+// the replay's waits (their wall-clock deadlines) so far
+struct TimedSink : RecordingSink {
+    BridgeCore* core = NULL;
+    std::vector<uint64_t> times;
+    std::vector<std::chrono::steady_clock::time_point> dues;
+    std::vector<size_t> waitsBefore;
+
+    void Post(ClientHandle target, BridgeMessage msg, OutputID id, int value) override {
+        RecordingSink::Post(target, msg, id, value);
+        times.push_back(core->NowMs());
+        waitsBefore.push_back(dues.size());
+    }
+    // Index of the n-th update of an output to a value, or -1
+    int Find(OutputID id, int value, int n = 0) const {
+        for (size_t i = 0; i < posts.size(); i++) {
+            if (posts[i].msg == MSG_UPDATE_STATE && posts[i].id == id && posts[i].value == value && n-- == 0) return (int)i;
+        }
+        return -1;
+    }
+    // Wall-clock time between two waits, in ms
+    long long WaitGapMs(size_t from, size_t to) const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(dues[to] - dues[from]).count();
+    }
+};
+
+// A raw capture with made-up timestamps (CaptureWriter takes them from the clock)
+static void WriteRawCapture(const std::string& path, const std::vector<std::pair<uint64_t, std::string>>& packets) {
+    std::string out = CAPTURE_MAGIC;
+    out.append(8, '\0');
+    auto record = [&out](uint8_t type, uint64_t timeUs, const std::string& data) {
+        out += (char)type;
+        for (int i = 0; i < 8; i++) out += (char)(timeUs >> (8 * i));
+        for (int i = 0; i < 4; i++) out += (char)((uint32_t)data.size() >> (8 * i));
+        out += data;
+    };
+    record(CAP_CONNECT, 0, "");
+    for (const auto& packet : packets) record(CAP_DATA, packet.first, packet.second);
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) return;
+    fwrite(out.data(), 1, out.size(), f);
+    fclose(f);
+}
+
+static void RegisterStretch() {
+    Add("Stretch/min_on_time", [] {
+        TestBridge t;
+        t.core.SetPulseStretch("*flash*=40");
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        t.Send("mame_start = sf2\r\n");
+        OutputID flash = 0;
+
+        // On and off within one packet: the client sees it on for 40 ms
+        t.Send("flash0 = 1\r\nflash0 = 0\r\n");
+        flash = t.core.nameToID["flash0"];
+        std::map<OutputID, int> shown = Shown(t.sink, 1);
+        CHECK_EQ(shown[flash], 1);
+        t.Advance(39);
+        CHECK_EQ(Shown(t.sink, 1)[flash], 1);
+        t.Advance(1);
+        CHECK_EQ(Shown(t.sink, 1)[flash], 0);
+        CHECK_EQ(t.core.pulsesStretched, 1);
+
+        // A pulse longer than the minimum goes through untouched
+        t.Send("flash0 = 1\r\n");
+        t.Advance(50);
+        t.Send("flash0 = 0\r\n");
+        CHECK_EQ(Shown(t.sink, 1)[flash], 0);
+        CHECK_EQ(t.core.pulsesStretched, 1);
+
+        // Back on before the held 0 went out: the client never sees it go off
+        t.sink.Clear();
+        t.Send("flash0 = 1\r\n");
+        t.Advance(5);
+        t.Send("flash0 = 0\r\n");
+        t.Advance(5);
+        t.Send("flash0 = 1\r\n");
+        t.Advance(100);
+        CHECK_EQ(t.sink.Count(MSG_UPDATE_STATE), 1);
+        CHECK_EQ(t.core.timers.Count(), 0);
+
+        // Outputs without a rule are not held
+        t.Send("lamp0 = 1\r\nlamp0 = 0\r\n");
+        CHECK_EQ(Shown(t.sink, 1)[t.core.nameToID["lamp0"]], 0);
+    });
+
+    Add("Stretch/many_pulses_one_wheel", [] {
+        // 500 outputs pulsing at once: one timer each in the shared wheel, all
+        // ending on time, in order
+        TestBridge t;
+        t.core.SetPulseStretch("*flash*=40");
+        t.core.RegisterClient(1);
+        t.core.OnConnect();
+        t.Send("mame_start = sf2\r\n");
+        for (int i = 0; i < 500; i++) {
+            std::string name = "flash" + std::to_string(i);
+            t.Send(name + " = 1\r\n" + name + " = 0\r\n");
+            t.nowMs++;
+        }
+        CHECK_EQ(t.core.timers.Count(), 40);  // Only the last 40 are still held
+        t.Advance(40);
+        CHECK_EQ(t.core.timers.Count(), 0);
+        std::map<OutputID, int> shown = Shown(t.sink, 1);
+        int lit = 0;
+        for (const auto& entry : shown) lit += entry.second;
+        CHECK_EQ(lit, 0);
+    });
+
+    // flash0 goes on at 1 ms and off at 2 ms; the next record is at 200 ms. The
+    // stretched 0 is due at 41 ms and must go out then, on the capture's clock
+    // and after the replay has waited that long. The end of the capture forgets the
+    // names, so the ID is picked up while it plays.
+    static auto watchFlash = [](BridgeCore& core, OutputID& flash) {
+        return [&core, &flash](uint64_t) {
+            auto it = core.nameToID.find("flash0");
+            if (it != core.nameToID.end()) flash = it->second;
+        };
+    };
+    static auto checkReplayTimes = [](TimedSink& sink, BridgeCore& core, OutputID flash) {
+        int on = sink.Find(flash, 1), off = sink.Find(flash, 0);
+        CHECK(on >= 0 && off > on);
+        if (on < 0 || off <= on) return;
+        CHECK_EQ(sink.times[on], 1);
+        CHECK_EQ(sink.times[off], 41);
+        CHECK_EQ(core.pulsesStretched, 1);
+        if (sink.dues.empty()) return;
+
+        // At 1x the 0 went out after waiting 40 ms past the first record, and
+        // before the wait for the 200 ms one
+        size_t before = sink.waitsBefore[off];
+        CHECK(before >= 1 && before < sink.dues.size());
+        if (before < 1 || before >= sink.dues.size()) return;
+        CHECK_EQ(sink.WaitGapMs(0, before - 1), 40);
+        CHECK_EQ(sink.WaitGapMs(0, before), 199);
+    };
+
+    // Waiting is only recorded, not done: the tests run on capture time alone
+    static auto recordWaits = [](TimedSink& sink) {
+        return [&sink](std::chrono::steady_clock::time_point due) { sink.dues.push_back(due); };
+    };
+
+    Add("Stretch/raw_replay_clock", [] {
+        std::string path = "bridgetests_replay.cap";
+        WriteRawCapture(path, { { 1000, "mame_start = sf2\rflash0 = 1\r" }, { 2000, "flash0 = 0\r" }, { 200000, "lamp0 = 1\r" } });
+        for (double speed : { 0.0, 1.0 }) {
+            TimedSink sink;
+            BridgeCore core(&sink);
+            sink.core = &core;
+            core.logging = false;
+            core.SetPulseStretch("*flash*=40");
+            core.RegisterClient(1);
+            CaptureReader reader;
+            CHECK(reader.Open(path));
+            OutputID flash = 0;
+            ReplayCapture(reader, core, speed, NULL, watchFlash(core, flash), recordWaits(sink));
+            CHECK_EQ(sink.dues.empty(), speed == 0);
+            checkReplayTimes(sink, core, flash);
+        }
+        remove(path.c_str());
+    });
+
+    Add("Stretch/compact_replay_clock", [] {
+        std::string path = "bridgetests_replay.ccap";
+        {
+            CompactWriter writer;
+            CHECK(writer.Open(path, 0));
+            writer.Connect(0);
+            writer.Start(1000, "sf2");
+            writer.Update(1000, "flash0", 1);
+            writer.Update(2000, "flash0", 0);
+            writer.Update(200000, "lamp0", 1);
+            writer.Close();
+        }
+        {
+            TimedSink sink;
+            BridgeCore core(&sink);
+            sink.core = &core;
+            core.logging = false;
+            core.SetPulseStretch("*flash*=40");
+            core.RegisterClient(1);
+            IndexedCapture capture;
+            CHECK(capture.Open(path));
+            OutputID flash = 0;
+            ReplayCompact(capture, core, 1.0, 0, NULL, watchFlash(core, flash), recordWaits(sink));
+            checkReplayTimes(sink, core, flash);
+        }
+        remove(path.c_str());
+        remove((path + ".idx").c_str());
+    });
+}
+
+// ==================================================================================
+//                                   TRANSFORMS
+// ==================================================================================
+
+// A set with one rule for every client and output; empty if it does not parse
+static TransformSet OneTransform(const std::string& steps, std::string& error) {
+    TransformSet set;
+    set.Parse("* * " + steps, error);
+    return set;
+}
+
+// The value through a single-rule set, table and steps alike
+static int Transform(const std::string& steps, int value) {
+    std::string error;
+    TransformSet set = OneTransform(steps, error);
+    CHECK(error.empty());
+    if (set.Empty()) return value;
+    return set.Apply(1, value);
+}
+
+static void RegisterTransforms() {
+    Add("Transforms/steps", [] {
+        CHECK_EQ(Transform("invert", 0), 1);
+        CHECK_EQ(Transform("invert", 7), 0);
+        CHECK_EQ(Transform("invert 255", 55), 200);
+        CHECK_EQ(Transform("invert 255", 1000), -745);               // Past the table
+        CHECK_EQ(Transform("scale 0 255 0 100", 255), 100);
+        CHECK_EQ(Transform("scale 0 255 0 100", 128), 50);           // Rounded
+        CHECK_EQ(Transform("scale 0 255 0 100", 510), 200);          // Not clamped
+        CHECK_EQ(Transform("scale 0 100 100 0", 25), 75);            // Reversed
+        CHECK_EQ(Transform("clamp 10 20", 5), 10);
+        CHECK_EQ(Transform("clamp 10 20", 15), 15);
+        CHECK_EQ(Transform("clamp 10 20", 300), 20);
+        CHECK_EQ(Transform("threshold 128", 127), 0);
+        CHECK_EQ(Transform("threshold 128", 128), 1);
+        CHECK_EQ(Transform("threshold 128", -5), 0);
+        CHECK_EQ(Transform("remap 0=3 1=2 2=1", 0), 3);
+        CHECK_EQ(Transform("remap 0=3 1=2 2=1", 2), 1);
+        CHECK_EQ(Transform("remap 0=3 1=2 2=1", 9), 9);               // Not listed
+        CHECK_EQ(Transform("remap 1000=1", 1000), 1);
+        CHECK_EQ(Transform("scale 0 255 0 100 clamp 0 50 threshold 50", 200), 1);  // Left to right
+        CHECK_EQ(Transform("threshold 1 invert", 0), 1);
+    });
+
+    Add("Transforms/wide_values", [] {
+        // The full 32-bit range on both sides: the ends are 2^32 - 1 apart
+        CHECK_EQ(Transform("scale -2147483648 2147483647 -2147483648 2147483647", 5), 5);
+        CHECK_EQ(Transform("scale -2147483648 2147483647 0 1", 2147483647), 1);
+        CHECK_EQ(Transform("scale 0 1 -2147483648 2147483647", 1), INT32_MAX);
+        CHECK_EQ(Transform("invert -2147483648", 1), INT32_MIN);     // Clamped at the end
+
+        // Chained scales past any 64-bit value: held at the limit, then clamped
+        const char* blowUp = "scale 0 1 0 2147483647 scale 0 1 0 2147483647 scale 0 1 0 2147483647";
+        CHECK_EQ(Transform(blowUp, 1000), INT32_MAX);
+        CHECK_EQ(Transform(blowUp, -1000), INT32_MIN);
+
+        // Past 32 bits between steps and back again
+        CHECK_EQ(Transform("scale 0 1 0 2000000000 scale 0 2000000000 0 1", 2), 2);
+    });
+
+    Add("Transforms/errors", [] {
+        std::vector<std::pair<std::string, std::string>> bad = {
+            { "* lamp*\n", "line 1: expected a client, an output and a transform" },
+            { "# comment\n\n* lamp* glow\n", "line 3: unknown transform 'glow'" },
+            { "* a invert\n* b scale 0 0 0 1\n", "line 2: scale needs FROM_LOW FROM_HIGH TO_LOW TO_HIGH (and FROM_LOW != FROM_HIGH)" },
+            { "* a clamp 5 1", "line 1: clamp needs LOW HIGH" },
+            { "* a threshold", "line 1: threshold needs a value" },
+            { "* a remap", "line 1: remap needs FROM=TO pairs" },
+            { "* a remap 1=x", "line 1: remap needs FROM=TO pairs, not '1=x'" },
+            { "* a clamp 0 2147483648", "line 1: '2147483648' does not fit in 32 bits" },
+            { "* a invert\n\n\n* b scale 0 1 0 99999999999", "line 4: '99999999999' does not fit in 32 bits" },
+            { "* a invert -2147483649", "line 1: '-2147483649' does not fit in 32 bits" },
+            { "* a remap 4294967297=1", "line 1: '4294967297' does not fit in 32 bits" },
+            { "* a threshold 123456789012345678901234567890", "line 1: '123456789012345678901234567890' does not fit in 32 bits" },
+        };
+        for (const auto& entry : bad) {
+            TransformSet set;
+            std::string error;
+            CHECK(!set.Parse(entry.first, error));
+            CHECK(error == entry.second);
+            if (error != entry.second) printf("    got \"%s\" for \"%s\"\n", error.c_str(), entry.first.c_str());
+            CHECK(set.Empty() && set.programs.empty());
+        }
+
+        // A number that fits, after a rule that did not, is read normally
+        TransformSet set;
+        std::string error;
+        CHECK(!set.Parse("* a clamp 0 2147483648", error));
+        CHECK(set.Parse("* a clamp 0 2147483647", error));
+    });
+
+    Add("Transforms/shared_programs", [] {
+        TransformSet set;
+        std::string error;
+        CHECK(set.Parse("*   lamp*   invert\n"
+                        "2   gauge*  scale 0 255 0 100   clamp 0 100\n"
+                        "3   lamp1   invert\n"
+                        "*   gauge*  scale  0 255  0 100 clamp 0 100   # same steps, other spacing\n"
+                        "*   mode    invert 1\n", error));
+        CHECK_EQ(set.rules.size(), 5);
+        CHECK_EQ(set.programs.size(), 3);
+        CHECK_EQ(set.rules[0].program, set.rules[2].program);
+        CHECK_EQ(set.rules[1].program, set.rules[3].program);
+        CHECK(set.rules[4].program != set.rules[0].program);
+        CHECK_EQ(set.Apply(set.rules[3].program, 255), 100);
+        CHECK_EQ(set.Apply(0, 1234), 1234);                         // No program
+    });
+
+    Add("Transforms/per_client", [] {
+        TestBridge t;
+        TransformSet set;
+        std::string error;
+        CHECK(set.Parse("1 lamp* invert\n2 gauge* scale 0 255 0 100\n", error));
+        t.core.SetTransforms(set);
+        t.core.RegisterClient(1);
+        t.core.RegisterClient(2);
+        t.core.SetClientName(1, "1");
+        t.core.SetClientName(2, "2");
+        t.core.OnConnect();
+        t.Send("mame_start = sf2\r\nlamp0 = 1\r\ngauge0 = 255\r\n");
+        OutputID lamp = t.core.nameToID["lamp0"], gauge = t.core.nameToID["gauge0"];
+        std::map<OutputID, int> one = Shown(t.sink, 1), two = Shown(t.sink, 2);
+        CHECK_EQ(one[lamp], 0);
+        CHECK_EQ(one[gauge], 255);
+        CHECK_EQ(two[lamp], 1);
+        CHECK_EQ(two[gauge], 100);
+    });
+}
+
+// ==================================================================================
+//                                  EXPRESSIONS
+// ==================================================================================
+
+// The value of "v = expression" with the inputs given by name (the rest are 0).
+// An expression that does not parse is reported and gives INT32_MIN + 1.
+static int Expression(const std::string& expression, const std::map<std::string, int>& inputs = {}) {
+    ExpressionSet set;
+    std::string error;
+    if (!set.Parse("v = " + expression, error)) {
+        printf("    \"%s\": %s\n", expression.c_str(), error.c_str());
+        CHECK(false);
+        return INT32_MIN + 1;
+    }
+    return set.Evaluate(0, [&](uint32_t slot) {
+        auto it = inputs.find(set.outputs[0].inputs[slot]);
+        return (it != inputs.end()) ? it->second : 0;
+    });
+}
+
+// The error for a file's text, "" if it parses
+static std::string ExpressionError(const std::string& text) {
+    ExpressionSet set;
+    std::string error;
+    if (set.Parse(text, error)) return "";
+    CHECK(set.Empty());
+    return error;
+}
+
+static void RegisterExpressions() {
+    Add("Expressions/precedence", [] {
+        CHECK_EQ(Expression("1 + 2 * 3"), 7);
+        CHECK_EQ(Expression("(1 + 2) * 3"), 9);
+        CHECK_EQ(Expression("1 - 2 - 3"), -4);                       // Left to right
+        CHECK_EQ(Expression("8 / 2 / 2"), 2);
+        CHECK_EQ(Expression("7 % 4 * 2"), 6);
+        CHECK_EQ(Expression("-2 * 3 + ~0"), -7);                     // Unary first
+        CHECK_EQ(Expression("!0 + !5"), 1);
+        CHECK_EQ(Expression("1 + 2 < 4"), 1);                        // Arithmetic before comparing
+        CHECK_EQ(Expression("3 < 4 == 1"), 1);                       // Comparing before equality
+        CHECK_EQ(Expression("1 | 2 ^ 3 & 1"), 1 | (2 ^ (3 & 1)));      // & before ^ before |
+        CHECK_EQ(Expression("6 & 3 == 3"), 6 & (3 == 3));            // Equality before & (as in C)
+        CHECK_EQ(Expression("0 || 1 && 0"), 0 || (1 && 0));
+        CHECK_EQ(Expression("1 | 0 && 0"), (1 | 0) && 0);
+        CHECK_EQ(Expression("0 ? 1 : 2 ? 3 : 4"), 3);                // ?: to the right
+        CHECK_EQ(Expression("x < 40 ? 1 : x > 100 ? 2 : 3", { { "x", 50 } }), 3);
+        CHECK_EQ(Expression("max(a, b) - min(a, b)", { { "a", 3 }, { "b", 10 } }), 7);
+        CHECK_EQ(Expression("sol0 && !pause", { { "sol0", 1 }, { "pause", 0 } }), 1);
+        CHECK_EQ(Expression("0x10 + lamp:1 + p1.gun_x", { { "lamp:1", 2 }, { "p1.gun_x", 3 } }), 21);
+    });
+
+    Add("Expressions/division_by_zero", [] {
+        CHECK_EQ(Expression("a / 0", { { "a", 3 } }), 0);
+        CHECK_EQ(Expression("a % 0", { { "a", 3 } }), 0);
+        CHECK_EQ(Expression("a / b + 1", { { "a", 3 } }), 1);        // b not sent yet
+        CHECK_EQ(Expression("a % (b - b)", { { "a", 3 }, { "b", 9 } }), 0);
+        CHECK_EQ(Expression("-7 / 2"), -3);                          // Rounds toward 0, as in C
+        CHECK_EQ(Expression("-7 % 2"), -1);
+    });
+
+    Add("Expressions/saturation", [] {
+        // Past 64 bits: held at the end of the range, then clamped to 32 bits
+        std::string huge = "2147483647 * 2147483647 * 2147483647";
+        CHECK_EQ(Expression(huge), INT32_MAX);
+        CHECK_EQ(Expression(huge + " * 2147483647 * 2147483647"), INT32_MAX);
+        CHECK_EQ(Expression("-" + huge + " * 4"), INT32_MIN);
+        CHECK_EQ(Expression(huge + " * -4"), INT32_MIN);
+        CHECK_EQ(Expression("(" + huge + ") - (" + huge + ")"), 0);  // Both held at the same value
+        CHECK_EQ(Expression(huge + " * 4 + " + huge + " * 4"), INT32_MAX);
+        CHECK_EQ(Expression("0 - " + huge + " * 4 - " + huge + " * 4"), INT32_MIN);
+        CHECK_EQ(Expression("-(-" + huge + " * 8) > 0"), 1);           // Negating the smallest
+        CHECK_EQ(Expression("(-" + huge + " * 8) / -1 > 0"), 1);        // ...and dividing it by -1
+        CHECK_EQ(Expression("(-" + huge + " * 8) % -1"), 0);
+        CHECK_EQ(Expression("2147483647 * 4"), INT32_MAX);
+        CHECK_EQ(Expression("2147483647 * 4 / 8"), 1073741823);        // 64 bits between steps
+    });
+
+    Add("Expressions/depth_limit", [] {
+        auto parens = [](int n) { return "v = " + std::string(n, '(') + "1" + std::string(n, ')'); };
+        auto nots = [](int n) { return "v = " + std::string(n, '!') + "x"; };
+        auto negs = [](int n) {
+            std::string text = "v = ";
+            for (int i = 0; i < n; i++) text += "- ";
+            return text + "1";
+        };
+        const std::string tooDeep = "line 1: expression nested too deep";
+
+        // Up to the limit parses; one more does not
+        CHECK(ExpressionError(parens(EXPRESSION_MAX_DEPTH - 1)).empty());
+        CHECK(ExpressionError(parens(EXPRESSION_MAX_DEPTH)) == tooDeep);
+        CHECK(ExpressionError(nots(EXPRESSION_MAX_DEPTH - 1)).empty());
+        CHECK(ExpressionError(nots(EXPRESSION_MAX_DEPTH)) == tooDeep);
+        CHECK_EQ(Expression(std::string(EXPRESSION_MAX_DEPTH - 2, '!') + "x", { { "x", 5 } }), 1);
+        CHECK_EQ(Expression(std::string(EXPRESSION_MAX_DEPTH - 1, '-') + "1"), -1);
+
+        // Far past it: stops as soon as it passes the limit, whatever the length
+        CHECK(ExpressionError(parens(1000000)) == tooDeep);
+        CHECK(ExpressionError(nots(1000000)) == tooDeep);
+        CHECK(ExpressionError(negs(1000000)) == tooDeep);
+        std::string ternaries = "v = ";
+        for (int i = 0; i < 1000000; i++) ternaries += "x ? 1 : ";
+        CHECK(ExpressionError(ternaries + "0") == tooDeep);
+        std::string maxes = "v = ";
+        for (int i = 0; i < 1000000; i++) maxes += "max(1, ";
+        CHECK(ExpressionError(maxes) == tooDeep);
+
+        // Long but flat is fine
+        std::string flat = "v = 1";
+        for (int i = 0; i < 10000; i++) flat += " + 1";
+        CHECK(ExpressionError(flat).empty());
+        CHECK_EQ(Expression(flat.substr(4)), 10001);
+    });
+
+    Add("Expressions/errors", [] {
+        std::vector<std::pair<std::string, std::string>> bad = {
+            { "v = ", "line 1: expression ends too soon" },
+            { "# comment\n\nv = (a", "line 3: expected ')'" },
+            { "v = a b", "line 1: unexpected 'b'" },
+            { "v == a", "line 1: expected NAME = EXPRESSION" },
+            { "1v = a", "line 1: '1v' is not an output name" },
+            { "v = a\nv = b", "line 2: v is defined twice" },
+            { "v = v | a", "line 1: v reads itself" },
+            { "v = w\nw = a", "line 2: v reads w, which is defined below it" },
+            { "v = a ? b", "line 1: expected ':'" },
+            { "v = max(a)", "line 1: expected ','" },
+            { "v = 99999999999", "line 1: number out of range" },
+            { "v = 1\nw = " + std::string(100, '('), "line 2: expression nested too deep" },
+        };
+        for (const auto& entry : bad) {
+            std::string error = ExpressionError(entry.first);
+            CHECK(error == entry.second);
+            if (error != entry.second) printf("    got \"%s\" for \"%s\"\n", error.c_str(), entry.first.c_str());
+        }
+    });
+}
+
+// ==================================================================================
+//                                 PRIORITY LANE
+// ==================================================================================
+
+// The updates one client was posted, in order
+static std::vector<Posted> Updates(const RecordingSink& sink, ClientHandle client) {
+    std::vector<Posted> updates;
+    for (const Posted& p : sink.posts) {
+        if (p.msg == MSG_UPDATE_STATE && p.target == client) updates.push_back(p);
+    }
+    return updates;
+}
+
+// A bridge with client 1 registered and "sf2" running
+struct GameBridge : TestBridge {
+    GameBridge() {
+        core.RegisterClient(1);
+        core.OnConnect();
+        Send("mame_start = sf2\r\n");
+        sink.Clear();
+    }
+    OutputID ID(const std::string& name) {
+        auto it = core.nameToID.find(name);
+        return (it != core.nameToID.end()) ? it->second : -1;
+    }
+};
+
+static void RegisterPriority() {
+    Add("Priority/default_patterns", [] {
+        GameBridge t;
+        t.Send("sol0 = 1\r\nsol12 = 1\r\np1_recoil = 1\r\ngun_solenoid = 1\r\nrumble0 = 1\r\n"
+               "lamp0 = 1\r\nsol = 1\r\nconsole_led = 1\r\n");
+        for (const char* name : { "sol0", "sol12", "p1_recoil", "gun_solenoid", "rumble0" }) {
+            CHECK(t.core.ClassOf(t.ID(name)) == OUTPUT_PRIORITY);
+        }
+        for (const char* name : { "lamp0", "sol", "console_led" }) {
+            CHECK(t.core.ClassOf(t.ID(name)) == OUTPUT_BULK);
+        }
+    });
+
+    Add("Priority/ahead_of_lamp_flood", [] {
+        // MAME sends 200 lamp changes with the solenoid last in the same packet
+        GameBridge t;
+        std::string packet;
+        for (int i = 0; i < 200; i++) packet += "lamp" + std::to_string(i) + " = 1\r\n";
+        packet += "sol0 = 1\r\n";
+        t.Send(packet);
+        std::vector<Posted> updates = Updates(t.sink, 1);
+        CHECK_EQ(updates.size(), 201);
+        if (updates.empty()) return;
+        CHECK_EQ(updates[0].id, t.ID("sol0"));
+        CHECK_EQ(updates[0].value, 1);
+        CHECK_EQ(updates[1].id, t.ID("lamp0"));
+        CHECK_EQ(updates.back().id, t.ID("lamp199"));
+        CHECK_EQ(t.core.priorityUpdates, 1);
+
+        // With the lane off, everything goes out in the order it came
+        GameBridge plain;
+        plain.core.SetPriorityPatterns("none");
+        plain.Send(packet);
+        updates = Updates(plain.sink, 1);
+        CHECK_EQ(updates.size(), 201);
+        if (!updates.empty()) CHECK_EQ(updates.back().id, plain.ID("sol0"));
+    });
+
+    Add("Priority/coalesce_keeps_last_value", [] {
+        GameBridge t;
+        t.Send("gauge0 = 10\r\ngauge0 = 20\r\ngauge0 = 30\r\nlamp0 = 1\r\ngauge0 = 40\r\n");
+        std::vector<Posted> updates = Updates(t.sink, 1);
+        CHECK_EQ(updates.size(), 2);
+        if (updates.size() != 2) return;
+        CHECK_EQ(updates[0].id, t.ID("gauge0"));                   // In the order first staged
+        CHECK_EQ(updates[0].value, 40);
+        CHECK_EQ(updates[1].id, t.ID("lamp0"));
+        CHECK_EQ(t.core.updatesCoalesced, 3);
+        CHECK_EQ(t.core.lastValue[t.ID("gauge0")], 40);
+
+        // Split over packets, each one goes out
+        t.sink.Clear();
+        t.Send("gauge0 = 41\r\n");
+        t.Send("gauge0 = 42\r\n");
+        CHECK_EQ(Updates(t.sink, 1).size(), 2);
+        CHECK_EQ(Shown(t.sink, 1)[t.ID("gauge0")], 42);
+    });
+
+    Add("Priority/blink_not_collapsed", [] {
+        GameBridge t;
+        t.Send("lamp0 = 0\r\n");
+        t.sink.Clear();
+
+        // 0 -> 1 -> 0 in one packet: coalescing it would show nothing at all
+        t.Send("lamp0 = 1\r\nlamp1 = 1\r\nlamp0 = 0\r\n");
+        std::vector<Posted> updates = Updates(t.sink, 1);
+        OutputID lamp0 = t.ID("lamp0");
+        std::vector<int> lamp0Values;
+        for (const Posted& p : updates) {
+            if (p.id == lamp0) lamp0Values.push_back(p.value);
+        }
+        CHECK_EQ(lamp0Values.size(), 2);
+        if (lamp0Values.size() == 2) {
+            CHECK_EQ(lamp0Values[0], 1);
+            CHECK_EQ(lamp0Values[1], 0);
+        }
+        CHECK_EQ(Shown(t.sink, 1)[lamp0], 0);
+
+        // On, off and on again: every edge goes out, ending on
+        t.sink.Clear();
+        t.Send("lamp0 = 1\r\nlamp0 = 0\r\nlamp0 = 1\r\n");
+        CHECK_EQ(Updates(t.sink, 1).size(), 3);
+        CHECK_EQ(Shown(t.sink, 1)[lamp0], 1);
+    });
+}
+
+// ==================================================================================
+//                                    CATCH-UP
+// ==================================================================================
+
+// Keeps names and updates in one list, to check which went first
+struct OrderedSink : RecordingSink {
+    struct Event { bool name; ClientHandle client; OutputID id; int value; };
+    std::vector<Event> events;
+
+    void Post(ClientHandle target, BridgeMessage msg, OutputID id, int value) override {
+        RecordingSink::Post(target, msg, id, value);
+        if (msg == MSG_UPDATE_STATE) events.push_back({ false, target, id, value });
+    }
+    void SendIDString(ClientHandle client, OutputID id) override {
+        RecordingSink::SendIDString(client, id);
+        events.push_back({ true, client, id, 0 });
+    }
+};
+
+static void RegisterCatchUp() {
+    Add("CatchUp/mid_game_client", [] {
+        OrderedSink sink;
+        BridgeCore core(&sink);
+        core.logging = false;
+        core.RegisterClient(1);
+        core.OnConnect();
+
+        // 300 outputs, a third of them off (a client assumes 0 until told otherwise)
+        std::string state = "mame_start = sf2\r\n";
+        for (int i = 0; i < 300; i++) state += "lamp" + std::to_string(i) + " = " + std::to_string(i % 3) + "\r\n";
+        core.Feed(state.data(), state.size());
+        std::map<OutputID, int> lit;
+        for (const auto& entry : core.nameToID) {
+            if (core.lastValue[entry.second] != 0) lit[entry.second] = core.lastValue[entry.second];
+        }
+        CHECK_EQ(lit.size(), 200);
+
+        // Client 2 registers: nothing goes out until the pump runs
+        sink.events.clear();
+        core.RegisterClient(2);
+        CHECK_EQ(core.catchUps.size(), 1);
+        CHECK(sink.events.empty());
+
+        // Each pump sends at most a batch; MAME keeps talking in between
+        size_t pumps = 0;
+        bool more = true;
+        while (more && pumps < 100) {
+            size_t before = sink.events.size();
+            more = core.PumpCatchUp();
+            pumps++;
+            size_t updates = 0;
+            for (size_t i = before; i < sink.events.size(); i++) updates += !sink.events[i].name;
+            CHECK(updates <= core.catchUpBatch);
+            if (pumps == 1) {
+                CHECK_EQ(updates, core.catchUpBatch);
+                std::string change = "lamp2 = 7\r\n";           // Sent already: reaches both clients
+                core.Feed(change.data(), change.size());
+                lit[core.nameToID["lamp2"]] = 7;
+            }
+        }
+        CHECK_EQ(pumps, (200 + core.catchUpBatch - 1) / core.catchUpBatch);
+        CHECK(core.catchUps.empty());
+        CHECK_EQ(core.catchUpUpdates, 200);
+
+        // Every lit output, with its current value, its name primed first
+        std::map<OutputID, bool> named;
+        bool romFirst = !sink.events.empty() && sink.events[0].name && sink.events[0].id == 0;
+        CHECK(romFirst);
+        for (const OrderedSink::Event& e : sink.events) {
+            if (e.client != 2) continue;
+            if (e.name) named[e.id] = true;
+            else CHECK(named.count(e.id));
+        }
+        std::map<OutputID, int> shown = Shown(sink, 2);
+        CHECK(shown == lit);
+        CHECK_EQ(Shown(sink, 1)[core.nameToID["lamp2"]], 7);
+    });
+
+    Add("CatchUp/not_before_a_game", [] {
+        TestBridge t;
+        t.core.OnConnect();
+        t.core.RegisterClient(1);                               // MAME is up, no game yet
+        CHECK(t.core.catchUps.empty());
+        CHECK(!t.core.PumpCatchUp());
+        CHECK(t.sink.idStrings.empty());
+    });
+}
+
+// ==================================================================================
+//                                  PWM DIMMING
+// ==================================================================================
+
+// Switches an output on for onMs and off for offMs, for totalMs
+static void Strobe(TestBridge& t, const std::string& name, uint64_t onMs, uint64_t offMs, uint64_t totalMs) {
+    for (uint64_t elapsed = 0; elapsed < totalMs; elapsed += onMs + offMs) {
+        t.Send(name + " = 1\r\n");
+        t.Advance(onMs);
+        t.Send(name + " = 0\r\n");
+        t.Advance(offMs);
+    }
+}
+
+// The brightness a duty cycle of levels/PWM_LEVELS is sent as
+static int PwmValue(int levels) { return levels * PWM_MAX_VALUE / PWM_LEVELS; }
+
+// Client 1 asked for brightness, client 2 did not; "lamp*" is watched
+struct PwmBridge : GameBridge {
+    PwmBridge() {
+        core.SetPwmPatterns("lamp*");
+        core.SetBrightnessClient(1, true);
+        core.RegisterClient(2);
+        core.catchUps.clear();
+    }
+};
+
+static void RegisterPwm() {
+    Add("PWM/detected_after_min_edges", [] {
+        PwmBridge t;
+        t.Send("lamp0 = 0\r\n");
+        OutputID lamp = t.ID("lamp0");
+        t.sink.Clear();
+        for (int edge = 1; edge < PWM_MIN_EDGES; edge++) {
+            t.Send(std::string("lamp0 = ") + (edge % 2 ? "1" : "0") + "\r\n");
+            t.Advance(5);
+        }
+        CHECK(!t.core.pwm[lamp].dimming);
+        CHECK_EQ(Updates(t.sink, 1).size(), PWM_MIN_EDGES - 1);     // Plain 0/1 so far
+        CHECK_EQ(t.core.pwmLevelsPosted, 0);
+
+        t.Send(std::string("lamp0 = ") + (PWM_MIN_EDGES % 2 ? "1" : "0") + "\r\n");
+        CHECK(t.core.pwm[lamp].dimming);
+        CHECK_EQ(t.core.pwmLevelsPosted, 0);
+        t.Advance(1);
+        CHECK_EQ(t.core.pwmLevelsPosted, 1);                        // The first level goes out at the next tick
+
+        // A blinker switching a few times a second never counts as strobing
+        PwmBridge slow;
+        Strobe(slow, "lamp1", 250, 250, 3000);
+        CHECK(!slow.core.pwm[slow.ID("lamp1")].dimming);
+        CHECK_EQ(slow.core.pwmLevelsPosted, 0);
+        CHECK_EQ(Updates(slow.sink, 1).size(), 12);
+    });
+
+    Add("PWM/duty_cycle_levels", [] {
+        // 25% on: 4 of 16 steps
+        PwmBridge t;
+        Strobe(t, "lamp0", 4, 12, 1000);
+        OutputID lamp = t.ID("lamp0");
+        CHECK(t.core.pwm[lamp].dimming);
+        CHECK_EQ(Shown(t.sink, 1)[lamp], PwmValue(4));
+        CHECK_EQ(t.core.pwm[lamp].level, 4);
+
+        // 75% on: 12 of 16 steps, once the window has moved on
+        Strobe(t, "lamp0", 12, 4, 1000);
+        CHECK_EQ(Shown(t.sink, 1)[lamp], PwmValue(12));
+
+        // Every update client 1 got while dimming was a level (the first one low, as
+        // the window still held the time before the strobe), at most one per interval
+        std::vector<Posted> updates = Updates(t.sink, 1);
+        size_t levels = 0;
+        for (size_t i = PWM_MIN_EDGES - 1; i < updates.size(); i++) {  // After the plain 0/1s
+            bool level = false;
+            for (int k = 1; k <= PWM_LEVELS; k++) level = level || updates[i].value == PwmValue(k);
+            CHECK(level);
+            levels++;
+        }
+        CHECK(levels <= 2000 / PWM_INTERVAL_MS + 1);
+        CHECK_EQ(levels, t.core.pwmLevelsPosted);
+    });
+
+    Add("PWM/back_to_plain_values", [] {
+        PwmBridge t;
+        Strobe(t, "lamp0", 8, 8, 500);
+        OutputID lamp = t.ID("lamp0");
+        CHECK(t.core.pwm[lamp].dimming);
+        CHECK_EQ(Shown(t.sink, 1)[lamp], PwmValue(8));
+
+        // It stays on: once the window holds no more switches it is a plain 1 again
+        t.Send("lamp0 = 1\r\n");
+        t.Advance(PWM_WINDOW_MS + PWM_INTERVAL_MS);
+        CHECK(!t.core.pwm[lamp].dimming);
+        CHECK_EQ(Shown(t.sink, 1)[lamp], 1);
+        CHECK_EQ(t.core.timers.Count(), 0);
+
+        // ...and the next switch goes straight out
+        t.sink.Clear();
+        t.Send("lamp0 = 0\r\n");
+        CHECK_EQ(Updates(t.sink, 1).size(), 1);
+        CHECK_EQ(Shown(t.sink, 1)[lamp], 0);
+    });
+
+    Add("PWM/plain_clients_get_raw_values", [] {
+        PwmBridge t;
+        Strobe(t, "lamp0", 4, 12, 1000);
+        OutputID lamp = t.ID("lamp0");
+        CHECK(t.core.pwm[lamp].dimming);
+
+        // Client 2 got every switch, and nothing but 0 and 1
+        std::vector<Posted> updates = Updates(t.sink, 2);
+        CHECK_EQ(updates.size(), 2 * (1000 / 16 + 1));
+        int expect = 1;
+        for (const Posted& p : updates) {
+            CHECK_EQ(p.value, expect);
+            expect = !expect;
+        }
+        CHECK(t.core.pwmUpdatesHeld > 0);                           // ...which client 1 did not
+
+        // A client that drops out of brightness gets the plain value at once
+        t.sink.Clear();
+        t.core.SetBrightnessClient(1, false);
+        CHECK_EQ(Shown(t.sink, 1)[lamp], t.core.lastValue[lamp]);
+        t.Send("lamp0 = 1\r\n");
+        CHECK_EQ(Shown(t.sink, 1)[lamp], 1);
+    });
+}
+
+// ==================================================================================
+//                                 OUTPUT FILTERS
+// ==================================================================================
+
+// The values client 1 got for one output, in order
+static std::vector<int> ValuesOf(const RecordingSink& sink, OutputID id) {
+    std::vector<int> values;
+    for (const Posted& p : Updates(sink, 1)) {
+        if (p.id == id) values.push_back(p.value);
+    }
+    return values;
+}
+
+static void RegisterFilter() {
+    Add("Filter/debounce_drops_chatter", [] {
+        GameBridge t;
+        t.core.SetDebounce("*door*=30");
+        t.Send("door0 = 1\r\n");
+        OutputID door = t.ID("door0");
+        CHECK(ValuesOf(t.sink, door).empty());                      // Even the first value settles
+        t.Advance(30);
+        CHECK(ValuesOf(t.sink, door) == std::vector<int>({ 1 }));
+
+        // The motor chatters and ends up where it was: the client never hears of it
+        t.sink.Clear();
+        for (int value : { 0, 1, 0, 1, 0, 1 }) {
+            t.Send("door0 = " + std::to_string(value) + "\r\n");
+            t.Advance(3);
+        }
+        t.Advance(100);
+        CHECK(ValuesOf(t.sink, door).empty());
+        CHECK_EQ(t.core.timers.Count(), 0);
+        CHECK_EQ(t.core.lastValue[door], 1);
+
+        // Undebounced outputs go straight through
+        t.Send("lamp0 = 1\r\n");
+        CHECK_EQ(Shown(t.sink, 1)[t.ID("lamp0")], 1);
+    });
+
+    Add("Filter/debounce_sends_settled_value", [] {
+        GameBridge t;
+        t.core.SetDebounce("*door*=30");
+        t.Send("door0 = 1\r\n");
+        t.Advance(30);
+        OutputID door = t.ID("door0");
+        t.sink.Clear();
+
+        // It chatters and settles on 0: that goes out 30 ms after the last change
+        for (int value : { 0, 1, 0, 1, 0 }) {
+            t.Send("door0 = " + std::to_string(value) + "\r\n");
+            t.Advance(5);
+        }
+        t.Advance(24);
+        CHECK(ValuesOf(t.sink, door).empty());
+        t.Advance(1);
+        CHECK(ValuesOf(t.sink, door) == std::vector<int>({ 0 }));
+        CHECK_EQ(t.core.updatesDebounced, 2);
+
+        // A value that keeps being repeated settles from when it first came
+        t.sink.Clear();
+        t.Send("door0 = 2\r\n");
+        for (int i = 0; i < 5; i++) {
+            t.Advance(5);
+            t.Send("door0 = 2\r\n");
+        }
+        t.Advance(5);
+        CHECK(ValuesOf(t.sink, door) == std::vector<int>({ 2 }));
+    });
+
+    Add("Filter/hysteresis_band", [] {
+        GameBridge t;
+        t.core.SetHysteresis("*gauge*=4");
+        t.Send("gauge0 = 100\r\n");
+        OutputID gauge = t.ID("gauge0");
+
+        // Swings inside the band around what the client has are dropped...
+        for (int value : { 102, 98, 103, 97, 101 }) t.Send("gauge0 = " + std::to_string(value) + "\r\n");
+        CHECK(ValuesOf(t.sink, gauge) == std::vector<int>({ 100 }));
+
+        // ...one that reaches an edge goes out, and the band moves with it
+        t.Send("gauge0 = 104\r\n");
+        t.Send("gauge0 = 101\r\n");
+        t.Send("gauge0 = 100\r\n");
+        t.Send("gauge0 = 96\r\n");
+        CHECK(ValuesOf(t.sink, gauge) == std::vector<int>({ 100, 104, 100, 96 }));
+
+        // A slow drift is measured from the client's value, so it still gets through
+        t.sink.Clear();
+        for (int value = 97; value <= 100; value++) t.Send("gauge0 = " + std::to_string(value) + "\r\n");
+        CHECK(ValuesOf(t.sink, gauge) == std::vector<int>({ 100 }));
+
+        // Going to or from 0 always counts
+        t.Send("gauge0 = 0\r\n");
+        t.Send("gauge0 = 2\r\n");
+        CHECK(ValuesOf(t.sink, gauge) == std::vector<int>({ 100, 0, 2 }));
+        CHECK_EQ(t.core.updatesFiltered, 5 + 1 + 3);
+    });
+}
+
+// ==================================================================================
+//                                   RATE CAPS
+// ==================================================================================
+
+// An output sent 10 times a millisecond for "ms", counting up from "from"; the
+// other output, if named, changes along with it
+static void Flood(TestBridge& t, const std::string& name, int from, int ms, const std::string& other = "") {
+    int value = from;
+    for (int i = 0; i < ms; i++) {
+        for (int k = 0; k < 10; k++, value++) {
+            t.Send(name + " = " + std::to_string(value) + "\r\n");
+            if (!other.empty()) t.Send(other + " = " + std::to_string(value) + "\r\n");
+        }
+        t.Advance(1);
+    }
+}
+
+static void RegisterRateCap() {
+    Add("RateCap/burst_is_throttled", [] {
+        // 100 a second: a token every 10 ms, RATE_CAP_BURST saved up
+        GameBridge t;
+        t.core.SetRateCaps("flood*=100");
+        Flood(t, "flood0", 1, 100);                                 // 1000 updates in 100 ms
+        OutputID flood = t.ID("flood0");
+        size_t got = ValuesOf(t.sink, flood).size();
+        CHECK(got >= 10 + RATE_CAP_BURST - 1);
+        CHECK(got <= 10 + RATE_CAP_BURST + 1);
+        CHECK_EQ(t.core.rateHeldUpdates + got - t.core.rateCatchUps, 1000);  // Held, passed or caught up on
+
+        // Every update the client got was one MAME sent, in order
+        std::vector<int> values = ValuesOf(t.sink, flood);
+        for (size_t i = 1; i < values.size(); i++) CHECK(values[i] > values[i - 1]);
+    });
+
+    Add("RateCap/final_value_arrives", [] {
+        GameBridge t;
+        t.core.SetRateCaps("flood*=100");
+        Flood(t, "flood0", 1, 100);
+        OutputID flood = t.ID("flood0");
+
+        // The burst ends with the bucket empty: the last value comes with the next token
+        t.Advance(10);
+        CHECK(!t.core.rate[flood].held);
+        CHECK_EQ(Shown(t.sink, 1)[flood], 1000);
+        CHECK(t.core.rateCatchUps >= 1);
+
+        // ...and nothing more after that
+        size_t got = ValuesOf(t.sink, flood).size();
+        t.Advance(1000);
+        CHECK_EQ(ValuesOf(t.sink, flood).size(), got);
+        CHECK_EQ(t.core.timers.Count(), 0);
+
+        // A single change after a quiet spell goes straight out
+        t.Send("flood0 = 5\r\n");
+        CHECK_EQ(Shown(t.sink, 1)[flood], 5);
+
+        // A new game catches the client up on a held output at once
+        for (int value = 2000; value < 2020; value++) t.Send("flood0 = " + std::to_string(value) + "\r\n");
+        CHECK(t.core.rate[flood].held);
+        CHECK(Shown(t.sink, 1)[flood] != 2019);
+        t.Send("mame_start = mk2\r\n");
+        CHECK_EQ(Shown(t.sink, 1)[flood], 2019);
+    });
+
+    Add("RateCap/uncapped_unaffected", [] {
+        GameBridge t;
+        t.core.SetRateCaps("flood*=100");
+        t.core.RegisterClient(2);
+        t.core.SetFullRateClient(2, true);
+        Flood(t, "flood0", 1, 100, "lamp0");
+        OutputID flood = t.ID("flood0"), lamp = t.ID("lamp0");
+
+        // The uncapped output reached client 1 every time, the full-rate client
+        // got every update of both
+        CHECK_EQ(ValuesOf(t.sink, lamp).size(), 1000);
+        size_t fullRate = 0;
+        for (const Posted& p : Updates(t.sink, 2)) fullRate += (p.id == flood);
+        CHECK_EQ(fullRate, 1000);
+        CHECK(ValuesOf(t.sink, flood).size() < 20);
+        CHECK(t.core.rate.size() <= (size_t)flood + 1);             // No bucket for lamp0
+        CHECK(!t.core.RateCapped(lamp));
+    });
+}
+
+// ==================================================================================
+//                                    ROUTING
+// ==================================================================================
+
+// The names of the outputs a client was sent
+static std::vector<std::string> NamesSent(const RecordingSink& sink, const BridgeCore& core, ClientHandle client) {
+    std::vector<std::string> names;
+    for (const Posted& p : Updates(sink, client)) names.push_back(core.GetNameForID(p.id));
+    return names;
+}
+
+static void RegisterRouting() {
+    Add("Routing/only_matching_outputs", [] {
+        GameBridge t;
+        t.core.RegisterClient(2);
+        t.core.RegisterClient(3);
+        t.core.catchUps.clear();
+        t.core.SetClientRoute(1, "lamp*");
+        t.core.SetClientRoute(2, "*recoil*;sol?*");
+        t.Send("lamp0 = 1\r\nsol0 = 1\r\np1_recoil = 1\r\ngauge0 = 7\r\nlamp1 = 1\r\n");
+
+        CHECK(NamesSent(t.sink, t.core, 1) == std::vector<std::string>({ "lamp0", "lamp1" }));
+        std::vector<std::string> two = NamesSent(t.sink, t.core, 2);
+        std::sort(two.begin(), two.end());
+        CHECK(two == std::vector<std::string>({ "p1_recoil", "sol0" }));
+        CHECK_EQ(NamesSent(t.sink, t.core, 3).size(), 5);          // No route: everything
+        CHECK_EQ(t.core.updatesUnrouted, 3 + 3);
+
+        // Taking the route away gives the client everything again
+        t.sink.Clear();
+        t.core.SetClientRoute(1, "");
+        t.Send("gauge0 = 8\r\n");
+        CHECK(NamesSent(t.sink, t.core, 1) == std::vector<std::string>({ "gauge0" }));
+    });
+
+    Add("Routing/bits_for_later_ids", [] {
+        // The route is given before any output has an ID
+        TestBridge t;
+        t.core.RegisterClient(1);
+        t.core.SetClientRoute(1, "lamp*");
+        t.core.OnConnect();
+        t.Send("mame_start = sf2\r\n");
+
+        // 200 outputs, past several 64-bit words; one lamp among them
+        std::string packet;
+        for (int i = 0; i < 199; i++) packet += "gauge" + std::to_string(i) + " = 1\r\n";
+        packet += "lamp0 = 1\r\n";
+        t.Send(packet);
+        CHECK(NamesSent(t.sink, t.core, 1) == std::vector<std::string>({ "lamp0" }));
+        CHECK(t.core.routes[0].wants.size() >= 200 / 64);
+
+        // Two games on, lamp0's ID is reclaimed and handed to another output: its bit
+        // must not follow the number
+        OutputID lampID = t.core.nameToID["lamp0"];
+        t.Send("mame_start = mk2\r\nmame_start = ssf2\r\n");
+        std::string other;
+        for (int i = 0; i < 200; i++) other += "door" + std::to_string(i) + " = 1\r\n";
+        t.sink.Clear();
+        t.Send(other);
+        CHECK(t.core.GetNameForID(lampID).compare(0, 4, "door") == 0);
+        CHECK(Updates(t.sink, 1).empty());
+        t.Send("lamp5 = 1\r\n");
+        CHECK(NamesSent(t.sink, t.core, 1) == std::vector<std::string>({ "lamp5" }));
+    });
+
+    Add("Routing/catch_up_follows_route", [] {
+        GameBridge t;
+        t.Send("lamp0 = 1\r\ngauge0 = 9\r\nlamp1 = 1\r\n");
+        t.core.RegisterClient(2);
+        t.core.SetClientRoute(2, "lamp*");
+        while (t.core.PumpCatchUp()) {}
+        std::vector<std::string> names = NamesSent(t.sink, t.core, 2);
+        CHECK(names == std::vector<std::string>({ "lamp0", "lamp1" }));
+    });
+}
+
+// ==================================================================================
+//                                      MAIN
+// ==================================================================================
+
+int main(int argc, char** argv) {
+    std::string filter;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) filter = argv[++i];
+        else {
+            printf("Usage: bridgetests [--filter TEXT]\n");
+            return 1;
+        }
+    }
+
+    RegisterReconnect();
+    RegisterIDStrings();
+    RegisterIDReplies();
+    RegisterNotify();
+    RegisterIdle();
+    RegisterStretch();
+    RegisterTransforms();
+    RegisterExpressions();
+    RegisterPriority();
+    RegisterCatchUp();
+    RegisterPwm();
+    RegisterFilter();
+    RegisterRateCap();
+    RegisterRouting();
+
+    int run = 0, failed = 0;
+    for (const TestCase& test : g_tests) {
+        if (!filter.empty() && test.name.find(filter) == std::string::npos) continue;
+        printf("%s\n", test.name.c_str());
+        g_failures = 0;
+        test.run();
+        run++;
+        if (g_failures) failed++;
+    }
+    printf("\n%d tests, %d failed\n", run, failed);
+    return failed ? 1 : 0;
+}
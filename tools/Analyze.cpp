@@ -0,0 +1,403 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                     MAME BRIDGE NET-TO-WIN : CAPTURE ANALYZER
+// ==================================================================================
+// Crunches a whole directory of session captures (collected from many cabinets) and
+// reports, per ROM:
+//   - Every output the game drives, with its update count and average rate
+//   - Burst peaks: the most updates seen in one 10 ms window (whole ROM) and in one
+//     second (per output)
+//   - A histogram of the values each output took (lamp 0/1, PWM levels, etc.)
+//
+// Every capture is played through the bridge core itself (BridgeCore.h: the same
+// framer, parser and ID mapping the live bridge uses), so the numbers match what
+// the bridge would have done with that traffic, quirks included.
+//
+// Files are spread over all cores with a small work-stealing pool: each worker
+// has its own queue and takes work from the others when it runs dry, so one huge
+// capture does not leave the other cores idle. Per-file results are merged in
+// file order, so the report is the same whatever the thread count.
+//
+// USAGE:
+//   analyze <dir or file>... [--threads N] [--top N]
+//       Both raw (.cap) and compact (.ccap) captures are read; directories are
+//       searched recursively. --top limits the outputs listed per ROM (default all).
+// ==================================================================================
+
+// Compile on Linux:
+// g++ -O2 -std=c++17 tools/Analyze.cpp -o analyze -pthread
+//
+// Compile with MSYS2 MINGW64:
+// g++ -O2 -std=c++17 tools/Analyze.cpp -o Analyze.exe -static
+
+#include "../BridgeCore.h"
+#include "../BridgeCapture.h"
+#include "../BridgeCompactCapture.h"
+#include "../BridgeCaptureIndex.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <filesystem>
+#include <cstdio>
+#include <cstdlib>
+
+// --- CONFIGURATION ---
+#define BURST_WINDOW_US 10000     // ROM burst peak window (10 ms, under one frame)
+#define RATE_WINDOW_US 1000000    // Per-output peak rate window (1 second)
+#define HISTOGRAM_VALUES 32       // Distinct values kept per output, the rest count as "other"
+#define HISTOGRAM_PRINT 6         // Most common values shown in the report
+
+typedef std::chrono::steady_clock Clock;
+
+// ==================================================================================
+//                                    STATISTICS
+// ==================================================================================
+
+struct OutputStats {
+    uint64_t updates = 0;
+    int minValue = 0, maxValue = 0;
+    uint64_t peakPerSecond = 0;
+    std::map<int, uint64_t> histogram;
+    uint64_t otherValues = 0;     // Updates whose value did not fit in the histogram
+
+    // Window tracking while a capture is being read
+    uint64_t windowStart = 0, windowCount = 0;
+
+    void Add(uint64_t timeUs, int value) {
+        if (updates == 0) minValue = maxValue = value;
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+        updates++;
+        AddToHistogram(value, 1);
+
+        if (windowCount == 0 || timeUs - windowStart >= RATE_WINDOW_US) {
+            windowStart = timeUs;
+            windowCount = 0;
+        }
+        peakPerSecond = std::max(peakPerSecond, ++windowCount);
+    }
+
+    void AddToHistogram(int value, uint64_t count) {
+        auto it = histogram.find(value);
+        if (it != histogram.end()) it->second += count;
+        else if (histogram.size() < HISTOGRAM_VALUES) histogram[value] = count;
+        else otherValues += count;
+    }
+
+    void Merge(const OutputStats& o) {
+        if (o.updates == 0) return;
+        if (updates == 0) { minValue = o.minValue; maxValue = o.maxValue; }
+        minValue = std::min(minValue, o.minValue);
+        maxValue = std::max(maxValue, o.maxValue);
+        updates += o.updates;
+        peakPerSecond = std::max(peakPerSecond, o.peakPerSecond);
+        for (const auto& h : o.histogram) AddToHistogram(h.first, h.second);
+        otherValues += o.otherValues;
+    }
+};
+
+struct RomStats {
+    uint64_t files = 0, sessions = 0, updates = 0;
+    uint64_t activeUs = 0;        // Time between "mame_start" and the end of the game
+    uint64_t peakBurst = 0;       // Most updates in one BURST_WINDOW_US
+    std::map<std::string, OutputStats> outputs;
+
+    uint64_t burstStart = 0, burstCount = 0;
+
+    void Merge(const RomStats& o) {
+        files += o.files;
+        sessions += o.sessions;
+        updates += o.updates;
+        activeUs += o.activeUs;
+        peakBurst = std::max(peakBurst, o.peakBurst);
+        for (const auto& out : o.outputs) outputs[out.first].Merge(out.second);
+    }
+};
+
+struct FileResult {
+    bool ok = false;
+    uint64_t bytes = 0;
+    std::map<std::string, RomStats> roms;
+};
+
+// ==================================================================================
+//                                  ANALYSIS SINK
+// ==================================================================================
+// Registered with the core as its only client. Every update the bridge would post
+// is attributed to the ROM that was running at the time.
+struct AnalyzeSink : BridgeSink {
+    BridgeCore* core = NULL;
+    FileResult* result = NULL;
+    uint64_t nowUs = 0;           // Capture time of the bytes being fed
+
+    RomStats* rom = NULL;         // ROM currently running (NULL before "mame_start")
+    uint64_t romStartUs = 0;
+    std::vector<OutputStats*> byID;  // Cache: output ID -> stats of the current ROM
+
+    void Post(ClientHandle /*target*/, BridgeMessage msg, OutputID id, int value) override {
+        if (msg == MSG_MAME_START) {
+            EndGame();
+            if (core->currentRomName == "___empty") return;  // Sent on connect, before any game
+            rom = &result->roms[core->currentRomName];
+            rom->sessions++;
+            romStartUs = nowUs;
+        }
+        else if (msg == MSG_MAME_STOP) {
+            EndGame();
+        }
+        else if (rom) {
+            if ((size_t)id >= byID.size()) byID.resize((size_t)id + 1, NULL);
+            if (!byID[id]) byID[id] = &rom->outputs[core->GetNameForID(id)];
+            byID[id]->Add(nowUs, value);
+
+            rom->updates++;
+            if (rom->burstCount == 0 || nowUs - rom->burstStart >= BURST_WINDOW_US) {
+                rom->burstStart = nowUs;
+                rom->burstCount = 0;
+            }
+            rom->peakBurst = std::max(rom->peakBurst, ++rom->burstCount);
+        }
+    }
+
+    void EndGame() {
+        if (rom) rom->activeUs += nowUs - romStartUs;
+        rom = NULL;
+        byID.clear();
+    }
+};
+
+// Plays one capture (raw or compact) through a private core
+static FileResult AnalyzeFile(const std::string& path) {
+    FileResult result;
+    AnalyzeSink sink;
+    BridgeCore core(&sink);
+    sink.core = &core;
+    sink.result = &result;
+    core.RegisterClient(1);
+    core.clock = [&sink] { return sink.nowUs / 1000; };  // Grace window on capture time
+
+    CaptureReader raw;
+    CompactReader compact;
+    if (raw.Open(path)) {
+        CaptureRecord rec;
+        result.bytes = raw.FileSize();
+        while (raw.Next(rec)) {
+            sink.nowUs = rec.timeUs;
+            core.CheckReconnectGrace();
+            if (rec.type == CAP_CONNECT) core.OnConnect();
+            else if (rec.type == CAP_DATA) core.Feed(rec.data, rec.length);
+            else if (rec.type == CAP_DISCONNECT) core.OnDisconnect();
+        }
+    }
+    else if (compact.Open(path)) {
+        // Compact captures hold already-parsed events; they are turned back into
+        // MAME's packets so they take the same path through the core
+        CompactEvent ev;
+        CompactPacketFeeder feeder(core);
+        result.bytes = compact.FileSize();
+        while (compact.Next(ev)) {
+            if (feeder.Ends(ev)) feeder.Flush();  // On the packet's own time
+            sink.nowUs = ev.timeUs;
+            core.CheckReconnectGrace();
+            feeder.Add(ev, compact);
+        }
+        feeder.Flush();
+    }
+    else {
+        return result;
+    }
+
+    // A capture cut short mid-game still counts the game up to its last event
+    core.CheckReconnectGrace(true);
+    sink.EndGame();
+    for (auto& r : result.roms) r.second.files = 1;
+    result.ok = true;
+    return result;
+}
+
+// ==================================================================================
+//                               WORK-STEALING POOL
+// ==================================================================================
+// Each worker owns a queue and takes jobs from its back. A worker with an empty
+// queue steals from the front of another's, where the biggest jobs were dealt.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int threads) : m_queues(threads) {}
+
+    // Jobs are dealt round-robin; give them largest first for the best balance
+    void Add(std::function<void()> job) {
+        Queue& q = m_queues[m_next++ % m_queues.size()];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.jobs.push_back(std::move(job));
+    }
+
+    // Runs every job and returns when all are done. Returns the jobs stolen.
+    uint64_t Run() {
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < m_queues.size(); i++) workers.emplace_back([this, i] { Work(i); });
+        for (std::thread& t : workers) t.join();
+        return m_stolen;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+    };
+    std::vector<Queue> m_queues;
+    size_t m_next = 0;
+    std::atomic<uint64_t> m_stolen{0};
+
+    void Work(size_t self) {
+        std::function<void()> job;
+        while (Take(self, job)) job();
+    }
+
+    // A worker runs its own jobs in the order dealt (largest first); a thief takes
+    // from the other end, the smallest job left, so the big files stay spread out
+    bool Take(size_t self, std::function<void()>& job) {
+        {
+            Queue& q = m_queues[self];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty()) {
+                job = std::move(q.jobs.front());
+                q.jobs.pop_front();
+                return true;
+            }
+        }
+        // No jobs are added once Run() starts, so all queues empty means done
+        for (size_t i = 1; i < m_queues.size(); i++) {
+            Queue& q = m_queues[(self + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty()) {
+                job = std::move(q.jobs.back());
+                q.jobs.pop_back();
+                m_stolen++;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// ==================================================================================
+//                                     REPORT
+// ==================================================================================
+
+static void PrintReport(const std::map<std::string, RomStats>& roms, size_t top) {
+    for (const auto& r : roms) {
+        const RomStats& rom = r.second;
+        double secs = rom.activeUs / 1e6;
+        printf("\n=== %s ===\n", r.first.c_str());
+        printf("Files: %llu   Games: %llu   Play time: %.1f s   Outputs: %llu\n",
+               (unsigned long long)rom.files, (unsigned long long)rom.sessions, secs,
+               (unsigned long long)rom.outputs.size());
+        printf("Updates: %llu (%.1f/s average, peak %llu in %d ms)\n", (unsigned long long)rom.updates,
+               secs > 0 ? rom.updates / secs : 0.0, (unsigned long long)rom.peakBurst, BURST_WINDOW_US / 1000);
+
+        // Busiest outputs first
+        std::vector<const std::pair<const std::string, OutputStats>*> order;
+        for (const auto& o : rom.outputs) order.push_back(&o);
+        std::stable_sort(order.begin(), order.end(), [](const auto* a, const auto* b) {
+            return a->second.updates > b->second.updates;
+        });
+        if (top > 0 && order.size() > top) order.resize(top);
+
+        printf("  %-24s %10s %9s %8s %11s  %s\n", "output", "updates", "avg/s", "peak/s", "range", "values (count)");
+        for (const auto* o : order) {
+            const OutputStats& s = o->second;
+            std::vector<std::pair<int, uint64_t>> values(s.histogram.begin(), s.histogram.end());
+            std::stable_sort(values.begin(), values.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+            std::string hist;
+            for (size_t i = 0; i < values.size() && i < HISTOGRAM_PRINT; i++) {
+                hist += std::to_string(values[i].first) + "(" + std::to_string(values[i].second) + ") ";
+            }
+            if (values.size() > HISTOGRAM_PRINT || s.otherValues) hist += "...";
+
+            std::string range = std::to_string(s.minValue) + ".." + std::to_string(s.maxValue);
+            printf("  %-24s %10llu %9.2f %8llu %11s  %s\n", o->first.c_str(), (unsigned long long)s.updates,
+                   secs > 0 ? s.updates / secs : 0.0, (unsigned long long)s.peakPerSecond, range.c_str(), hist.c_str());
+        }
+    }
+}
+
+// ==================================================================================
+//                                      MAIN
+// ==================================================================================
+
+static bool IsCapture(const std::filesystem::path& p) {
+    return p.extension() == ".cap" || p.extension() == ".ccap";
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> files;
+    int threads = (int)std::thread::hardware_concurrency();
+    size_t top = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasNext = (i + 1 < argc);
+        if (arg == "--threads" && hasNext) threads = atoi(argv[++i]);
+        else if (arg == "--top" && hasNext) top = (size_t)atoi(argv[++i]);
+        else if (std::filesystem::is_directory(arg)) {
+            for (const auto& e : std::filesystem::recursive_directory_iterator(arg)) {
+                if (e.is_regular_file() && IsCapture(e.path())) files.push_back(e.path().string());
+            }
+        }
+        else files.push_back(arg);
+    }
+    if (files.empty()) {
+        fprintf(stderr, "Usage: analyze <dir or file>... [--threads N] [--top N]\n");
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    std::sort(files.begin(), files.end());
+
+    // Deal the biggest files first so no core is left with a giant one at the end
+    std::vector<size_t> order(files.size());
+    std::vector<uintmax_t> sizes(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        order[i] = i;
+        std::error_code ec;
+        sizes[i] = std::filesystem::file_size(files[i], ec);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    std::vector<FileResult> results(files.size());
+    WorkStealingPool pool(threads);
+    for (size_t i : order) pool.Add([&, i] { results[i] = AnalyzeFile(files[i]); });
+
+    Clock::time_point start = Clock::now();
+    uint64_t stolen = pool.Run();
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // Merge in file order, so the report does not depend on scheduling
+    std::map<std::string, RomStats> roms;
+    uint64_t bytes = 0, analyzed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!results[i].ok) {
+            fprintf(stderr, "Skipped %s (not a capture)\n", files[i].c_str());
+            continue;
+        }
+        analyzed++;
+        bytes += results[i].bytes;
+        for (const auto& r : results[i].roms) roms[r.first].Merge(r.second);
+    }
+
+    PrintReport(roms, top);
+    fprintf(stderr, "\nAnalyzed %llu files (%.1f MB) on %d threads in %.3f s (%.1f MB/s, %llu jobs stolen)\n",
+            (unsigned long long)analyzed, bytes / 1e6, threads, secs, secs > 0 ? bytes / 1e6 / secs : 0.0,
+            (unsigned long long)stolen);
+    return analyzed ? 0 : 1;
+}
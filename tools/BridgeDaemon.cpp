@@ -0,0 +1,457 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                     MAME BRIDGE NET-TO-WIN : CONSOLE DAEMON
+// ==================================================================================
+// The bridge core (BridgeCore.h) as a Linux console program, for testing the
+// headless build without Windows: it connects to MAME (or tools/LoadGen), reconnects
+// like the bridge does, and delivers to simulated clients instead of windows.
+//
+// By default it runs like "MAME-Bridge-NetToWin.exe --headless": no log text is
+// built at all. --gui-log runs the log pipeline of the windowed build instead
+// (every line formatted, handed to a second thread and appended to a text buffer
+// the size of the log window), so the two can be compared.
+//
+// When it exits (Ctrl+C, or after --duration) it prints the bridge status and what
+// it cost: CPU time per update, peak memory and how often it woke up (left alone
+// with MAME closed, that should be rarely). "kill -USR1 <pid>" prints the status
+// while it runs.
+//
+// --latency measures how long each update took to reach the clients, from the
+// moment its packet came out of recv(), and prints a histogram for each output class
+// (see PRIORITY LANE in BridgeCore.h). A real PostMessage costs about a microsecond;
+// --post-ns makes every simulated post take that long, so a flood of lamps costs
+// what it would on Windows. Against "loadgen --stamp" it also prints how long each
+// batch took from LoadGen's send() to the clients, wake-up included.
+//
+// --busy-poll spins on recv() for up to that many microseconds before sleeping, like
+// the bridge's --busy-poll (see BridgeBusyPoll.h); compare the latency and the CPU
+// time with and without it.
+//
+// --stretch sets minimum on-times for short pulses, like the bridge's --stretch (see
+// PULSE STRETCHING in BridgeCore.h). --pwm turns strobing outputs into brightness
+// levels for the first --pwm-clients clients (default all, see PWM DIMMING).
+// --debounce and --hysteresis filter chattering outputs (see OUTPUT FILTERS).
+// --rate-cap caps the updates per second of matching outputs for the first
+// --cap-clients clients (default all, see RATE CAPS). --route "2=*recoil*" only sends
+// client 2 the matching outputs (see ROUTING). --transforms reads value transforms
+// from a file, with the clients named "1", "2" and so on (see TRANSFORMS), and
+// --virtuals reads outputs worked out from others (see VIRTUAL OUTPUTS). Filters, caps, pulses and brightness
+// run on core timers, which the receive loop serves by sleeping in poll() only until
+// the next one is due.
+//
+// USAGE:
+//   bridgedaemon [--ip ADDR] [--port N] [--clients N] [--duration S] [--grace MS]
+//                [--retry-max MS] [--priority LIST] [--gui-log] [--verbose]
+//                [--latency] [--post-ns N] [--busy-poll US] [--stretch RULES]
+//                [--pwm LIST] [--pwm-clients N] [--debounce RULES] [--hysteresis RULES]
+//                [--rate-cap RULES] [--cap-clients N] [--route N=LIST ...] [--transforms FILE]
+//                [--virtuals FILE]
+//       --verbose prints the log to the console (implies building it).
+//       --priority sets the priority output patterns ("none" = every update in order).
+// ==================================================================================
+
+// Compile on Linux:
+// g++ -O2 -std=c++17 tools/BridgeDaemon.cpp -o bridgedaemon -pthread
+//
+// Linux only: on Windows, run the bridge itself with --headless.
+
+#include "../BridgeCore.h"
+#include "../BridgeBusyPoll.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+// --- CONFIGURATION ---
+#define MAME_IP "127.0.0.1"
+#define MAME_PORT 8000
+#define LOG_WINDOW_CHARS 30000  // What the log window's EDIT control holds by default
+
+static volatile sig_atomic_t g_stop = 0;
+static volatile sig_atomic_t g_statusWanted = 0;
+
+static void OnSignal(int sig) {
+    if (sig == SIGUSR1) g_statusWanted = 1;
+    else g_stop = 1;
+}
+
+// ==================================================================================
+//                                   DAEMON SINK
+// ==================================================================================
+// Counts what the clients would receive. With --gui-log, log lines take the same
+// trip as in the windowed bridge: a heap copy per line, posted to another thread,
+// appended to the log text.
+struct DaemonSink : BridgeSink {
+    typedef std::chrono::steady_clock Clock;
+
+    uint64_t posts = 0;
+    bool guiLog = false;
+    bool verbose = false;
+
+    // --latency: nanoseconds from recv() to the post, per OutputClass
+    const BridgeCore* core = NULL;
+    bool latency = false;
+    int postNs = 0;
+    Clock::time_point packetTime;
+    bool inPacket = false;                    // Posts outside Feed() (pulse ends) are not timed
+    std::vector<uint32_t> latencyNs[2];
+    OutputID stampId = 0;                     // "loadgen_stamp", once it has an ID
+    std::vector<uint32_t> stampNs;            // LoadGen send() to post
+
+    std::mutex logMutex;
+    std::condition_variable logReady;
+    std::deque<std::string*> logQueue;
+    std::string logText;
+    bool logDone = false;
+
+    void Post(ClientHandle /*target*/, BridgeMessage msg, OutputID id, int value) override {
+        posts++;
+        if (postNs > 0) {
+            Clock::time_point until = Clock::now() + std::chrono::nanoseconds(postNs);
+            while (Clock::now() < until) {}
+        }
+        if (latency && inPacket && msg == MSG_UPDATE_STATE) {
+            uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - packetTime).count();
+            latencyNs[core->ClassOf(id)].push_back((uint32_t)std::min<uint64_t>(ns, UINT32_MAX));
+            if (id == stampId) {
+                uint64_t nowUs = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                    Clock::now().time_since_epoch()).count();
+                uint64_t us = (nowUs - (uint64_t)value) & 0x7fffffff;
+                stampNs.push_back((uint32_t)std::min<uint64_t>(us * 1000, UINT32_MAX));
+            }
+        }
+    }
+
+    void Log(const std::string& msg) override {
+        if (verbose) printf("%s\n", msg.c_str());
+        if (!guiLog) return;
+        std::string* pMsg = new std::string(msg);
+        {
+            std::lock_guard<std::mutex> lock(logMutex);
+            logQueue.push_back(pMsg);
+        }
+        logReady.notify_one();
+    }
+
+    // Stands in for the GUI thread's WM_APPEND_LOG handling
+    void LogWindowThread() {
+        std::unique_lock<std::mutex> lock(logMutex);
+        while (true) {
+            logReady.wait(lock, [this] { return logDone || !logQueue.empty(); });
+            if (logQueue.empty()) return;
+            std::string* pStr = logQueue.front();
+            logQueue.pop_front();
+            lock.unlock();
+            logText += *pStr + "\r\n";
+            if (logText.size() > LOG_WINDOW_CHARS) logText.erase(0, logText.size() - LOG_WINDOW_CHARS);
+            delete pStr;
+            lock.lock();
+        }
+    }
+};
+
+static void PrintStatus(const BridgeCore& core) {
+    printf("Status: %s\n", core.Status().ToString().c_str());
+    fflush(stdout);
+}
+
+// Prints the latency histogram of one output class
+static void PrintLatency(const char* name, std::vector<uint32_t>& ns) {
+    if (ns.empty()) {
+        printf("Latency %-8s no updates\n", name);
+        return;
+    }
+    std::sort(ns.begin(), ns.end());
+    double p50 = ns[ns.size() / 2] / 1e3;
+    double p99 = ns[std::min(ns.size() - 1, ns.size() * 99 / 100)] / 1e3;
+    printf("Latency %-8s %zu updates, median %.1f us, p99 %.1f us, max %.1f us\n", name, ns.size(), p50, p99, ns.back() / 1e3);
+
+    static const uint32_t limitsUs[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+    size_t from = 0;
+    for (size_t b = 0; b <= sizeof(limitsUs) / sizeof(limitsUs[0]) && from < ns.size(); b++) {
+        bool last = (b == sizeof(limitsUs) / sizeof(limitsUs[0]));
+        size_t to = last ? ns.size() : (size_t)(std::lower_bound(ns.begin(), ns.end(), limitsUs[b] * 1000) - ns.begin());
+        if (to == from) continue;
+        double share = 100.0 * (to - from) / ns.size();
+        if (last) printf("  >= %4u us %9zu %5.1f%% ", limitsUs[b - 1], to - from, share);
+        else printf("  <  %4u us %9zu %5.1f%% ", limitsUs[b], to - from, share);
+        printf("%s\n", std::string((size_t)(share / 2.5 + 0.5), '#').c_str());
+        from = to;
+    }
+}
+
+// Peak and current resident memory from /proc (kB)
+static void ReadMemory(long& peakKb, long& currentKb) {
+    peakKb = currentKb = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) return;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) peakKb = atol(line + 6);
+        else if (strncmp(line, "VmRSS:", 6) == 0) currentKb = atol(line + 6);
+    }
+    fclose(f);
+}
+
+// ==================================================================================
+//                                MAIN ENTRY POINT
+// ==================================================================================
+int main(int argc, char** argv) {
+    std::string ip = MAME_IP;
+    int port = MAME_PORT, clients = 1;
+    unsigned duration = 0;
+    uint64_t graceMs = RECONNECT_GRACE_MS, retryMaxMs = CONNECT_RETRY_MAX_MS;
+    std::string priority = PRIORITY_OUTPUTS;
+    std::string stretch, pwm, debounce, hysteresis, rateCap, transformsPath, virtualsPath;
+    int pwmClients = -1, capClients = -1;
+    std::vector<std::pair<int, std::string>> routes;
+    uint32_t busyPollUs = 0;
+    DaemonSink sink;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasNext = (i + 1 < argc);
+        if (arg == "--ip" && hasNext) ip = argv[++i];
+        else if (arg == "--port" && hasNext) port = atoi(argv[++i]);
+        else if (arg == "--clients" && hasNext) clients = atoi(argv[++i]);
+        else if (arg == "--duration" && hasNext) duration = (unsigned)atoi(argv[++i]);
+        else if (arg == "--grace" && hasNext) graceMs = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--retry-max" && hasNext) retryMaxMs = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--priority" && hasNext) priority = argv[++i];
+        else if (arg == "--gui-log") sink.guiLog = true;
+        else if (arg == "--verbose") sink.verbose = true;
+        else if (arg == "--latency") sink.latency = true;
+        else if (arg == "--post-ns" && hasNext) sink.postNs = atoi(argv[++i]);
+        else if (arg == "--busy-poll" && hasNext) busyPollUs = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (arg == "--stretch" && hasNext) stretch = argv[++i];
+        else if (arg == "--pwm" && hasNext) pwm = argv[++i];
+        else if (arg == "--pwm-clients" && hasNext) pwmClients = atoi(argv[++i]);
+        else if (arg == "--debounce" && hasNext) debounce = argv[++i];
+        else if (arg == "--hysteresis" && hasNext) hysteresis = argv[++i];
+        else if (arg == "--rate-cap" && hasNext) rateCap = argv[++i];
+        else if (arg == "--cap-clients" && hasNext) capClients = atoi(argv[++i]);
+        else if (arg == "--route" && hasNext && strchr(argv[i + 1], '=')) {
+            std::string route = argv[++i];
+            routes.push_back({ atoi(route.c_str()), route.substr(route.find('=') + 1) });
+        }
+        else if (arg == "--transforms" && hasNext) transformsPath = argv[++i];
+        else if (arg == "--virtuals" && hasNext) virtualsPath = argv[++i];
+        else {
+            printf("Usage: bridgedaemon [--ip ADDR] [--port N] [--clients N] [--duration S] [--grace MS]\n"
+                   "                    [--retry-max MS] [--priority LIST] [--gui-log] [--verbose]\n"
+                   "                    [--latency] [--post-ns N] [--busy-poll US] [--stretch RULES]\n"
+                   "                    [--pwm LIST] [--pwm-clients N] [--debounce RULES] [--hysteresis RULES]\n"
+                   "                    [--rate-cap RULES] [--cap-clients N] [--route N=LIST ...]\n"
+                   "                    [--transforms FILE] [--virtuals FILE]\n");
+            return 1;
+        }
+    }
+
+    // No SA_RESTART: a signal must break recv() and sleep so the loops see it
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    if (duration) alarm(duration);
+
+    BridgeCore core(&sink);
+    core.logging = sink.guiLog || sink.verbose;
+    core.reconnectGraceMs = graceMs;
+    core.retryMaxMs = retryMaxMs;
+    core.SetPriorityPatterns(priority);
+    core.SetDebounce(debounce);
+    core.SetHysteresis(hysteresis);
+    core.SetPulseStretch(stretch);
+    core.SetPwmPatterns(pwm);
+    core.SetRateCaps(rateCap);
+    if (!transformsPath.empty()) {
+        TransformSet transforms;
+        std::string error;
+        if (!transforms.Load(transformsPath, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        core.SetTransforms(transforms);
+    }
+    if (!virtualsPath.empty()) {
+        ExpressionSet virtuals;
+        std::string error;
+        if (!virtuals.Load(virtualsPath, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        core.SetVirtualOutputs(virtuals);
+    }
+    sink.core = &core;
+    for (int i = 0; i < clients; i++) {
+        core.RegisterClient((ClientHandle)(i + 1));
+        if (pwmClients < 0 || i < pwmClients) core.SetBrightnessClient((ClientHandle)(i + 1), true);
+        if (capClients >= 0 && i >= capClients) core.SetFullRateClient((ClientHandle)(i + 1), true);
+    }
+    for (const auto& route : routes) core.SetClientRoute((ClientHandle)route.first, route.second);
+    for (int i = 0; i < clients && !core.transforms.Empty(); i++) core.SetClientName((ClientHandle)(i + 1), std::to_string(i + 1));
+
+    std::thread logThread;
+    if (sink.guiLog) logThread = std::thread([&sink] { sink.LogWindowThread(); });
+
+    sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons((unsigned short)port);
+    server.sin_addr.s_addr = inet_addr(ip.c_str());
+
+    printf("Bridge daemon %s: %s:%d, %d client(s), %s\n", BRIDGE_VERSION, ip.c_str(), port, clients,
+           sink.guiLog ? "GUI log pipeline" : "headless");
+    fflush(stdout);
+
+    // Same loop as the bridge's network thread
+    BusyPoller busyPoll;
+    busyPoll.Configure(busyPollUs);
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    uint64_t attempts = 0;
+    while (!g_stop) {
+        attempts++;
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock, (struct sockaddr*)&server, sizeof(server)) == 0) {
+            core.OnConnect();
+            send(sock, "\r\n", 2, 0);
+
+            char buffer[4096];
+            ssize_t n;
+            while (!g_stop) {
+                // Spin first (--busy-poll), then sleep in recv()
+                n = busyPoll.Spin([&]() -> long {
+                    ssize_t r = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+                    if (r > 0) return (long)r;
+                    return (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) ? 0 : -1;
+                }, [&core] { core.RunTimers(); });
+                if (n < 0) break;
+                core.RunTimers();
+                if (n == 0) {
+                    // A core timer (pulse end, brightness) is due before MAME sends more: wake up for it
+                    uint64_t timerMs = core.TimerWaitMs();
+                    if (timerMs != UINT64_MAX) {
+                        pollfd pfd = { sock, POLLIN, 0 };
+                        if (poll(&pfd, 1, (int)std::min<uint64_t>(timerMs, 1000)) <= 0) continue;
+                    }
+                    n = recv(sock, buffer, sizeof(buffer), 0);
+                    if (n > 0) busyPoll.OnWake();
+                }
+                if (n > 0) {
+                    if (sink.latency) sink.packetTime = DaemonSink::Clock::now();
+                    sink.inPacket = true;
+                    core.Feed(buffer, (size_t)n);
+                    sink.inPacket = false;
+                    if (sink.latency && sink.stampId == 0) {
+                        auto it = core.nameToID.find("loadgen_stamp");
+                        if (it != core.nameToID.end()) sink.stampId = it->second;
+                    }
+                }
+                else if (n < 0 && errno == EINTR) {
+                    if (g_statusWanted) { g_statusWanted = 0; PrintStatus(core); }
+                    continue;
+                }
+                else break;
+            }
+            core.OnDisconnect();
+            sink.stampId = 0;
+        }
+        else {
+            uint64_t retryMs = core.NextRetryDelayMs();
+            usleep((useconds_t)(retryMs * 1000));  // Cut short by any signal
+            core.CheckReconnectGrace();
+        }
+        close(sock);
+        if (g_statusWanted) { g_statusWanted = 0; PrintStatus(core); }
+    }
+    core.CheckReconnectGrace(true);
+
+    if (logThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(sink.logMutex);
+            sink.logDone = true;
+        }
+        sink.logReady.notify_one();
+        logThread.join();
+    }
+
+    // What it cost (all threads)
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpuMs = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+    long peakKb, currentKb;
+    ReadMemory(peakKb, currentKb);
+
+    PrintStatus(core);
+    printf("Delivered: %llu messages to clients\n", (unsigned long long)sink.posts);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    printf("CPU:       %.1f ms total (%.1f%% of a core), %.0f ns per line from MAME\n", cpuMs,
+           secs > 0 ? cpuMs / (secs * 10) : 0.0, core.linesProcessed ? cpuMs * 1e6 / core.linesProcessed : 0.0);
+    printf("Memory:    %ld kB peak, %ld kB now\n", peakKb, currentKb);
+    printf("Wake-ups:  %ld in %.1f s (%.2f/s), %llu connection attempts\n", ru.ru_nvcsw, secs,
+           secs > 0 ? ru.ru_nvcsw / secs : 0.0, (unsigned long long)attempts);
+    if (busyPoll.Enabled()) {
+        printf("Busy-poll: %llu of %llu spins caught data, %llu wake-ups from sleep\n",
+               (unsigned long long)busyPoll.caught, (unsigned long long)busyPoll.spins, (unsigned long long)busyPoll.wakes);
+    }
+    if (!core.filters.empty()) {
+        printf("Filters:   %llu updates held back, %llu of them sent once settled\n",
+               (unsigned long long)core.updatesFiltered, (unsigned long long)core.updatesDebounced);
+    }
+    if (!core.routes.empty()) {
+        printf("Routing:   %llu updates not sent to clients outside their route\n", (unsigned long long)core.updatesUnrouted);
+    }
+    if (!core.transformClients.empty()) {
+        printf("Transform: %zu of %d clients get transformed values (%zu programs)\n", core.transformClients.size(), clients,
+               core.transforms.programs.size());
+    }
+    if (!core.virtuals.Empty()) {
+        printf("Virtual:   %llu evaluations of %zu virtual outputs, %llu values passed on\n",
+               (unsigned long long)core.virtualEvaluations, core.virtuals.outputs.size(),
+               (unsigned long long)core.virtualUpdates);
+    }
+    if (!core.rateCapRules.empty()) {
+        printf("Rate caps: %llu updates skipped by capped clients, %llu latest values sent once a token came back\n",
+               (unsigned long long)core.rateHeldUpdates, (unsigned long long)core.rateCatchUps);
+    }
+    if (!core.stretchRules.empty()) {
+        printf("Stretch:   %llu pulses held on to their minimum on-time\n", (unsigned long long)core.pulsesStretched);
+    }
+    if (!core.pwmPatterns.empty()) {
+        printf("PWM:       %llu brightness levels sent, %llu 0/1 updates held back\n",
+               (unsigned long long)core.pwmLevelsPosted, (unsigned long long)core.pwmUpdatesHeld);
+    }
+    if (sink.latency) {
+        printf("Priority:  %llu updates sent first, %llu bulk updates coalesced\n",
+               (unsigned long long)core.priorityUpdates, (unsigned long long)core.updatesCoalesced);
+        PrintLatency("priority", sink.latencyNs[OUTPUT_PRIORITY]);
+        PrintLatency("bulk", sink.latencyNs[OUTPUT_BULK]);
+        if (!sink.stampNs.empty()) PrintLatency("loadgen", sink.stampNs);
+    }
+    return 0;
+}
@@ -0,0 +1,674 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                      MAME BRIDGE NET-TO-WIN : CAPTURE TOOL
+// ==================================================================================
+// Records and replays session captures (see BridgeCapture.h) without Windows.
+//
+// COMMANDS:
+//   capturetool record <file> [--ip ADDR] [--port N] [--duration S] [--reconnect]
+//       Connects to MAME (or tools/LoadGen) like the bridge does and writes
+//       everything received to <file> until MAME disconnects.
+//       --reconnect keeps reconnecting, like the bridge, until --duration is up.
+//
+//   capturetool replay <file> [--speed N] [--clients N] [--print] [--flight FILE] [--from S] [--grace MS]
+//                [--late-client S] [--notify broadcast|targeted] [--desktop N] [--priority LIST]
+//                [--debounce RULES] [--hysteresis RULES] [--stretch RULES] [--pwm LIST] [--pwm-clients N]
+//                [--rate-cap RULES] [--cap-clients N] [--route N=LIST ...] [--transforms FILE]
+//                [--virtuals FILE]
+//       Feeds the capture (raw or compact) through the bridge core with N simulated clients.
+//       --speed 1 is real time, --speed 0 (default) is as fast as possible.
+//       --print lists every message the clients would receive.
+//       --flight saves the flight recorder to FILE if MAME disconnects without
+//       "mame_stop", just like the bridge does.
+//       --from starts a compact capture S seconds in (instant, via the index).
+//       --grace sets the reconnect grace window (default 5000, 0 = reset on every
+//       drop), to see how many messages it saves on a capture with drops in it.
+//       --late-client registers one more client S seconds in and checks that its
+//       catch-up leaves it with the same lights as the client that saw everything.
+//       --notify picks how START and STOP are delivered (default targeted), and
+//       --desktop N is the number of top-level windows a broadcast wakes up
+//       (default 40), to count what each mode costs the rest of the desktop.
+//       --priority sets the priority output patterns (default "*recoil*,*solenoid*,
+//       *rumble*,sol?*"); "--priority none" posts every update as soon as it is read.
+//       --debounce and --hysteresis filter chattering outputs (e.g. "*door*=30" holds
+//       a new value until it has settled for 30 ms, "*gauge*=4" drops changes smaller
+//       than 4) and report how many updates they kept from the clients.
+//       --stretch sets minimum on-times (e.g. "*flash*=50,*solenoid*=30") and checks,
+//       on the capture's own clock, that no pulse of those outputs reached client 1
+//       shorter than its minimum.
+//       --pwm turns strobing outputs (e.g. "lamp*") into brightness levels for the
+//       first N clients (--pwm-clients, default all), and lists what each client got.
+//       --rate-cap caps the updates per second of matching outputs (e.g. "lamp*=200")
+//       for the first N clients (--cap-clients, default all); the others get every
+//       update. With both kinds of client it checks, after every record, that client 1
+//       has the same value as the last client for every output it is not behind on.
+//       --route gives client N a route (e.g. "2=*recoil*,sol*"): it only gets those
+//       outputs. Repeat it for more clients. It counts updates a client got outside
+//       its route (there should be none).
+//       --transforms reads value transforms from FILE (see BridgeTransforms.h); the
+//       clients are named "1", "2" and so on. If the last client has no transforms
+//       (and is otherwise treated like client 1), it checks after every record that
+//       client 1 has the last client's values run through client 1's transforms.
+//       --virtuals reads virtual outputs from FILE (see BridgeExpressions.h) and
+//       reports how often they were evaluated and how many updates they sent.
+//       The "message digest" is the same on every run of the same capture, so
+//       two builds can be checked for identical behaviour.
+//
+//   capturetool encode <file.cap> <file.ccap>
+//       Converts a raw capture to the compact format (BridgeCompactCapture.h)
+//       and reports the compression ratio.
+//
+//   capturetool decode <file.ccap> [--print]
+//       Decodes a compact capture, reporting decode throughput.
+//       --print lists every event as text.
+//
+//   capturetool index <file.ccap>
+//       (Re)builds the index for a compact capture (BridgeCaptureIndex.h).
+//
+//   capturetool query <file.ccap> --output NAME [--from S] [--to S]
+//       Lists the changes of one output between two times (in seconds) using the
+//       index, e.g. "--output lamp17 --from 2400 --to 2460" for minute 40 to 41.
+// ==================================================================================
+
+// Compile on Linux:
+// g++ -O2 -std=c++17 tools/CaptureTool.cpp -o capturetool -pthread
+//
+// Compile with MSYS2 MINGW64:
+// g++ -O2 tools/CaptureTool.cpp -o CaptureTool.exe -lws2_32 -static
+
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0600
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+#include "../BridgeCore.h"
+#include "../BridgeCapture.h"
+#include "../BridgeCompactCapture.h"
+#include "../BridgeCaptureIndex.h"
+
+#include <string>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+
+// --- CONFIGURATION ---
+#define MAME_IP "127.0.0.1"
+#define MAME_PORT 8000
+
+typedef std::chrono::steady_clock Clock;
+
+// ==================================================================================
+//                                  REPLAY SINK
+// ==================================================================================
+// Counts messages and folds every one of them into a digest (FNV-1a), so the whole
+// message sequence can be compared between runs with a single number.
+struct ReplaySink : BridgeSink {
+    bool print = false;
+    BridgeCore* core = NULL;
+    std::string flightPath;     // --flight: where to save the flight recorder
+    uint64_t updates = 0, starts = 0, stops = 0, idStrings = 0;
+    uint64_t broadcasts = 0;    // START/STOP sent to every window
+    uint64_t digest = 1469598103934665603ull;
+    std::map<ClientHandle, std::map<OutputID, int>> lights;  // What each client has lit
+    std::map<OutputID, uint64_t> onSinceMs;   // Client 1: when each stretched output went on
+    uint64_t pulses = 0, shortPulses = 0;     // Client 1: pulses of stretched outputs
+    uint64_t shortestMs = UINT64_MAX;         // ...and the shortest on-time among them
+    std::map<ClientHandle, uint64_t> clientUpdates;
+    uint64_t strayUpdates = 0;                // Updates a routed client got outside its route
+    bool keepValues = false;                  // --transforms: fill values
+    std::map<ClientHandle, std::map<OutputID, int>> values;  // Every value each client got, 0 too
+
+    void Mix(uint64_t v) {
+        for (int i = 0; i < 8; i++) {
+            digest ^= (v >> (8 * i)) & 0xff;
+            digest *= 1099511628211ull;
+        }
+    }
+
+    void Post(ClientHandle target, BridgeMessage msg, OutputID id, int value) override {
+        if (msg == MSG_UPDATE_STATE) {
+            updates++;
+            clientUpdates[target]++;
+            if (!core->ClientWants(target, id)) strayUpdates++;
+        }
+        else if (msg == MSG_MAME_START) starts++;
+        else stops++;
+        if (target == CLIENT_BROADCAST) broadcasts++;
+        Mix((uint64_t)target); Mix((uint64_t)msg); Mix((uint64_t)id); Mix((uint64_t)(int64_t)value);
+
+        // Clients turn everything off on START and STOP
+        if (target == 1 || target == CLIENT_BROADCAST) CheckPulse(msg, id, value);
+        if (msg != MSG_UPDATE_STATE && target == CLIENT_BROADCAST) lights.clear();
+        else if (msg != MSG_UPDATE_STATE) lights.erase(target);
+        else if (value) lights[target][id] = value;
+        else lights[target].erase(id);
+        if (keepValues) {
+            if (msg != MSG_UPDATE_STATE && target == CLIENT_BROADCAST) values.clear();
+            else if (msg != MSG_UPDATE_STATE) values.erase(target);
+            else values[target][id] = value;
+        }
+
+        if (print) {
+            const char* names[] = { "START", "STOP", "UPDATE" };
+            if (target == CLIENT_BROADCAST) printf("%-6s -> all\n", names[msg]);
+            else printf("%-6s -> client %llu  id=%lld value=%d\n", names[msg],
+                        (unsigned long long)target, (long long)id, value);
+        }
+    }
+
+    // Times client 1's pulses of stretched outputs (see BridgeCore PULSE STRETCHING).
+    // The replay clock is the capture's, so the result is the same on every run.
+    // A START or STOP ends every pulse: that is the game's doing, not a short pulse.
+    void CheckPulse(BridgeMessage msg, OutputID id, int value) {
+        if (msg != MSG_UPDATE_STATE) {
+            onSinceMs.clear();
+            return;
+        }
+        uint32_t minMs = core->MinOnTime(id);
+        if (minMs == 0) return;
+        bool wasOn = (lights[1].count(id) != 0);
+        if (value != 0 && !wasOn) onSinceMs[id] = core->NowMs();
+        if (value != 0 || !wasOn || onSinceMs.count(id) == 0) return;
+        uint64_t onMs = core->NowMs() - onSinceMs[id];
+        pulses++;
+        if (onMs < minMs) shortPulses++;
+        shortestMs = std::min<uint64_t>(shortestMs, onMs);
+    }
+
+    void SendIDString(ClientHandle client, OutputID id) override {
+        idStrings++;
+        if (print) printf("IDSTR  -> client %llu  id=%lld\n", (unsigned long long)client, (long long)id);
+    }
+
+    void OnUnexpectedDisconnect() override {
+        if (flightPath.empty() || !core) return;
+        if (core->DumpFlightRecorder(flightPath, "Unexpected disconnect from MAME (replay)")) {
+            printf("Flight recorder saved to %s\n", flightPath.c_str());
+        }
+    }
+};
+
+// ==================================================================================
+//                                    COMMANDS
+// ==================================================================================
+
+static int Record(const std::string& path, const std::string& ip, int port, double duration, bool reconnect) {
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons((unsigned short)port);
+    server.sin_addr.s_addr = inet_addr(ip.c_str());
+
+    CaptureWriter writer;
+    Clock::time_point start = Clock::now();
+    uint64_t bytes = 0, sessions = 0;
+    auto timeUp = [&] {
+        return duration > 0 && std::chrono::duration<double>(Clock::now() - start).count() >= duration;
+    };
+
+    do {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock, (struct sockaddr*)&server, sizeof(server)) != 0) {
+            closesocket(sock);
+            if (!reconnect || sessions == 0) {
+                fprintf(stderr, "Could not connect to %s:%d\n", ip.c_str(), port);
+                return sessions ? 0 : 1;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+
+        if (!writer.IsOpen() && !writer.Open(path)) {
+            fprintf(stderr, "Could not create %s\n", path.c_str());
+            return 1;
+        }
+        writer.WriteEvent(CAP_CONNECT);
+        sessions++;
+
+        // Same wake-up the bridge sends
+        send(sock, "\r\n", 2, 0);
+
+        char buffer[4096];
+        int n;
+        while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+            writer.WriteData(buffer, n);
+            bytes += n;
+            if (timeUp()) break;
+        }
+        writer.WriteEvent(CAP_DISCONNECT);
+        closesocket(sock);
+    } while (reconnect && !timeUp());
+    writer.Close();
+
+    printf("Recorded %llu bytes in %llu connection(s) to %s\n", (unsigned long long)bytes,
+           (unsigned long long)sessions, path.c_str());
+    return 0;
+}
+
+struct ReplayOptions {
+    double speed = 0;
+    int clients = 1;
+    bool print = false;
+    std::string flightPath;
+    double fromSecs = 0;
+    uint64_t graceMs = RECONNECT_GRACE_MS;
+    double lateClientSecs = -1;   // < 0: no late client
+    NotifyMode notify = NOTIFY_TARGETED;
+    int desktopWindows = 40;      // Top-level windows woken by a broadcast
+    std::string priority = PRIORITY_OUTPUTS;
+    std::string debounce;         // Settle times ("" = off)
+    std::string hysteresis;       // Smallest changes passed on ("" = off)
+    std::string stretch;          // Minimum on-times ("" = off)
+    std::string pwm;              // Outputs turned into brightness when strobing ("" = off)
+    int pwmClients = -1;          // Clients that get brightness (-1 = all)
+    std::string rateCap;          // Most updates per second per output ("" = off)
+    int capClients = -1;          // Clients the caps apply to (-1 = all)
+    std::vector<std::pair<int, std::string>> routes;  // Client, outputs it gets
+    std::string transformsPath;   // Value transforms file ("" = off)
+    std::string virtualsPath;     // Virtual outputs file ("" = off)
+};
+
+static int Replay(const std::string& path, const ReplayOptions& opt) {
+    CaptureReader reader;
+    IndexedCapture compact;
+    bool isCompact = false;
+    if (!reader.Open(path)) {
+        if (!compact.Open(path)) {
+            fprintf(stderr, "Could not open capture %s\n", path.c_str());
+            return 1;
+        }
+        isCompact = true;
+    }
+    else if (opt.fromSecs > 0) {
+        fprintf(stderr, "--from needs a compact capture (see \"encode\")\n");
+        return 1;
+    }
+
+    ReplaySink sink;
+    FlightRecorder flight;
+    sink.print = opt.print;
+    sink.flightPath = opt.flightPath;
+    BridgeCore core(&sink);
+    sink.core = &core;
+    core.recorder = &flight;
+    core.reconnectGraceMs = opt.graceMs;
+    core.notifyMode = opt.notify;
+    core.SetPriorityPatterns(opt.priority);
+    core.SetDebounce(opt.debounce);
+    core.SetHysteresis(opt.hysteresis);
+    core.SetPulseStretch(opt.stretch);
+    core.SetPwmPatterns(opt.pwm);
+    core.SetRateCaps(opt.rateCap);
+    if (!opt.transformsPath.empty()) {
+        TransformSet transforms;
+        std::string error;
+        if (!transforms.Load(opt.transformsPath, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        core.SetTransforms(transforms);
+    }
+    if (!opt.virtualsPath.empty()) {
+        ExpressionSet virtuals;
+        std::string error;
+        if (!virtuals.Load(opt.virtualsPath, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        core.SetVirtualOutputs(virtuals);
+    }
+    for (int i = 0; i < opt.clients; i++) {
+        core.RegisterClient((ClientHandle)(i + 1));
+        if (opt.pwmClients < 0 || i < opt.pwmClients) core.SetBrightnessClient((ClientHandle)(i + 1), true);
+        if (opt.capClients >= 0 && i >= opt.capClients) core.SetFullRateClient((ClientHandle)(i + 1), true);
+    }
+    for (const auto& route : opt.routes) core.SetClientRoute((ClientHandle)route.first, route.second);
+    if (!core.transforms.Empty()) {
+        for (int i = 0; i < opt.clients; i++) core.SetClientName((ClientHandle)(i + 1), std::to_string(i + 1));
+    }
+
+    // Catch-up batches go out one per record, like the bridge's timer ticks
+    const ClientHandle lateClient = 1000;
+    bool lateRegistered = false;
+    uint64_t checks = 0, mismatches = 0;
+    const ClientHandle fullRateClient = (ClientHandle)opt.clients;
+    bool checkCaps = !core.rateCapRules.empty() && opt.clients > 1 && !core.IsCappedClient(fullRateClient) &&
+                     core.IsCappedClient(1);
+    uint64_t capChecks = 0, capMismatches = 0;
+    const ClientHandle plainClient = (ClientHandle)opt.clients;
+    bool checkTransforms = !core.transforms.Empty() && opt.clients > 1 && core.TransformIndex(plainClient) < 0 &&
+                           core.IsBrightnessClient(1) == core.IsBrightnessClient(plainClient) &&
+                           core.IsCappedClient(1) == core.IsCappedClient(plainClient) &&
+                           core.RouteIndex(1) < 0 && core.RouteIndex(plainClient) < 0;
+    sink.keepValues = checkTransforms;
+    uint64_t transformChecks = 0, transformMismatches = 0;
+    auto onRecord = [&](uint64_t timeUs) {
+        if (checkTransforms) {
+            // Every value the plain client has, client 1 has through its transforms
+            auto& transformed = sink.values[1];
+            for (const auto& entry : sink.values[plainClient]) {
+                auto it = transformed.find(entry.first);
+                transformChecks++;
+                if (it == transformed.end() || it->second != core.TransformedFor(1, entry.first, entry.second)) {
+                    transformMismatches++;
+                }
+            }
+        }
+        if (checkCaps) {
+            // Client 1 may only differ from the full-rate client on outputs it is behind on
+            for (OutputID id = 1; (size_t)id < core.lastValue.size(); id++) {
+                if (core.RateCapped(id) && core.rate[id].held) continue;
+                auto& capped = sink.lights[1];
+                auto& full = sink.lights[fullRateClient];
+                int a = capped.count(id) ? capped[id] : 0, b = full.count(id) ? full[id] : 0;
+                capChecks++;
+                if (a != b) capMismatches++;
+            }
+        }
+        if (opt.lateClientSecs >= 0 && !lateRegistered && timeUs >= opt.lateClientSecs * 1e6) {
+            core.RegisterClient(lateClient);
+            lateRegistered = true;
+        }
+        if (core.PumpCatchUp() || !lateRegistered) return;
+        checks++;
+        if (sink.lights[lateClient] != sink.lights[1]) mismatches++;
+    };
+
+    Clock::time_point start = Clock::now();
+    uint64_t records = isCompact ? ReplayCompact(compact, core, opt.speed, (uint64_t)(opt.fromSecs * 1e6), NULL, onRecord)
+                                 : ReplayCapture(reader, core, opt.speed, NULL, onRecord);
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    printf("Capture:        %s (%llu bytes, %llu %s)\n", path.c_str(),
+           (unsigned long long)(isCompact ? compact.Reader().FileSize() : reader.FileSize()),
+           (unsigned long long)records, isCompact ? "events" : "records");
+    printf("Messages:       %llu updates, %llu starts, %llu stops\n",
+           (unsigned long long)sink.updates, (unsigned long long)sink.starts, (unsigned long long)sink.stops);
+    printf("Reconnects:     %llu resumed within %llu ms, %llu updates reconciled away\n",
+           (unsigned long long)core.reconnectsResumed, (unsigned long long)opt.graceMs,
+           (unsigned long long)core.updatesReconciled);
+    printf("Start/stop:     %llu broadcasts, %llu sent to one client; %llu window wakeups with %d desktop windows\n",
+           (unsigned long long)sink.broadcasts, (unsigned long long)core.notifyTargeted,
+           (unsigned long long)(sink.broadcasts * opt.desktopWindows + core.notifyTargeted), opt.desktopWindows);
+    printf("Priority lane:  %llu priority updates sent first, %llu bulk updates coalesced\n",
+           (unsigned long long)core.priorityUpdates, (unsigned long long)core.updatesCoalesced);
+    if (!core.filters.empty()) {
+        printf("Filters:        %llu updates held back, %llu of them sent once settled (%llu filter settings)\n",
+               (unsigned long long)core.updatesFiltered, (unsigned long long)core.updatesDebounced,
+               (unsigned long long)core.filters.size());
+    }
+    if (!core.stretchRules.empty()) {
+        printf("Pulse stretch:  %llu pulses stretched; client 1 saw %llu pulses, shortest %llu ms, %llu below the minimum\n",
+               (unsigned long long)core.pulsesStretched, (unsigned long long)sink.pulses,
+               (unsigned long long)(sink.pulses ? sink.shortestMs : 0), (unsigned long long)sink.shortPulses);
+    }
+    if (!core.pwmPatterns.empty()) {
+        printf("PWM dimming:    %llu brightness levels sent, %llu 0/1 updates held back; updates per client:",
+               (unsigned long long)core.pwmLevelsPosted, (unsigned long long)core.pwmUpdatesHeld);
+        for (int i = 0; i < opt.clients; i++) {
+            printf(" %d%s=%llu", i + 1, core.IsBrightnessClient((ClientHandle)(i + 1)) ? "(levels)" : "",
+                   (unsigned long long)sink.clientUpdates[(ClientHandle)(i + 1)]);
+        }
+        printf("\n");
+    }
+    if (!core.rateCapRules.empty()) {
+        printf("Rate caps:      %llu updates skipped by capped clients, %llu latest values sent once a token came back;\n"
+               "                updates per client:",
+               (unsigned long long)core.rateHeldUpdates, (unsigned long long)core.rateCatchUps);
+        for (int i = 0; i < opt.clients; i++) {
+            printf(" %d%s=%llu", i + 1, core.IsCappedClient((ClientHandle)(i + 1)) ? "(capped)" : "",
+                   (unsigned long long)sink.clientUpdates[(ClientHandle)(i + 1)]);
+        }
+        printf("\n");
+        if (checkCaps) {
+            printf("                client 1 differs from client %d on %llu of %llu output checks\n", opt.clients,
+                   (unsigned long long)capMismatches, (unsigned long long)capChecks);
+        }
+    }
+    if (!core.routes.empty()) {
+        printf("Routing:        %llu updates not sent to clients outside their route, %llu sent anyway; updates per client:",
+               (unsigned long long)core.updatesUnrouted, (unsigned long long)sink.strayUpdates);
+        for (int i = 0; i < opt.clients; i++) {
+            printf(" %d%s=%llu", i + 1, core.RouteIndex((ClientHandle)(i + 1)) >= 0 ? "(routed)" : "",
+                   (unsigned long long)sink.clientUpdates[(ClientHandle)(i + 1)]);
+        }
+        printf("\n");
+    }
+    if (!core.transforms.Empty()) {
+        printf("Transforms:     %llu rules, %llu programs; updates per client:",
+               (unsigned long long)core.transforms.rules.size(), (unsigned long long)core.transforms.programs.size());
+        for (int i = 0; i < opt.clients; i++) {
+            printf(" %d%s=%llu", i + 1, core.TransformIndex((ClientHandle)(i + 1)) >= 0 ? "(transformed)" : "",
+                   (unsigned long long)sink.clientUpdates[(ClientHandle)(i + 1)]);
+        }
+        printf("\n");
+        if (checkTransforms) {
+            printf("                client 1 differs from client %d transformed on %llu of %llu value checks\n",
+                   opt.clients, (unsigned long long)transformMismatches, (unsigned long long)transformChecks);
+        }
+    }
+    if (!core.virtuals.Empty()) {
+        printf("Virtual:        %llu outputs, %llu evaluations, %llu values passed on\n",
+               (unsigned long long)core.virtuals.outputs.size(), (unsigned long long)core.virtualEvaluations,
+               (unsigned long long)core.virtualUpdates);
+    }
+    if (lateRegistered) {
+        printf("Late client:    %llu catch-up updates, %llu ID strings primed, lights differ %llu of %llu checks\n",
+               (unsigned long long)core.catchUpUpdates, (unsigned long long)sink.idStrings,
+               (unsigned long long)mismatches, (unsigned long long)checks);
+    }
+    printf("Replay time:    %.3f s (%.0f updates/s)\n", secs, secs > 0 ? sink.updates / secs : 0.0);
+    printf("Message digest: %016llx\n", (unsigned long long)sink.digest);
+    return 0;
+}
+
+static int Encode(const std::string& inPath, const std::string& outPath) {
+    CaptureReader in;
+    if (!in.Open(inPath)) {
+        fprintf(stderr, "Could not open capture %s\n", inPath.c_str());
+        return 1;
+    }
+    CompactWriter out;
+    if (!out.Open(outPath, in.StartUnixTime())) {
+        fprintf(stderr, "Could not create %s\n", outPath.c_str());
+        return 1;
+    }
+
+    Clock::time_point start = Clock::now();
+    uint64_t updates = ConvertCaptureToCompact(in, out);
+    out.Close();
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    uint64_t outBytes = out.BytesWritten();
+    printf("Raw capture:     %llu bytes\n", (unsigned long long)in.FileSize());
+    printf("Compact capture: %llu bytes (%llu updates, %.2f bytes/update)\n", (unsigned long long)outBytes,
+           (unsigned long long)updates, updates ? (double)outBytes / updates : 0.0);
+    printf("Ratio:           %.2f : 1\n", outBytes ? (double)in.FileSize() / outBytes : 0.0);
+    printf("Encode time:     %.3f s\n", secs);
+    return 0;
+}
+
+static int Decode(const std::string& path, bool print) {
+    CompactReader reader;
+    if (!reader.Open(path)) {
+        fprintf(stderr, "Could not open compact capture %s\n", path.c_str());
+        return 1;
+    }
+
+    CompactEvent ev;
+    if (print) {
+        while (reader.Next(ev)) {
+            double t = ev.timeUs / 1e6;
+            if (ev.type == CEV_UPDATE) printf("%12.6f  %s = %d\n", t, reader.Name(ev.id).c_str(), ev.value);
+            else if (ev.type == CEV_START) printf("%12.6f  mame_start = %.*s\n", t, (int)ev.textLen, ev.text);
+            else if (ev.type == CEV_STOP) printf("%12.6f  mame_stop\n", t);
+            else if (ev.type == CEV_CONNECT) printf("%12.6f  [connect]\n", t);
+            else printf("%12.6f  [disconnect]\n", t);
+        }
+        return 0;
+    }
+
+    // Decode repeatedly for at least half a second to get a stable throughput figure
+    uint64_t events = 0, passes = 0, checksum = 0;
+    Clock::time_point start = Clock::now();
+    double secs = 0;
+    do {
+        reader.Rewind();
+        while (reader.Next(ev)) {
+            events++;
+            checksum += ev.value;
+        }
+        passes++;
+        secs = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (secs < 0.5);
+
+    printf("Compact capture: %llu bytes, %llu outputs, %llu events\n", (unsigned long long)reader.FileSize(),
+           (unsigned long long)reader.OutputCount(), (unsigned long long)(events / passes));
+    printf("Decode speed:    %.1f MB/s, %.1f M events/s (checksum %llu)\n",
+           reader.FileSize() * passes / secs / (1024.0 * 1024.0), events / secs / 1e6,
+           (unsigned long long)(checksum / passes));
+    return 0;
+}
+
+static int Index(const std::string& path) {
+    Clock::time_point start = Clock::now();
+    if (!BuildCaptureIndex(path)) {
+        fprintf(stderr, "Could not index %s (is it a compact capture?)\n", path.c_str());
+        return 1;
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    IndexedCapture capture;
+    if (!capture.Open(path)) return 1;
+    printf("Indexed %s: %llu blocks, %llu outputs in %.3f s\n", path.c_str(),
+           (unsigned long long)capture.BlockCount(), (unsigned long long)capture.OutputCount(), secs);
+    return 0;
+}
+
+static int Query(const std::string& path, const std::string& output, double fromSecs, double toSecs) {
+    IndexedCapture capture;
+    if (!capture.Open(path)) {
+        fprintf(stderr, "Could not open compact capture %s\n", path.c_str());
+        return 1;
+    }
+    uint32_t id = capture.FindOutput(output);
+    if (id == 0) {
+        fprintf(stderr, "Output '%s' does not appear in %s\n", output.c_str(), path.c_str());
+        return 1;
+    }
+
+    uint64_t t0 = (uint64_t)(fromSecs * 1e6);
+    uint64_t t1 = (toSecs > 0) ? (uint64_t)(toSecs * 1e6) : UINT64_MAX;
+    uint64_t changes = 0;
+    Clock::time_point start = Clock::now();
+    size_t blocks = capture.ForEachUpdate(id, t0, t1, [&](const CompactEvent& ev) {
+        printf("%12.6f  %s = %d\n", ev.timeUs / 1e6, output.c_str(), ev.value);
+        changes++;
+    });
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    printf("%llu changes; decoded %llu of %llu blocks in %.3f ms\n", (unsigned long long)changes,
+           (unsigned long long)blocks, (unsigned long long)capture.BlockCount(), secs * 1000.0);
+    return 0;
+}
+
+static void Usage() {
+    printf("Usage:\n"
+           "  capturetool record <file> [--ip ADDR] [--port N] [--duration S] [--reconnect]\n"
+           "  capturetool replay <file> [--speed N] [--clients N] [--print] [--flight FILE] [--from S] [--grace MS]\n"
+           "                      [--late-client S] [--notify broadcast|targeted] [--desktop N] [--priority LIST]\n"
+           "                      [--debounce RULES] [--hysteresis RULES] [--stretch RULES] [--pwm LIST]\n"
+           "                      [--pwm-clients N] [--rate-cap RULES] [--cap-clients N] [--route N=LIST ...]\n"
+           "                      [--transforms FILE] [--virtuals FILE]\n"
+           "  capturetool encode <file.cap> <file.ccap>\n"
+           "  capturetool decode <file.ccap> [--print]\n"
+           "  capturetool index <file.ccap>\n"
+           "  capturetool query <file.ccap> --output NAME [--from S] [--to S]\n");
+}
+
+// ==================================================================================
+//                                MAIN ENTRY POINT
+// ==================================================================================
+int main(int argc, char** argv) {
+    if (argc < 3) { Usage(); return 1; }
+    std::string command = argv[1];
+    std::string path = argv[2];
+    if (command == "encode") {
+        if (argc != 4) { Usage(); return 1; }
+        return Encode(path, argv[3]);
+    }
+
+    std::string ip = MAME_IP;
+    int port = MAME_PORT;
+    double duration = 0, fromSecs = 0, toSecs = 0;
+    ReplayOptions opt;
+    bool print = false, reconnect = false;
+    std::string output;
+
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasNext = (i + 1 < argc);
+        if (arg == "--ip" && hasNext) ip = argv[++i];
+        else if (arg == "--port" && hasNext) port = atoi(argv[++i]);
+        else if (arg == "--duration" && hasNext) duration = atof(argv[++i]);
+        else if (arg == "--speed" && hasNext) opt.speed = atof(argv[++i]);
+        else if (arg == "--clients" && hasNext) opt.clients = atoi(argv[++i]);
+        else if (arg == "--print") print = true;
+        else if (arg == "--reconnect") reconnect = true;
+        else if (arg == "--grace" && hasNext) opt.graceMs = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--late-client" && hasNext) opt.lateClientSecs = atof(argv[++i]);
+        else if (arg == "--notify" && hasNext) opt.notify = (std::string(argv[++i]) == "broadcast") ? NOTIFY_BROADCAST : NOTIFY_TARGETED;
+        else if (arg == "--desktop" && hasNext) opt.desktopWindows = atoi(argv[++i]);
+        else if (arg == "--priority" && hasNext) opt.priority = argv[++i];
+        else if (arg == "--debounce" && hasNext) opt.debounce = argv[++i];
+        else if (arg == "--hysteresis" && hasNext) opt.hysteresis = argv[++i];
+        else if (arg == "--stretch" && hasNext) opt.stretch = argv[++i];
+        else if (arg == "--pwm" && hasNext) opt.pwm = argv[++i];
+        else if (arg == "--pwm-clients" && hasNext) opt.pwmClients = atoi(argv[++i]);
+        else if (arg == "--rate-cap" && hasNext) opt.rateCap = argv[++i];
+        else if (arg == "--cap-clients" && hasNext) opt.capClients = atoi(argv[++i]);
+        else if (arg == "--route" && hasNext) {
+            std::string route = argv[++i];
+            size_t eq = route.find('=');
+            if (eq == std::string::npos) { Usage(); return 1; }
+            opt.routes.push_back({ atoi(route.c_str()), route.substr(eq + 1) });
+        }
+        else if (arg == "--transforms" && hasNext) opt.transformsPath = argv[++i];
+        else if (arg == "--virtuals" && hasNext) opt.virtualsPath = argv[++i];
+        else if (arg == "--flight" && hasNext) opt.flightPath = argv[++i];
+        else if (arg == "--from" && hasNext) fromSecs = atof(argv[++i]);
+        else if (arg == "--to" && hasNext) toSecs = atof(argv[++i]);
+        else if (arg == "--output" && hasNext) output = argv[++i];
+        else { Usage(); return 1; }
+    }
+
+    if (command == "record") return Record(path, ip, port, duration, reconnect);
+    if (command == "replay") {
+        opt.print = print;
+        opt.fromSecs = fromSecs;
+        return Replay(path, opt);
+    }
+    if (command == "decode") return Decode(path, print);
+    if (command == "index") return Index(path);
+    if (command == "query" && !output.empty()) return Query(path, output, fromSecs, toSecs);
+    Usage();
+    return 1;
+}
@@ -0,0 +1,188 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                     MAME BRIDGE NET-TO-WIN : CLIENT SIMULATOR
+// ==================================================================================
+// Simulates Windows clients asking the bridge for ID strings ("MAMEOutputGetIDString"),
+// with one of them hung, and runs them against the bridge's reply service
+// (BridgeIDReplies.h) to show that the hung client costs the others very little.
+//
+// Each healthy client asks for every output's name, then again every --interval ms
+// (as LEDBlinky does after each game start or reconnect). The hung client asks too,
+// but never accepts a reply: every send to it runs into its timeout. A "send" to
+// a healthy client takes --work microseconds.
+//
+// Reported:
+//   - How long the bridge was blocked per request (just the queueing), next
+//     to how long it would have been blocked replying synchronously as it used to
+//   - How long healthy clients waited for their replies (median, 99th, max)
+//   - What happened to the hung client's replies (timed out / dropped in quarantine)
+//
+// USAGE:
+//   clientsim [--clients N] [--outputs N] [--interval MS] [--duration S] [--work US]
+//             [--hung N] [--policy on|off]
+//       --policy off gives every reply the full timeout, for comparison.
+// ==================================================================================
+
+// Compile on Linux:
+// g++ -O2 -std=c++17 tools/ClientSim.cpp -o clientsim -pthread
+//
+// Compile with MSYS2 MINGW64:
+// g++ -O2 -std=c++17 tools/ClientSim.cpp -o ClientSim.exe -static
+
+#include "../BridgeCore.h"
+#include "../BridgeIDReplies.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+typedef std::chrono::steady_clock Clock;
+
+// Client handles: healthy clients are 1..N, hung ones start here
+#define HUNG_CLIENT_BASE 1000
+
+struct Settings {
+    int clients = 4;
+    int outputs = 128;
+    int intervalMs = 500;
+    double duration = 5;
+    int workUs = 20;
+    int hung = 1;
+    bool policy = true;
+};
+
+static double Percentile(std::vector<double>& v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+int main(int argc, char** argv) {
+    Settings s;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasNext = (i + 1 < argc);
+        if (arg == "--clients" && hasNext) s.clients = atoi(argv[++i]);
+        else if (arg == "--outputs" && hasNext) s.outputs = atoi(argv[++i]);
+        else if (arg == "--interval" && hasNext) s.intervalMs = atoi(argv[++i]);
+        else if (arg == "--duration" && hasNext) s.duration = atof(argv[++i]);
+        else if (arg == "--work" && hasNext) s.workUs = atoi(argv[++i]);
+        else if (arg == "--hung" && hasNext) s.hung = atoi(argv[++i]);
+        else if (arg == "--policy" && hasNext) s.policy = std::string(argv[++i]) != "off";
+        else {
+            printf("Usage: clientsim [--clients N] [--outputs N] [--interval MS] [--duration S] [--work US]\n"
+                   "                 [--hung N] [--policy on|off]\n");
+            return 1;
+        }
+    }
+
+    // When each waiting request was made, to measure how long the client waited
+    std::mutex waitMutex;
+    std::map<std::pair<ClientHandle, OutputID>, Clock::time_point> asked;
+    std::vector<double> waitMs;
+
+    IDReplyService service;
+    service.useHealth = s.policy;
+    std::atomic<int> quarantines(0);
+    service.onQuarantine = [&](ClientHandle) { quarantines++; };
+    service.send = [&](const IDReplyQueue::Request& req, uint32_t timeoutMs) {
+        ClientHandle client = req.client;
+        OutputID id = req.id;
+        if (client >= HUNG_CLIENT_BASE) {
+            // Never answers: the send runs into its timeout
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(s.workUs));
+        std::lock_guard<std::mutex> lock(waitMutex);
+        auto it = asked.find(std::make_pair(client, id));
+        if (it != asked.end()) {
+            waitMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - it->second).count());
+            asked.erase(it);
+        }
+        return true;
+    };
+
+    std::atomic<bool> running(true);
+    std::thread replyThread([&] { service.Run(running); });
+
+    // The replies, as the core builds them
+    std::vector<std::vector<uint8_t>> replies((size_t)s.outputs + 1);
+    for (int id = 1; id <= s.outputs; id++) {
+        std::string name = "lamp" + std::to_string(id);
+        replies[id].resize(IDStringSize(name));
+        WriteIDString(replies[id].data(), (uint32_t)id, name);
+    }
+
+    // The core thread: queues every request, as the bridge does
+    double windowMaxUs = 0, windowTotalUs = 0;
+    uint64_t requests = 0;
+    Clock::time_point start = Clock::now();
+    Clock::time_point next = start;
+    while (std::chrono::duration<double>(Clock::now() - start).count() < s.duration) {
+        std::vector<ClientHandle> askers;
+        for (int c = 1; c <= s.clients; c++) askers.push_back((ClientHandle)c);
+        for (int h = 0; h < s.hung; h++) askers.push_back((ClientHandle)(HUNG_CLIENT_BASE + h));
+
+        for (int id = 1; id <= s.outputs; id++) {
+            for (ClientHandle c : askers) {
+                Clock::time_point t0 = Clock::now();
+                {
+                    std::lock_guard<std::mutex> lock(waitMutex);
+                    if (c < HUNG_CLIENT_BASE) asked.emplace(std::make_pair(c, (OutputID)id), t0);
+                }
+                service.queue.Push(c, (OutputID)id, replies[id].data(), replies[id].size());
+                double us = std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+                windowMaxUs = std::max(windowMaxUs, us);
+                windowTotalUs += us;
+                requests++;
+            }
+        }
+        next += std::chrono::milliseconds(s.intervalMs);
+        std::this_thread::sleep_until(next);
+    }
+
+    // Let the queue drain (healthy replies still waiting behind hung ones)
+    Clock::time_point drainEnd = Clock::now() + std::chrono::seconds(5);
+    while (Clock::now() < drainEnd) {
+        {
+            std::lock_guard<std::mutex> lock(waitMutex);
+            if (asked.empty()) break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    running = false;
+    service.queue.Wake();
+    replyThread.join();
+
+    // The old synchronous handler would have blocked the window for every send
+    double syncBlockedMs = service.sent * (s.workUs / 1000.0) + service.timedOut * (double)ID_REPLY_TIMEOUT_MS;
+
+    printf("Clients:          %d healthy, %d hung, %d outputs, asked every %d ms for %.1f s\n",
+           s.clients, s.hung, s.outputs, s.intervalMs, s.duration);
+    printf("Health policy:    %s\n", s.policy ? "on" : "off");
+    printf("Queueing:         %llu requests queued, %.2f us average, %.1f us max\n",
+           (unsigned long long)requests, requests ? windowTotalUs / requests : 0.0, windowMaxUs);
+    printf("                  (synchronous replies would have blocked the bridge for at least %.0f ms)\n", syncBlockedMs);
+    printf("Replies:          %llu sent, %llu timed out, %llu dropped in quarantine (%d quarantines)\n",
+           (unsigned long long)service.sent, (unsigned long long)service.timedOut,
+           (unsigned long long)service.dropped, (int)quarantines);
+    {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        double median = Percentile(waitMs, 0.5);
+        double p99 = Percentile(waitMs, 0.99);
+        double worst = waitMs.empty() ? 0.0 : waitMs.back();
+        printf("Healthy wait:     median %.2f ms, p99 %.2f ms, max %.2f ms (%zu replies, %zu never answered)\n",
+               median, p99, worst, waitMs.size(), asked.size());
+    }
+    return 0;
+}
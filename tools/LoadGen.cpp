@@ -0,0 +1,470 @@
+// license: BSD-3-Clause
+// copyright-holders: Jacob Simpson
+
+// ==================================================================================
+//                      MAME BRIDGE NET-TO-WIN : LOAD GENERATOR
+// ==================================================================================
+// A stand-in for MAME's network output server, used to stress test the bridge.
+//
+// It listens on TCP (default 127.0.0.1:8000) just like MAME does with
+// "-output network". When the bridge connects it sends "mame_start = <rom>",
+// then a stream of "<name> = <value>" lines, and "mame_stop = 1" when the run ends.
+// Every line is terminated with '\r', exactly like MAME.
+//
+// OUTPUT GROUPS:
+// Outputs are configured in groups with --group PREFIX:COUNT:RATE:DIST
+//   --group lamp:48:30:toggle    lamp0..lamp47, each flipping 0/1 30 times a second
+//   --group sol:4:15:pulse       sol0..sol3, each firing a 1->0 pulse 15 times a second
+//   --group gauge:2:60:uniform   gauge0..gauge1, random values 0..--max 60 times a second
+//   --group dial:1:20:ramp       dial0, counting 0..--max and wrapping
+//   --group lamp:8:30:pwm        lamp0..lamp7, each switched on and off 30 times a second
+//                                and on for 1/8 to 7/8 of every cycle (by output), the way
+//                                games dim a lamp
+//   --group door:4:2:chatter     door0..door3, each switching 0/1 twice a second, but
+//                                bouncing on the way: 1,0,1,0,1 a millisecond apart, like
+//                                a driver that chatters while an output changes
+// If no group is given, "lamp:32:10:toggle" is used.
+//
+// STRESS OPTIONS:
+//   --scale X              Multiply every group rate by X (e.g. 10 or 100)
+//   --burst N:MS           Every MS milliseconds, fire N extra updates back to back
+//   --fragment MODE        How lines are written to the socket:
+//                            none       one write per batch (default)
+//                            byte       one byte per write (worst case for the framer)
+//                            random:N   random write sizes of 1..N bytes, so lines
+//                                       are split across recv() calls at random points
+//   --duration S           Stop each session after S seconds (0 = run until disconnect)
+//   --drop S               Cut the connection every S seconds without "mame_stop", like a
+//                          network hiccup. The game carries on: after the bridge reconnects
+//                          it gets "mame_start" and the current value of every output (as
+//                          MAME sends a new connection), then the outputs continue.
+//   --stamp                End every batch with "loadgen_stamp = <send time>", the steady
+//                          clock in microseconds (modulo 2^31), so a bridge on the same
+//                          machine can measure how long each batch took to get through
+//                          (see BridgeDaemon --latency)
+//   --once                 Exit after the first session instead of waiting for a reconnect
+//   --seed N               Random seed, so runs are repeatable
+// ==================================================================================
+
+// Compile on Linux:
+// g++ -O2 -std=c++17 tools/LoadGen.cpp -o loadgen -pthread
+//
+// Compile with MSYS2 MINGW64:
+// g++ -O2 tools/LoadGen.cpp -o LoadGen.exe -lws2_32 -static
+
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0600
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef int socklen_t;
+#define SHUT_WR SD_SEND
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// --- CONFIGURATION ---
+#define DEFAULT_IP "127.0.0.1"
+#define DEFAULT_PORT 8000
+#define DEFAULT_ROM "loadgen"
+
+typedef std::chrono::steady_clock Clock;
+
+// How the values of an output group change over time
+enum ValueDist { DIST_TOGGLE, DIST_PULSE, DIST_UNIFORM, DIST_RAMP, DIST_PWM, DIST_CHATTER };
+
+#define CHATTER_SWITCHES 5      // DIST_CHATTER: switches per change (odd, so it ends up changed)
+
+struct OutputGroup {
+    std::string prefix;  // e.g. "lamp"
+    int count;           // number of outputs in the group
+    double rateHz;       // updates per second, per output
+    ValueDist dist;
+};
+
+// One simulated output, with its own schedule
+struct SimOutput {
+    std::string name;
+    ValueDist dist;
+    Clock::duration period;
+    double duty;         // DIST_PWM: share of each cycle spent on
+    int value;
+    bool sent;           // Has been sent at least once (so it is part of the game's state)
+    int bounces;         // DIST_CHATTER: switches left in the current change
+};
+
+// Min-heap entry: "output X is due at time T"
+struct DueEntry {
+    Clock::time_point due;
+    size_t index;
+    bool operator>(const DueEntry& o) const { return due > o.due; }
+};
+
+struct Settings {
+    std::string ip = DEFAULT_IP;
+    int port = DEFAULT_PORT;
+    std::string rom = DEFAULT_ROM;
+    std::vector<OutputGroup> groups;
+    double scale = 1.0;
+    int maxValue = 255;
+    int burstCount = 0;
+    int burstEveryMs = 0;
+    int fragmentMode = 0;   // 0 = none, 1 = byte, 2 = random
+    int fragmentMax = 16;
+    double duration = 0;
+    double drop = 0;
+    bool once = false;
+    bool stamp = false;
+    unsigned seed = 1;
+};
+
+// ==================================================================================
+//                                  HELPER FUNCTIONS
+// ==================================================================================
+
+static void Usage() {
+    printf("Usage: loadgen [options]\n"
+           "  --ip ADDR              Address to listen on (default " DEFAULT_IP ")\n"
+           "  --port N               Port to listen on (default %d)\n"
+           "  --rom NAME             ROM name sent with mame_start (default " DEFAULT_ROM ")\n"
+           "  --group P:N:HZ:DIST    Output group, DIST = toggle|pulse|uniform|ramp|pwm|chatter (repeatable)\n"
+           "  --max V                Largest value for uniform/ramp outputs (default 255)\n"
+           "  --scale X              Multiply all rates by X\n"
+           "  --burst N:MS           Fire N extra updates every MS milliseconds\n"
+           "  --fragment MODE        none | byte | random:N\n"
+           "  --duration S           Seconds per session (0 = until disconnect)\n"
+           "  --drop S               Drop the connection every S seconds (game state is kept)\n"
+           "  --stamp                End every batch with loadgen_stamp = <send time in us>\n"
+           "  --once                 Exit after one session\n"
+           "  --seed N               Random seed\n", DEFAULT_PORT);
+}
+
+static bool ParseDist(const std::string& s, ValueDist& out) {
+    if (s == "toggle") out = DIST_TOGGLE;
+    else if (s == "pulse") out = DIST_PULSE;
+    else if (s == "uniform") out = DIST_UNIFORM;
+    else if (s == "ramp") out = DIST_RAMP;
+    else if (s == "pwm") out = DIST_PWM;
+    else if (s == "chatter") out = DIST_CHATTER;
+    else return false;
+    return true;
+}
+
+// Parses "lamp:48:30:toggle" into a group
+static bool ParseGroup(const std::string& spec, OutputGroup& g) {
+    std::vector<std::string> parts;
+    size_t start = 0, pos;
+    while ((pos = spec.find(':', start)) != std::string::npos) {
+        parts.push_back(spec.substr(start, pos - start));
+        start = pos + 1;
+    }
+    parts.push_back(spec.substr(start));
+    if (parts.size() < 3 || parts.size() > 4 || parts[0].empty()) return false;
+
+    g.prefix = parts[0];
+    g.count = atoi(parts[1].c_str());
+    g.rateHz = atof(parts[2].c_str());
+    g.dist = DIST_TOGGLE;
+    if (parts.size() == 4 && !ParseDist(parts[3], g.dist)) return false;
+    return g.count > 0 && g.rateHz > 0;
+}
+
+static bool ParseArgs(int argc, char** argv, Settings& s) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasNext = (i + 1 < argc);
+
+        if (arg == "--once") s.once = true;
+        else if (arg == "--stamp") s.stamp = true;
+        else if (arg == "--ip" && hasNext) s.ip = argv[++i];
+        else if (arg == "--port" && hasNext) s.port = atoi(argv[++i]);
+        else if (arg == "--rom" && hasNext) s.rom = argv[++i];
+        else if (arg == "--max" && hasNext) s.maxValue = atoi(argv[++i]);
+        else if (arg == "--scale" && hasNext) s.scale = atof(argv[++i]);
+        else if (arg == "--duration" && hasNext) s.duration = atof(argv[++i]);
+        else if (arg == "--drop" && hasNext) s.drop = atof(argv[++i]);
+        else if (arg == "--seed" && hasNext) s.seed = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (arg == "--group" && hasNext) {
+            OutputGroup g;
+            if (!ParseGroup(argv[++i], g)) { fprintf(stderr, "Bad group: %s\n", argv[i]); return false; }
+            s.groups.push_back(g);
+        }
+        else if (arg == "--burst" && hasNext) {
+            if (sscanf(argv[++i], "%d:%d", &s.burstCount, &s.burstEveryMs) != 2 || s.burstEveryMs <= 0) {
+                fprintf(stderr, "Bad burst: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (arg == "--fragment" && hasNext) {
+            std::string mode = argv[++i];
+            if (mode == "none") s.fragmentMode = 0;
+            else if (mode == "byte") s.fragmentMode = 1;
+            else if (mode.compare(0, 6, "random") == 0) {
+                s.fragmentMode = 2;
+                if (mode.size() > 7) s.fragmentMax = atoi(mode.c_str() + 7);
+                if (s.fragmentMax < 1) s.fragmentMax = 1;
+            }
+            else { fprintf(stderr, "Bad fragment mode: %s\n", mode.c_str()); return false; }
+        }
+        else { Usage(); return false; }
+    }
+
+    if (s.groups.empty()) {
+        OutputGroup g = { "lamp", 32, 10.0, DIST_TOGGLE };
+        s.groups.push_back(g);
+    }
+    return s.scale > 0;
+}
+
+// Advances an output to its next value and appends "<name> = <value>\r" to the batch
+static void EmitUpdate(SimOutput& o, int maxValue, std::mt19937& rng, std::string& batch) {
+    char line[160];
+    switch (o.dist) {
+    case DIST_TOGGLE:
+    case DIST_PWM:
+        o.value = o.value ? 0 : 1;
+        break;
+    case DIST_CHATTER:
+        if (o.bounces == 0) o.bounces = CHATTER_SWITCHES;
+        o.bounces--;
+        o.value = o.value ? 0 : 1;
+        break;
+    case DIST_PULSE:
+        // A complete 0->1->0 pulse inside one batch, the hardest case for any coalescing
+        snprintf(line, sizeof(line), "%s = 1\r", o.name.c_str());
+        batch += line;
+        o.value = 0;
+        break;
+    case DIST_UNIFORM:
+        o.value = (int)(rng() % (uint32_t)(maxValue + 1));
+        break;
+    case DIST_RAMP:
+        o.value = (o.value >= maxValue) ? 0 : o.value + 1;
+        break;
+    }
+    snprintf(line, sizeof(line), "%s = %d\r", o.name.c_str(), o.value);
+    batch += line;
+    o.sent = true;
+}
+
+// Time until the output's next update: a PWM output stays on for its duty cycle's
+// share of the period and off for the rest, a chattering one bounces a millisecond apart
+static Clock::duration NextDelay(const SimOutput& o) {
+    if (o.dist == DIST_CHATTER && o.bounces > 0) return std::chrono::milliseconds(1);
+    if (o.dist != DIST_PWM) return o.period;
+    double share = o.value ? o.duty : 1.0 - o.duty;
+    return std::chrono::duration_cast<Clock::duration>(o.period * share);
+}
+
+// Writes the batch using the selected fragmentation mode. Returns false if the peer is gone.
+static bool SendBatch(SOCKET sock, const std::string& batch, const Settings& s, std::mt19937& rng) {
+    size_t pos = 0;
+    while (pos < batch.size()) {
+        size_t chunk = batch.size() - pos;
+        if (s.fragmentMode == 1) chunk = 1;
+        else if (s.fragmentMode == 2) chunk = std::min(chunk, (size_t)(1 + rng() % (uint32_t)s.fragmentMax));
+
+        int sent = send(sock, batch.data() + pos, (int)chunk, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        pos += (size_t)sent;
+    }
+    return true;
+}
+
+// ==================================================================================
+//                                    SESSION
+// ==================================================================================
+// Builds the output list from the configured groups
+static std::vector<SimOutput> BuildOutputs(const Settings& s) {
+    std::vector<SimOutput> outputs;
+    for (const OutputGroup& g : s.groups) {
+        double hz = g.rateHz * s.scale;
+        Clock::duration period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / hz));
+        if (period.count() <= 0) period = Clock::duration(1);
+        for (int i = 0; i < g.count; i++) {
+            SimOutput o = { g.prefix + std::to_string(i), g.dist, period, (i % 7 + 1) / 8.0, 0, false, 0 };
+            outputs.push_back(o);
+        }
+    }
+    return outputs;
+}
+
+// Runs one connected session. Returns the number of update lines sent.
+// Sets "dropped" if the session ended with a --drop instead of "mame_stop".
+static uint64_t RunSession(SOCKET sock, const Settings& s, std::vector<SimOutput>& outputs, std::mt19937& rng,
+                           bool& dropped) {
+    dropped = false;
+
+    // Schedule every output with a random phase so they don't all fire together
+    Clock::time_point start = Clock::now();
+    std::priority_queue<DueEntry, std::vector<DueEntry>, std::greater<DueEntry>> schedule;
+    for (size_t i = 0; i < outputs.size(); i++) {
+        Clock::duration phase = Clock::duration((Clock::rep)(rng() % (uint64_t)outputs[i].period.count()));
+        schedule.push({ start + phase, i });
+    }
+
+    Clock::time_point nextBurst = start + std::chrono::milliseconds(s.burstEveryMs);
+    Clock::time_point nextReport = start + std::chrono::seconds(1);
+    Clock::time_point endTime = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s.duration));
+    Clock::time_point dropTime = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s.drop));
+    size_t burstCursor = 0;
+    uint64_t totalLines = 0, reportLines = 0, reportBytes = 0;
+    std::string batch;
+
+    // 1. MAME START, then the state of a game already running
+    batch = "mame_start = " + s.rom + "\r";
+    for (const SimOutput& o : outputs) {
+        if (o.sent) batch += o.name + " = " + std::to_string(o.value) + "\r";
+    }
+    if (!SendBatch(sock, batch, s, rng)) return 0;
+
+    // 2. UPDATE LOOP
+    while (true) {
+        Clock::time_point now = Clock::now();
+        if (s.duration > 0 && now >= endTime) break;
+        if (s.drop > 0 && now >= dropTime) {
+            dropped = true;
+            return totalLines;
+        }
+        batch.clear();
+        size_t lines = 0;
+
+        // Everything that is due goes into one batch
+        while (!schedule.empty() && schedule.top().due <= now) {
+            DueEntry e = schedule.top();
+            schedule.pop();
+            EmitUpdate(outputs[e.index], s.maxValue, rng, batch);
+            lines++;
+            e.due += NextDelay(outputs[e.index]);
+            schedule.push(e);
+        }
+
+        // Bursts walk round-robin through the outputs, back to back
+        if (s.burstCount > 0 && now >= nextBurst) {
+            for (int i = 0; i < s.burstCount; i++) {
+                EmitUpdate(outputs[burstCursor], s.maxValue, rng, batch);
+                burstCursor = (burstCursor + 1) % outputs.size();
+                lines++;
+            }
+            nextBurst += std::chrono::milliseconds(s.burstEveryMs);
+        }
+
+        if (!batch.empty()) {
+            if (s.stamp) {
+                uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                    Clock::now().time_since_epoch()).count();
+                batch += "loadgen_stamp = " + std::to_string(us & 0x7fffffff) + "\r";
+            }
+            if (!SendBatch(sock, batch, s, rng)) return totalLines;
+            totalLines += lines;
+            reportLines += lines;
+            reportBytes += batch.size();
+        }
+
+        if (now >= nextReport) {
+            printf("[GEN] %llu lines/s, %.1f KB/s\n", (unsigned long long)reportLines, reportBytes / 1024.0);
+            fflush(stdout);
+            reportLines = reportBytes = 0;
+            nextReport += std::chrono::seconds(1);
+        }
+
+        // Sleep until the next thing is due
+        Clock::time_point wake = nextReport;
+        if (!schedule.empty() && schedule.top().due < wake) wake = schedule.top().due;
+        if (s.burstCount > 0 && nextBurst < wake) wake = nextBurst;
+        if (s.duration > 0 && endTime < wake) wake = endTime;
+        if (s.drop > 0 && dropTime < wake) wake = dropTime;
+        std::this_thread::sleep_until(wake);
+    }
+
+    // 3. MAME STOP
+    batch = "mame_stop = 1\r";
+    SendBatch(sock, batch, s, rng);
+    return totalLines;
+}
+
+// ==================================================================================
+//                                MAIN ENTRY POINT
+// ==================================================================================
+int main(int argc, char** argv) {
+    Settings s;
+    if (!ParseArgs(argc, argv, s)) return 1;
+    std::mt19937 rng(s.seed);
+    std::vector<SimOutput> outputs = BuildOutputs(s);
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)s.port);
+    addr.sin_addr.s_addr = inet_addr(s.ip.c_str());
+
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        fprintf(stderr, "Could not listen on %s:%d\n", s.ip.c_str(), s.port);
+        return 1;
+    }
+    printf("[GEN] Listening on %s:%d\n", s.ip.c_str(), s.port);
+
+    do {
+        SOCKET client = accept(listener, NULL, NULL);
+        if (client == INVALID_SOCKET) break;
+
+        // Disable Nagle, otherwise fragmented writes are merged back into one segment
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+        printf("[GEN] Bridge connected.\n");
+
+        Clock::time_point start = Clock::now();
+        bool dropped;
+        uint64_t lines = RunSession(client, s, outputs, rng, dropped);
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        printf("[GEN] Session %s: %llu updates in %.2f s (%.0f updates/s)\n", dropped ? "dropped" : "ended",
+               (unsigned long long)lines, secs, secs > 0 ? lines / secs : 0.0);
+
+        // A finished game starts from scratch next time; a dropped one carries on
+        if (!dropped) outputs = BuildOutputs(s);
+
+        // Half-close and drain whatever the bridge sent us (its "\r\n" wake-up),
+        // otherwise closing with unread data resets the connection mid-stream.
+        char drain[256];
+        shutdown(client, SHUT_WR);
+        while (recv(client, drain, sizeof(drain), 0) > 0) {}
+        closesocket(client);
+    } while (!s.once);
+
+    closesocket(listener);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}